@@ -7,7 +7,7 @@
 			specified specified by the user in the command line.
    Version: 1.0
 */
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <stdio.h> 
 #include <time.h> 
 #include <fcntl.h> 
@@ -15,581 +15,8218 @@
 #include <unistd.h> 
 #include <sys/types.h> 
 #include <dirent.h> 
-#include <ftw.h> 
 #include <sys/stat.h> 
 #include <grp.h> 
 #include <pwd.h> 
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <libgen.h>
+#include <fnmatch.h>
+#include <sys/file.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+// io_uring is used through its system calls, no liburing needed
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+// FIEMAP tells where a file's data lies on the disk, see firstExtent
+#if defined(__linux__) && __has_include(<linux/fiemap.h>)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#define HAVE_FIEMAP
+#endif
 
   // SYMBOLIC CONSTANTS
   #define BUFFER_DIR (1024)
   #define BUFFER_SIZE (1024)
   #define TIME_SIZE (128)
   #define INFOSTR_SIZE (2048)
+  #define COPY_SIZE (1024 * 1024)
+  #define COPY_CHUNK (64 * 1024 * 1024)
+  #define WRITER_BUFFER_SIZE (8 * 1024 * 1024)
+  #define WRITER_ALIGN (4096)
+  #define SMALL_PAYLOAD (256 * 1024)
+  #define URING_DEPTH (64) // small files opened and read at once
+  #define PREFETCH_BYTES (8 * 1024 * 1024) // most file data read ahead
+  #define URING_CLOSE (1ULL << 63) // user_data tag of close requests
+  #define STATX_ENTRY_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK \
+                            | STATX_UID | STATX_GID | STATX_INO \
+                            | STATX_SIZE | STATX_MTIME | STATX_CTIME)
+  #define SCAN_BATCH (256)
+  #define SCAN_ARENA (64 * 1024)
+  #define SCAN_QUEUE_DEPTH (64)
+  // -O, order the entries of a batch are read and archived in
+  #define ORDER_NONE (0) // as readdir returns them, hash order on ext4/XFS
+  #define ORDER_INODE (1) // by inode number, close to the on-disk order
+  #define ORDER_EXTENT (2) // by the physical offset of the first extent
+  #define RESTORE_BUFFER_SIZE (4 * 1024 * 1024)
+  #define RESTORE_SLOTS (4)
+  #define RESTORE_RANGE (32 * 1024 * 1024) // -j restore: pwrite unit of
+                                            // large stored files
+  #define BLAKE3_BLOCK_LEN (64)
+  #define BLAKE3_CHUNK_LEN (1024)
+  #define BLAKE3_CHUNK_START (1)
+  #define BLAKE3_CHUNK_END (2)
+  #define BLAKE3_PARENT (4)
+  #define BLAKE3_ROOT (8)
+  #define BLAKE3_LANES (8) // chunks hashed side by side by the SIMD kernel
+  #define HASH_SEGMENT (1024 * 1024) // subtree a hashing thread works on
+  #define HASH_SIZE (32)
 
-// Stores time limit basis to skip nftw
-static char* timeLimit;
+  // the SIMD kernel is built once per instruction set and the best one the
+  // CPU supports is picked when the program is loaded
+  #if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+    #define HASH_KERNEL __attribute__((target_clones("arch=skylake-avx512", \
+                                                     "avx2", "default")))
+  #else
+    #define HASH_KERNEL
+  #endif
+
+  // MULTI-VOLUME ARCHIVES, -V
+  // The archive is split into volumes <archive>.000, .001, ... of at most
+  // the -V size (a single larger entry gets a volume of its own). Every
+  // volume is a complete archive that restores on its own, so dedup
+  // references, hard links and owner names never cross volumes. Several
+  // volumes are written at the same time, one per writer thread.
+  #define VOLUME_WRITERS_MAX (8)
+  #define VOLUME_QUEUE (1024) // entries waiting for each writer
+
+  // RUN METRICS, -m
+  // Each thread counts into its own metricSet, so measuring takes no lock
+  // or atomic on the hot paths; the sets are summed when the run ends.
+  // Phase times also go into a histogram whose bucket b holds durations
+  // below 2^b nanoseconds (the last one everything longer).
+  #define METRIC_BUCKETS (32)
+  #define PHASE_READDIR (0) // reading one directory, its statx calls included
+  #define PHASE_STAT (1) // statx of one entry
+  #define PHASE_OPEN (2) // opening a file to archive
+  #define PHASE_READ (3) // reading a small file into the write buffer
+  #define PHASE_PREFETCH (4) // one io_uring read ahead window
+  #define PHASE_HASH (5) // BLAKE3 of a large file
+  #define PHASE_COPY (6) // kernel side copy of a large file to the archive
+  #define PHASE_WRITE (7) // a write of the archive buffer, or waiting for it
+  #define PHASE_COMPRESS (8) // compressing one block
+  #define PHASE_OWNER (9) // getpwuid or getgrgid of an id not seen before
+  #define PHASE_ENTRY (10) // writeFileToBackup, one entry from start to end
+  #define PHASE_CATALOG (11) // writing the catalog of the run
+  #define PHASE_RESTORE (12) // restoring one file
+  #define PHASE_RESTORE_RANGE (13) // one piece of a large file, -j restore
+  #define PHASE_FIEMAP (14) // looking up where a file lies, -O extent
+  #define PHASE_COUNT (15)
+  #define COUNT_DIRS (0) // directories read
+  #define COUNT_ENTRIES (1) // entries stat()ed
+  #define COUNT_SELECTED (2) // entries passed on to be archived
+  #define COUNT_CUTOFF (3) // entries skipped, not newer than the -t cut off
+  #define COUNT_UNCHANGED (4) // entries skipped, the same as in the catalog
+  #define COUNT_ARCHIVED (5) // entries written to the archive
+  #define COUNT_FAILED (6) // entries that could not be archived
+  #define COUNT_BYTES_READ (7) // content bytes of the files archived
+  #define COUNT_BYTES_WRITTEN (8) // bytes written to the archive
+  #define COUNT_RESTORED (9) // files restored
+  #define COUNT_BYTES_RESTORED (10) // content bytes of the files restored
+  #define COUNT_COUNT (11)
+
+  // ARCHIVE FORMAT
+  // All integers are little-endian. An archive is laid out as:
+  //   [archive header][entry][entry]...[index][path index][trailer]
+  // where every entry is a fixed header followed by the path bytes, the
+  // extra bytes and payloadLen bytes of payload. The index is entryCount
+  // 64-bit offsets of the entry headers, and the trailer sits in the last
+  // TRAILER_SIZE bytes so readers can find the index without a scan.
+  // The path index (version 3 on) lists the entries again sorted by path,
+  // in blocks of PATH_INDEX_BLOCK records each followed by its path
+  // minus the bytes it shares with the path before it in the block:
+  //   0 shared u16   2 suffixLen u16   4 entryOffset u64
+  // and ends with the u64 offset of every block, for binary search.
+  // Owner name entries have the empty path and so come first.
+  #define ARCHIVE_MAGIC "IFBACKUP"
+  #define ARCHIVE_VERSION (3)
+  #define ARCHIVE_HEADER_SIZE (32)
+  #define ENTRY_MAGIC (0x45424649u) // "IFBE"
+  #define ENTRY_HEADER_SIZE (64)
+  #define TRAILER_MAGIC "IFBINDEX"
+  #define TRAILER_SIZE (64)
+  #define PATH_INDEX_BLOCK (16)
+  #define PATH_RECORD_SIZE (12)
+
+  // entry types
+  #define ENTRY_FILE (1)
+  #define ENTRY_DIR (2)
+  #define ENTRY_SYMLINK (3)
+  #define ENTRY_TOMBSTONE (4) // path was deleted since the previous run
+  #define ENTRY_HARDLINK (5) // payload is the path of an earlier link
+  // Owner names: the first entry owned by a uid or gid is preceded by one of
+  // these, with no path, the id in the uid or gid field and the name as the
+  // payload. Entries themselves only carry the numeric ids.
+  #define ENTRY_USERNAME (6)
+  #define ENTRY_GROUPNAME (7)
+
+  // entry flags
+  #define ENTRY_F_CHUNKED (1) // payload is a list of chunk records
+  #define ENTRY_F_DIGEST (2) // extra starts with the BLAKE3 of the content
+  // ENTRY_F_COMPRESSED (4), payload is a list of compressed blocks
+  // ENTRY_F_DELTA (8), payload is a list of delta records
+  // ENTRY_F_SPARSE (16), payload is an extent map and the extents' data
+
+  // CONTENT DEFINED CHUNKING, -D
+  // The payload of a chunked entry is a sequence of records, each a
+  // CHUNK_RECORD_SIZE byte header (u8 kind, 3 reserved bytes, u32 len)
+  // followed by len bytes of data for CHUNK_DATA, or by the u64 archive
+  // offset of identical data stored earlier in the archive for CHUNK_REF.
+  // Chunk boundaries are FastCDC cut points so an insertion only changes
+  // the chunks around it.
+  #define CHUNK_RECORD_SIZE (8)
+  #define CHUNK_DATA (1)
+  #define CHUNK_REF (2)
+  #define CHUNK_MIN (16 * 1024)
+  #define CHUNK_AVG (64 * 1024)
+  #define CHUNK_MAX (256 * 1024)
+  #define CHUNK_MASK_SMALL (~0ULL << (64 - 18)) // before CHUNK_AVG, harder
+  #define CHUNK_MASK_LARGE (~0ULL << (64 - 14)) // after CHUNK_AVG, easier
+  #define CHUNK_WINDOW (4 * 1024 * 1024)
+
+  // BLOCK COMPRESSION, -z
+  // The payload of a compressed entry is a sequence of blocks, each a
+  // COMPRESS_RECORD_SIZE byte header (u8 codec, 3 reserved bytes, u32 rawLen,
+  // u32 storedLen, u32 reserved) followed by storedLen bytes. Every block is
+  // compressed on its own, so readers can expand them in any order, and
+  // blocks that do not shrink are stored as CODEC_STORED.
+  #define ENTRY_F_COMPRESSED (4)
+  #define COMPRESS_BLOCK (HASH_SEGMENT)
+  #define COMPRESS_RECORD_SIZE (16)
+  #define CODEC_STORED (0)
+  #define CODEC_ZSTD (1)
+  #define CODEC_LZ4 (2)
+  #define CODEC_ZLIB (3)
+
+  // BLOCK DELTA, -d
+  // A delta entry rebuilds a file from the version restored before it. Its
+  // payload is a sequence of records, each a DELTA_RECORD_SIZE byte header
+  // (u8 kind, 3 reserved bytes, u32 len) followed by len new bytes for
+  // DELTA_LITERAL, or by the u64 offset in the previous version to copy len
+  // bytes from for DELTA_COPY. The previous version is described by a
+  // signature kept in the catalog: u32 blockSize, u32 reserved, u64 count,
+  // then count DELTA_SIG_SIZE byte entries (u32 rolling checksum, 16 bytes
+  // of BLAKE3) of its aligned full blocks.
+  #define ENTRY_F_DELTA (8)
+  #define DELTA_RECORD_SIZE (8)
+  #define DELTA_LITERAL (1)
+  #define DELTA_COPY (2)
+  #define DELTA_BLOCK (64 * 1024)
+  #define DELTA_MIN (1024 * 1024) // smaller files are stored whole
+  #define DELTA_SIG_HEADER (16)
+  #define DELTA_SIG_SIZE (20)
+  #define DELTA_STRONG_SIZE (16)
+  #define DELTA_WINDOW (4 * 1024 * 1024)
+  #define DELTA_COPY_MAX (1024 * 1024 * 1024) // longest merged copy record
+  #define DELTA_EMPTY (UINT32_MAX)
+
+  // SPARSE FILES
+  // A file with holes is stored as a u64 extent count, count pairs of u64
+  // offset and u64 length of its data extents in ascending order, then the
+  // data of each extent back to back. Everything else reads back as zeros.
+  // The digest of a sparse entry covers this payload, not the expanded
+  // content, so hashing never has to walk the holes.
+  #define ENTRY_F_SPARSE (16)
+  #define SPARSE_EXTENT_SIZE (16)
+
+  // CATALOG FORMAT, see struct catalog
+  #define CATALOG_MAGIC "IFBCATLG"
+  #define CATALOG_VERSION (2)
+  #define CATALOG_HEADER_SIZE (64)
+  #define CATALOG_RECORD_SIZE (80)
+  #define CATALOG_RECORD_SIZE_V1 (72) // version 1 had no signatures
+  #define CATALOG_HASH_SIZE (16)
+  #define CATALOG_BLOCK (4096)
+  #define CATALOG_ARENA (1024 * 1024)
+
+  // CHANGE JOURNAL, written by backupwatch and read with -J, all
+  // little-endian:
+  //   header (JOURNAL_HEADER_SIZE): magic "IFBJOURN", u32 version,
+  //     u32 reserved, u64 dev and u64 ino of the watched root, i64 startNs
+  //     (changes are recorded from then on), i64 overflowNs (last time
+  //     events were lost, 0 for never)
+  //   records (JOURNAL_RECORD_SIZE then the path): i64 timeNs, u32 pathLen,
+  //     path relative to the root; a path may appear more than once
+  #define JOURNAL_MAGIC "IFBJOURN"
+  #define JOURNAL_VERSION (1)
+  #define JOURNAL_HEADER_SIZE (64)
+  #define JOURNAL_RECORD_SIZE (12)
+  #define JOURNAL_SLACK (10LL * 1000000000LL) // ns between a change and its
+                                              // record reaching the journal
+
+/*
+   Name: entryHeader
+   Purpose: In memory form of the fixed width header that precedes every
+            entry in the archive. On disk it is ENTRY_HEADER_SIZE bytes:
+			  0 magic      u32   4 type     u16   6 flags    u16
+			  8 mode       u32  12 uid      u32  16 gid      u32
+			 20 pathLen    u32  24 extraLen u32  28 reserved u32
+			 32 size       u64  40 mtimeNs  i64  48 payloadLen u64
+			 56 reserved   u64
+*/
+struct entryHeader {
+  uint16_t type; // ENTRY_FILE, ENTRY_DIR, ...
+  uint16_t flags; // ENTRY_F_* bits, how the payload is encoded
+  uint32_t mode; // st_mode of the file
+  uint32_t uid; // owner user id
+  uint32_t gid; // owner group id
+  uint32_t pathLen; // bytes of path following the header
+  uint32_t extraLen; // bytes of extra metadata following the path
+  uint64_t size; // logical size of the file in bytes
+  int64_t mtimeNs; // modification time in nanoseconds since the epoch
+  uint64_t payloadLen; // bytes of payload following the extra metadata
+};
+
+/*
+   Name: changePredicate
+   Purpose: The -t/-c selection rule, compiled once in commandLineSwitch.
+            Times are integer nanoseconds since the epoch so testing an entry
+			is two integer compares with no formatting or parsing per file,
+			correct across month boundaries and to sub-second precision.
+*/
+struct changePredicate {
+  int64_t mtimeCutoffNs; // select entries modified after this
+  int64_t ctimeCutoffNs; // select entries changed after this (-c only)
+};
+
+/*
+   Name: catalog
+   Purpose: The previous run's catalog, mapped read only. Layout, all
+            little-endian:
+			  header  (CATALOG_HEADER_SIZE): magic "IFBCATLG", u32 version,
+			          u32 reserved, u64 count, u64 stringsOffset,
+					  u64 sigsOffset, i64 scanStartNs (realtime the run
+					  started scanning, 0 in older catalogs)
+			  records (CATALOG_RECORD_SIZE each, sorted by path bytes):
+			           0 pathOff u64   8 pathLen u32  12 mode u32
+			          16 dev     u64  24 ino     u64  32 size u64
+			          40 mtimeNs i64  48 ctimeNs i64  56 hash[16]
+			          72 sig     u64 (catalog offset of the delta
+					             signature, 0 for none)
+			  strings: every path back to back
+			  sigs:    delta signatures, see DELTA_SIG_HEADER
+			Version 1 catalogs have 72 byte records and no signatures.
+*/
+struct catalog {
+  const unsigned char* map; // NULL when there is no previous catalog
+  size_t mapLen;
+  uint64_t count;
+  size_t recordSize; // CATALOG_RECORD_SIZE, or smaller for old versions
+  const unsigned char* records;
+  const char* strings;
+  uint64_t stringsLen;
+  int64_t scanStartNs; // when the run that wrote it started scanning
+};
+
+// one path of a changeJournal
+struct journalPath {
+  const char* path; // into the mapping, not NUL terminated
+  uint32_t len;
+};
+
+/*
+   Name: changeJournal
+   Purpose: The -J journal, mapped read only, reduced to the distinct paths
+            changed since the previous run started scanning, sorted by
+			path bytes. The paths point into the mapping.
+*/
+struct changeJournal {
+  const unsigned char* map;
+  size_t mapLen;
+  struct journalPath* paths;
+  size_t count;
+};
+
+/*
+   Name: catalogRecord
+   Purpose: State of one path as seen by a run. The catalog written at the
+            end of a run is these records sorted by path; the next run
+			compares its live scan against it.
+*/
+struct catalogRecord {
+  const char* path; // relative to the backup root, not NUL terminated
+  uint32_t pathLen;
+  uint32_t mode;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtimeNs;
+  int64_t ctimeNs;
+  unsigned char hash[CATALOG_HASH_SIZE]; // leading bytes of the BLAKE3 of
+                                         // the content, zero if unknown
+  int64_t sigPrev; // unchanged: record whose delta signature carries over
+  int64_t sigSpill; // offset of a new delta signature in the spill file
+  uint64_t sigLen; // bytes of that signature
+};
+
+/*
+   Name: chunkIndex
+   Purpose: Open addressing hash table from the BLAKE3 digest of a chunk to
+            where its data lies in the archive. Digests are uniformly
+			distributed so the first 8 bytes are the bucket, and linear
+			probing keeps a lookup to one or two adjacent cache lines.
+*/
+struct chunkSlot {
+  unsigned char hash[HASH_SIZE];
+  uint64_t offset; // archive offset of the chunk data
+  uint32_t len; // bytes of chunk data
+  uint32_t used; // slot holds a chunk
+};
+
+struct chunkIndex {
+  struct chunkSlot* slots;
+  size_t mask; // slot count - 1, the count is a power of two
+  size_t count; // slots in use
+};
+
+/*
+   Name: blake3Hasher
+   Purpose: Incremental BLAKE3 state (unkeyed, 32 byte output). Input is
+            cut into 1 KiB chunks whose chaining values are merged pairwise
+			into a binary tree; cvStack holds the pending left subtrees.
+*/
+struct blake3Hasher {
+  uint32_t cv[8]; // chaining value of the chunk being compressed
+  uint64_t chunkCounter; // index of the current chunk
+  unsigned char block[BLAKE3_BLOCK_LEN]; // pending bytes of the chunk
+  uint8_t blockLen; // bytes pending in block
+  uint8_t blocksCompressed; // full blocks already folded into cv
+  uint8_t cvStackLen;
+  uint32_t cvStack[54][8]; // one per level, enough for 2^64 bytes
+};
+
+/*
+   Name: codec
+   Purpose: One block compressor. Which ones exist depends on the HAVE_ZSTD,
+            HAVE_LZ4 and HAVE_ZLIB build flags; see codecs.
+*/
+struct codec {
+  const char* name; // as given to -z
+  uint8_t id; // CODEC_ZSTD, ... as stored in block records
+  size_t (*bound)(size_t len); // worst case compressed size
+  // compressed size, 0 if the block could not be compressed
+  size_t (*compress)(const void* src, size_t len, void* dst, size_t cap);
+  // 1 if src expanded to exactly rawLen bytes, -1 otherwise
+  int (*decompress)(const void* src, size_t len, void* dst, size_t rawLen);
+};
+
+/*
+   Name: pendingEntry
+   Purpose: A compressed file whose blocks are still in the compressor. Its
+            header is written when its first block leaves the pipeline and
+			patched with payloadLen and the digest after the last one.
+*/
+struct pendingEntry {
+  struct entryHeader hdr;
+  char* path;
+  struct catalogRecord* rec; // receives the digest, NULL without -C
+  int damaged; // a read error left zeros in the content
+  uint64_t hdrOffset; // archive offset of the header once written
+  uint64_t payloadStart; // archive offset of the first block record
+  struct blake3Hasher hasher; // digest of the content, block by block
+};
+
+/*
+   Name: compressSlot
+   Purpose: One COMPRESS_BLOCK sized block in flight. The worker that
+            compresses it also hashes it as a BLAKE3 subtree, so hashing
+			scales with compression.
+*/
+struct compressSlot {
+  unsigned char* raw; // block as read from the file
+  size_t rawLen;
+  unsigned char* out; // compressed block
+  size_t outLen;
+  uint8_t codec; // codec of out, CODEC_STORED if raw is written instead
+  uint64_t counter; // BLAKE3 chunk index of raw[0]
+  uint32_t cv[8]; // subtree chaining value of raw, unless last
+  struct pendingEntry* entry; // file the block belongs to
+  int first; // first block of entry, its header goes out before it
+  int last; // last block of entry
+  int ready; // compressed, may be written
+};
+
+/*
+   Name: compressor
+   Purpose: Ordered compression pipeline. The archiving thread reads blocks
+            into a ring of slots, a pool of workers compresses them in any
+			order, and the archiving thread writes them back out strictly
+			in ring order whenever it needs a free slot. Blocks of
+			consecutive files share the ring, so a directory of small
+			files keeps every worker busy.
+*/
+struct compressor {
+  const struct codec* codec; // NULL when -z was not given
+  struct compressSlot* slots;
+  int slotCount;
+  pthread_t* tids;
+  int threads;
+  uint64_t head; // next slot to fill
+  uint64_t next; // next slot a worker takes
+  uint64_t tail; // next slot to write to the archive
+  pthread_mutex_t lock;
+  pthread_cond_t work; // signalled when a slot is submitted
+  pthread_cond_t done; // signalled when a slot is compressed
+  int stop; // workers should exit
+};
+
+/*
+   Name: linkSet
+   Purpose: Files with more than one link archived so far, by (dev, ino),
+            with the path they were stored under. Open addressing with
+			linear probing like chunkIndex; only files with st_nlink > 1
+			ever reach it.
+*/
+struct linkSlot {
+  uint64_t dev;
+  uint64_t ino;
+  char* path; // NULL for a free slot
+};
+
+struct linkSet {
+  struct linkSlot* slots;
+  size_t mask; // slot count - 1, the count is a power of two
+  size_t count; // slots in use
+};
+
+/*
+   Name: nameCache
+   Purpose: Per run cache of user or group names by numeric id, so the
+            passwd and group databases (possibly LDAP or sssd behind NSS)
+			are asked once per id instead of once per file. Open addressing
+			with linear probing. When restoring, the same table maps the ids
+			of the archive to the ids the names have on this host.
+*/
+struct idName {
+  unsigned int id;
+  char* name; // NULL for a free slot
+  int known; // 0 if NSS has no entry and name is just the number
+  unsigned int local; // restore: id of the same name on this host
+};
+
+struct nameCache {
+  struct idName* slots;
+  size_t mask; // slot count - 1, the count is a power of two
+  size_t count; // slots in use
+};
+
+/*
+   Name: sparseExtent
+   Purpose: One run of data in a sparse file, as found by SEEK_DATA and
+            SEEK_HOLE.
+*/
+struct sparseExtent {
+  uint64_t offset;
+  uint64_t length;
+};
+
+/*
+   Name: deltaIndex
+   Purpose: Blocks of the previous version of a file, by rolling checksum.
+            Slots are 8 bytes in one flat array probed linearly, so the
+			lookup done for every byte of the rolling scan touches a single
+			cache line; the 16 byte strong hashes are only read on a hit.
+*/
+struct deltaSlot {
+  uint32_t weak; // rolling checksum of the block
+  uint32_t block; // block number, DELTA_EMPTY for a free slot
+};
+
+struct deltaIndex {
+  const unsigned char* entries; // signature entries, in the mapped catalog
+  uint64_t count; // blocks, 0 when there is nothing to match against
+  struct deltaSlot* slots;
+  uint64_t mask; // slot count - 1
+};
+
+/*
+   Name: uring
+   Purpose: An io_uring instance driven through its raw system calls. Only
+            ever used by the thread that owns it, so the submission tail and
+			completion head need no locking, just the ordering the kernel
+			expects.
+*/
+struct uring {
+  int fd; // -1 when the kernel has no io_uring, callers fall back
+#ifdef HAVE_IO_URING
+  unsigned int entries;
+  unsigned int tail; // local submission tail, published by uringSubmit
+  unsigned int* sqHead;
+  unsigned int* sqTail;
+  unsigned int* sqMask;
+  unsigned int* sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned int* cqHead;
+  unsigned int* cqTail;
+  unsigned int* cqMask;
+  struct io_uring_cqe* cqes;
+  void* sqMap;
+  size_t sqMapSize;
+  void* cqMap; // same as sqMap with IORING_FEAT_SINGLE_MMAP
+  size_t cqMapSize;
+  size_t sqesSize;
+#endif
+};
+
+/*
+   Name: prefetchFile
+   Purpose: Content of a small file read ahead through io_uring, handed to
+            writeFileToBackup in place of opening and reading it there.
+*/
+struct prefetchFile {
+  unsigned char* data; // NULL if this entry was not read ahead
+  ssize_t got; // bytes read, -1 if opening or reading failed
+};
+
+/*
+   Name: archiveWriter
+   Purpose: The archive being written. It is opened once per run and every
+            entry goes through its WRITER_BUFFER_SIZE byte page aligned
+			buffer, so millions of small headers and payloads turn into a few
+			large sequential writes. Large payloads bypass the buffer after
+			an explicit flush.
+*/
+struct archiveWriter {
+  int fd; // archive descriptor, never O_APPEND
+  unsigned char* buf; // pending bytes not yet written to fd
+  size_t used; // bytes pending in buf
+  uint64_t offset; // archive offset of buf[0]
+  uint64_t* offsets; // offset of every entry header, becomes the index
+  uint64_t* pathOffs; // where each entry's path is in paths
+  char* paths; // every path, each after its u16 length
+  size_t pathsUsed;
+  size_t pathsCapacity;
+  size_t count; // entries written
+  size_t capacity; // allocated length of offsets and pathOffs
+  int failed; // a write to the archive failed, the archive is unusable
+  struct uring* ring; // when set, full buffers are written asynchronously
+  unsigned char* spare; // second buffer, being written while buf fills
+  size_t inflight; // bytes of spare still being written, 0 if none
+  // what only makes sense within one archive, so every volume of a
+  // multi-volume run has its own
+  struct compressor* compressor; // -z, NULL when payloads are stored
+  struct chunkIndex chunks; // every distinct chunk stored, see chunkFind
+  struct linkSet links; // first path of every multiply linked file
+  struct nameCache named[2]; // user and group ids with a name entry here
+};
+
+/*
+   Name: volumeWriter
+   Purpose: One writer thread of a multi-volume run with the volume it is
+            currently filling. Entries reach it through a bounded queue of
+			references into the scanner's batches.
+*/
+struct volumeJob {
+  struct scanBatch* batch;
+  size_t index; // entry within the batch
+};
+
+struct volumeWriter {
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t filled; // signalled when a job is queued or on done
+  pthread_cond_t drained; // signalled when a job is taken
+  struct volumeJob jobs[VOLUME_QUEUE];
+  size_t head; // oldest job
+  size_t count; // jobs queued
+  uint64_t queuedBytes; // file bytes queued, used to balance the writers
+  int done; // no more jobs will be queued
+  int open; // archive holds a volume being filled
+  int failed; // a volume could not be written
+  struct archiveWriter archive;
+  struct compressor compressor; // -z, one per writer like the archive
+  struct volumeSet* set;
+};
+
+/*
+   Name: volumeSet
+   Purpose: All writers of a multi-volume run and what they share.
+*/
+struct volumeSet {
+  struct volumeWriter* writers;
+  int count; // 0 when the run writes a single archive
+  uint64_t limit; // -V, largest size of a volume
+  atomic_uint next; // number the next volume opened gets
+  int rootFd;
+  const struct codec* codec;
+};
+
+/*
+   Name: metricSet
+   Purpose: One thread's counters and phase timers for -m. Only the owning
+            thread writes it; metricsWrite reads them all once every thread
+			has been joined.
+*/
+struct metricSet {
+  uint64_t counts[COUNT_COUNT];
+  uint64_t phaseNs[PHASE_COUNT]; // total time spent in each phase
+  uint64_t phaseCalls[PHASE_COUNT];
+  uint64_t buckets[PHASE_COUNT][METRIC_BUCKETS];
+  struct metricSet* next; // all sets of the run, see metricSets
+};
+
+// selection rule built from -t and -c
+static struct changePredicate predicate;
+
+// small file reads of backupTree and archive writes, see uringInit
+static struct uring readRing = { .fd = -1 };
+static struct uring writeRing = { .fd = -1 };
 
 // stores archive file
 static char* archiveFile;
 
-// write backup to file
-int writeFileToBackup(const char *path, FILE *backup,
-		      char* fileName, int fileMode,
-                      char* permissions, char* modtime,
-                      int size) {
-  int readFile = open(path, O_RDONLY, S_IRWXU);
-  char* sizeStr = malloc(1000);
-  sprintf(sizeStr, "%d", size);
+// directory being backed up, paths are stored relative to it
+static char* rootDir;
+
+// set by -r, restore the archive instead of creating it
+static int restoreMode;
+
+// set by -l, list the archive instead of creating it
+static int listMode;
+
+// number of scanner threads, -j, defaults to the online CPUs
+static int scanThreads;
+
+// -O, ORDER_* the files of each batch are read in
+static int readOrder = ORDER_INODE;
+
+// threads hashing one large file, the same as scanThreads
+static int hashThreads = 1;
+
+// -C, per path state of the last run, and that state mapped for this run
+static char* catalogFile;
+static struct catalog prevCatalog;
+
+// -J, change journal kept by backupwatch; when it covers the time since the
+// previous run only the paths it names are visited, see journalWorker
+static char* journalFile;
+
+// realtime this run started scanning, kept in the catalog so the next run
+// knows which journal records it needs
+static int64_t scanStartNs;
+
+// the archive being written, opened once per run
+static struct archiveWriter archive;
+
+// set by -D, store large files as deduplicated chunks
+static int dedupMode;
+
+// -z, compresses file payloads when a codec is chosen
+static struct compressor compressor;
+
+// -p, paths and patterns a restore is limited to
+static char** restorePaths;
+static int restorePathCount;
+
+// -V, largest size of a volume, 0 writes a single archive
+static uint64_t volumeLimit;
+
+// writers of the volumes of a multi-volume run
+static struct volumeSet volumes;
+
+// set by -d, large changed files are stored as deltas; the signatures of
+// this run wait in sigSpill until catalogFinish
+static int deltaMode;
+static FILE* sigSpill;
+static uint64_t sigSpillLen;
+
+// names of the owners seen this run, see cachedName; volume writers share
+// them under nameLock
+static struct nameCache userNames;
+static struct nameCache groupNames;
+static pthread_mutex_t nameLock = PTHREAD_MUTEX_INITIALIZER;
+
+// FastCDC gear values, set up once, and each writing thread's read window
+static uint64_t gearTable[256];
+static pthread_once_t gearOnce = PTHREAD_ONCE_INIT;
+static _Thread_local unsigned char* chunkWindow;
+
+// each writing thread's copy buffers for copyPayload and writeSparsePayload,
+// kept for the life of the thread
+static _Thread_local char* copyBuffer;
+static _Thread_local unsigned char* sparseBuffer;
+
+// -m, file the run's metrics go to (NULL when not measured), when the run
+// started, and every thread's metricSet; each thread finds its own one
+// through threadMetrics
+static char* metricsFile;
+static uint64_t metricsStart;
+static struct metricSet* metricSets;
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct metricSet* threadMetrics;
+
+/*
+   Name: putLE16, putLE32, putLE64
+   Purpose: Store an integer at buf in little-endian byte order regardless of
+            the byte order of the host.
+   Parameters: unsigned char* buf: destination, uintN_t val: value to store
+   return: void
+*/
+static void putLE16(unsigned char* buf, uint16_t val) {
+  buf[0] = val & 0xff;
+  buf[1] = (val >> 8) & 0xff;
+}
+
+static void putLE32(unsigned char* buf, uint32_t val) {
+  for (int i = 0; i < 4; i++) {
+    buf[i] = (val >> (8 * i)) & 0xff;
+  }
+}
+
+static void putLE64(unsigned char* buf, uint64_t val) {
+  for (int i = 0; i < 8; i++) {
+    buf[i] = (val >> (8 * i)) & 0xff;
+  }
+}
+
+/*
+   Name: getLE16, getLE32, getLE64
+   Purpose: Read back an integer stored by putLE16/putLE32/putLE64.
+   Parameters: const unsigned char* buf: source bytes
+   return: the decoded value
+*/
+static uint16_t getLE16(const unsigned char* buf) {
+  return (uint16_t) (buf[0] | (buf[1] << 8));
+}
+
+static uint32_t getLE32(const unsigned char* buf) {
+  uint32_t val = 0;
+  for (int i = 3; i >= 0; i--) {
+    val = (val << 8) | buf[i];
+  }
+  return val;
+}
+
+static uint64_t getLE64(const unsigned char* buf) {
+  uint64_t val = 0;
+  for (int i = 7; i >= 0; i--) {
+    val = (val << 8) | buf[i];
+  }
+  return val;
+}
+
+/*
+   Name: encodeEntryHeader
+   Purpose: Serialise an entryHeader into its ENTRY_HEADER_SIZE byte on disk
+            form.
+   Parameters: const struct entryHeader* hdr: header to encode
+               unsigned char* buf: ENTRY_HEADER_SIZE bytes of output
+   return: void
+*/
+void encodeEntryHeader(const struct entryHeader* hdr, unsigned char* buf) {
+  memset(buf, 0, ENTRY_HEADER_SIZE);
+  putLE32(buf, ENTRY_MAGIC);
+  putLE16(buf + 4, hdr -> type);
+  putLE16(buf + 6, hdr -> flags);
+  putLE32(buf + 8, hdr -> mode);
+  putLE32(buf + 12, hdr -> uid);
+  putLE32(buf + 16, hdr -> gid);
+  putLE32(buf + 20, hdr -> pathLen);
+  putLE32(buf + 24, hdr -> extraLen);
+  putLE64(buf + 32, hdr -> size);
+  putLE64(buf + 40, (uint64_t) hdr -> mtimeNs);
+  putLE64(buf + 48, hdr -> payloadLen);
+}
+
+/*
+   Name: decodeEntryHeader
+   Purpose: Parse ENTRY_HEADER_SIZE bytes read from an archive back into an
+            entryHeader.
+   Parameters: const unsigned char* buf: the raw header bytes
+               struct entryHeader* hdr: filled in on success
+   return: 1 on success, -1 if the bytes are not an entry header
+*/
+int decodeEntryHeader(const unsigned char* buf, struct entryHeader* hdr) {
+  if (getLE32(buf) != ENTRY_MAGIC) {
+    return -1;
+  }
+  hdr -> type = getLE16(buf + 4);
+  hdr -> flags = getLE16(buf + 6);
+  hdr -> mode = getLE32(buf + 8);
+  hdr -> uid = getLE32(buf + 12);
+  hdr -> gid = getLE32(buf + 16);
+  hdr -> pathLen = getLE32(buf + 20);
+  hdr -> extraLen = getLE32(buf + 24);
+  hdr -> size = getLE64(buf + 32);
+  hdr -> mtimeNs = (int64_t) getLE64(buf + 40);
+  hdr -> payloadLen = getLE64(buf + 48);
+  return 1;
+}
+
+/*
+   Name: readArchiveTrailer
+   Purpose: Locate and validate the trailer in the last TRAILER_SIZE bytes of
+            an archive and return where its index starts.
+   Parameters: FILE* fp: archive opened for reading
+               uint64_t* count: set to the number of entries
+			   uint64_t* indexOffset: set to the offset of the index
+   return: 1 on success, -1 if the archive has no valid trailer
+*/
+int readArchiveTrailer(FILE* fp, uint64_t* count, uint64_t* indexOffset) {
+  unsigned char buf[TRAILER_SIZE];
+  if (fseeko(fp, -TRAILER_SIZE, SEEK_END) != 0
+      || fread(buf, 1, TRAILER_SIZE, fp) != TRAILER_SIZE
+      || memcmp(buf + 56, TRAILER_MAGIC, 8) != 0) {
+    return -1;
+  }
+  *count = getLE64(buf);
+  *indexOffset = getLE64(buf + 8);
+  return 1;
+}
+
+/*
+   Name: archiveIndex
+   Purpose: Where the indexes of a mapped archive are, from its trailer.
+*/
+struct archiveIndex {
+  uint64_t count; // entries
+  uint64_t indexOffset; // entry offsets, in archive order
+  uint64_t pathsOffset; // path index records, 0 if there is no path index
+  uint64_t tableOffset; // offsets of the path index blocks
+  uint64_t blocks; // path index blocks
+};
+
+/*
+   Name: archiveIndexOf
+   Purpose: Validate the trailer of a mapped archive and its indexes. They
+            are only trusted if they exactly fill the space before it.
+   Parameters: const unsigned char* map, uint64_t size
+               struct archiveIndex* ai: filled in
+   return: 1 if the archive is indexed, -1 if not (an interrupted run)
+*/
+int archiveIndexOf(const unsigned char* map, uint64_t size,
+                   struct archiveIndex* ai) {
+  memset(ai, 0, sizeof(*ai));
+  if (size < ARCHIVE_HEADER_SIZE + TRAILER_SIZE
+      || memcmp(map + size - 8, TRAILER_MAGIC, 8) != 0) {
+    return -1;
+  }
+  const unsigned char* trailer = map + size - TRAILER_SIZE;
+  uint64_t end = size - TRAILER_SIZE;
+  ai -> count = getLE64(trailer);
+  ai -> indexOffset = getLE64(trailer + 8);
+  ai -> pathsOffset = getLE64(trailer + 16);
+  ai -> tableOffset = getLE64(trailer + 24);
+  // every entry has an 8 byte offset, so count is bounded by the size
+  if (ai -> count > size / 8) {
+    return -1;
+  }
+  if (ai -> tableOffset != 0) {
+    ai -> blocks = (ai -> count + PATH_INDEX_BLOCK - 1) / PATH_INDEX_BLOCK;
+    // the block table, tableOffset + blocks * 8, ends at the trailer
+    if (ai -> pathsOffset < ARCHIVE_HEADER_SIZE
+        || ai -> pathsOffset > ai -> tableOffset || ai -> tableOffset > end
+        || ai -> blocks != (end - ai -> tableOffset) / 8
+        || (end - ai -> tableOffset) % 8 != 0) {
+      return -1;
+    }
+    end = ai -> pathsOffset;
+  }
+  if (ai -> indexOffset > end || ai -> count != (end - ai -> indexOffset) / 8
+      || (end - ai -> indexOffset) % 8 != 0) {
+    return -1;
+  }
+  return 1;
+}
+
+static const uint32_t blake3IV[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+// order the message words are used in by each of the 7 rounds
+static const uint8_t blake3Schedule[7][16] = {
+  {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+  {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+  {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+  {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+  {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+  {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+  {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+};
+
+static inline uint32_t rotr32(uint32_t w, int c) {
+  return (w >> c) | (w << (32 - c));
+}
+
+/*
+   Name: blake3G
+   Purpose: The BLAKE3 quarter round mixing two message words into four
+            state words.
+*/
+static inline void blake3G(uint32_t* s, int a, int b, int c, int d,
+                           uint32_t x, uint32_t y) {
+  s[a] = s[a] + s[b] + x;
+  s[d] = rotr32(s[d] ^ s[a], 16);
+  s[c] = s[c] + s[d];
+  s[b] = rotr32(s[b] ^ s[c], 12);
+  s[a] = s[a] + s[b] + y;
+  s[d] = rotr32(s[d] ^ s[a], 8);
+  s[c] = s[c] + s[d];
+  s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+/*
+   Name: blake3Compress
+   Purpose: Compress one 64 byte block into a chaining value. Only the
+            first 8 output words are needed for 32 byte digests.
+   Parameters: const uint32_t cv[8], const unsigned char* block,
+               uint8_t blockLen, uint64_t counter, uint8_t flags,
+			   uint32_t out[8]
+   return: void
+*/
+static void blake3Compress(const uint32_t cv[8], const unsigned char* block,
+                           uint8_t blockLen, uint64_t counter, uint8_t flags,
+                           uint32_t out[8]) {
+  uint32_t m[16];
+  for (int i = 0; i < 16; i++) {
+    m[i] = getLE32(block + 4 * i);
+  }
+  uint32_t s[16] = {
+    cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+    blake3IV[0], blake3IV[1], blake3IV[2], blake3IV[3],
+    (uint32_t) counter, (uint32_t) (counter >> 32), blockLen, flags
+  };
+  for (int r = 0; r < 7; r++) {
+    const uint8_t* o = blake3Schedule[r];
+    blake3G(s, 0, 4, 8, 12, m[o[0]], m[o[1]]);
+    blake3G(s, 1, 5, 9, 13, m[o[2]], m[o[3]]);
+    blake3G(s, 2, 6, 10, 14, m[o[4]], m[o[5]]);
+    blake3G(s, 3, 7, 11, 15, m[o[6]], m[o[7]]);
+    blake3G(s, 0, 5, 10, 15, m[o[8]], m[o[9]]);
+    blake3G(s, 1, 6, 11, 12, m[o[10]], m[o[11]]);
+    blake3G(s, 2, 7, 8, 13, m[o[12]], m[o[13]]);
+    blake3G(s, 3, 4, 9, 14, m[o[14]], m[o[15]]);
+  }
+  for (int i = 0; i < 8; i++) {
+    out[i] = s[i] ^ s[i + 8];
+  }
+}
+
+/*
+   Name: blake3Parent
+   Purpose: Chaining value of a tree node from its two children.
+   Parameters: const uint32_t left[8], const uint32_t right[8],
+               uint8_t flags: BLAKE3_PARENT, plus BLAKE3_ROOT for the root
+			   uint32_t out[8]
+   return: void
+*/
+static void blake3Parent(const uint32_t left[8], const uint32_t right[8],
+                         uint8_t flags, uint32_t out[8]) {
+  unsigned char block[BLAKE3_BLOCK_LEN];
+  for (int i = 0; i < 8; i++) {
+    putLE32(block + 4 * i, left[i]);
+    putLE32(block + 32 + 4 * i, right[i]);
+  }
+  blake3Compress(blake3IV, block, BLAKE3_BLOCK_LEN, 0, flags, out);
+}
+
+// one 32 bit word from each of BLAKE3_LANES independent chunks
+typedef uint32_t blake3Lanes __attribute__((vector_size(4 * BLAKE3_LANES)));
+
+// vectors only travel by pointer so no AVX values cross a call boundary
+static inline __attribute__((always_inline))
+void rotrLanes(blake3Lanes* w, int c) {
+  *w = (*w >> c) | (*w << (32 - c));
+}
+
+static inline __attribute__((always_inline))
+void blake3GLanes(blake3Lanes* s, int a, int b, int c, int d,
+                  const blake3Lanes* x, const blake3Lanes* y) {
+  s[a] = s[a] + s[b] + *x;
+  s[d] ^= s[a];
+  rotrLanes(&s[d], 16);
+  s[c] = s[c] + s[d];
+  s[b] ^= s[c];
+  rotrLanes(&s[b], 12);
+  s[a] = s[a] + s[b] + *y;
+  s[d] ^= s[a];
+  rotrLanes(&s[d], 8);
+  s[c] = s[c] + s[d];
+  s[b] ^= s[c];
+  rotrLanes(&s[b], 7);
+}
+
+/*
+   Name: blake3LoadLanes
+   Purpose: Load 8 message words at the same position of each of the
+            BLAKE3_LANES chunks and transpose them, so m[j] holds word j of
+			every chunk. Little-endian hosts load whole rows and transpose
+			with three rounds of shuffles, others assemble the words.
+   Parameters: const unsigned char* input: the words in the first chunk,
+               blake3Lanes* m: receives 8 vectors
+   return: void
+*/
+static inline __attribute__((always_inline))
+void blake3LoadLanes(const unsigned char* input, blake3Lanes* m) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && BLAKE3_LANES == 8
+  typedef int32_t laneIndex __attribute__((vector_size(4 * BLAKE3_LANES)));
+  blake3Lanes t[8];
+  for (int l = 0; l < 8; l++) {
+    memcpy(&m[l], input + l * BLAKE3_CHUNK_LEN, sizeof(blake3Lanes));
+  }
+  // swap 4x4, then 2x2, then 1x1 blocks across the diagonal
+  for (int i = 0; i < 4; i++) {
+    t[i] = __builtin_shuffle(m[i], m[i + 4],
+                             (laneIndex) {0, 1, 2, 3, 8, 9, 10, 11});
+    t[i + 4] = __builtin_shuffle(m[i], m[i + 4],
+                                 (laneIndex) {4, 5, 6, 7, 12, 13, 14, 15});
+  }
+  for (int g = 0; g < 8; g += 4) {
+    for (int i = g; i < g + 2; i++) {
+      m[i] = __builtin_shuffle(t[i], t[i + 2],
+                               (laneIndex) {0, 1, 8, 9, 4, 5, 12, 13});
+      m[i + 2] = __builtin_shuffle(t[i], t[i + 2],
+                                   (laneIndex) {2, 3, 10, 11, 6, 7, 14, 15});
+    }
+  }
+  for (int i = 0; i < 8; i += 2) {
+    t[i] = __builtin_shuffle(m[i], m[i + 1],
+                             (laneIndex) {0, 8, 2, 10, 4, 12, 6, 14});
+    t[i + 1] = __builtin_shuffle(m[i], m[i + 1],
+                                 (laneIndex) {1, 9, 3, 11, 5, 13, 7, 15});
+  }
+  memcpy(m, t, sizeof(t));
+#else
+  for (int j = 0; j < 8; j++) {
+    for (int l = 0; l < BLAKE3_LANES; l++) {
+      m[j][l] = getLE32(input + l * BLAKE3_CHUNK_LEN + 4 * j);
+    }
+  }
+#endif
+}
+
+/*
+   Name: blake3HashChunks
+   Purpose: Chaining values of BLAKE3_LANES consecutive full chunks, one
+            chunk per vector lane, so each round of blake3Compress runs on
+			all of them at once. Written with GCC vector types and built
+			for AVX-512, AVX2 and the baseline (NEON on ARM) by HASH_KERNEL.
+			None of the chunks may be the root of the tree.
+   Parameters: const unsigned char* input: BLAKE3_LANES * BLAKE3_CHUNK_LEN
+               bytes, uint64_t counter: index of the first chunk,
+			   uint32_t cvs[][8]: receives one chaining value per chunk
+   return: void
+*/
+HASH_KERNEL
+static void blake3HashChunks(const unsigned char* input, uint64_t counter,
+                             uint32_t cvs[][8]) {
+  blake3Lanes cv[8], m[16], s[16], counterLo, counterHi;
+
+  for (int l = 0; l < BLAKE3_LANES; l++) {
+    counterLo[l] = (uint32_t) (counter + l);
+    counterHi[l] = (uint32_t) ((counter + l) >> 32);
+  }
+  for (int i = 0; i < 8; i++) {
+    cv[i] = (blake3Lanes) {0} + blake3IV[i];
+  }
+  for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) {
+    // transpose: word j of this block from every chunk
+    blake3LoadLanes(input + b * BLAKE3_BLOCK_LEN, m);
+    blake3LoadLanes(input + b * BLAKE3_BLOCK_LEN + 32, m + 8);
+    uint32_t flags = (b == 0 ? BLAKE3_CHUNK_START : 0)
+                     | (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1
+                        ? BLAKE3_CHUNK_END : 0);
+    for (int i = 0; i < 8; i++) {
+      s[i] = cv[i];
+    }
+    for (int i = 0; i < 4; i++) {
+      s[8 + i] = (blake3Lanes) {0} + blake3IV[i];
+    }
+    s[12] = counterLo;
+    s[13] = counterHi;
+    s[14] = (blake3Lanes) {0} + BLAKE3_BLOCK_LEN;
+    s[15] = (blake3Lanes) {0} + flags;
+    for (int r = 0; r < 7; r++) {
+      const uint8_t* o = blake3Schedule[r];
+      blake3GLanes(s, 0, 4, 8, 12, &m[o[0]], &m[o[1]]);
+      blake3GLanes(s, 1, 5, 9, 13, &m[o[2]], &m[o[3]]);
+      blake3GLanes(s, 2, 6, 10, 14, &m[o[4]], &m[o[5]]);
+      blake3GLanes(s, 3, 7, 11, 15, &m[o[6]], &m[o[7]]);
+      blake3GLanes(s, 0, 5, 10, 15, &m[o[8]], &m[o[9]]);
+      blake3GLanes(s, 1, 6, 11, 12, &m[o[10]], &m[o[11]]);
+      blake3GLanes(s, 2, 7, 8, 13, &m[o[12]], &m[o[13]]);
+      blake3GLanes(s, 3, 4, 9, 14, &m[o[14]], &m[o[15]]);
+    }
+    for (int i = 0; i < 8; i++) {
+      cv[i] = s[i] ^ s[i + 8];
+    }
+  }
+  for (int l = 0; l < BLAKE3_LANES; l++) {
+    for (int i = 0; i < 8; i++) {
+      cvs[l][i] = cv[i][l];
+    }
+  }
+}
+
+/*
+   Name: blake3Subtree
+   Purpose: Chaining value of the complete subtree over chunks full chunks,
+            where chunks is a power of two and a multiple of BLAKE3_LANES.
+			Subtrees are independent of each other, which is what lets
+			hashFile spread one file across threads.
+   Parameters: const unsigned char* input, size_t chunks,
+               uint64_t counter: index of the first chunk, uint32_t out[8]
+   return: void
+*/
+static void blake3Subtree(const unsigned char* input, size_t chunks,
+                          uint64_t counter, uint32_t out[8]) {
+  uint32_t cvs[HASH_SEGMENT / BLAKE3_CHUNK_LEN][8];
+
+  for (size_t i = 0; i < chunks; i += BLAKE3_LANES) {
+    blake3HashChunks(input + i * BLAKE3_CHUNK_LEN, counter + i, cvs + i);
+  }
+  for (; chunks > 1; chunks /= 2) {
+    for (size_t i = 0; i < chunks / 2; i++) {
+      blake3Parent(cvs[2 * i], cvs[2 * i + 1], BLAKE3_PARENT, cvs[i]);
+    }
+  }
+  memcpy(out, cvs[0], 32);
+}
+
+/*
+   Name: blake3Init
+   Purpose: Start a new digest.
+   Parameters: struct blake3Hasher* h
+   return: void
+*/
+void blake3Init(struct blake3Hasher* h) {
+  memcpy(h -> cv, blake3IV, sizeof(blake3IV));
+  h -> chunkCounter = 0;
+  h -> blockLen = 0;
+  h -> blocksCompressed = 0;
+  h -> cvStackLen = 0;
+}
+
+/*
+   Name: blake3PushChunk
+   Purpose: Add the chaining value of a completed chunk to the tree, merging
+            every subtree it completes. totalChunks counts chunks so far; its
+			trailing zero bits say how many merges are due.
+   Parameters: struct blake3Hasher* h, uint32_t cv[8], uint64_t totalChunks
+   return: void
+*/
+static void blake3PushChunk(struct blake3Hasher* h, uint32_t cv[8],
+                            uint64_t totalChunks) {
+  while ((totalChunks & 1) == 0) {
+    h -> cvStackLen--;
+    blake3Parent(h -> cvStack[h -> cvStackLen], cv, BLAKE3_PARENT, cv);
+    totalChunks >>= 1;
+  }
+  memcpy(h -> cvStack[h -> cvStackLen++], cv, 32);
+}
+
+/*
+   Name: blake3PushSubtree
+   Purpose: Add a subtree of chunks chunks, hashed elsewhere by
+            blake3Subtree, as if its chunks had been fed one by one. The
+			hasher must sit on a multiple of chunks with no pending input,
+			and more input must follow.
+   Parameters: struct blake3Hasher* h, uint32_t cv[8], uint64_t chunks
+   return: void
+*/
+void blake3PushSubtree(struct blake3Hasher* h, uint32_t cv[8],
+                       uint64_t chunks) {
+  h -> chunkCounter += chunks;
+  blake3PushChunk(h, cv, h -> chunkCounter / chunks);
+}
+
+/*
+   Name: blake3Update
+   Purpose: Feed more input into the digest.
+   Parameters: struct blake3Hasher* h, const void* data, size_t len
+   return: void
+*/
+void blake3Update(struct blake3Hasher* h, const void* data, size_t len) {
+  const unsigned char* in = data;
+  while (len > 0) {
+    // a full chunk is only closed once more input proves it is not the last
+    if (h -> blocksCompressed * BLAKE3_BLOCK_LEN + h -> blockLen
+        == BLAKE3_CHUNK_LEN) {
+      uint32_t cv[8];
+      blake3Compress(h -> cv, h -> block, h -> blockLen, h -> chunkCounter,
+                     BLAKE3_CHUNK_END, cv);
+      h -> chunkCounter++;
+      blake3PushChunk(h, cv, h -> chunkCounter);
+      memcpy(h -> cv, blake3IV, sizeof(blake3IV));
+      h -> blockLen = 0;
+      h -> blocksCompressed = 0;
+    }
+    if (h -> blockLen == 0 && h -> blocksCompressed == 0
+        && len > BLAKE3_LANES * BLAKE3_CHUNK_LEN) {
+      // whole chunks with more input behind them go through the kernel
+      uint32_t cvs[BLAKE3_LANES][8];
+      blake3HashChunks(in, h -> chunkCounter, cvs);
+      for (int i = 0; i < BLAKE3_LANES; i++) {
+        h -> chunkCounter++;
+        blake3PushChunk(h, cvs[i], h -> chunkCounter);
+      }
+      in += BLAKE3_LANES * BLAKE3_CHUNK_LEN;
+      len -= BLAKE3_LANES * BLAKE3_CHUNK_LEN;
+      continue;
+    }
+    if (h -> blockLen == BLAKE3_BLOCK_LEN) {
+      uint8_t flags = h -> blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0;
+      blake3Compress(h -> cv, h -> block, BLAKE3_BLOCK_LEN,
+                     h -> chunkCounter, flags, h -> cv);
+      h -> blocksCompressed++;
+      h -> blockLen = 0;
+    }
+    size_t take = BLAKE3_BLOCK_LEN - h -> blockLen;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(h -> block + h -> blockLen, in, take);
+    h -> blockLen += take;
+    in += take;
+    len -= take;
+  }
+}
+
+/*
+   Name: blake3Final
+   Purpose: Produce the 32 byte digest of everything fed so far. The hasher
+            is left untouched.
+   Parameters: const struct blake3Hasher* h, unsigned char out[32]
+   return: void
+*/
+void blake3Final(const struct blake3Hasher* h, unsigned char* out) {
+  unsigned char block[BLAKE3_BLOCK_LEN];
+  uint32_t cv[8];
+  uint8_t flags = BLAKE3_CHUNK_END
+                  | (h -> blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0);
+
+  memset(block, 0, BLAKE3_BLOCK_LEN);
+  memcpy(block, h -> block, h -> blockLen);
+  if (h -> cvStackLen == 0) {
+    blake3Compress(h -> cv, block, h -> blockLen, h -> chunkCounter,
+                   flags | BLAKE3_ROOT, cv);
+  } else {
+    blake3Compress(h -> cv, block, h -> blockLen, h -> chunkCounter, flags,
+                   cv);
+    for (int i = h -> cvStackLen - 1; i >= 0; i--) {
+      blake3Parent(h -> cvStack[i], cv, BLAKE3_PARENT
+                   | (i == 0 ? BLAKE3_ROOT : 0), cv);
+    }
+  }
+  for (int i = 0; i < 8; i++) {
+    putLE32(out + 4 * i, cv[i]);
+  }
+}
+
+/*
+   Name: blake3Hash
+   Purpose: One shot digest of a buffer.
+   Parameters: const void* data, size_t len, unsigned char out[32]
+   return: void
+*/
+void blake3Hash(const void* data, size_t len, unsigned char* out) {
+  struct blake3Hasher h;
+  blake3Init(&h);
+  blake3Update(&h, data, len);
+  blake3Final(&h, out);
+}
+
+/*
+   Name: hashJob
+   Purpose: One file being hashed by several threads. Every full
+            HASH_SEGMENT of the file except the last is a complete subtree
+			of the BLAKE3 tree, so threads claim segments in any order and
+			only the final merge in hashFile is sequential.
+*/
+struct hashJob {
+  int fd; // file being hashed, read with pread only
+  uint64_t size; // bytes hashed
+  uint64_t segments; // segments hashed as subtrees
+  atomic_uint_fast64_t next; // next segment to claim
+  uint32_t (*cvs)[8]; // chaining value of every segment
+  pthread_t* tids; // threads hashBegin started
+  int started;
+};
+
+/*
+   Name: readAt
+   Purpose: Fill buf from offset of fd, padding with zeros where the file
+            ends early or cannot be read, like copyPayload does.
+   Parameters: int fd, unsigned char* buf, size_t len, uint64_t offset
+   return: void
+*/
+static void readAt(int fd, unsigned char* buf, size_t len, uint64_t offset) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = pread(fd, buf + got, len - got, offset + got);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    got += n;
+  }
+  memset(buf + got, 0, len - got);
+}
+
+/*
+   Name: hashWorker
+   Purpose: Hash segments of a hashJob until none are left.
+   Parameters: void* arg: the struct hashJob
+   return: NULL
+*/
+static void* hashWorker(void* arg) {
+  struct hashJob* job = arg;
+  unsigned char* buf = malloc(HASH_SEGMENT);
+  if (buf == NULL) {
+    // claim nothing, the other threads take the segments
+    return NULL;
+  }
+  uint64_t seg;
+  while ((seg = atomic_fetch_add(&job -> next, 1)) < job -> segments) {
+    readAt(job -> fd, buf, HASH_SEGMENT, seg * HASH_SEGMENT);
+    blake3Subtree(buf, HASH_SEGMENT / BLAKE3_CHUNK_LEN,
+                  seg * (HASH_SEGMENT / BLAKE3_CHUNK_LEN), job -> cvs[seg]);
+  }
+  free(buf);
+  return NULL;
+}
+
+/*
+   Name: hashBegin
+   Purpose: Start the BLAKE3 digest of the first size bytes of fd on up to
+            hashThreads threads and return at once, so the caller can copy
+			the payload meanwhile. Both read the same pages, whichever is
+			first brings them into the page cache. The file offset is left
+			alone. Segments no thread took are hashed by hashEnd.
+   Parameters: struct hashJob* job: filled here, int fd, uint64_t size
+   return: 1 on success, -1 if out of memory
+*/
+int hashBegin(struct hashJob* job, int fd, uint64_t size) {
+  memset(job, 0, sizeof(*job));
+  job -> fd = fd;
+  job -> size = size;
+  job -> segments = size == 0 ? 0 : (size - 1) / HASH_SEGMENT;
+  job -> cvs = malloc((job -> segments + 1) * sizeof(*job -> cvs));
+  int threads = hashThreads < (int) job -> segments ? hashThreads
+                : (int) job -> segments;
+  job -> tids = malloc((threads > 0 ? threads : 1) * sizeof(pthread_t));
+  if (job -> cvs == NULL || job -> tids == NULL) {
+    printf("Error in hashBegin: Out of memory\n");
+    free(job -> cvs);
+    free(job -> tids);
+    return -1;
+  }
+  for (; job -> started < threads; job -> started++) {
+    if (pthread_create(&job -> tids[job -> started], NULL, hashWorker,
+                       job) != 0) {
+      break;
+    }
+  }
+  return 1;
+}
+
+/*
+   Name: hashEnd
+   Purpose: Help hash what is left of a hashBegin job, wait for its threads
+            and put the digest together.
+   Parameters: struct hashJob* job, unsigned char* digest: HASH_SIZE bytes
+   return: 1 on success, -1 if out of memory
+*/
+int hashEnd(struct hashJob* job, unsigned char* digest) {
+  struct blake3Hasher h;
+
+  hashWorker(job);
+  for (int i = 0; i < job -> started; i++) {
+    pthread_join(job -> tids[i], NULL);
+  }
+  int result = 1;
+  unsigned char* tail = malloc(HASH_SEGMENT);
+  if (tail == NULL || atomic_load(&job -> next) < job -> segments) {
+    // no thread had a buffer
+    printf("Error in hashEnd: Out of memory\n");
+    result = -1;
+  } else {
+    blake3Init(&h);
+    for (uint64_t i = 0; i < job -> segments; i++) {
+      blake3PushSubtree(&h, job -> cvs[i], HASH_SEGMENT / BLAKE3_CHUNK_LEN);
+    }
+    // the last segment holds the root, it goes through the normal path
+    size_t rest = job -> size - job -> segments * HASH_SEGMENT;
+    readAt(job -> fd, tail, rest, job -> segments * HASH_SEGMENT);
+    blake3Update(&h, tail, rest);
+    blake3Final(&h, digest);
+  }
+  free(job -> cvs);
+  free(job -> tids);
+  free(tail);
+  return result;
+}
+
+/*
+   Name: timespecToNs
+   Purpose: Collapse a struct timespec into integer nanoseconds since the
+            epoch, the unit every time comparison in the backup uses.
+   Parameters: const struct timespec* ts
+   return: nanoseconds since the epoch
+*/
+static inline int64_t timespecToNs(const struct timespec* ts) {
+  return (int64_t) ts -> tv_sec * 1000000000LL + ts -> tv_nsec;
+}
+
+/*
+   Name: metricNow
+   Purpose: Start of a -m timer. The clock is only read when the run is
+            measured, so an unmeasured run pays one branch per hook.
+   return: monotonic nanoseconds, 0 without -m
+*/
+static inline uint64_t metricNow(void) {
+  struct timespec ts;
+
+  if (metricsFile == NULL) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) timespecToNs(&ts);
+}
+
+/*
+   Name: metricSetOfThread
+   Purpose: The calling thread's metricSet, made and linked into metricSets
+            the first time the thread counts anything.
+   return: the set, NULL if out of memory (the thread then goes uncounted)
+*/
+static struct metricSet* metricSetOfThread(void) {
+  if (threadMetrics == NULL) {
+    threadMetrics = calloc(1, sizeof(struct metricSet));
+    if (threadMetrics != NULL) {
+      pthread_mutex_lock(&metricsLock);
+      threadMetrics -> next = metricSets;
+      metricSets = threadMetrics;
+      pthread_mutex_unlock(&metricsLock);
+    }
+  }
+  return threadMetrics;
+}
+
+/*
+   Name: metricTime
+   Purpose: End a -m timer: add the time since start to the phase and its
+            histogram.
+   Parameters: int phase: PHASE_*
+               uint64_t start: what metricNow returned
+   return: void
+*/
+static void metricTime(int phase, uint64_t start) {
+  if (metricsFile == NULL) {
+    return;
+  }
+  struct metricSet* set = metricSetOfThread();
+  if (set == NULL) {
+    return;
+  }
+  uint64_t ns = metricNow() - start;
+  int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+  if (bucket >= METRIC_BUCKETS) {
+    bucket = METRIC_BUCKETS - 1;
+  }
+  set -> phaseNs[phase] += ns;
+  set -> phaseCalls[phase]++;
+  set -> buckets[phase][bucket]++;
+}
+
+/*
+   Name: metricCount
+   Purpose: Add n to a -m counter of the calling thread.
+   Parameters: int counter: COUNT_*, uint64_t n
+   return: void
+*/
+static void metricCount(int counter, uint64_t n) {
+  if (metricsFile == NULL) {
+    return;
+  }
+  struct metricSet* set = metricSetOfThread();
+  if (set != NULL) {
+    set -> counts[counter] += n;
+  }
+}
+
+/*
+   Name: parseTime
+   Purpose: Convert a time string already accepted by isValidTime() of the
+            format YYYY-MM-DD hh:mm:ss (local time) into nanoseconds since
+			the epoch. Done once per run for the -t cut off.
+   Parameters: const char* time: the time string
+               int64_t* ns: set to the parsed time
+   return: 1 on success, -1 if the string does not name a valid time
+*/
+int parseTime(const char* time, int64_t* ns) {
+  struct tm timeInfo;
+  memset(&timeInfo, 0, sizeof(timeInfo));
+  if (sscanf(time, "%4d-%2d-%2d %2d:%2d:%2d", &timeInfo.tm_year,
+             &timeInfo.tm_mon, &timeInfo.tm_mday, &timeInfo.tm_hour,
+             &timeInfo.tm_min, &timeInfo.tm_sec) != 6) {
+    return -1;
+  }
+  timeInfo.tm_year -= 1900;
+  timeInfo.tm_mon -= 1;
+  timeInfo.tm_isdst = -1; // let mktime decide whether DST applied
+  time_t t = mktime(&timeInfo);
+  if (t == (time_t) -1) {
+    return -1;
+  }
+  *ns = (int64_t) t * 1000000000LL;
+  return 1;
+}
+
+/*
+   Name: compilePredicate
+   Purpose: Build the change predicate from the parsed command line. The
+            ctime test is folded into a second cut off that is unreachable
+			when -c is not given, so isChanged() never has to branch on the
+			mode.
+   Parameters: struct changePredicate* pred: filled in
+               int64_t cutoffNs: the -t cut off
+			   int useCtime: non zero for -c
+   return: void
+*/
+void compilePredicate(struct changePredicate* pred, int64_t cutoffNs,
+                      int useCtime) {
+  pred -> mtimeCutoffNs = cutoffNs;
+  pred -> ctimeCutoffNs = useCtime ? cutoffNs : INT64_MAX;
+}
+
+/*
+   Name: isChanged
+   Purpose: The innermost test of an incremental run: has this entry
+            changed since the cut off? Pure integer compares on the
+			metadata the scanner already fetched.
+   Parameters: const struct changePredicate* pred, const struct stat* st
+   return: 1 if the entry is selected, 0 if not
+*/
+static inline int isChanged(const struct changePredicate* pred,
+                            const struct stat* st) {
+  return (timespecToNs(&st -> st_mtim) > pred -> mtimeCutoffNs)
+         | (timespecToNs(&st -> st_ctim) > pred -> ctimeCutoffNs);
+}
+
+/*
+   Name: writeFully
+   Purpose: write() that retries on short writes and EINTR.
+   Parameters: int fd, const void* buf, size_t len
+   return: 1 on success, -1 on failure
+*/
+static int writeFully(int fd, const void* buf, size_t len) {
+  const char* p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/*
+   Name: copyPayload
+   Purpose: Append exactly len bytes of srcFd to dstFd, both at their current
+            file positions. Bytes are moved kernel side where possible:
+			copy_file_range first (can reflink or offload on NFS/XFS/btrfs),
+			then sendfile (the splice path for file to file copies), and
+			finally a bounded user space buffer. A method that the kernel or
+			filesystem rejects is not retried for the rest of the run, any
+			other kernel side error drops to the next method for this file.
+			If the source turns out shorter than len, or cannot be read, the
+			rest is zero filled so the entry keeps the length promised in its
+			header; if it grew, only len bytes are taken.
+   Parameters: int srcFd: file being archived
+               int dstFd: archive descriptor, must not be O_APPEND
+			   uint64_t len: payload length recorded in the entry header
+   return: 1 on success, 0 if a read error left zeros in the payload,
+           -1 if writing the archive failed
+*/
+int copyPayload(int srcFd, int dstFd, uint64_t len) {
+  // shared by the volume writer threads
+  static atomic_int noCopyRange;
+  static atomic_int noSendfile;
+  uint64_t remaining = len;
+  int useCopyRange = atomic_load(&noCopyRange) == 0;
+  int useSendfile = atomic_load(&noSendfile) == 0;
+  int eof = 0;
+  int damaged = 0;
+
+  while (remaining > 0 && useCopyRange && eof == 0) {
+    ssize_t n = copy_file_range(srcFd, NULL, dstFd, NULL,
+                                remaining < COPY_CHUNK ? remaining
+                                : COPY_CHUNK, 0);
+    if (n > 0) {
+      remaining -= n;
+    } else if (n == 0) {
+      eof = 1;
+    } else if (errno != EINTR) {
+      if (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+          || errno == EOPNOTSUPP || errno == EBADF) {
+        atomic_store(&noCopyRange, 1);
+      }
+      useCopyRange = 0;
+    }
+  }
+  while (remaining > 0 && useSendfile && eof == 0) {
+    ssize_t n = sendfile(dstFd, srcFd, NULL,
+                         remaining < COPY_CHUNK ? remaining : COPY_CHUNK);
+    if (n > 0) {
+      remaining -= n;
+    } else if (n == 0) {
+      eof = 1;
+    } else if (errno != EINTR) {
+      if (errno == EINVAL || errno == ENOSYS) {
+        atomic_store(&noSendfile, 1);
+      }
+      useSendfile = 0;
+    }
+  }
+
+  if (copyBuffer == NULL) {
+    copyBuffer = malloc(COPY_SIZE);
+    if (copyBuffer == NULL) {
+      return -1;
+    }
+  }
+  // only reached when both kernel paths gave up on this file
+  while (remaining > 0 && eof == 0) {
+    ssize_t n = read(srcFd, copyBuffer, remaining < COPY_SIZE ? remaining
+                     : COPY_SIZE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      perror("Error in copyPayload: Could not read file");
+      eof = 1;
+      damaged = 1;
+    } else if (n == 0) {
+      eof = 1;
+    } else if (writeFully(dstFd, copyBuffer, n) == -1) {
+      return -1;
+    } else {
+      remaining -= n;
+    }
+  }
+
+  // file shrank underneath us, keep the entry length consistent
+  memset(copyBuffer, 0, COPY_SIZE);
+  while (remaining > 0) {
+    size_t pad = remaining < COPY_SIZE ? remaining : COPY_SIZE;
+    if (writeFully(dstFd, copyBuffer, pad) == -1) {
+      return -1;
+    }
+    remaining -= pad;
+  }
+  return damaged ? 0 : 1;
+}
+
+#ifdef HAVE_IO_URING
+/*
+   Name: uringInit
+   Purpose: Set up an io_uring and map its queues. Kernels without io_uring,
+            or where it is disabled, leave ring -> fd at -1 and every user
+			falls back to the synchronous path.
+   Parameters: struct uring* ring, unsigned int entries: submission slots
+   return: 1 on success, -1 if io_uring is not available
+*/
+int uringInit(struct uring* ring, unsigned int entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(*ring));
+  ring -> fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring -> fd < 0) {
+    ring -> fd = -1;
+    return -1;
+  }
+  // archive writes rely on the file position, reads on hard links
+  if ((params.features & IORING_FEAT_RW_CUR_POS) == 0
+      || (params.features & IORING_FEAT_NODROP) == 0) {
+    close(ring -> fd);
+    ring -> fd = -1;
+    return -1;
+  }
+  ring -> entries = params.sq_entries;
+  ring -> sqMapSize = params.sq_off.array
+                      + params.sq_entries * sizeof(unsigned int);
+  ring -> cqMapSize = params.cq_off.cqes
+                      + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring -> cqMapSize > ring -> sqMapSize) {
+      ring -> sqMapSize = ring -> cqMapSize;
+    }
+    ring -> cqMapSize = ring -> sqMapSize;
+  }
+  ring -> sqMap = mmap(NULL, ring -> sqMapSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring -> fd,
+                       IORING_OFF_SQ_RING);
+  ring -> cqMap = ring -> sqMap;
+  if (ring -> sqMap != MAP_FAILED
+      && (params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    ring -> cqMap = mmap(NULL, ring -> cqMapSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring -> fd,
+                         IORING_OFF_CQ_RING);
+  }
+  ring -> sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring -> sqes = mmap(NULL, ring -> sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring -> fd,
+                      IORING_OFF_SQES);
+  if (ring -> sqMap == MAP_FAILED || ring -> cqMap == MAP_FAILED
+      || ring -> sqes == MAP_FAILED) {
+    printf("Error in uringInit: Could not map the queues\n");
+    close(ring -> fd);
+    ring -> fd = -1;
+    return -1;
+  }
+  char* sq = ring -> sqMap;
+  char* cq = ring -> cqMap;
+  ring -> sqHead = (unsigned int*) (sq + params.sq_off.head);
+  ring -> sqTail = (unsigned int*) (sq + params.sq_off.tail);
+  ring -> sqMask = (unsigned int*) (sq + params.sq_off.ring_mask);
+  ring -> sqArray = (unsigned int*) (sq + params.sq_off.array);
+  ring -> cqHead = (unsigned int*) (cq + params.cq_off.head);
+  ring -> cqTail = (unsigned int*) (cq + params.cq_off.tail);
+  ring -> cqMask = (unsigned int*) (cq + params.cq_off.ring_mask);
+  ring -> cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+  ring -> tail = *ring -> sqTail;
+  return 1;
+}
+
+/*
+   Name: uringFree
+   Purpose: Unmap and close a ring set up by uringInit.
+   Parameters: struct uring* ring
+   return: void
+*/
+void uringFree(struct uring* ring) {
+  if (ring -> fd == -1) {
+    return;
+  }
+  munmap(ring -> sqes, ring -> sqesSize);
+  if (ring -> cqMap != ring -> sqMap) {
+    munmap(ring -> cqMap, ring -> cqMapSize);
+  }
+  munmap(ring -> sqMap, ring -> sqMapSize);
+  close(ring -> fd);
+  ring -> fd = -1;
+}
+
+/*
+   Name: uringQueue
+   Purpose: Fill in the next submission slot. Nothing reaches the kernel
+            until uringSubmit.
+   Parameters: struct uring* ring, int op: IORING_OP_ code, int fd,
+               const void* addr, unsigned int len, uint64_t offset,
+			   int flags: open flags for IORING_OP_OPENAT, sqe flags
+			   otherwise, uint64_t tag: user_data of the completion
+   return: 1 on success, -1 if the submission queue is full
+*/
+int uringQueue(struct uring* ring, int op, int fd, const void* addr,
+               unsigned int len, uint64_t offset, int flags, uint64_t tag) {
+  unsigned int head = __atomic_load_n(ring -> sqHead, __ATOMIC_ACQUIRE);
+  if (ring -> tail - head >= ring -> entries) {
+    return -1;
+  }
+  unsigned int index = ring -> tail & *ring -> sqMask;
+  struct io_uring_sqe* sqe = &ring -> sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe -> opcode = op;
+  sqe -> fd = fd;
+  sqe -> addr = (uintptr_t) addr;
+  sqe -> len = len;
+  sqe -> off = offset;
+  if (op == IORING_OP_OPENAT) {
+    sqe -> open_flags = flags;
+  } else {
+    sqe -> flags = flags;
+  }
+  sqe -> user_data = tag;
+  ring -> sqArray[index] = index;
+  ring -> tail++;
+  return 1;
+}
+
+/*
+   Name: uringSubmit
+   Purpose: Publish the queued submissions to the kernel and wait until at
+            least wait completions are available.
+   Parameters: struct uring* ring, unsigned int wait
+   return: 1 on success, -1 on failure
+*/
+int uringSubmit(struct uring* ring, unsigned int wait) {
+  unsigned int queued = ring -> tail - *ring -> sqTail;
+  __atomic_store_n(ring -> sqTail, ring -> tail, __ATOMIC_RELEASE);
+  while (queued > 0 || wait > 0) {
+    int n = syscall(__NR_io_uring_enter, ring -> fd, queued, wait,
+                    wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      perror("Error in uringSubmit: io_uring_enter failed");
+      return -1;
+    }
+    queued -= n;
+    wait = 0;
+  }
+  return 1;
+}
+
+/*
+   Name: uringReap
+   Purpose: Take the next completion, waiting for one if none is ready.
+   Parameters: struct uring* ring, uint64_t* tag: receives its user_data
+   return: the result of the request (negative errno on failure)
+*/
+int uringReap(struct uring* ring, uint64_t* tag) {
+  unsigned int head = *ring -> cqHead;
+  while (head == __atomic_load_n(ring -> cqTail, __ATOMIC_ACQUIRE)) {
+    if (uringSubmit(ring, 1) == -1) {
+      *tag = 0;
+      return -EIO;
+    }
+  }
+  struct io_uring_cqe* cqe = &ring -> cqes[head & *ring -> cqMask];
+  *tag = cqe -> user_data;
+  int res = cqe -> res;
+  __atomic_store_n(ring -> cqHead, head + 1, __ATOMIC_RELEASE);
+  return res;
+}
+#else
+// without the kernel headers every caller takes the synchronous path
+int uringInit(struct uring* ring, unsigned int entries) {
+  ring -> fd = -1;
+  return -1;
+}
+void uringFree(struct uring* ring) {
+}
+#endif
+
+/*
+   Name: archiveWait
+   Purpose: Wait for the asynchronous write of the spare buffer, if one is
+            in flight, finishing a short write synchronously.
+   Parameters: struct archiveWriter* w
+   return: 1 on success, -1 on write failure
+*/
+int archiveWait(struct archiveWriter* w) {
+#ifdef HAVE_IO_URING
+  if (w -> inflight > 0) {
+    uint64_t tag;
+    uint64_t started = metricNow();
+    int res = uringReap(w -> ring, &tag);
+    size_t len = w -> inflight;
+    w -> inflight = 0;
+    if (res < 0 || writeFully(w -> fd, w -> spare + res, len - res) == -1) {
+      printf("Error in archiveWait: Could not write archive\n");
+      w -> failed = 1;
+      return -1;
+    }
+    metricTime(PHASE_WRITE, started);
+  }
+#endif
+  return 1;
+}
+
+/*
+   Name: archiveFlush
+   Purpose: Write everything held in the writer's buffer to the archive,
+            after any asynchronous write still in flight. Buffered bytes
+			only reach the file here and in archiveSubmit, so callers that
+			write to the descriptor directly must call it first.
+   Parameters: struct archiveWriter* w
+   return: 1 on success, -1 on write failure
+*/
+int archiveFlush(struct archiveWriter* w) {
+  if (archiveWait(w) == -1) {
+    return -1;
+  }
+  if (w -> used > 0) {
+    uint64_t started = metricNow();
+    if (writeFully(w -> fd, w -> buf, w -> used) == -1) {
+      perror("Error in archiveFlush: Could not write archive");
+      w -> failed = 1;
+      return -1;
+    }
+    metricTime(PHASE_WRITE, started);
+    metricCount(COUNT_BYTES_WRITTEN, w -> used);
+    w -> offset += w -> used;
+    w -> used = 0;
+  }
+  return 1;
+}
+
+/*
+   Name: archiveSubmit
+   Purpose: Hand the full buffer to the kernel and keep filling the spare
+            one while it is written, falling back to archiveFlush when
+			there is no ring. At most one write is in flight; it uses the
+			descriptor's file position like write() so direct writers that
+			come after an archiveFlush land behind it.
+   Parameters: struct archiveWriter* w
+   return: 1 on success, -1 on write failure
+*/
+int archiveSubmit(struct archiveWriter* w) {
+#ifdef HAVE_IO_URING
+  if (w -> ring != NULL && w -> used > 0) {
+    if (archiveWait(w) == -1) {
+      return -1;
+    }
+    if (uringQueue(w -> ring, IORING_OP_WRITE, w -> fd, w -> buf, w -> used,
+                   (uint64_t) -1, 0, 0) == -1
+        || uringSubmit(w -> ring, 0) == -1) {
+      w -> failed = 1;
+      return -1;
+    }
+    unsigned char* full = w -> buf;
+    w -> buf = w -> spare;
+    w -> spare = full;
+    metricCount(COUNT_BYTES_WRITTEN, w -> used);
+    w -> inflight = w -> used;
+    w -> offset += w -> used;
+    w -> used = 0;
+    return 1;
+  }
+#endif
+  return archiveFlush(w);
+}
+
+/*
+   Name: archiveAppend
+   Purpose: Append bytes to the archive through the write buffer so that
+            headers and paths of many entries leave in one large write.
+   Parameters: struct archiveWriter* w, const void* data, size_t len
+   return: 1 on success, -1 on write failure
+*/
+int archiveAppend(struct archiveWriter* w, const void* data, size_t len) {
+  const char* src = data;
+  while (len > 0) {
+    if (w -> used == WRITER_BUFFER_SIZE && archiveSubmit(w) == -1) {
+      return -1;
+    }
+    size_t take = WRITER_BUFFER_SIZE - w -> used;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(w -> buf + w -> used, src, take);
+    w -> used += take;
+    src += take;
+    len -= take;
+  }
+  return 1;
+}
+
+/*
+   Name: archiveTell
+   Purpose: Archive offset the next appended byte will land at.
+   Parameters: const struct archiveWriter* w
+   return: the offset
+*/
+uint64_t archiveTell(const struct archiveWriter* w) {
+  return w -> offset + w -> used;
+}
+
+/*
+   Name: archivePatch
+   Purpose: Overwrite bytes that were already appended, such as an entry
+            header whose payloadLen is only known once the payload is
+			written. Bytes still in the buffer are patched in place, bytes
+			already written are rewritten with pwrite once any write still
+			in flight has finished.
+   Parameters: struct archiveWriter* w, uint64_t offset, const void* data,
+               size_t len
+   return: 1 on success, -1 on write failure
+*/
+int archivePatch(struct archiveWriter* w, uint64_t offset, const void* data,
+                 size_t len) {
+  const unsigned char* src = data;
+  if (offset < w -> offset && archiveWait(w) == -1) {
+    return -1;
+  }
+  if (offset < w -> offset) {
+    size_t written = w -> offset - offset;
+    if (written > len) {
+      written = len;
+    }
+    if (pwrite(w -> fd, src, written, offset) != (ssize_t) written) {
+      perror("Error in archivePatch: Could not rewrite archive");
+      w -> failed = 1;
+      return -1;
+    }
+    src += written;
+    offset += written;
+    len -= written;
+  }
+  if (len > 0) {
+    memcpy(w -> buf + (offset - w -> offset), src, len);
+  }
+  return 1;
+}
+
+/*
+   Name: recordEntryOffset
+   Purpose: Remember where an entry header starts, and its path, so that
+            both indexes can be written once the backup is complete.
+   Parameters: struct archiveWriter* w, uint64_t offset: archive offset of
+               the entry header, const char* path, uint32_t len: the
+			   entry's path, length 0 for none
+   return: 1 on success, -1 if out of memory
+*/
+int recordEntryOffset(struct archiveWriter* w, uint64_t offset,
+                      const char* path, uint32_t len) {
+  if (w -> count == w -> capacity) {
+    size_t capacity = w -> capacity == 0 ? 1024 : w -> capacity * 2;
+    uint64_t* grown = realloc(w -> offsets, capacity * sizeof(uint64_t));
+    uint64_t* grownPaths = grown == NULL ? NULL
+                           : realloc(w -> pathOffs,
+                                     capacity * sizeof(uint64_t));
+    if (grown != NULL) {
+      w -> offsets = grown;
+    }
+    if (grownPaths == NULL) {
+      printf("Error in recordEntryOffset: Out of memory\n");
+      return -1;
+    }
+    w -> pathOffs = grownPaths;
+    w -> capacity = capacity;
+  }
+  if (w -> pathsUsed + len + 2 > w -> pathsCapacity) {
+    size_t capacity = w -> pathsCapacity == 0 ? 64 * 1024
+                      : w -> pathsCapacity * 2;
+    while (capacity < w -> pathsUsed + len + 2) {
+      capacity *= 2;
+    }
+    char* grown = realloc(w -> paths, capacity);
+    if (grown == NULL) {
+      printf("Error in recordEntryOffset: Out of memory\n");
+      return -1;
+    }
+    w -> paths = grown;
+    w -> pathsCapacity = capacity;
+  }
+  w -> pathOffs[w -> count] = w -> pathsUsed;
+  putLE16((unsigned char*) w -> paths + w -> pathsUsed, len);
+  if (len > 0) {
+    memcpy(w -> paths + w -> pathsUsed + 2, path, len);
+  }
+  w -> pathsUsed += len + 2;
+  w -> offsets[w -> count++] = offset;
+  return 1;
+}
+
+/*
+   Name: comparePaths
+   Purpose: The one ordering used by every catalog and the path index of
+            an archive: plain byte order, a shorter path sorting before any
+			path it is a prefix of.
+   Parameters: const char* a, size_t aLen, const char* b, size_t bLen
+   return: <0, 0 or >0 like memcmp
+*/
+static int comparePaths(const char* a, size_t aLen, const char* b,
+                        size_t bLen) {
+  int c = memcmp(a, b, aLen < bLen ? aLen : bLen);
+  if (c != 0) {
+    return c;
+  }
+  return aLen < bLen ? -1 : (aLen > bLen ? 1 : 0);
+}
+
+/*
+   Name: pathSort
+   Purpose: An entry of the path index while it is being sorted.
+*/
+struct pathSort {
+  const char* path;
+  uint32_t len;
+  uint64_t offset; // archive offset of the entry header
+};
+
+static int comparePathSort(const void* a, const void* b) {
+  const struct pathSort* x = a;
+  const struct pathSort* y = b;
+  int c = comparePaths(x -> path, x -> len, y -> path, y -> len);
+  if (c != 0) {
+    return c;
+  }
+  return x -> offset < y -> offset ? -1 : x -> offset > y -> offset;
+}
+
+/*
+   Name: archivePathIndex
+   Purpose: Append the path index: every entry sorted by path in blocks of
+            PATH_INDEX_BLOCK front coded records, then the block offsets.
+			Paths of a block mostly share their directories, so a record
+			is often little more than the file name.
+   Parameters: struct archiveWriter* w, uint64_t* tableOffset: set to the
+               offset of the block offsets
+   return: 1 on success, -1 on failure
+*/
+static int archivePathIndex(struct archiveWriter* w, uint64_t* tableOffset) {
+  size_t blocks = (w -> count + PATH_INDEX_BLOCK - 1) / PATH_INDEX_BLOCK;
+  struct pathSort* sorted = malloc(w -> count * sizeof(*sorted) + 1);
+  uint64_t* blockOffsets = malloc(blocks * sizeof(uint64_t) + 1);
+  if (sorted == NULL || blockOffsets == NULL) {
+    printf("Error in archivePathIndex: Out of memory\n");
+    free(sorted);
+    free(blockOffsets);
+    return -1;
+  }
+  for (size_t i = 0; i < w -> count; i++) {
+    const unsigned char* rec = (unsigned char*) w -> paths
+                               + w -> pathOffs[i];
+    sorted[i].len = getLE16(rec);
+    sorted[i].path = (const char*) rec + 2;
+    sorted[i].offset = w -> offsets[i];
+  }
+  qsort(sorted, w -> count, sizeof(*sorted), comparePathSort);
+
+  int result = 1;
+  for (size_t i = 0; i < w -> count && result == 1; i++) {
+    unsigned char rec[PATH_RECORD_SIZE];
+    uint32_t shared = 0;
+    if (i % PATH_INDEX_BLOCK == 0) {
+      blockOffsets[i / PATH_INDEX_BLOCK] = archiveTell(w);
+    } else {
+      uint32_t most = sorted[i].len < sorted[i - 1].len ? sorted[i].len
+                      : sorted[i - 1].len;
+      while (shared < most
+             && sorted[i].path[shared] == sorted[i - 1].path[shared]) {
+        shared++;
+      }
+    }
+    putLE16(rec, shared);
+    putLE16(rec + 2, sorted[i].len - shared);
+    putLE64(rec + 4, sorted[i].offset);
+    result = archiveAppend(w, rec, PATH_RECORD_SIZE);
+    if (result == 1) {
+      result = archiveAppend(w, sorted[i].path + shared,
+                             sorted[i].len - shared);
+    }
+  }
+  *tableOffset = archiveTell(w);
+  for (size_t i = 0; i < blocks && result == 1; i++) {
+    unsigned char offset[8];
+    putLE64(offset, blockOffsets[i]);
+    result = archiveAppend(w, offset, 8);
+  }
+  free(sorted);
+  free(blockOffsets);
+  return result;
+}
+
+/*
+   Name: archiveOpen
+   Purpose: Create (or truncate) the archive once for the whole run, allocate
+            the page aligned write buffer and queue the ARCHIVE_HEADER_SIZE
+			byte header: magic, format version, flags and creation time.
+			With io_uring a spare buffer is allocated too, so full buffers
+			are written asynchronously by archiveSubmit.
+   Parameters: struct archiveWriter* w, const char* path
+   return: 1 on success, -1 on failure
+*/
+int archiveOpen(struct archiveWriter* w, const char* path) {
+  unsigned char buf[ARCHIVE_HEADER_SIZE];
+  struct timespec now;
+
+  memset(w, 0, sizeof(*w));
+  w -> fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR
+                 | S_IRGRP | S_IROTH);
+  if (w -> fd == -1) {
+    printf("Error in archiveOpen: Could not create archive\n");
+    return -1;
+  }
+  if (posix_memalign((void**) &w -> buf, WRITER_ALIGN,
+                     WRITER_BUFFER_SIZE) != 0) {
+    printf("Error in archiveOpen: Out of memory\n");
+    close(w -> fd);
+    return -1;
+  }
+  // a second buffer lets the next one fill while the last is written
+  if (writeRing.fd != -1 && posix_memalign((void**) &w -> spare,
+                                           WRITER_ALIGN,
+                                           WRITER_BUFFER_SIZE) == 0) {
+    w -> ring = &writeRing;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  memset(buf, 0, ARCHIVE_HEADER_SIZE);
+  memcpy(buf, ARCHIVE_MAGIC, 8);
+  putLE32(buf + 8, ARCHIVE_VERSION);
+  putLE64(buf + 16, (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec);
+  return archiveAppend(w, buf, ARCHIVE_HEADER_SIZE);
+}
+
+/*
+   Name: archiveClose
+   Purpose: Append the index of entry offsets and the path index followed
+            by the trailer, flush and close the archive:
+			  0 entryCount u64   8 indexOffset u64
+			 16 pathsOffset u64 24 tableOffset u64 (both 0 before version 3)
+			 32 reserved (16 bytes)
+			 48 version    u32  52 reserved    u32  56 magic "IFBINDEX"
+   Parameters: struct archiveWriter* w
+   return: 1 on success, -1 on write failure
+*/
+int archiveClose(struct archiveWriter* w) {
+  unsigned char buf[TRAILER_SIZE];
+  uint64_t indexOffset = archiveTell(w);
+  int result = 1;
+
+  for (size_t i = 0; i < w -> count && result == 1; i++) {
+    unsigned char offset[8];
+    putLE64(offset, w -> offsets[i]);
+    result = archiveAppend(w, offset, 8);
+  }
+  uint64_t pathsOffset = archiveTell(w);
+  uint64_t tableOffset = 0;
+  if (result == 1 && w -> count > 0) {
+    result = archivePathIndex(w, &tableOffset);
+  }
+
+  memset(buf, 0, TRAILER_SIZE);
+  putLE64(buf, w -> count);
+  putLE64(buf + 8, indexOffset);
+  if (tableOffset != 0) {
+    putLE64(buf + 16, pathsOffset);
+    putLE64(buf + 24, tableOffset);
+  }
+  putLE32(buf + 48, ARCHIVE_VERSION);
+  memcpy(buf + 56, TRAILER_MAGIC, 8);
+  if (result == -1 || archiveAppend(w, buf, TRAILER_SIZE) == -1
+      || archiveFlush(w) == -1) {
+    printf("Error in archiveClose: Could not write trailer\n");
+    result = -1;
+  }
+  if (close(w -> fd) == -1) {
+    result = -1;
+  }
+  free(w -> buf);
+  free(w -> spare);
+  free(w -> offsets);
+  free(w -> pathOffs);
+  free(w -> paths);
+  free(w -> chunks.slots);
+  for (size_t i = 0; w -> links.slots != NULL && i <= w -> links.mask; i++) {
+    free(w -> links.slots[i].path);
+  }
+  free(w -> links.slots);
+  free(w -> named[0].slots);
+  free(w -> named[1].slots);
+  return result;
+}
+
+/*
+   Name: chunkFind
+   Purpose: Look up a chunk digest, inserting an empty slot for it if it is
+            not there yet. The table doubles before it is 70% full.
+   Parameters: struct chunkIndex* idx, const unsigned char* hash
+   return: the slot, slot -> used is 0 for a new digest, NULL if out of memory
+*/
+struct chunkSlot* chunkFind(struct chunkIndex* idx, const unsigned char* hash) {
+  if ((idx -> count + 1) * 10 > (idx -> mask + 1) * 7 || idx -> slots == NULL) {
+    size_t size = idx -> slots == NULL ? 4096 : (idx -> mask + 1) * 2;
+    struct chunkSlot* grown = calloc(size, sizeof(struct chunkSlot));
+    if (grown == NULL) {
+      printf("Error in chunkFind: Out of memory\n");
+      return NULL;
+    }
+    for (size_t i = 0; idx -> slots != NULL && i <= idx -> mask; i++) {
+      if (idx -> slots[i].used) {
+        size_t j = getLE64(idx -> slots[i].hash) & (size - 1);
+        while (grown[j].used) {
+          j = (j + 1) & (size - 1);
+        }
+        grown[j] = idx -> slots[i];
+      }
+    }
+    free(idx -> slots);
+    idx -> slots = grown;
+    idx -> mask = size - 1;
+  }
+
+  size_t i = getLE64(hash) & idx -> mask;
+  while (idx -> slots[i].used
+         && memcmp(idx -> slots[i].hash, hash, HASH_SIZE) != 0) {
+    i = (i + 1) & idx -> mask;
+  }
+  return &idx -> slots[i];
+}
+
+// inode numbers are often sequential, mix them before masking
+static inline size_t linkHash(uint64_t dev, uint64_t ino) {
+  uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 29);
+}
+
+/*
+   Name: linkFind
+   Purpose: Look up an inode, inserting an empty slot for it if it is not
+            there yet. The table doubles before it is 70% full.
+   Parameters: struct linkSet* set, uint64_t dev, uint64_t ino
+   return: the slot, slot -> path is NULL for a new inode, NULL if out of
+           memory
+*/
+struct linkSlot* linkFind(struct linkSet* set, uint64_t dev, uint64_t ino) {
+  if (set -> slots == NULL || (set -> count + 1) * 10 > (set -> mask + 1) * 7) {
+    size_t size = set -> slots == NULL ? 1024 : (set -> mask + 1) * 2;
+    struct linkSlot* grown = calloc(size, sizeof(struct linkSlot));
+    if (grown == NULL) {
+      printf("Error in linkFind: Out of memory\n");
+      return NULL;
+    }
+    for (size_t i = 0; set -> slots != NULL && i <= set -> mask; i++) {
+      if (set -> slots[i].path != NULL) {
+        size_t j = linkHash(set -> slots[i].dev, set -> slots[i].ino)
+                   & (size - 1);
+        while (grown[j].path != NULL) {
+          j = (j + 1) & (size - 1);
+        }
+        grown[j] = set -> slots[i];
+      }
+    }
+    free(set -> slots);
+    set -> slots = grown;
+    set -> mask = size - 1;
+  }
+
+  size_t i = linkHash(dev, ino) & set -> mask;
+  while (set -> slots[i].path != NULL
+         && (set -> slots[i].dev != dev || set -> slots[i].ino != ino)) {
+    i = (i + 1) & set -> mask;
+  }
+  return &set -> slots[i];
+}
+
+/*
+   Name: linkRemember
+   Purpose: Fill the slot linkFind returned for a file that has just been
+            archived, so its other links can refer to it. Out of memory only
+			means later links are stored as copies.
+   Parameters: struct linkSet* set, struct linkSlot* slot,
+               const struct stat* st, const char* relPath
+   return: void
+*/
+static void linkRemember(struct linkSet* set, struct linkSlot* slot,
+                         const struct stat* st, const char* relPath) {
+  slot -> path = strdup(relPath);
+  if (slot -> path != NULL) {
+    slot -> dev = st -> st_dev;
+    slot -> ino = st -> st_ino;
+    set -> count++;
+  }
+}
+
+/*
+   Name: chunkSetup
+   Purpose: Fill the FastCDC gear table from a fixed splitmix64 sequence so
+            cut points are the same on every run and every host, and
+			allocate the read window.
+   Parameters: none
+   return: 1 on success, -1 if out of memory
+*/
+static void gearSetup(void) {
+  uint64_t x = 0x49464243444347ULL; // "IFBCDCG"
+  for (int i = 0; i < 256; i++) {
+    x += 0x9E3779B97F4A7C15ULL;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    gearTable[i] = z ^ (z >> 31);
+  }
+}
+
+int chunkSetup(void) {
+  pthread_once(&gearOnce, gearSetup);
+  chunkWindow = malloc(CHUNK_WINDOW);
+  if (chunkWindow == NULL) {
+    printf("Error in chunkSetup: Out of memory\n");
+    return -1;
+  }
+  return 1;
+}
+
+/*
+   Name: chunkCut
+   Purpose: FastCDC: length of the next chunk starting at data. No cut is
+            considered in the first CHUNK_MIN bytes, a cut needs 18 zero bits
+			until CHUNK_AVG and only 14 after it, which pulls chunk sizes
+			towards CHUNK_AVG, and CHUNK_MAX forces a cut.
+   Parameters: const unsigned char* data, size_t len: bytes available
+   return: bytes in the chunk, at most len
+*/
+static size_t chunkCut(const unsigned char* data, size_t len) {
+  if (len <= CHUNK_MIN) {
+    return len;
+  }
+  size_t normal = len < CHUNK_AVG ? len : CHUNK_AVG;
+  size_t limit = len < CHUNK_MAX ? len : CHUNK_MAX;
+  uint64_t hash = 0;
+  size_t i = CHUNK_MIN;
+  for (; i < normal; i++) {
+    hash = (hash << 1) + gearTable[data[i]];
+    if ((hash & CHUNK_MASK_SMALL) == 0) {
+      return i + 1;
+    }
+  }
+  for (; i < limit; i++) {
+    hash = (hash << 1) + gearTable[data[i]];
+    if ((hash & CHUNK_MASK_LARGE) == 0) {
+      return i + 1;
+    }
+  }
+  return limit;
+}
+
+/*
+   Name: writeChunk
+   Purpose: Append one chunk record. A chunk whose digest is already in the
+            index becomes a reference to the earlier copy, anything else is
+			stored and added to the index.
+   Parameters: struct archiveWriter* w, const unsigned char* data, size_t len
+   return: 1 on success, -1 on failure
+*/
+static int writeChunk(struct archiveWriter* w, const unsigned char* data,
+                      size_t len) {
+  unsigned char hash[HASH_SIZE];
+  unsigned char rec[CHUNK_RECORD_SIZE + 8];
+
+  blake3Hash(data, len, hash);
+  struct chunkSlot* slot = chunkFind(&w -> chunks, hash);
+  if (slot == NULL) {
+    return -1;
+  }
+  memset(rec, 0, sizeof(rec));
+  putLE32(rec + 4, len);
+  if (slot -> used) {
+    rec[0] = CHUNK_REF;
+    putLE64(rec + CHUNK_RECORD_SIZE, slot -> offset);
+    return archiveAppend(w, rec, CHUNK_RECORD_SIZE + 8);
+  }
+  rec[0] = CHUNK_DATA;
+  if (archiveAppend(w, rec, CHUNK_RECORD_SIZE) == -1) {
+    return -1;
+  }
+  memcpy(slot -> hash, hash, HASH_SIZE);
+  slot -> offset = archiveTell(w);
+  slot -> len = len;
+  slot -> used = 1;
+  w -> chunks.count++;
+  return archiveAppend(w, data, len);
+}
+
+/*
+   Name: writeChunkedPayload
+   Purpose: Store up to hdr -> size bytes of srcFd as chunk records, then
+            patch the entry header with the real payloadLen (and the real
+			size, should the file have shrunk). The file is read through
+			a CHUNK_WINDOW byte window, and a cut is only taken once a full
+			CHUNK_MAX bytes are in view or the file is exhausted, so cut
+			points never depend on read sizes.
+   Parameters: struct archiveWriter* w, int srcFd,
+               struct entryHeader* hdr, uint64_t hdrOffset: where the
+			   entry header of the file was appended
+			   unsigned char* digest: receives the BLAKE3 of the content
+   return: 1 on success, -1 on failure
+*/
+int writeChunkedPayload(struct archiveWriter* w, int srcFd,
+                        struct entryHeader* hdr, uint64_t hdrOffset,
+                        unsigned char* digest) {
+  struct blake3Hasher h;
+  uint64_t start = archiveTell(w);
+  uint64_t remaining = hdr -> size;
+  uint64_t stored = 0;
+  size_t have = 0;
+  int done = 0;
+  int result = 1;
+
+  if (chunkWindow == NULL && chunkSetup() == -1) {
+    return -1;
+  }
+  blake3Init(&h);
+  while (result == 1 && (have > 0 || done == 0)) {
+    while (done == 0 && have < CHUNK_WINDOW) {
+      size_t want = CHUNK_WINDOW - have;
+      if (want > remaining) {
+        want = remaining;
+      }
+      ssize_t n = want == 0 ? 0 : read(srcFd, chunkWindow + have, want);
+      if (n > 0) {
+        have += n;
+        remaining -= n;
+      } else if (n < 0 && errno == EINTR) {
+        continue;
+      } else {
+        if (n < 0) {
+          perror("Error in writeChunkedPayload: Could not read file");
+        }
+        done = 1;
+      }
+    }
+    size_t pos = 0;
+    while (result == 1 && pos < have
+           && (have - pos >= CHUNK_MAX || done == 1)) {
+      size_t len = chunkCut(chunkWindow + pos, have - pos);
+      result = writeChunk(w, chunkWindow + pos, len);
+      blake3Update(&h, chunkWindow + pos, len);
+      pos += len;
+    }
+    memmove(chunkWindow, chunkWindow + pos, have - pos);
+    have -= pos;
+    stored += pos;
+  }
+
+  if (result == 1) {
+    unsigned char hdrBuf[ENTRY_HEADER_SIZE];
+    hdr -> size = stored;
+    hdr -> payloadLen = archiveTell(w) - start;
+    encodeEntryHeader(hdr, hdrBuf);
+    result = archivePatch(w, hdrOffset, hdrBuf, ENTRY_HEADER_SIZE);
+    blake3Final(&h, digest);
+  }
+  return result;
+}
+
+#ifdef HAVE_ZSTD
+static size_t zstdBound(size_t len) {
+  return ZSTD_compressBound(len);
+}
+
+static size_t zstdCompress(const void* src, size_t len, void* dst,
+                           size_t cap) {
+  size_t n = ZSTD_compress(dst, cap, src, len, 3);
+  return ZSTD_isError(n) ? 0 : n;
+}
+
+static int zstdDecompress(const void* src, size_t len, void* dst,
+                          size_t rawLen) {
+  size_t n = ZSTD_decompress(dst, rawLen, src, len);
+  return !ZSTD_isError(n) && n == rawLen ? 1 : -1;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static size_t lz4Bound(size_t len) {
+  return LZ4_compressBound(len);
+}
+
+static size_t lz4Compress(const void* src, size_t len, void* dst,
+                          size_t cap) {
+  int n = LZ4_compress_default(src, dst, len, cap);
+  return n > 0 ? (size_t) n : 0;
+}
+
+static int lz4Decompress(const void* src, size_t len, void* dst,
+                         size_t rawLen) {
+  return LZ4_decompress_safe(src, dst, len, rawLen) == (int) rawLen ? 1 : -1;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+static size_t zlibBound(size_t len) {
+  return compressBound(len);
+}
+
+static size_t zlibCompress(const void* src, size_t len, void* dst,
+                           size_t cap) {
+  uLongf n = cap;
+  return compress2(dst, &n, src, len, Z_BEST_SPEED) == Z_OK ? n : 0;
+}
+
+static int zlibDecompress(const void* src, size_t len, void* dst,
+                          size_t rawLen) {
+  uLongf n = rawLen;
+  return uncompress(dst, &n, src, len) == Z_OK && n == rawLen ? 1 : -1;
+}
+#endif
+
+// every codec this build supports, in order of preference
+static const struct codec codecs[] = {
+#ifdef HAVE_ZSTD
+  {"zstd", CODEC_ZSTD, zstdBound, zstdCompress, zstdDecompress},
+#endif
+#ifdef HAVE_LZ4
+  {"lz4", CODEC_LZ4, lz4Bound, lz4Compress, lz4Decompress},
+#endif
+#ifdef HAVE_ZLIB
+  {"zlib", CODEC_ZLIB, zlibBound, zlibCompress, zlibDecompress},
+#endif
+  {NULL, CODEC_STORED, NULL, NULL, NULL}
+};
+
+/*
+   Name: findCodec
+   Purpose: Look a codec up by its -z name or by its stored id.
+   Parameters: const char* name: NULL to search by id, uint8_t id
+   return: the codec, NULL if this build does not have it
+*/
+const struct codec* findCodec(const char* name, uint8_t id) {
+  for (const struct codec* c = codecs; c -> name != NULL; c++) {
+    if (name != NULL ? strcmp(c -> name, name) == 0 : c -> id == id) {
+      return c;
+    }
+  }
+  return NULL;
+}
+
+/*
+   Name: compressWorker
+   Purpose: Compress and hash submitted slots until the compressor stops.
+   Parameters: void* arg: the struct compressor
+   return: NULL
+*/
+static void* compressWorker(void* arg) {
+  struct compressor* c = arg;
+  size_t cap = c -> codec -> bound(COMPRESS_BLOCK);
+
+  pthread_mutex_lock(&c -> lock);
+  while (1) {
+    while (c -> next == c -> head && c -> stop == 0) {
+      pthread_cond_wait(&c -> work, &c -> lock);
+    }
+    if (c -> next == c -> head) {
+      break;
+    }
+    struct compressSlot* slot = &c -> slots[c -> next++ % c -> slotCount];
+    pthread_mutex_unlock(&c -> lock);
+
+    uint64_t started = metricNow();
+    size_t n = slot -> rawLen == 0 ? 0
+               : c -> codec -> compress(slot -> raw, slot -> rawLen,
+                                        slot -> out, cap);
+    metricTime(PHASE_COMPRESS, started);
+    if (n == 0 || n >= slot -> rawLen) {
+      slot -> codec = CODEC_STORED;
+      slot -> outLen = slot -> rawLen;
+    } else {
+      slot -> codec = c -> codec -> id;
+      slot -> outLen = n;
+    }
+    if (slot -> last == 0) {
+      blake3Subtree(slot -> raw, slot -> rawLen / BLAKE3_CHUNK_LEN,
+                    slot -> counter, slot -> cv);
+    }
+
+    pthread_mutex_lock(&c -> lock);
+    slot -> ready = 1;
+    pthread_cond_broadcast(&c -> done);
+  }
+  pthread_mutex_unlock(&c -> lock);
+  return NULL;
+}
+
+/*
+   Name: compressStart
+   Purpose: Allocate the slot ring and start the workers.
+   Parameters: struct compressor* c, const struct codec* codec, int threads
+   return: 1 on success, -1 on failure
+*/
+int compressStart(struct compressor* c, const struct codec* codec,
+                  int threads) {
+  memset(c, 0, sizeof(*c));
+  c -> codec = codec;
+  c -> threads = threads;
+  // enough blocks in flight to keep every worker busy while one is written
+  c -> slotCount = 2 * threads + 2;
+  c -> slots = calloc(c -> slotCount, sizeof(struct compressSlot));
+  c -> tids = calloc(threads, sizeof(pthread_t));
+  if (c -> slots == NULL || c -> tids == NULL) {
+    printf("Error in compressStart: Out of memory\n");
+    return -1;
+  }
+  for (int i = 0; i < c -> slotCount; i++) {
+    c -> slots[i].raw = malloc(COMPRESS_BLOCK);
+    c -> slots[i].out = malloc(codec -> bound(COMPRESS_BLOCK));
+    if (c -> slots[i].raw == NULL || c -> slots[i].out == NULL) {
+      printf("Error in compressStart: Out of memory\n");
+      return -1;
+    }
+  }
+  pthread_mutex_init(&c -> lock, NULL);
+  pthread_cond_init(&c -> work, NULL);
+  pthread_cond_init(&c -> done, NULL);
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&c -> tids[i], NULL, compressWorker, c) != 0) {
+      printf("Error in compressStart: Could not start worker\n");
+      c -> threads = i;
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/*
+   Name: catalogForget
+   Purpose: Make the record of a file that could not be archived differ
+            from any live file, so the next run selects it again instead of
+			trusting a record of content that is in no archive. Its digest
+			and signature may describe half written content and are dropped.
+   Parameters: struct catalogRecord* rec: NULL without a catalog
+   return: void
+*/
+void catalogForget(struct catalogRecord* rec) {
+  if (rec == NULL) {
+    return;
+  }
+  rec -> ctimeNs = 0;
+  memset(rec -> hash, 0, CATALOG_HASH_SIZE);
+  rec -> sigPrev = -1;
+  rec -> sigSpill = -1;
+  rec -> sigLen = 0;
+}
+
+/*
+   Name: compressWriteOne
+   Purpose: Wait for the oldest slot and write it to the archive, preceded
+            by its file's header if it is the first block and followed by
+			the header and digest patches if it is the last.
+   Parameters: struct compressor* c, struct archiveWriter* w
+   return: 1 on success, -1 on write failure
+*/
+static int compressWriteOne(struct compressor* c, struct archiveWriter* w) {
+  struct compressSlot* slot = &c -> slots[c -> tail % c -> slotCount];
+  struct pendingEntry* e = slot -> entry;
+  unsigned char buf[ENTRY_HEADER_SIZE + HASH_SIZE];
+  int result = 1;
+
+  pthread_mutex_lock(&c -> lock);
+  while (slot -> ready == 0) {
+    pthread_cond_wait(&c -> done, &c -> lock);
+  }
+  pthread_mutex_unlock(&c -> lock);
+
+  if (slot -> first) {
+    e -> hdrOffset = archiveTell(w);
+    encodeEntryHeader(&e -> hdr, buf);
+    memset(buf + ENTRY_HEADER_SIZE, 0, HASH_SIZE);
+    result = recordEntryOffset(w, e -> hdrOffset, e -> path,
+                               e -> hdr.pathLen);
+    if (result == 1) {
+      result = archiveAppend(w, buf, ENTRY_HEADER_SIZE);
+    }
+    if (result == 1) {
+      result = archiveAppend(w, e -> path, e -> hdr.pathLen);
+    }
+    if (result == 1) {
+      result = archiveAppend(w, buf + ENTRY_HEADER_SIZE, e -> hdr.extraLen);
+    }
+    e -> payloadStart = archiveTell(w);
+  }
+  if (result == 1 && slot -> rawLen > 0) {
+    unsigned char rec[COMPRESS_RECORD_SIZE];
+    memset(rec, 0, COMPRESS_RECORD_SIZE);
+    rec[0] = slot -> codec;
+    putLE32(rec + 4, slot -> rawLen);
+    putLE32(rec + 8, slot -> outLen);
+    result = archiveAppend(w, rec, COMPRESS_RECORD_SIZE);
+    if (result == 1) {
+      result = archiveAppend(w, slot -> codec == CODEC_STORED ? slot -> raw
+                             : slot -> out, slot -> outLen);
+    }
+  }
+
+  if (slot -> last) {
+    // the final block may hold the root of the tree, hash it in order
+    blake3Update(&e -> hasher, slot -> raw, slot -> rawLen);
+    blake3Final(&e -> hasher, buf + ENTRY_HEADER_SIZE);
+    e -> hdr.payloadLen = archiveTell(w) - e -> payloadStart;
+    encodeEntryHeader(&e -> hdr, buf);
+    if (result == 1) {
+      result = archivePatch(w, e -> hdrOffset, buf, ENTRY_HEADER_SIZE);
+    }
+    if (result == 1) {
+      result = archivePatch(w, e -> hdrOffset + ENTRY_HEADER_SIZE
+                            + e -> hdr.pathLen, buf + ENTRY_HEADER_SIZE,
+                            HASH_SIZE);
+    }
+    if (result == 1 && e -> damaged) {
+      // like writeFileToBackup, the next run has to archive it again
+      printf("Error in compressWriteOne: Could not read all of %s\n",
+             e -> path);
+      catalogForget(e -> rec);
+    } else if (result == 1 && e -> rec != NULL) {
+      memcpy(e -> rec -> hash, buf + ENTRY_HEADER_SIZE, CATALOG_HASH_SIZE);
+    }
+    free(e -> path);
+    free(e);
+  } else {
+    blake3PushSubtree(&e -> hasher, slot -> cv,
+                      COMPRESS_BLOCK / BLAKE3_CHUNK_LEN);
+  }
+
+  slot -> ready = 0;
+  c -> tail++;
+  if (result == -1) {
+    w -> failed = 1;
+  }
+  return result;
+}
+
+/*
+   Name: compressFlush
+   Purpose: Write every block still in the pipeline. Needed before anything
+            is appended to the archive around the compressor.
+   Parameters: struct compressor* c, struct archiveWriter* w
+   return: 1 on success, -1 on write failure
+*/
+int compressFlush(struct compressor* c, struct archiveWriter* w) {
+  while (c -> tail < c -> head) {
+    if (compressWriteOne(c, w) == -1) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/*
+   Name: compressStop
+   Purpose: Stop the workers and free the ring. Blocks not yet written are
+            dropped, so flush first on the success path.
+   Parameters: struct compressor* c
+   return: void
+*/
+void compressStop(struct compressor* c) {
+  if (c -> codec == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&c -> lock);
+  c -> stop = 1;
+  pthread_cond_broadcast(&c -> work);
+  pthread_mutex_unlock(&c -> lock);
+  for (int i = 0; i < c -> threads; i++) {
+    pthread_join(c -> tids[i], NULL);
+  }
+  for (; c -> tail < c -> head; c -> tail++) {
+    struct compressSlot* slot = &c -> slots[c -> tail % c -> slotCount];
+    if (slot -> last) {
+      free(slot -> entry -> path);
+      free(slot -> entry);
+    }
+  }
+  for (int i = 0; i < c -> slotCount; i++) {
+    free(c -> slots[i].raw);
+    free(c -> slots[i].out);
+  }
+  free(c -> slots);
+  free(c -> tids);
+  c -> codec = NULL;
+}
+
+/*
+   Name: compressPayload
+   Purpose: Feed one regular file into the compressor, a block at a time.
+            When the ring is full the oldest block is written out first, so
+			reading, compressing and writing overlap and memory stays at
+			slotCount blocks. The file is padded with zeros if it shrinks
+			or cannot be read, like copyPayload does; after a read error
+			compressWriteOne forgets rec once the entry is written out.
+   Parameters: struct compressor* c, struct archiveWriter* w, int srcFd,
+               const struct entryHeader* hdr, const char* relPath,
+			   struct catalogRecord* rec: receives the digest, NULL
+			   without -C
+   return: 1 on success, -1 on failure
+*/
+int compressPayload(struct compressor* c, struct archiveWriter* w, int srcFd,
+                    const struct entryHeader* hdr, const char* relPath,
+                    struct catalogRecord* rec) {
+  struct pendingEntry* e = malloc(sizeof(struct pendingEntry));
+  char* path = strdup(relPath);
+  if (e == NULL || path == NULL) {
+    printf("Error in compressPayload: Out of memory\n");
+    free(e);
+    free(path);
+    return -1;
+  }
+  e -> hdr = *hdr;
+  e -> hdr.flags |= ENTRY_F_COMPRESSED;
+  e -> path = path;
+  e -> rec = rec;
+  e -> damaged = 0;
+  blake3Init(&e -> hasher);
+
+  uint64_t offset = 0;
+  do {
+    if (c -> head - c -> tail == (uint64_t) c -> slotCount
+        && compressWriteOne(c, w) == -1) {
+      // e is owned by the ring once its first block is in it
+      if (offset == 0) {
+        free(e -> path);
+        free(e);
+      }
+      return -1;
+    }
+    struct compressSlot* slot = &c -> slots[c -> head % c -> slotCount];
+    size_t len = hdr -> size - offset < COMPRESS_BLOCK
+                 ? hdr -> size - offset : COMPRESS_BLOCK;
+    size_t got = 0;
+    while (got < len) {
+      ssize_t n = read(srcFd, slot -> raw + got, len - got);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        if (n < 0 && e -> damaged == 0) {
+          perror("Error in compressPayload: Could not read file");
+        }
+        e -> damaged |= n < 0;
+        break;
+      }
+      got += n;
+    }
+    memset(slot -> raw + got, 0, len - got);
+    slot -> rawLen = len;
+    slot -> counter = offset / BLAKE3_CHUNK_LEN;
+    slot -> entry = e;
+    slot -> first = offset == 0;
+    offset += len;
+    slot -> last = offset == hdr -> size;
+
+    pthread_mutex_lock(&c -> lock);
+    c -> head++;
+    pthread_cond_signal(&c -> work);
+    pthread_mutex_unlock(&c -> lock);
+  } while (offset < hdr -> size);
+  return 1;
+}
+
+/*
+   Name: catalogOpen
+   Purpose: Map the previous catalog. A missing catalog is not an error, it
+            just means this is the first run and everything is new.
+   Parameters: struct catalog* cat: filled in, cat -> map is NULL if absent
+               const char* path: catalog file
+   return: 1 on success or if absent, -1 if the file is not a catalog
+*/
+int catalogOpen(struct catalog* cat, const char* path) {
+  memset(cat, 0, sizeof(*cat));
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return errno == ENOENT ? 1 : -1;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == -1 || info.st_size < CATALOG_HEADER_SIZE) {
+    close(fd);
+    printf("Error in catalogOpen: %s is not a catalog\n", path);
+    return -1;
+  }
+  void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("Error in catalogOpen: Could not map %s\n", path);
+    return -1;
+  }
+  const unsigned char* base = map;
+  uint64_t count = getLE64(base + 16);
+  uint64_t stringsOffset = getLE64(base + 24);
+  uint64_t sigsOffset = getLE64(base + 32);
+  size_t recordSize = getLE32(base + 8) < 2 ? CATALOG_RECORD_SIZE_V1
+                      : CATALOG_RECORD_SIZE;
+  if (memcmp(base, CATALOG_MAGIC, 8) != 0
+      || getLE32(base + 8) > CATALOG_VERSION
+      || stringsOffset > (uint64_t) info.st_size
+      || (sigsOffset != 0 && (sigsOffset < stringsOffset
+                              || sigsOffset > (uint64_t) info.st_size))
+      || count > (stringsOffset - CATALOG_HEADER_SIZE) / recordSize) {
+    munmap(map, info.st_size);
+    printf("Error in catalogOpen: %s is not a catalog\n", path);
+    return -1;
+  }
+  // lookups are binary searches, they jump around the record array
+  madvise(map, info.st_size, MADV_RANDOM);
+  cat -> map = base;
+  cat -> mapLen = info.st_size;
+  cat -> count = count;
+  cat -> recordSize = recordSize;
+  cat -> records = base + CATALOG_HEADER_SIZE;
+  cat -> strings = (const char*) base + stringsOffset;
+  cat -> stringsLen = (sigsOffset != 0 ? sigsOffset : (uint64_t) info.st_size)
+                      - stringsOffset;
+  cat -> scanStartNs = (int64_t) getLE64(base + 40);
+  return 1;
+}
+
+/*
+   Name: catalogPath
+   Purpose: Path of record i of a mapped catalog.
+   Parameters: const struct catalog* cat, uint64_t i, uint32_t* len: set to
+               the path length
+   return: pointer to the (not NUL terminated) path bytes
+*/
+static const char* catalogPath(const struct catalog* cat, uint64_t i,
+                               uint32_t* len) {
+  const unsigned char* rec = cat -> records + i * cat -> recordSize;
+  uint64_t off = getLE64(rec);
+  *len = getLE32(rec + 8);
+  if (off + *len > cat -> stringsLen) {
+    *len = 0; // corrupt record, treat it as an empty path
+    return cat -> strings;
+  }
+  return cat -> strings + off;
+}
+
+/*
+   Name: catalogSig
+   Purpose: Delta signature of record i of a mapped catalog.
+   Parameters: const struct catalog* cat, int64_t i, uint64_t* len: set to
+               the length of the signature
+   return: pointer to the signature, NULL if there is none
+*/
+const unsigned char* catalogSig(const struct catalog* cat, int64_t i,
+                                uint64_t* len) {
+  if (i < 0 || cat -> recordSize < CATALOG_RECORD_SIZE) {
+    return NULL;
+  }
+  uint64_t off = getLE64(cat -> records + i * cat -> recordSize + 72);
+  if (off == 0 || off > cat -> mapLen - DELTA_SIG_HEADER) {
+    return NULL;
+  }
+  uint64_t count = getLE64(cat -> map + off + 8);
+  if (count > (cat -> mapLen - off - DELTA_SIG_HEADER) / DELTA_SIG_SIZE) {
+    return NULL;
+  }
+  *len = DELTA_SIG_HEADER + count * DELTA_SIG_SIZE;
+  return cat -> map + off;
+}
+
+
+/*
+   Name: catalogFind
+   Purpose: Binary search the previous catalog for a path. Safe to call from
+            every scanner thread at once, the mapping is read only.
+   Parameters: const struct catalog* cat, const char* path, size_t len
+   return: record index, or -1 if the path was not in the previous run
+*/
+int64_t catalogFind(const struct catalog* cat, const char* path, size_t len) {
+  uint64_t lo = 0;
+  uint64_t hi = cat -> count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    uint32_t midLen;
+    const char* midPath = catalogPath(cat, mid, &midLen);
+    int c = comparePaths(midPath, midLen, path, len);
+    if (c == 0) {
+      return (int64_t) mid;
+    } else if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return -1;
+}
+
+/*
+   Name: catalogLowerBound
+   Purpose: Binary search the previous catalog for the first record that
+            does not sort before a path. Every path below a directory "d"
+			starts with "d/", so they all follow it without a gap.
+   Parameters: const struct catalog* cat, const char* path, size_t len
+   return: record index, cat -> count if every record sorts before path
+*/
+static uint64_t catalogLowerBound(const struct catalog* cat, const char* path,
+                                  size_t len) {
+  uint64_t lo = 0;
+  uint64_t hi = cat -> count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    uint32_t midLen;
+    const char* midPath = catalogPath(cat, mid, &midLen);
+    if (comparePaths(midPath, midLen, path, len) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+   Name: catalogChanged
+   Purpose: Decide whether an entry differs from its record in the previous
+            catalog. Any difference counts, not just a newer mtime: a file
+			restored with an old mtime, replaced by a rename (new inode) or
+			changed in size or ctime is selected.
+   Parameters: const struct catalog* cat, int64_t i: record from
+               catalogFind, const struct stat* st: live metadata
+   return: 1 if changed, 0 if identical
+*/
+int catalogChanged(const struct catalog* cat, int64_t i,
+                   const struct stat* st) {
+  const unsigned char* rec = cat -> records + i * cat -> recordSize;
+  return getLE32(rec + 12) != st -> st_mode
+         || getLE64(rec + 16) != (uint64_t) st -> st_dev
+         || getLE64(rec + 24) != (uint64_t) st -> st_ino
+         || getLE64(rec + 32) != (uint64_t) st -> st_size
+         || (int64_t) getLE64(rec + 40) != timespecToNs(&st -> st_mtim)
+         || (int64_t) getLE64(rec + 48) != timespecToNs(&st -> st_ctim);
+}
+
+// checksums of nearby windows differ in few bits, spread them out
+static inline uint64_t deltaSlotOf(uint32_t weak, uint64_t mask) {
+  return ((weak * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+/*
+   Name: deltaIndexBuild
+   Purpose: Load a previous signature into a deltaIndex. Signatures made
+            with another block size are ignored, so everything is literal.
+   Parameters: struct deltaIndex* idx, const unsigned char* sig: NULL if
+               there is none, uint64_t len: bytes of sig
+   return: 1 on success, -1 if out of memory
+*/
+int deltaIndexBuild(struct deltaIndex* idx, const unsigned char* sig,
+                    uint64_t len) {
+  memset(idx, 0, sizeof(*idx));
+  if (sig == NULL || len < DELTA_SIG_HEADER
+      || getLE32(sig) != DELTA_BLOCK || getLE64(sig + 8) == 0) {
+    return 1;
+  }
+  uint64_t count = getLE64(sig + 8);
+  uint64_t size = 16;
+  while (size < count * 2) {
+    size *= 2;
+  }
+  idx -> slots = malloc(size * sizeof(struct deltaSlot));
+  if (idx -> slots == NULL) {
+    printf("Error in deltaIndexBuild: Out of memory\n");
+    return -1;
+  }
+  memset(idx -> slots, 0xff, size * sizeof(struct deltaSlot));
+  idx -> entries = sig + DELTA_SIG_HEADER;
+  idx -> count = count;
+  idx -> mask = size - 1;
+  for (uint64_t i = 0; i < count; i++) {
+    uint32_t weak = getLE32(idx -> entries + i * DELTA_SIG_SIZE);
+    uint64_t j = deltaSlotOf(weak, idx -> mask);
+    while (idx -> slots[j].block != DELTA_EMPTY) {
+      j = (j + 1) & idx -> mask;
+    }
+    idx -> slots[j].weak = weak;
+    idx -> slots[j].block = i;
+  }
+  return 1;
+}
+
+/*
+   Name: deltaWeak
+   Purpose: rsync's rolling checksum of one DELTA_BLOCK: a is the sum of
+            the bytes and b the sum weighted by distance from the end, so
+			sliding the block by one byte updates both in constant time.
+   Parameters: const unsigned char* p, uint32_t* a, uint32_t* b
+   return: void
+*/
+static void deltaWeak(const unsigned char* p, uint32_t* a, uint32_t* b) {
+  uint32_t s1 = 0;
+  uint32_t s2 = 0;
+  for (uint32_t i = 0; i < DELTA_BLOCK; i++) {
+    s1 += p[i];
+    s2 += (DELTA_BLOCK - i) * p[i];
+  }
+  *a = s1;
+  *b = s2;
+}
+
+/*
+   Name: deltaMatch
+   Purpose: Find a block of the previous version equal to the DELTA_BLOCK
+            bytes at data. The strong hash is only computed when the rolling
+			checksum hits.
+   Parameters: const struct deltaIndex* idx, uint32_t weak,
+               const unsigned char* data
+   return: the block number, -1 if there is none
+*/
+static int64_t deltaMatch(const struct deltaIndex* idx, uint32_t weak,
+                          const unsigned char* data) {
+  unsigned char strong[HASH_SIZE];
+  int hashed = 0;
+  uint64_t j = deltaSlotOf(weak, idx -> mask);
+  for (; idx -> slots[j].block != DELTA_EMPTY; j = (j + 1) & idx -> mask) {
+    if (idx -> slots[j].weak != weak) {
+      continue;
+    }
+    if (hashed == 0) {
+      blake3Hash(data, DELTA_BLOCK, strong);
+      hashed = 1;
+    }
+    const unsigned char* e = idx -> entries
+                             + (uint64_t) idx -> slots[j].block
+                               * DELTA_SIG_SIZE;
+    if (memcmp(e + 4, strong, DELTA_STRONG_SIZE) == 0) {
+      return idx -> slots[j].block;
+    }
+  }
+  return -1;
+}
+
+/*
+   Name: deltaEmit
+   Purpose: Append the pending copy, if any, then a literal of len bytes.
+            Copies of consecutive blocks are merged into one record by the
+			caller, so they are only written when something else follows.
+   Parameters: struct archiveWriter* w, uint64_t* copyFrom,
+               uint64_t* copyLen: the pending copy, cleared here
+			   const unsigned char* data, size_t len: literal, may be empty
+   return: 1 on success, -1 on write failure
+*/
+static int deltaEmit(struct archiveWriter* w, uint64_t* copyFrom,
+                     uint64_t* copyLen, const unsigned char* data,
+                     size_t len) {
+  unsigned char rec[DELTA_RECORD_SIZE + 8];
+  memset(rec, 0, sizeof(rec));
+  if (*copyLen > 0) {
+    rec[0] = DELTA_COPY;
+    putLE32(rec + 4, *copyLen);
+    putLE64(rec + DELTA_RECORD_SIZE, *copyFrom);
+    *copyLen = 0;
+    if (archiveAppend(w, rec, DELTA_RECORD_SIZE + 8) == -1) {
+      return -1;
+    }
+  }
+  if (len == 0) {
+    return 1;
+  }
+  rec[0] = DELTA_LITERAL;
+  putLE32(rec + 4, len);
+  if (archiveAppend(w, rec, DELTA_RECORD_SIZE) == -1) {
+    return -1;
+  }
+  return archiveAppend(w, data, len);
+}
+
+/*
+   Name: deltaRetire
+   Purpose: Bytes leaving the window: feed them to the content digest and
+            add the signature of every full block among them to sigSpill.
+			data always starts on a DELTA_BLOCK boundary of the file.
+   Parameters: struct blake3Hasher* h, const unsigned char* data, size_t len
+   return: void
+*/
+static void deltaRetire(struct blake3Hasher* h, const unsigned char* data,
+                        size_t len) {
+  unsigned char strong[HASH_SIZE];
+  unsigned char e[DELTA_SIG_SIZE];
+  blake3Update(h, data, len);
+  for (size_t off = 0; off + DELTA_BLOCK <= len; off += DELTA_BLOCK) {
+    uint32_t a, b;
+    deltaWeak(data + off, &a, &b);
+    blake3Hash(data + off, DELTA_BLOCK, strong);
+    putLE32(e, (a & 0xffff) | (b << 16));
+    memcpy(e + 4, strong, DELTA_STRONG_SIZE);
+    fwrite(e, 1, DELTA_SIG_SIZE, sigSpill);
+    sigSpillLen += DELTA_SIG_SIZE;
+  }
+}
+
+/*
+   Name: writeDeltaPayload
+   Purpose: Store hdr -> size bytes of srcFd as delta records against the
+            previous version described by idx, rsync style: the rolling
+			checksum slides over the file a byte at a time, blocks found in
+			idx become copies and the bytes between them literals. The file
+			streams through a DELTA_WINDOW byte window, so memory does not
+			grow with the file, and the signature for the next run is built
+			from the same bytes. A shrinking file is padded with zeros.
+   Parameters: struct archiveWriter* w, int srcFd, struct entryHeader* hdr,
+               uint64_t hdrOffset: where the entry header was appended
+			   const struct deltaIndex* idx: previous signature, may be empty
+			   unsigned char* digest: receives the BLAKE3 of the content
+			   struct catalogRecord* rec: receives the new signature
+   return: 1 on success, -1 on failure
+*/
+int writeDeltaPayload(struct archiveWriter* w, int srcFd,
+                      struct entryHeader* hdr, uint64_t hdrOffset,
+                      const struct deltaIndex* idx, unsigned char* digest,
+                      struct catalogRecord* rec) {
+  static unsigned char* win;
+  struct blake3Hasher h;
+  unsigned char sigHdr[DELTA_SIG_HEADER];
+  uint64_t start = archiveTell(w);
+  uint64_t remaining = hdr -> size;
+  uint64_t copyFrom = 0, copyLen = 0;
+  size_t have = 0, pos = 0, lit = 0;
+  uint32_t a = 0, b = 0;
+  int weakValid = 0;
+  int result = 1;
+
+  if (win == NULL && (win = malloc(DELTA_WINDOW)) == NULL) {
+    printf("Error in writeDeltaPayload: Out of memory\n");
+    return -1;
+  }
+  blake3Init(&h);
+  rec -> sigSpill = sigSpillLen;
+  memset(sigHdr, 0, DELTA_SIG_HEADER);
+  putLE32(sigHdr, DELTA_BLOCK);
+  putLE64(sigHdr + 8, hdr -> size / DELTA_BLOCK);
+  fwrite(sigHdr, 1, DELTA_SIG_HEADER, sigSpill);
+  sigSpillLen += DELTA_SIG_HEADER;
+
+  while (result == 1) {
+    if (have - pos < DELTA_BLOCK && remaining > 0) {
+      // slide: emit the literal so far, retire whole blocks before pos
+      result = deltaEmit(w, &copyFrom, &copyLen, win + lit, pos - lit);
+      size_t keep = pos / DELTA_BLOCK * DELTA_BLOCK;
+      deltaRetire(&h, win, keep);
+      memmove(win, win + keep, have - keep);
+      have -= keep;
+      pos -= keep;
+      lit = pos;
+      while (have < DELTA_WINDOW && remaining > 0) {
+        size_t want = DELTA_WINDOW - have < remaining ? DELTA_WINDOW - have
+                      : remaining;
+        ssize_t n = read(srcFd, win + have, want);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          if (n < 0) {
+            perror("Error in writeDeltaPayload: Could not read file");
+          }
+          // file shrank underneath us, keep the entry length consistent
+          memset(win + have, 0, want);
+          n = want;
+        }
+        have += n;
+        remaining -= n;
+      }
+      continue;
+    }
+    if (have - pos < DELTA_BLOCK) {
+      break;
+    }
+    if (idx -> count == 0) {
+      // nothing to match against, the whole window is literal
+      pos = have;
+      continue;
+    }
+    if (weakValid == 0) {
+      deltaWeak(win + pos, &a, &b);
+      weakValid = 1;
+    }
+    int64_t block = deltaMatch(idx, (a & 0xffff) | (b << 16), win + pos);
+    if (block >= 0) {
+      uint64_t from = (uint64_t) block * DELTA_BLOCK;
+      if (copyLen > 0 && copyFrom + copyLen == from
+          && pos == lit && copyLen + DELTA_BLOCK <= DELTA_COPY_MAX) {
+        copyLen += DELTA_BLOCK;
+      } else {
+        result = deltaEmit(w, &copyFrom, &copyLen, win + lit, pos - lit);
+        copyFrom = from;
+        copyLen = DELTA_BLOCK;
+      }
+      pos += DELTA_BLOCK;
+      lit = pos;
+      weakValid = 0;
+    } else if (have - pos > DELTA_BLOCK) {
+      // roll one byte forward
+      uint32_t out = win[pos];
+      a = a - out + win[pos + DELTA_BLOCK];
+      b = b - DELTA_BLOCK * out + a;
+      pos++;
+    } else {
+      pos++;
+      weakValid = 0;
+    }
+  }
+
+  // whatever is left never matched
+  if (result == 1) {
+    result = deltaEmit(w, &copyFrom, &copyLen, win + lit, have - lit);
+  }
+  deltaRetire(&h, win, have);
+  blake3Final(&h, digest);
+  rec -> sigLen = sigSpillLen - rec -> sigSpill;
+  if (result == 1) {
+    unsigned char hdrBuf[ENTRY_HEADER_SIZE];
+    hdr -> payloadLen = archiveTell(w) - start;
+    encodeEntryHeader(hdr, hdrBuf);
+    result = archivePatch(w, hdrOffset, hdrBuf, ENTRY_HEADER_SIZE);
+  }
+  return result;
+}
+
+/*
+   Name: nameSlot
+   Purpose: Find the slot of an id in a nameCache, growing the table before
+            it is 70% full. A new id gets a free slot (name NULL).
+   Parameters: struct nameCache* cache, unsigned int id
+   return: the slot, NULL if out of memory
+*/
+static struct idName* nameSlot(struct nameCache* cache, unsigned int id) {
+  if (cache -> slots == NULL
+      || (cache -> count + 1) * 10 > (cache -> mask + 1) * 7) {
+    size_t size = cache -> slots == NULL ? 64 : (cache -> mask + 1) * 2;
+    struct idName* grown = calloc(size, sizeof(struct idName));
+    if (grown == NULL) {
+      printf("Error in nameSlot: Out of memory\n");
+      return NULL;
+    }
+    for (size_t i = 0; cache -> slots != NULL && i <= cache -> mask; i++) {
+      if (cache -> slots[i].name != NULL) {
+        size_t j = (cache -> slots[i].id * 0x9E3779B1U) & (size - 1);
+        while (grown[j].name != NULL) {
+          j = (j + 1) & (size - 1);
+        }
+        grown[j] = cache -> slots[i];
+      }
+    }
+    free(cache -> slots);
+    cache -> slots = grown;
+    cache -> mask = size - 1;
+  }
+
+  size_t i = (id * 0x9E3779B1U) & cache -> mask;
+  while (cache -> slots[i].name != NULL && cache -> slots[i].id != id) {
+    i = (i + 1) & cache -> mask;
+  }
+  return &cache -> slots[i];
+}
+
+/*
+   Name: cachedName
+   Purpose: Look up the name of a user or group id, asking NSS only the
+            first time an id is seen. Ids without an entry are named by
+			their number, like ls does, instead of failing.
+   Parameters: struct nameCache* cache: userNames or groupNames
+               unsigned int id, int isGroup
+   return: the cache slot, NULL if out of memory
+*/
+static struct idName* cachedName(struct nameCache* cache, unsigned int id,
+                                 int isGroup) {
+  struct idName* slot = nameSlot(cache, id);
+  if (slot == NULL || slot -> name != NULL) {
+    return slot;
+  }
+  const char* name = NULL;
+  uint64_t started = metricNow();
+  if (isGroup) {
+    struct group* gPoint = getgrgid(id);
+    name = gPoint != NULL ? gPoint -> gr_name : NULL;
+  } else {
+    struct passwd* pPoint = getpwuid(id);
+    name = pPoint != NULL ? pPoint -> pw_name : NULL;
+  }
+  metricTime(PHASE_OWNER, started);
+  char number[16];
+  if (name == NULL) {
+    snprintf(number, sizeof(number), "%u", id);
+  }
+  slot -> name = strdup(name != NULL ? name : number);
+  if (slot -> name == NULL) {
+    printf("Error in cachedName: Out of memory\n");
+    return NULL;
+  }
+  slot -> id = id;
+  slot -> known = name != NULL;
+  slot -> local = id;
+  cache -> count++;
+  return slot;
+}
+
+/*
+   Name: getGroupName()
+   Purpose: Retrieve the group name that a file belongs too given the ID.
+   Parameters: int groupID, retrieved from the stat struct for a given file
+   return: char* the name of the group, or the ID itself if it has none
+*/
+char* getGroupName(int groupID) {
+  struct idName* slot = cachedName(&groupNames, groupID, 1);
+  return slot != NULL ? slot -> name : "?";
+}
+/*
+   Name: getUserName()
+   Purpose: Retrieve the username of the account that created the file.
+   Parameters: int userID, retrieved from the stat struct for a given file
+   return: char* the name of the user, or the ID itself if it has none
+*/
+char* getUserName(int userID) {
+  struct idName* slot = cachedName(&userNames, userID, 0);
+  return slot != NULL ? slot -> name : "?";
+}
+
+/*
+   Name: archiveOwnerName
+   Purpose: Write the ENTRY_USERNAME or ENTRY_GROUPNAME entry for an id
+            the first time an entry owned by it is archived. Ids without a
+			name on this host are left numeric. The shared name cache is
+			only touched under nameLock, which ids this archive already
+			named is kept in w -> named.
+   Parameters: struct archiveWriter* w, unsigned int id, int isGroup
+   return: 1 on success, -1 if writing the archive failed
+*/
+static int archiveOwnerName(struct archiveWriter* w, unsigned int id,
+                            int isGroup) {
+  struct idName* named = nameSlot(&w -> named[isGroup], id);
+  if (named == NULL || named -> name != NULL) {
+    return 1;
+  }
+  pthread_mutex_lock(&nameLock);
+  struct idName* slot = cachedName(isGroup ? &groupNames : &userNames, id,
+                                   isGroup);
+  // names never move once cached, only their slots do
+  char* name = slot != NULL && slot -> known ? slot -> name : NULL;
+  pthread_mutex_unlock(&nameLock);
+  if (name == NULL) {
+    return 1;
+  }
+  // written directly, so it must come after the blocks still queued
+  if (w -> compressor != NULL && compressFlush(w -> compressor, w) == -1) {
+    return -1;
+  }
+  struct entryHeader hdr;
+  unsigned char hdrBuf[ENTRY_HEADER_SIZE];
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.type = isGroup ? ENTRY_GROUPNAME : ENTRY_USERNAME;
+  if (isGroup) {
+    hdr.gid = id;
+  } else {
+    hdr.uid = id;
+  }
+  hdr.size = strlen(name);
+  hdr.payloadLen = hdr.size;
+  encodeEntryHeader(&hdr, hdrBuf);
+  int result = recordEntryOffset(w, archiveTell(w), NULL, 0);
+  if (result == 1) {
+    result = archiveAppend(w, hdrBuf, ENTRY_HEADER_SIZE);
+  }
+  if (result == 1) {
+    result = archiveAppend(w, name, hdr.payloadLen);
+  }
+  if (result == 1) {
+    named -> id = id;
+    named -> name = name;
+    w -> named[isGroup].count++;
+  }
+  return result;
+}
+
+/*
+   Name: sparseMap
+   Purpose: List the data extents of a file with SEEK_DATA and SEEK_HOLE.
+            Files whose data turns out to be one extent covering everything
+			(no holes after all, or a filesystem that does not report them)
+			are not worth the extent map and are left to the normal path.
+   Parameters: int fd, uint64_t size: length recorded for the entry
+               struct sparseExtent** extents: receives a malloced array
+			   size_t* count: receives its length
+   return: 1 if the file has holes, 0 if it should be stored whole,
+           -1 if out of memory
+*/
+static int sparseMap(int fd, uint64_t size, struct sparseExtent** extents,
+                     size_t* count) {
+  struct sparseExtent* list = NULL;
+  size_t used = 0;
+  size_t capacity = 0;
+  off_t pos = 0;
+
+  while ((uint64_t) pos < size) {
+    off_t data = lseek(fd, pos, SEEK_DATA);
+    if (data == -1 && errno != ENXIO) {
+      free(list);
+      return 0;
+    }
+    if (data == -1 || (uint64_t) data >= size) {
+      break; // the rest of the file is a hole
+    }
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if (hole == -1 || (uint64_t) hole > size) {
+      hole = size;
+    }
+    if (used == capacity) {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      struct sparseExtent* grown = realloc(list, capacity * sizeof(*list));
+      if (grown == NULL) {
+        printf("Error in sparseMap: Out of memory\n");
+        free(list);
+        return -1;
+      }
+      list = grown;
+    }
+    list[used].offset = data;
+    list[used].length = hole - data;
+    used++;
+    pos = hole;
+  }
+  lseek(fd, 0, SEEK_SET);
+  if (used == 1 && list[0].offset == 0 && list[0].length == size) {
+    free(list);
+    return 0;
+  }
+  *extents = list;
+  *count = used;
+  return 1;
+}
+
+/*
+   Name: writeSparsePayload
+   Purpose: Append the extent map and the data of each extent of a sparse
+            file, hashing the payload as it is written. Extents that shrank
+			underneath us are zero filled so the payload keeps the length
+			the header promised.
+   Parameters: struct archiveWriter* w, int fd: the file being archived
+               const struct sparseExtent* extents, size_t count
+			   unsigned char* digest: receives the BLAKE3 of the payload
+   return: 1 on success, -1 if writing the archive failed
+*/
+static int writeSparsePayload(struct archiveWriter* w, int fd,
+                              const struct sparseExtent* extents,
+                              size_t count, unsigned char* digest) {
+  struct blake3Hasher h;
+  unsigned char rec[SPARSE_EXTENT_SIZE];
+
+  if (sparseBuffer == NULL && (sparseBuffer = malloc(COPY_SIZE)) == NULL) {
+    printf("Error in writeSparsePayload: Out of memory\n");
+    return -1;
+  }
+  blake3Init(&h);
+  putLE64(rec, count);
+  blake3Update(&h, rec, 8);
+  int result = archiveAppend(w, rec, 8);
+  for (size_t i = 0; result == 1 && i < count; i++) {
+    putLE64(rec, extents[i].offset);
+    putLE64(rec + 8, extents[i].length);
+    blake3Update(&h, rec, SPARSE_EXTENT_SIZE);
+    result = archiveAppend(w, rec, SPARSE_EXTENT_SIZE);
+  }
+  for (size_t i = 0; result == 1 && i < count; i++) {
+    uint64_t done = 0;
+    while (result == 1 && done < extents[i].length) {
+      uint64_t left = extents[i].length - done;
+      size_t take = left < COPY_SIZE ? left : COPY_SIZE;
+      ssize_t n = pread(fd, sparseBuffer, take, extents[i].offset + done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        memset(sparseBuffer, 0, take);
+      } else {
+        take = n;
+      }
+      blake3Update(&h, sparseBuffer, take);
+      result = archiveAppend(w, sparseBuffer, take);
+      done += take;
+    }
+  }
+  blake3Final(&h, digest);
+  return result;
+}
+
+/*
+   Name: writeFileToBackup
+   Purpose: Append one entry to the archive: the fixed entry header, the
+            path relative to the backup root and the payload, which is the
+			link target for a symlink and st_size bytes of content for a
+			regular file. A file whose inode was archived before under
+			another name becomes an ENTRY_HARDLINK naming that path. The
+			payload of a regular file is stored in the first of these
+			forms that applies:
+			  sparse     holes found in a large file, by writeSparsePayload
+			  delta      -d and a catalog signature for a file of at least
+			             DELTA_MIN bytes, by writeDeltaPayload
+			  chunked    -D and more than SMALL_PAYLOAD bytes, as
+			             deduplicated chunks by writeChunkedPayload
+			  compressed -z, handed to the compressor
+			  plain      up to SMALL_PAYLOAD bytes through the write
+			             buffer (or from pre when backupTree read it
+			             through io_uring), larger ones by copyPayload
+			so -z only ever compresses what would otherwise be plain.
+			Content carries its BLAKE3 digest as extra metadata unless the
+			file changed while it was read, and a file that shrinks is
+			padded with zeros so payloadLen stays truthful. Owner and group
+			names go out through archiveOwnerName first.
+   Parameters: int rootFd: descriptor of the backup root
+               const char* relPath: path of the file relative to rootFd
+               struct archiveWriter* w: the run's archive writer
+			   const struct stat* fileData: metadata of the file
+			   struct catalogRecord* rec: live catalog record, receives the
+			   leading CATALOG_HASH_SIZE bytes of a regular file's digest
+			   once its payload is written and its delta signature; NULL
+			   without -C
+			   const struct prefetchFile* pre: content read ahead, or NULL
+   return: 1 on success, -1 on failure (w -> failed tells whether the
+           archive itself is broken or just this file was unreadable)
+*/
+int writeFileToBackup(int rootFd, const char* relPath,
+                      struct archiveWriter* w, const struct stat* fileData,
+                      struct catalogRecord* rec,
+                      const struct prefetchFile* pre) {
+  struct entryHeader hdr;
+  unsigned char hdrBuf[ENTRY_HEADER_SIZE];
+  unsigned char fileDigest[HASH_SIZE];
+  int damaged = 0; // a read error left zeros in the payload
+
+  memset(&hdr, 0, sizeof(hdr));
+  // a further link to a file already in the archive only names it
+  struct linkSlot* link = NULL;
+  if (S_ISREG(fileData -> st_mode) && fileData -> st_nlink > 1) {
+    link = linkFind(&w -> links, fileData -> st_dev, fileData -> st_ino);
+  }
+  if (link != NULL && link -> path != NULL) {
+    hdr.type = ENTRY_HARDLINK;
+    hdr.size = fileData -> st_size; // listed like the file it names
+    hdr.payloadLen = strlen(link -> path);
+  } else if (S_ISDIR(fileData -> st_mode)) {
+    hdr.type = ENTRY_DIR;
+  } else if (S_ISREG(fileData -> st_mode)) {
+    hdr.type = ENTRY_FILE;
+    hdr.flags = ENTRY_F_DIGEST;
+    hdr.size = fileData -> st_size;
+    hdr.extraLen = HASH_SIZE;
+    hdr.payloadLen = fileData -> st_size;
+  } else if (S_ISLNK(fileData -> st_mode)) {
+    hdr.type = ENTRY_SYMLINK;
+  } else {
+    // fifos, sockets and devices have no payload we can archive
+    return 1;
+  }
+  if (archiveOwnerName(w, fileData -> st_uid, 0) == -1
+      || archiveOwnerName(w, fileData -> st_gid, 1) == -1) {
+    w -> failed = 1;
+    return -1;
+  }
+  hdr.mode = fileData -> st_mode;
+  hdr.uid = fileData -> st_uid;
+  hdr.gid = fileData -> st_gid;
+  hdr.pathLen = strlen(relPath);
+  hdr.mtimeNs = timespecToNs(&fileData -> st_mtim);
+
+  int readFile = -1;
+  char target[PATH_MAX];
+  if (pre != NULL && (pre -> got < 0 || hdr.type != ENTRY_FILE
+                      || hdr.payloadLen > SMALL_PAYLOAD
+                      || w -> compressor != NULL)) {
+    pre = NULL; // read ahead failed or is not usable, read it here
+  }
+  if (hdr.type == ENTRY_FILE && pre == NULL) {
+    uint64_t started = metricNow();
+    readFile = openat(rootFd, relPath, O_RDONLY | O_NOFOLLOW);
+    metricTime(PHASE_OPEN, started);
+    if (readFile == -1) {
+      perror("Error in writeFileToBackup: Could not open file");
+      return -1;
+    }
+  } else if (hdr.type == ENTRY_SYMLINK) {
+    // the payload of a link is its target
+    ssize_t len = readlinkat(rootFd, relPath, target, sizeof(target));
+    if (len == -1) {
+      perror("Error in writeFileToBackup: Could not read link");
+      return -1;
+    }
+    hdr.size = len;
+    hdr.payloadLen = len;
+  }
+
+  struct sparseExtent* extents = NULL;
+  size_t extentCount = 0;
+  int sparse = 0;
+  if (hdr.type == ENTRY_FILE && hdr.size > SMALL_PAYLOAD
+      && (uint64_t) fileData -> st_blocks * 512 < hdr.size) {
+    sparse = sparseMap(readFile, hdr.size, &extents, &extentCount);
+    if (sparse == -1) {
+      close(readFile);
+      return -1;
+    }
+  }
+
+  // payloadLen is patched in once a delta or the chunks are written
+  struct deltaIndex delta;
+  if (sparse == 1) {
+    hdr.flags |= ENTRY_F_SPARSE;
+    hdr.payloadLen = 8 + extentCount * SPARSE_EXTENT_SIZE;
+    for (size_t i = 0; i < extentCount; i++) {
+      hdr.payloadLen += extents[i].length;
+    }
+  } else if (hdr.type == ENTRY_FILE && deltaMode && rec != NULL
+             && hdr.size >= DELTA_MIN) {
+    uint64_t sigLen = 0;
+    const unsigned char* sig =
+      catalogSig(&prevCatalog, catalogFind(&prevCatalog, relPath,
+                                           hdr.pathLen), &sigLen);
+    if (deltaIndexBuild(&delta, sig, sigLen) == -1) {
+      close(readFile);
+      return -1;
+    }
+    hdr.flags |= ENTRY_F_DELTA;
+  } else if (hdr.type == ENTRY_FILE && dedupMode
+             && hdr.size > SMALL_PAYLOAD) {
+    hdr.flags |= ENTRY_F_CHUNKED;
+  }
+  if (w -> compressor != NULL && hdr.type == ENTRY_FILE
+      && (hdr.flags & (ENTRY_F_CHUNKED | ENTRY_F_DELTA | ENTRY_F_SPARSE))
+         == 0) {
+    int result = compressPayload(w -> compressor, w, readFile, &hdr, relPath,
+                                 rec);
+    close(readFile);
+    if (result == 1 && link != NULL) {
+      linkRemember(&w -> links, link, fileData, relPath);
+    }
+    if (result == 1) {
+      metricCount(COUNT_BYTES_READ, hdr.size);
+    }
+    return result;
+  }
+  // anything written directly must come after the blocks still queued
+  if (w -> compressor != NULL && compressFlush(w -> compressor, w) == -1) {
+    if (readFile != -1) {
+      close(readFile);
+    }
+    if (hdr.flags & ENTRY_F_DELTA) {
+      free(delta.slots);
+    }
+    free(extents);
+    return -1;
+  }
+  uint64_t hdrOffset = archiveTell(w);
+  int result = recordEntryOffset(w, hdrOffset, relPath, hdr.pathLen);
+  encodeEntryHeader(&hdr, hdrBuf);
+  if (result == 1) {
+    result = archiveAppend(w, hdrBuf, ENTRY_HEADER_SIZE);
+  }
+  if (result == 1) {
+    result = archiveAppend(w, relPath, hdr.pathLen);
+  }
+  // the digest is patched in once the payload has been read
+  uint64_t extraOffset = archiveTell(w);
+  memset(fileDigest, 0, HASH_SIZE);
+  if (result == 1 && hdr.extraLen > 0) {
+    result = archiveAppend(w, fileDigest, hdr.extraLen);
+  }
+  if (result == 1 && hdr.type == ENTRY_SYMLINK) {
+    result = archiveAppend(w, target, hdr.payloadLen);
+  }
+  if (result == 1 && hdr.type == ENTRY_HARDLINK) {
+    result = archiveAppend(w, link -> path, hdr.payloadLen);
+  }
+
+  if (hdr.flags & ENTRY_F_SPARSE) {
+    if (result == 1) {
+      result = writeSparsePayload(w, readFile, extents, extentCount,
+                                  fileDigest);
+    }
+    free(extents);
+  } else if (hdr.flags & ENTRY_F_DELTA) {
+    if (result == 1) {
+      result = writeDeltaPayload(w, readFile, &hdr, hdrOffset, &delta,
+                                 fileDigest, rec);
+    }
+    free(delta.slots);
+  } else if (result == 1 && (hdr.flags & ENTRY_F_CHUNKED)) {
+    result = writeChunkedPayload(w, readFile, &hdr, hdrOffset, fileDigest);
+  } else if (result == 1 && (readFile != -1 || pre != NULL)
+             && hdr.payloadLen <= SMALL_PAYLOAD) {
+    // small file: read it into the write buffer next to its header
+    if (WRITER_BUFFER_SIZE - w -> used < hdr.payloadLen) {
+      result = archiveSubmit(w);
+    }
+    size_t got = 0;
+    ssize_t n = 1;
+    uint64_t started = metricNow();
+    if (result == 1 && pre != NULL) {
+      got = (size_t) pre -> got < hdr.payloadLen ? (size_t) pre -> got
+            : hdr.payloadLen;
+      memcpy(w -> buf + w -> used, pre -> data, got);
+      n = 0;
+    }
+    while (result == 1 && got < hdr.payloadLen && n > 0) {
+      n = read(readFile, w -> buf + w -> used + got, hdr.payloadLen - got);
+      if (n > 0) {
+        got += n;
+      } else if (n < 0 && errno == EINTR) {
+        n = 1;
+      } else if (n < 0) {
+        perror("Error in writeFileToBackup: Could not read file");
+        damaged = 1;
+        n = 0;
+      }
+    }
+    metricTime(PHASE_READ, started);
+    // file shrank underneath us, keep the entry length consistent
+    memset(w -> buf + w -> used + got, 0, hdr.payloadLen - got);
+    blake3Hash(w -> buf + w -> used, hdr.payloadLen, fileDigest);
+    w -> used += hdr.payloadLen;
+  } else if (result == 1 && readFile != -1) {
+    // explicit flush point, the payload goes to the descriptor directly
+    struct hashJob job;
+    struct stat before;
+    struct stat after;
+    result = archiveFlush(w);
+    if (result == 1 && fstat(readFile, &before) == -1) {
+      before = *fileData;
+    }
+    if (result == 1) {
+      result = hashBegin(&job, readFile, hdr.payloadLen);
+    }
+    if (result == 1) {
+      uint64_t started = metricNow();
+      int copied = copyPayload(readFile, w -> fd, hdr.payloadLen);
+      metricTime(PHASE_COPY, started);
+      started = metricNow();
+      result = hashEnd(&job, fileDigest);
+      metricTime(PHASE_HASH, started);
+      // the entry is complete either way, only its content is not
+      if (copied == 0) {
+        damaged = 1;
+      } else if (copied == -1) {
+        result = -1;
+      }
+    }
+    if (result == 1) {
+      metricCount(COUNT_BYTES_WRITTEN, hdr.payloadLen);
+      w -> offset += hdr.payloadLen;
+      // written to meanwhile: the two reads may have seen different bytes
+      if (fstat(readFile, &after) == -1 || after.st_size != before.st_size
+          || timespecToNs(&after.st_mtim) != timespecToNs(&before.st_mtim)
+          || timespecToNs(&after.st_ctim) != timespecToNs(&before.st_ctim)) {
+        hdr.flags &= ~ENTRY_F_DIGEST;
+        encodeEntryHeader(&hdr, hdrBuf);
+        result = archivePatch(w, hdrOffset, hdrBuf, ENTRY_HEADER_SIZE);
+        memset(fileDigest, 0, HASH_SIZE);
+      }
+    }
+  }
+  if (result == 1 && hdr.extraLen > 0) {
+    result = archivePatch(w, extraOffset, fileDigest, HASH_SIZE);
+    if (rec != NULL && damaged == 0) {
+      memcpy(rec -> hash, fileDigest, CATALOG_HASH_SIZE);
+    }
+  }
+  if (readFile != -1) {
+    close(readFile);
+  }
+  // the caller forgets the catalog record, so the next run tries again
+  if (result == 1 && damaged) {
+    printf("Error in writeFileToBackup: Could not read all of %s\n",
+           relPath);
+    return -1;
+  }
+  if (result == 1 && link != NULL && hdr.type == ENTRY_FILE) {
+    linkRemember(&w -> links, link, fileData, relPath);
+  }
+  if (result == 1 && hdr.type == ENTRY_FILE) {
+    metricCount(COUNT_BYTES_READ, hdr.size);
+  }
+  if (result == -1) {
+    printf("Error in writeFileToBackup: Could not archive %s\n", relPath);
+    w -> failed = 1;
+  }
+  return result;
+}
+
+
+/*
+   Name: restoreStream
+   Purpose: Bounded pipeline between the thread reading the archive and the
+            thread writing files. The reader fills up to RESTORE_SLOTS
+			buffers of RESTORE_BUFFER_SIZE bytes ahead of the writer, so large
+			sequential archive reads overlap with the file writes and memory
+			use stays fixed no matter how large the archive is.
+*/
+struct restoreStream {
+  int fd; // archive being read
+  pthread_mutex_t lock;
+  pthread_cond_t filled; // signalled when the reader publishes a buffer
+  pthread_cond_t drained; // signalled when the writer releases a buffer
+  char* data[RESTORE_SLOTS]; // fixed pool of read buffers
+  size_t length[RESTORE_SLOTS]; // bytes valid in each buffer
+  int head; // slot the writer is consuming
+  int count; // slots filled and not yet released
+  int stop; // writer is done, reader should exit
+  int finished; // reader hit end of archive
+  int failed; // reader hit a read error
+  size_t pos; // writer position inside data[head]
+  uint64_t offset; // archive offset of the writer position
+  struct blake3Hasher* hasher; // when set, payload written is hashed too
+};
+
+// each restoring thread's scratch buffers for restoreChunks, restoreBlocks
+// and restoreDelta, kept for the life of the thread
+static _Thread_local unsigned char* restoreChunk;
+static _Thread_local unsigned char* restorePacked;
+static _Thread_local size_t restorePackedCap;
+static _Thread_local unsigned char* restoreRaw;
+static _Thread_local unsigned char* restoreCopy;
+
+/*
+   Name: restoreReader
+   Purpose: Thread body that reads the archive sequentially into the free
+            slots of a restoreStream until end of file.
+   Parameters: void* arg: the restoreStream
+   return: NULL
+*/
+static void* restoreReader(void* arg) {
+  struct restoreStream* rs = arg;
+  int tail = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&rs -> lock);
+    while (rs -> count == RESTORE_SLOTS && rs -> stop == 0) {
+      pthread_cond_wait(&rs -> drained, &rs -> lock);
+    }
+    int stop = rs -> stop;
+    pthread_mutex_unlock(&rs -> lock);
+    if (stop) {
+      return NULL;
+    }
+
+    // fill the whole buffer so the writer sees few, large slots
+    size_t got = 0;
+    ssize_t n = 0;
+    while (got < RESTORE_BUFFER_SIZE && (n = read(rs -> fd,
+           rs -> data[tail] + got, RESTORE_BUFFER_SIZE - got)) > 0) {
+      got += n;
+    }
+
+    pthread_mutex_lock(&rs -> lock);
+    if (got > 0) {
+      rs -> length[tail] = got;
+      rs -> count++;
+      tail = (tail + 1) % RESTORE_SLOTS;
+    }
+    if (n <= 0) {
+      rs -> finished = 1;
+      rs -> failed = n < 0;
+    }
+    pthread_cond_signal(&rs -> filled);
+    pthread_mutex_unlock(&rs -> lock);
+    if (n <= 0) {
+      return NULL;
+    }
+  }
+}
+
+/*
+   Name: restoreAvailable
+   Purpose: Make sure the writer has unread bytes at the head of the stream,
+            releasing exhausted buffers back to the reader and waiting for
+			new ones as needed.
+   Parameters: struct restoreStream* rs
+   return: number of contiguous bytes available, 0 at end of archive,
+           -1 on read error
+*/
+static ssize_t restoreAvailable(struct restoreStream* rs) {
+  pthread_mutex_lock(&rs -> lock);
+  if (rs -> count > 0 && rs -> pos == rs -> length[rs -> head]) {
+    rs -> head = (rs -> head + 1) % RESTORE_SLOTS;
+    rs -> count--;
+    rs -> pos = 0;
+    pthread_cond_signal(&rs -> drained);
+  }
+  while (rs -> count == 0 && rs -> finished == 0) {
+    pthread_cond_wait(&rs -> filled, &rs -> lock);
+  }
+  ssize_t avail = rs -> count > 0 ? 
+                  (ssize_t) (rs -> length[rs -> head] - rs -> pos) : 0;
+  if (avail == 0 && rs -> failed) {
+    avail = -1;
+  }
+  pthread_mutex_unlock(&rs -> lock);
+  return avail;
+}
+
+/*
+   Name: restoreRead
+   Purpose: Copy the next len bytes of the archive into dst, crossing buffer
+            boundaries where needed. Used for headers and paths.
+   Parameters: struct restoreStream* rs, void* dst, size_t len
+   return: 1 on success, 0 if the archive ended first, -1 on read error
+*/
+static int restoreRead(struct restoreStream* rs, void* dst, size_t len) {
+  char* out = dst;
+  while (len > 0) {
+    ssize_t avail = restoreAvailable(rs);
+    if (avail <= 0) {
+      return (int) avail;
+    }
+    size_t take = (size_t) avail < len ? (size_t) avail : len;
+    memcpy(out, rs -> data[rs -> head] + rs -> pos, take);
+    rs -> pos += take;
+    rs -> offset += take;
+    out += take;
+    len -= take;
+  }
+  return 1;
+}
+
+/*
+   Name: restoreCopyOut
+   Purpose: Write the next len bytes of the archive straight from the read
+            buffers into fd. A negative fd skips the bytes instead.
+   Parameters: struct restoreStream* rs, int fd, uint64_t len
+   return: 1 on success, -1 on read or write error
+*/
+static int restoreCopyOut(struct restoreStream* rs, int fd, uint64_t len) {
+  while (len > 0) {
+    ssize_t avail = restoreAvailable(rs);
+    if (avail <= 0) {
+      return -1;
+    }
+    size_t take = (uint64_t) avail < len ? (size_t) avail : len;
+    const char* src = rs -> data[rs -> head] + rs -> pos;
+    size_t done = 0;
+    if (rs -> hasher != NULL) {
+      blake3Update(rs -> hasher, src, take);
+    }
+    while (fd >= 0 && done < take) {
+      ssize_t n = write(fd, src + done, take - done);
+      if (n < 0) {
+        return -1;
+      }
+      done += n;
+    }
+    rs -> pos += take;
+    rs -> offset += take;
+    len -= take;
+  }
+  return 1;
+}
+
+/*
+   Name: isSafeRestorePath
+   Purpose: Reject archive paths that would escape the restore directory,
+            i.e. absolute paths or paths with a ".." component.
+   Parameters: const char* path
+   return: 1 if the path stays inside the restore directory, 0 if not
+*/
+static int isSafeRestorePath(const char* path) {
+  if (path[0] == '/' || path[0] == '\0') {
+    return 0;
+  }
+  for (const char* p = path; *p != '\0'; p++) {
+    if (p[0] == '.' && p[1] == '.' && (p == path || p[-1] == '/')
+        && (p[2] == '/' || p[2] == '\0')) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+   Name: openRestoreParent
+   Purpose: Open the directory that holds path below rootFd one component
+            at a time with O_NOFOLLOW, so a symlink restored from the
+			archive, or already in the restore directory, can not lead a
+			later entry outside of it. With create set missing directories
+			are made on the way: an incremental archive need not contain
+			the directories above a changed file.
+   Parameters: int rootFd: restore directory, const char* path, int create
+               const char** name: receives the last component of path
+   return: descriptor (rootFd itself for a top level path), -1 if a
+           component is missing, a symlink or not a directory
+*/
+static int openRestoreParent(int rootFd, const char* path, int create,
+                             const char** name) {
+  int fd = rootFd;
+  const char* at = path;
+  for (const char* slash; (slash = strchr(at, '/')) != NULL; at = slash + 1) {
+    char part[NAME_MAX + 1];
+    size_t len = slash - at;
+    if (len == 0 || (len == 1 && at[0] == '.')) {
+      continue;
+    }
+    if (len > NAME_MAX) {
+      if (fd != rootFd) {
+        close(fd);
+      }
+      return -1;
+    }
+    memcpy(part, at, len);
+    part[len] = '\0';
+    int next = openat(fd, part, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+    if (next == -1 && errno == ENOENT && create) {
+      mkdirat(fd, part, S_IRWXU);
+      next = openat(fd, part, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+    }
+    if (fd != rootFd) {
+      close(fd);
+    }
+    if (next == -1) {
+      return -1;
+    }
+    fd = next;
+  }
+  *name = at;
+  return fd;
+}
+
+/*
+   Name: restoreDirectory
+   Purpose: Create the directory path below rootFd, and its parents.
+   Parameters: int rootFd: restore directory, const char* path
+   return: void
+*/
+static void restoreDirectory(int rootFd, const char* path) {
+  const char* name;
+  int dirFd = openRestoreParent(rootFd, path, 1, &name);
+  if (dirFd == -1) {
+    printf("Error in restoreDirectory: Could not create %s\n", path);
+    return;
+  }
+  mkdirat(dirFd, name, S_IRWXU);
+  if (dirFd != rootFd) {
+    close(dirFd);
+  }
+}
+
+/*
+   Name: restoreRemove
+   Purpose: Delete path below rootFd for a tombstone, whether it is a file,
+            a link or an empty directory.
+   Parameters: int rootFd: restore directory, const char* path
+   return: void
+*/
+static void restoreRemove(int rootFd, const char* path) {
+  const char* name;
+  int dirFd = openRestoreParent(rootFd, path, 0, &name);
+  if (dirFd == -1) {
+    return;
+  }
+  if (unlinkat(dirFd, name, 0) == -1 && errno == EISDIR) {
+    unlinkat(dirFd, name, AT_REMOVEDIR);
+  }
+  if (dirFd != rootFd) {
+    close(dirFd);
+  }
+}
+
+/*
+   Name: applyMetadata
+   Purpose: Set mode, ownership (when running as root) and modification time
+            of a restored object from its entry header. Uses the open fd when
+			there is one, otherwise name in dirFd, which is only done for
+			symlinks and never follows them.
+   Parameters: int dirFd, int fd (-1 for none), const char* name,
+               const struct entryHeader* hdr
+   return: void
+*/
+static void applyMetadata(int dirFd, int fd, const char* name,
+                          const struct entryHeader* hdr) {
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1].tv_sec = hdr -> mtimeNs / 1000000000LL;
+  times[1].tv_nsec = hdr -> mtimeNs % 1000000000LL;
+
+  if (fd >= 0) {
+    if (geteuid() == 0) {
+      fchown(fd, hdr -> uid, hdr -> gid);
+    }
+    fchmod(fd, hdr -> mode & 07777);
+    futimens(fd, times);
+  } else {
+    if (geteuid() == 0) {
+      fchownat(dirFd, name, hdr -> uid, hdr -> gid, AT_SYMLINK_NOFOLLOW);
+    }
+    if (hdr -> type != ENTRY_SYMLINK) {
+      fchmodat(dirFd, name, hdr -> mode & 07777, 0);
+    }
+    utimensat(dirFd, name, times, AT_SYMLINK_NOFOLLOW);
+  }
+}
+
+/*
+   Name: restoreChunks
+   Purpose: Write the chunk records of a chunked entry to fd. Stored chunks
+            come from the stream, references are read back from the earlier
+			copy with pread, so a chunked archive must be a seekable file.
+   Parameters: struct restoreStream* rs, int fd: -1 to only skip the payload
+               const struct entryHeader* hdr
+   return: 1 on success, -1 on a corrupt or unreadable archive
+*/
+static int restoreChunks(struct restoreStream* rs, int fd,
+                         const struct entryHeader* hdr) {
+  unsigned char rec[CHUNK_RECORD_SIZE + 8];
+  uint64_t left = hdr -> payloadLen;
+
+  while (left > 0) {
+    if (left < CHUNK_RECORD_SIZE
+        || restoreRead(rs, rec, CHUNK_RECORD_SIZE) != 1) {
+      return -1;
+    }
+    left -= CHUNK_RECORD_SIZE;
+    uint32_t len = getLE32(rec + 4);
+    if (rec[0] == CHUNK_DATA && len <= left) {
+      if (restoreCopyOut(rs, fd, len) == -1) {
+        return -1;
+      }
+      left -= len;
+    } else if (rec[0] == CHUNK_REF && left >= 8 && len <= CHUNK_MAX) {
+      if (restoreRead(rs, rec + CHUNK_RECORD_SIZE, 8) != 1) {
+        return -1;
+      }
+      left -= 8;
+      if (restoreChunk == NULL && (restoreChunk = malloc(CHUNK_MAX)) == NULL) {
+        printf("Error in restoreChunks: Out of memory\n");
+        return -1;
+      }
+      uint64_t offset = getLE64(rec + CHUNK_RECORD_SIZE);
+      if (pread(rs -> fd, restoreChunk, len, offset) != (ssize_t) len) {
+        printf("Error in restoreChunks: Chunked entries need a seekable "
+               "archive\n");
+        return -1;
+      }
+      if (fd != -1 && writeFully(fd, restoreChunk, len) == -1) {
+        return -1;
+      }
+      if (rs -> hasher != NULL) {
+        blake3Update(rs -> hasher, restoreChunk, len);
+      }
+    } else {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/*
+   Name: restoreBlocks
+   Purpose: Expand the blocks of a compressed entry into fd. Stored blocks
+            are copied straight from the stream.
+   Parameters: struct restoreStream* rs, int fd: -1 to only skip the payload
+               const struct entryHeader* hdr
+   return: 1 on success, -1 on a corrupt archive or unknown codec
+*/
+static int restoreBlocks(struct restoreStream* rs, int fd,
+                         const struct entryHeader* hdr) {
+  unsigned char rec[COMPRESS_RECORD_SIZE];
+  uint64_t left = hdr -> payloadLen;
+
+  if (restoreRaw == NULL && (restoreRaw = malloc(COMPRESS_BLOCK)) == NULL) {
+    printf("Error in restoreBlocks: Out of memory\n");
+    return -1;
+  }
+  while (left > 0) {
+    if (left < COMPRESS_RECORD_SIZE
+        || restoreRead(rs, rec, COMPRESS_RECORD_SIZE) != 1) {
+      return -1;
+    }
+    uint32_t rawLen = getLE32(rec + 4);
+    uint32_t storedLen = getLE32(rec + 8);
+    left -= COMPRESS_RECORD_SIZE;
+    if (storedLen > left || rawLen > COMPRESS_BLOCK) {
+      return -1;
+    }
+    left -= storedLen;
+    if (rec[0] == CODEC_STORED) {
+      if (storedLen != rawLen || restoreCopyOut(rs, fd, storedLen) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    const struct codec* codec = findCodec(NULL, rec[0]);
+    if (codec == NULL) {
+      printf("Error in restoreBlocks: Codec %d is not built in, rebuild "
+             "with the HAVE_ flag for it\n", rec[0]);
+      return -1;
+    }
+    if (storedLen > restorePackedCap) {
+      free(restorePacked);
+      restorePackedCap = storedLen;
+      restorePacked = malloc(restorePackedCap);
+      if (restorePacked == NULL) {
+        restorePackedCap = 0;
+        printf("Error in restoreBlocks: Out of memory\n");
+        return -1;
+      }
+    }
+    if (restoreRead(rs, restorePacked, storedLen) != 1
+        || codec -> decompress(restorePacked, storedLen, restoreRaw,
+                               rawLen) == -1) {
+      return -1;
+    }
+    if (fd != -1 && writeFully(fd, restoreRaw, rawLen) == -1) {
+      return -1;
+    }
+    if (rs -> hasher != NULL) {
+      blake3Update(rs -> hasher, restoreRaw, rawLen);
+    }
+  }
+  return 1;
+}
+
+/*
+   Name: restoreDelta
+   Purpose: Rebuild a delta entry into fd: literals come from the stream,
+            copies from oldFd, the version of the file restored before.
+   Parameters: struct restoreStream* rs, int fd, int oldFd: -1 if there is
+               no previous version, const struct entryHeader* hdr,
+			   const char* path: for messages
+   return: 1 on success, 0 if the previous version is missing or does not
+           fit (the payload is skipped), -1 on a corrupt archive
+*/
+static int restoreDelta(struct restoreStream* rs, int fd, int oldFd,
+                        const struct entryHeader* hdr, const char* path) {
+  unsigned char rec[DELTA_RECORD_SIZE + 8];
+  uint64_t left = hdr -> payloadLen;
+
+  if (restoreCopy == NULL && (restoreCopy = malloc(COPY_SIZE)) == NULL) {
+    printf("Error in restoreDelta: Out of memory\n");
+    return -1;
+  }
+  while (left > 0) {
+    if (left < DELTA_RECORD_SIZE
+        || restoreRead(rs, rec, DELTA_RECORD_SIZE) != 1) {
+      return -1;
+    }
+    left -= DELTA_RECORD_SIZE;
+    uint32_t len = getLE32(rec + 4);
+    if (rec[0] == DELTA_LITERAL && len <= left) {
+      if (restoreCopyOut(rs, fd, len) == -1) {
+        return -1;
+      }
+      left -= len;
+      continue;
+    }
+    if (rec[0] != DELTA_COPY || left < 8
+        || restoreRead(rs, rec + DELTA_RECORD_SIZE, 8) != 1) {
+      return -1;
+    }
+    left -= 8;
+    uint64_t from = getLE64(rec + DELTA_RECORD_SIZE);
+    while (len > 0) {
+      size_t take = len < COPY_SIZE ? len : COPY_SIZE;
+      if (oldFd == -1
+          || pread(oldFd, restoreCopy, take, from) != (ssize_t) take) {
+        printf("Error in restoreDelta: %s needs the version it was based "
+               "on, restore the earlier archives first\n", path);
+        return restoreCopyOut(rs, -1, left) == 1 ? 0 : -1;
+      }
+      if (writeFully(fd, restoreCopy, take) == -1) {
+        return -1;
+      }
+      if (rs -> hasher != NULL) {
+        blake3Update(rs -> hasher, restoreCopy, take);
+      }
+      from += take;
+      len -= take;
+    }
+  }
+  return 1;
+}
+
+/*
+   Name: restoreSparse
+   Purpose: Rebuild a sparse entry into fd, which already has the full size
+            from ftruncate, so only the data extents are written and the
+			rest stays unallocated.
+   Parameters: struct restoreStream* rs, int fd,
+               const struct entryHeader* hdr
+   return: 1 on success, -1 on a corrupt archive or a write error
+*/
+static int restoreSparse(struct restoreStream* rs, int fd,
+                         const struct entryHeader* hdr) {
+  unsigned char rec[SPARSE_EXTENT_SIZE];
+  if (hdr -> payloadLen < 8 || restoreRead(rs, rec, 8) != 1) {
+    return -1;
+  }
+  if (rs -> hasher != NULL) {
+    blake3Update(rs -> hasher, rec, 8);
+  }
+  uint64_t count = getLE64(rec);
+  if (count > (hdr -> payloadLen - 8) / SPARSE_EXTENT_SIZE) {
+    return -1;
+  }
+  struct sparseExtent* extents = malloc(count * sizeof(*extents) + 1);
+  if (extents == NULL) {
+    printf("Error in restoreSparse: Out of memory\n");
+    return -1;
+  }
+  uint64_t left = hdr -> payloadLen - 8 - count * SPARSE_EXTENT_SIZE;
+  int result = 1;
+  for (uint64_t i = 0; result == 1 && i < count; i++) {
+    result = restoreRead(rs, rec, SPARSE_EXTENT_SIZE);
+    extents[i].offset = getLE64(rec);
+    extents[i].length = getLE64(rec + 8);
+    if (rs -> hasher != NULL) {
+      blake3Update(rs -> hasher, rec, SPARSE_EXTENT_SIZE);
+    }
+    if (extents[i].length > left || extents[i].offset > hdr -> size
+        || extents[i].length > hdr -> size - extents[i].offset) {
+      result = -1;
+    } else {
+      left -= extents[i].length;
+    }
+  }
+  for (uint64_t i = 0; result == 1 && i < count; i++) {
+    if (fd != -1 && lseek(fd, extents[i].offset, SEEK_SET) == -1) {
+      result = -1;
+    } else {
+      result = restoreCopyOut(rs, fd, extents[i].length);
+    }
+  }
+  free(extents);
+  return result;
+}
+
+/*
+   Name: restoreFile
+   Purpose: Create one regular file from the stream. The full size is
+            preallocated before the payload is written so the filesystem can
+			lay it out contiguously, then mode and mtime are applied through
+			the still open descriptor. Chunked entries are rebuilt by
+			restoreChunks, compressed ones by restoreBlocks and deltas by
+			restoreDelta into a temporary file that then replaces the
+			previous version. Sparse entries get their size from ftruncate
+			instead, which leaves the holes unallocated, and restoreSparse
+			writes only the data extents. When the
+			entry has a digest the content is hashed as it is written and
+			a mismatch is reported.
+   Parameters: struct restoreStream* rs, int rootFd, const char* path,
+               const struct entryHeader* hdr,
+			   const unsigned char* digest: expected digest or NULL
+   return: 1 on success, 0 if the file could not be restored intact,
+           -1 on failure
+*/
+static int restoreFile(struct restoreStream* rs, int rootFd, const char* path,
+                       const struct entryHeader* hdr,
+                       const unsigned char* digest) {
+  struct blake3Hasher h;
+  char tmp[NAME_MAX + 16];
+  const char* name;
+  int dirFd = openRestoreParent(rootFd, path, 1, &name);
+  const char* target = name;
+  int oldFd = -1;
+  if (dirFd != -1 && (hdr -> flags & ENTRY_F_DELTA)) {
+    // built next to the previous version, which it reads from
+    oldFd = openat(dirFd, name, O_RDONLY | O_NOFOLLOW);
+    snprintf(tmp, sizeof(tmp), "%s.ifbdelta", name);
+    target = tmp;
+  }
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+  int fd = dirFd == -1 ? -1 : openat(dirFd, target, flags, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    printf("Error in restoreFile: Could not create %s\n", path);
+    if (oldFd != -1) {
+      close(oldFd);
+    }
+    if (dirFd != -1 && dirFd != rootFd) {
+      close(dirFd);
+    }
+    // keep the stream in step with the archive
+    if (hdr -> flags & ENTRY_F_CHUNKED) {
+      return restoreChunks(rs, -1, hdr) == 1 ? 0 : -1;
+    }
+    // compressed blocks are skipped whole, like plain payloads
+    return restoreCopyOut(rs, -1, hdr -> payloadLen) == 1 ? 0 : -1;
+  }
+  if (hdr -> flags & ENTRY_F_SPARSE) {
+    ftruncate(fd, hdr -> size);
+  } else if (hdr -> size > 0) {
+    posix_fallocate(fd, 0, hdr -> size);
+  }
+  if (digest != NULL) {
+    blake3Init(&h);
+    rs -> hasher = &h;
+  }
+  int result;
+  if (hdr -> flags & ENTRY_F_DELTA) {
+    result = restoreDelta(rs, fd, oldFd, hdr, path);
+  } else if (hdr -> flags & ENTRY_F_CHUNKED) {
+    result = restoreChunks(rs, fd, hdr);
+  } else if (hdr -> flags & ENTRY_F_COMPRESSED) {
+    result = restoreBlocks(rs, fd, hdr);
+  } else if (hdr -> flags & ENTRY_F_SPARSE) {
+    result = restoreSparse(rs, fd, hdr);
+  } else {
+    result = restoreCopyOut(rs, fd, hdr -> payloadLen);
+  }
+  rs -> hasher = NULL;
+  if (oldFd != -1) {
+    close(oldFd);
+  }
+  if (result != 1) {
+    if (result == -1) {
+      printf("Error in restoreFile: Could not write %s\n", path);
+    }
+    if (target != name) {
+      unlinkat(dirFd, target, 0);
+    }
+    close(fd);
+    if (dirFd != rootFd) {
+      close(dirFd);
+    }
+    return result;
+  }
+  if (target != name && renameat(dirFd, target, dirFd, name) == -1) {
+    printf("Error in restoreFile: Could not replace %s\n", path);
+    result = 0;
+  }
+  if (digest != NULL) {
+    unsigned char actual[HASH_SIZE];
+    blake3Final(&h, actual);
+    if (memcmp(actual, digest, HASH_SIZE) != 0) {
+      printf("Error in restoreFile: Checksum mismatch for %s\n", path);
+      result = 0;
+    }
+  }
+  applyMetadata(dirFd, fd, name, hdr);
+  close(fd);
+  if (dirFd != rootFd) {
+    close(dirFd);
+  }
+  return result;
+}
+
+/*
+   Name: restoreOwnerName
+   Purpose: Read an ENTRY_USERNAME or ENTRY_GROUPNAME entry and remember
+            which id the name has on this host, so the entries after it
+			are chowned to the same account even if its number differs
+			here. Names this host does not know keep the archived id.
+   Parameters: struct restoreStream* rs, const struct entryHeader* hdr
+   return: 1 on success, -1 on a corrupt archive or out of memory
+*/
+static int restoreOwnerName(struct restoreStream* rs,
+                            const struct entryHeader* hdr) {
+  char name[256];
+  int isGroup = hdr -> type == ENTRY_GROUPNAME;
+  unsigned int id = isGroup ? hdr -> gid : hdr -> uid;
+  if (hdr -> payloadLen >= sizeof(name)
+      || restoreRead(rs, name, hdr -> payloadLen) != 1) {
+    return -1;
+  }
+  name[hdr -> payloadLen] = '\0';
+  struct idName* slot = nameSlot(isGroup ? &groupNames : &userNames, id);
+  if (slot == NULL) {
+    return -1;
+  }
+  if (slot -> name == NULL) {
+    (isGroup ? &groupNames : &userNames) -> count++;
+  }
+  free(slot -> name);
+  slot -> name = strdup(name);
+  if (slot -> name == NULL) {
+    return -1;
+  }
+  slot -> id = id;
+  slot -> local = id;
+  if (isGroup) {
+    struct group* gPoint = getgrnam(name);
+    if (gPoint != NULL) {
+      slot -> local = gPoint -> gr_gid;
+    }
+  } else {
+    struct passwd* pPoint = getpwnam(name);
+    if (pPoint != NULL) {
+      slot -> local = pPoint -> pw_uid;
+    }
+  }
+  return 1;
+}
+
+/*
+   Name: restoreOwner
+   Purpose: Switch the ids of an entry to the local ids of the owner names
+            the archive recorded for them, see restoreOwnerName.
+   Parameters: struct entryHeader* hdr
+   return: void
+*/
+static void restoreOwner(struct entryHeader* hdr) {
+  struct idName* owner = nameSlot(&userNames, hdr -> uid);
+  if (owner != NULL && owner -> name != NULL) {
+    hdr -> uid = owner -> local;
+  }
+  owner = nameSlot(&groupNames, hdr -> gid);
+  if (owner != NULL && owner -> name != NULL) {
+    hdr -> gid = owner -> local;
+  }
+}
+
+/*
+   Name: restoreLink
+   Purpose: Create a symbolic link, or a hard link to an earlier restored
+            path, in place of whatever path is now.
+   Parameters: int rootFd, const struct entryHeader* hdr, const char* path
+               const char* target: the link's payload
+   return: void
+*/
+static void restoreLink(int rootFd, const struct entryHeader* hdr,
+                        const char* path, const char* target) {
+  const char* name;
+  int dirFd = openRestoreParent(rootFd, path, 1, &name);
+  if (dirFd == -1) {
+    printf("Error in restoreLink: Could not create %s\n", path);
+    return;
+  }
+  unlinkat(dirFd, name, 0);
+  if (hdr -> type == ENTRY_SYMLINK) {
+    symlinkat(target, dirFd, name);
+    applyMetadata(dirFd, -1, name, hdr);
+  } else if (isSafeRestorePath(target) == 0) {
+    printf("Error in restoreLink: Skipping unsafe link %s\n", path);
+  } else {
+    // the target is resolved the same way, so it can not be outside either
+    const char* targetName;
+    int targetFd = openRestoreParent(rootFd, target, 0, &targetName);
+    if (targetFd == -1
+        || linkat(targetFd, targetName, dirFd, name, 0) == -1) {
+      printf("Error in restoreLink: Could not link %s\n", path);
+    }
+    if (targetFd != -1 && targetFd != rootFd) {
+      close(targetFd);
+    }
+  }
+  if (dirFd != rootFd) {
+    close(dirFd);
+  }
+}
+
+/*
+   Name: restoreDirMetadata
+   Purpose: Apply the metadata of a restored directory once everything in it
+            is written. The directory is opened without following a link
+			that an entry after it put in its place.
+   Parameters: int rootFd: restore directory, const char* path,
+               const struct entryHeader* hdr
+   return: void
+*/
+static void restoreDirMetadata(int rootFd, const char* path,
+                               const struct entryHeader* hdr) {
+  const char* name;
+  int dirFd = openRestoreParent(rootFd, path, 0, &name);
+  if (dirFd == -1) {
+    return;
+  }
+  int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  if (fd != -1) {
+    applyMetadata(dirFd, fd, name, hdr);
+    close(fd);
+  }
+  if (dirFd != rootFd) {
+    close(dirFd);
+  }
+}
+
+/*
+   Name: restoreDirAdd
+   Purpose: Remember a restored directory so its metadata is applied once
+            everything in it is written, see restoreDirMetadata.
+   Parameters: struct entryHeader** hdrs, char*** paths: grown as needed
+               size_t* count, size_t* capacity: of both arrays
+			   const struct entryHeader* hdr, const char* path
+   return: 1 on success, -1 if out of memory
+*/
+static int restoreDirAdd(struct entryHeader** hdrs, char*** paths,
+                         size_t* count, size_t* capacity,
+                         const struct entryHeader* hdr, const char* path) {
+  if (*count == *capacity) {
+    size_t grown = *capacity == 0 ? 256 : *capacity * 2;
+    struct entryHeader* moreHdrs = realloc(*hdrs, grown * sizeof(**hdrs));
+    if (moreHdrs != NULL) {
+      *hdrs = moreHdrs;
+    }
+    char** morePaths = realloc(*paths, grown * sizeof(**paths));
+    if (morePaths != NULL) {
+      *paths = morePaths;
+    }
+    if (moreHdrs == NULL || morePaths == NULL) {
+      return -1;
+    }
+    *capacity = grown;
+  }
+  char* copy = strdup(path);
+  if (copy == NULL) {
+    return -1;
+  }
+  (*hdrs)[*count] = *hdr;
+  (*paths)[(*count)++] = copy;
+  return 1;
+}
+
+/*
+   Name: restoreMapped
+   Purpose: Set up a restoreStream over bytes of a mapped archive instead of
+            a reader thread, so the restore functions can work on any entry
+			directly. fd stays the archive for the pread of chunk
+			references.
+   Parameters: struct restoreStream* rs, int fd: the archive
+               const unsigned char* data, uint64_t len: the bytes to serve
+   return: void
+*/
+static void restoreMapped(struct restoreStream* rs, int fd,
+                          const unsigned char* data, uint64_t len) {
+  memset(rs, 0, sizeof(*rs));
+  rs -> fd = fd;
+  pthread_mutex_init(&rs -> lock, NULL);
+  pthread_cond_init(&rs -> filled, NULL);
+  pthread_cond_init(&rs -> drained, NULL);
+  rs -> data[0] = (char*) data;
+  rs -> length[0] = len;
+  rs -> count = len > 0;
+  rs -> finished = 1;
+}
+
+/*
+   Name: restoreJob
+   Purpose: One unit of work of a parallel restore: a whole file entry, or
+            one RESTORE_RANGE piece of a large stored file. The pieces of a
+			file share a restoreRange, and whoever writes the last one
+			checks the digest and applies the metadata.
+*/
+struct restoreRange {
+  int fd; // created and sized before the pieces are queued
+  struct entryHeader hdr;
+  char* path;
+  const unsigned char* digest; // in the map, NULL without ENTRY_F_DIGEST
+  const unsigned char* payload; // in the map
+  atomic_size_t pending; // pieces not written yet
+  atomic_int failed;
+};
+
+struct restoreJob {
+  uint64_t offset; // archive offset of the entry header
+  uint64_t start; // piece of a range: payload offset and length
+  uint64_t len;
+  struct restoreRange* range; // NULL for a whole entry
+  uint32_t uid; // local owner, see restoreOwner
+  uint32_t gid;
+};
+
+/*
+   Name: restorePool
+   Purpose: What the workers of a parallel restore share. Jobs are handed
+            out in archive order through next.
+*/
+struct restorePool {
+  const unsigned char* map;
+  uint64_t size;
+  int fd; // the archive
+  int rootFd;
+  struct restoreJob* jobs;
+  size_t count;
+  atomic_size_t next;
+  atomic_int damaged; // a file could not be restored intact
+  atomic_int failed; // the archive turned out corrupt
+};
+
+/*
+   Name: restoreRangeDone
+   Purpose: Finish a large file once all of its pieces are written: compare
+            its digest over the mapped payload and apply the metadata.
+   Parameters: struct restorePool* pool, struct restoreRange* range
+   return: void
+*/
+static void restoreRangeDone(struct restorePool* pool,
+                             struct restoreRange* range) {
+  if (atomic_load(&range -> failed)) {
+    printf("Error in restoreRangeDone: Could not write %s\n", range -> path);
+    atomic_store(&pool -> damaged, 1);
+  } else if (range -> digest != NULL) {
+    struct blake3Hasher h;
+    unsigned char actual[HASH_SIZE];
+    blake3Init(&h);
+    blake3Update(&h, range -> payload, range -> hdr.payloadLen);
+    blake3Final(&h, actual);
+    if (memcmp(actual, range -> digest, HASH_SIZE) != 0) {
+      printf("Error in restoreRangeDone: Checksum mismatch for %s\n",
+             range -> path);
+      atomic_store(&pool -> damaged, 1);
+    }
+  }
+  applyMetadata(pool -> rootFd, range -> fd, range -> path, &range -> hdr);
+  close(range -> fd);
+  metricCount(COUNT_RESTORED, 1);
+}
+
+/*
+   Name: restoreWorker
+   Purpose: Thread body of a parallel restore worker. It takes jobs until
+            none are left: whole files go through restoreFile on a mapped
+			stream, pieces of large files are written with pwrite.
+   Parameters: void* arg: the struct restorePool
+   return: NULL
+*/
+static void* restoreWorker(void* arg) {
+  struct restorePool* pool = arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&pool -> next, 1)) < pool -> count) {
+    struct restoreJob* job = &pool -> jobs[i];
+    if (job -> range != NULL) {
+      struct restoreRange* range = job -> range;
+      uint64_t started = metricNow();
+      for (uint64_t done = 0; done < job -> len;) {
+        ssize_t n = pwrite(range -> fd, range -> payload + job -> start
+                           + done, job -> len - done, job -> start + done);
+        if (n <= 0) {
+          atomic_store(&range -> failed, 1);
+          break;
+        }
+        done += n;
+      }
+      metricTime(PHASE_RESTORE_RANGE, started);
+      metricCount(COUNT_BYTES_RESTORED, job -> len);
+      if (atomic_fetch_sub(&range -> pending, 1) == 1) {
+        restoreRangeDone(pool, range);
+      }
+      continue;
+    }
+
+    // offsets and lengths were checked when the job was queued
+    struct entryHeader hdr;
+    char path[PATH_MAX];
+    decodeEntryHeader(pool -> map + job -> offset, &hdr);
+    hdr.uid = job -> uid;
+    hdr.gid = job -> gid;
+    const unsigned char* body = pool -> map + job -> offset
+                                + ENTRY_HEADER_SIZE;
+    memcpy(path, body, hdr.pathLen);
+    path[hdr.pathLen] = '\0';
+    int hasDigest = (hdr.flags & ENTRY_F_DIGEST) && hdr.extraLen >= HASH_SIZE;
+    struct restoreStream rs;
+    restoreMapped(&rs, pool -> fd, body + hdr.pathLen + hdr.extraLen,
+                  hdr.payloadLen);
+    uint64_t started = metricNow();
+    int restored = restoreFile(&rs, pool -> rootFd, path, &hdr,
+                               hasDigest ? body + hdr.pathLen : NULL);
+    metricTime(PHASE_RESTORE, started);
+    if (restored == 1) {
+      metricCount(COUNT_RESTORED, 1);
+      metricCount(COUNT_BYTES_RESTORED, hdr.size);
+    }
+    if (restored == 0) {
+      atomic_store(&pool -> damaged, 1);
+    } else if (restored == -1) {
+      atomic_store(&pool -> failed, 1);
+    }
+  }
+  // restoreParallel runs this on its own thread when it has no others
+  free(restoreChunk);
+  restoreChunk = NULL;
+  free(restorePacked);
+  restorePacked = NULL;
+  free(restoreRaw);
+  restoreRaw = NULL;
+  free(restoreCopy);
+  restoreCopy = NULL;
+  return NULL;
+}
+
+/*
+   Name: pathCursor
+   Purpose: Position in the path index of a mapped archive, with the path
+            of the current record rebuilt from the front coding.
+*/
+struct pathCursor {
+  const unsigned char* map;
+  const struct archiveIndex* ai;
+  uint64_t record; // next record to decode
+  uint64_t pos; // archive offset of that record
+  char path[PATH_MAX];
+  uint32_t len;
+  uint64_t offset; // entry header of the current record
+};
+
+/*
+   Name: pathBlock
+   Purpose: Where block b of the path index starts.
+   Parameters: const unsigned char* map, const struct archiveIndex* ai,
+               uint64_t b
+   return: archive offset of the block's first record, 0 if corrupt
+*/
+static uint64_t pathBlock(const unsigned char* map,
+                          const struct archiveIndex* ai, uint64_t b) {
+  if (b >= ai -> blocks) {
+    return 0;
+  }
+  // a record header has to fit between pos and the block table
+  uint64_t pos = getLE64(map + ai -> tableOffset + b * 8);
+  if (pos < ai -> pathsOffset || ai -> tableOffset < PATH_RECORD_SIZE
+      || pos > ai -> tableOffset - PATH_RECORD_SIZE) {
+    return 0;
+  }
+  return pos;
+}
+
+/*
+   Name: pathSeek
+   Purpose: Point a cursor at the block that holds the first path not
+            sorting before prefix: a binary search over the first path of
+			every block, which is stored whole.
+   Parameters: struct pathCursor* pc: map and ai set
+               const char* prefix, size_t len
+   return: void
+*/
+static void pathSeek(struct pathCursor* pc, const char* prefix, size_t len) {
+  uint64_t lo = 0;
+  uint64_t hi = pc -> ai -> blocks;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    uint64_t pos = pathBlock(pc -> map, pc -> ai, mid);
+    uint32_t midLen = pos == 0 ? 0 : getLE16(pc -> map + pos + 2);
+    if (pos != 0 && midLen <= pc -> ai -> tableOffset - pos
+                              - PATH_RECORD_SIZE
+        && comparePaths((const char*) pc -> map + pos + PATH_RECORD_SIZE,
+                        midLen, prefix, len) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  // lo is the first block starting at or after prefix, earlier paths may
+  // sit at the end of the block before
+  pc -> record = (lo > 0 ? lo - 1 : 0) * PATH_INDEX_BLOCK;
+  pc -> len = 0;
+}
+
+/*
+   Name: pathNext
+   Purpose: Decode the next record of the path index.
+   Parameters: struct pathCursor* pc
+   return: 1 with path, len and offset set, 0 at the end, -1 if corrupt
+*/
+static int pathNext(struct pathCursor* pc) {
+  if (pc -> record >= pc -> ai -> count) {
+    return 0;
+  }
+  if (pc -> record % PATH_INDEX_BLOCK == 0) {
+    pc -> pos = pathBlock(pc -> map, pc -> ai,
+                          pc -> record / PATH_INDEX_BLOCK);
+    pc -> len = 0;
+    if (pc -> pos == 0) {
+      return -1;
+    }
+  }
+  // check the header is inside the paths before reading it
+  if (pc -> pos > pc -> ai -> tableOffset
+      || pc -> ai -> tableOffset - pc -> pos < PATH_RECORD_SIZE) {
+    return -1;
+  }
+  const unsigned char* rec = pc -> map + pc -> pos;
+  uint32_t shared = getLE16(rec);
+  uint32_t suffix = getLE16(rec + 2);
+  if (shared > pc -> len || shared + suffix >= PATH_MAX
+      || suffix > pc -> ai -> tableOffset - pc -> pos - PATH_RECORD_SIZE) {
+    return -1;
+  }
+  memcpy(pc -> path + shared, rec + PATH_RECORD_SIZE, suffix);
+  pc -> len = shared + suffix;
+  pc -> path[pc -> len] = '\0';
+  pc -> offset = getLE64(rec + 4);
+  pc -> pos += PATH_RECORD_SIZE + suffix;
+  pc -> record++;
+  return 1;
+}
+
+/*
+   Name: pathFind
+   Purpose: Look up the entry of one exact path in the path index.
+   Parameters: const unsigned char* map, const struct archiveIndex* ai,
+               const char* path, size_t len
+   return: archive offset of the entry header, 0 if there is none
+*/
+static uint64_t pathFind(const unsigned char* map,
+                         const struct archiveIndex* ai, const char* path,
+                         size_t len) {
+  struct pathCursor pc;
+  pc.map = map;
+  pc.ai = ai;
+  pathSeek(&pc, path, len);
+  while (pathNext(&pc) == 1) {
+    int c = comparePaths(pc.path, pc.len, path, len);
+    if (c == 0) {
+      return pc.offset;
+    } else if (c > 0) {
+      break;
+    }
+  }
+  return 0;
+}
+
+/*
+   Name: pathMatches
+   Purpose: Whether a -p selector picks a path: the path itself or one of
+            the directories above it is the selector, or matches it as an
+			fnmatch pattern when it has wildcards. A * also matches /.
+   Parameters: const char* selector, int isGlob, char* path: NUL terminated,
+               briefly cut at each / while matching
+   return: 1 if it matches, 0 if not
+*/
+static int pathMatches(const char* selector, int isGlob, char* path) {
+  for (char* cut = path; ; cut++) {
+    if (*cut == '/' || *cut == '\0') {
+      char saved = *cut;
+      *cut = '\0';
+      int match = isGlob ? fnmatch(selector, path, 0) == 0
+                  : strcmp(selector, path) == 0;
+      *cut = saved;
+      if (match) {
+        return 1;
+      }
+      if (saved == '\0') {
+        return 0;
+      }
+    }
+  }
+}
+
+/*
+   Name: offsetList
+   Purpose: Growing array of entry offsets picked for a restore.
+*/
+struct offsetList {
+  uint64_t* offsets;
+  size_t count;
+  size_t capacity;
+};
+
+static int offsetAdd(struct offsetList* list, uint64_t offset) {
+  if (list -> count == list -> capacity) {
+    size_t capacity = list -> capacity == 0 ? 256 : list -> capacity * 2;
+    uint64_t* grown = realloc(list -> offsets, capacity * sizeof(uint64_t));
+    if (grown == NULL) {
+      printf("Error in offsetAdd: Out of memory\n");
+      return -1;
+    }
+    list -> offsets = grown;
+    list -> capacity = capacity;
+  }
+  list -> offsets[list -> count++] = offset;
+  return 1;
+}
+
+static int compareOffsets(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+   Name: pathAncestors
+   Purpose: Add the entries of the directories above a path, so they are
+            restored with their own mode and mtime, and for a hard link the
+			entry of the path it links to, which a restore needs first.
+   Parameters: const unsigned char* map, uint64_t size,
+               const struct archiveIndex* ai, struct offsetList* list,
+			   const char* path, uint32_t len, uint64_t offset: its entry
+   return: 1 on success, -1 if out of memory
+*/
+static int pathAncestors(const unsigned char* map, uint64_t size,
+                         const struct archiveIndex* ai,
+                         struct offsetList* list, const char* path,
+                         uint32_t len, uint64_t offset) {
+  for (uint32_t i = 0; i < len; i++) {
+    uint64_t dir = path[i] == '/' ? pathFind(map, ai, path, i) : 0;
+    if (dir != 0 && offsetAdd(list, dir) == -1) {
+      return -1;
+    }
+  }
+  struct entryHeader hdr;
+  if (offset > size - ENTRY_HEADER_SIZE
+      || decodeEntryHeader(map + offset, &hdr) == -1
+      || hdr.type != ENTRY_HARDLINK || hdr.payloadLen >= PATH_MAX) {
+    return 1;
+  }
+  uint64_t payload = offset + ENTRY_HEADER_SIZE + hdr.pathLen + hdr.extraLen;
+  if (payload > size || size - payload < hdr.payloadLen) {
+    return 1;
+  }
+  const char* target = (const char*) map + payload;
+  uint64_t file = pathFind(map, ai, target, hdr.payloadLen);
+  if (file == 0) {
+    return 1;
+  }
+  if (offsetAdd(list, file) == -1) {
+    return -1;
+  }
+  return pathAncestors(map, size, ai, list, target, hdr.payloadLen, file);
+}
+
+/*
+   Name: pathSelect
+   Purpose: Pick the entries a -p restore needs from the path index alone:
+            the owner names, the entries every selector matches and what
+			those depend on, see pathAncestors. Only the part of the index
+			sharing a selector's literal prefix is read, so a selector
+			naming one file touches a handful of index pages.
+   Parameters: const unsigned char* map, uint64_t size,
+               const struct archiveIndex* ai, struct offsetList* list:
+			   receives the entry offsets in archive order, no duplicates
+   return: number of entries a selector matched, -1 on failure
+*/
+static int64_t pathSelect(const unsigned char* map, uint64_t size,
+                          const struct archiveIndex* ai,
+                          struct offsetList* list) {
+  struct pathCursor pc;
+  int64_t matched = 0;
+  int state;
+  pc.map = map;
+  pc.ai = ai;
+  // owner names have the empty path and sort first
+  pathSeek(&pc, "", 0);
+  while ((state = pathNext(&pc)) == 1 && pc.len == 0) {
+    if (offsetAdd(list, pc.offset) == -1) {
+      return -1;
+    }
+  }
+  for (int i = 0; state != -1 && i < restorePathCount; i++) {
+    const char* selector = restorePaths[i];
+    size_t prefixLen = strcspn(selector, "*?[\\");
+    int isGlob = selector[prefixLen] != '\0';
+    char parent[PATH_MAX] = "";
+    pathSeek(&pc, selector, prefixLen);
+    while ((state = pathNext(&pc)) == 1) {
+      if (comparePaths(pc.path, pc.len, selector, prefixLen) < 0) {
+        continue;
+      }
+      if (pc.len < prefixLen || memcmp(pc.path, selector, prefixLen) != 0) {
+        break; // past every path starting with the prefix
+      }
+      if (pathMatches(selector, isGlob, pc.path) == 0) {
+        continue;
+      }
+      matched++;
+      if (offsetAdd(list, pc.offset) == -1) {
+        return -1;
+      }
+      // paths of one directory follow each other, its parents are only
+      // looked up for the first
+      char* slash = strrchr(pc.path, '/');
+      size_t dirLen = slash == NULL ? 0 : (size_t) (slash - pc.path);
+      int sameDir = strlen(parent) == dirLen
+                    && strncmp(parent, pc.path, dirLen) == 0;
+      memcpy(parent, pc.path, dirLen);
+      parent[dirLen] = '\0';
+      if (pathAncestors(map, size, ai, list, pc.path, sameDir ? 0 : pc.len,
+                        pc.offset) == -1) {
+        return -1;
+      }
+    }
+  }
+  if (state == -1) {
+    printf("Error in pathSelect: Corrupt path index\n");
+    return -1;
+  }
+  qsort(list -> offsets, list -> count, sizeof(uint64_t), compareOffsets);
+  size_t unique = 0;
+  for (size_t i = 0; i < list -> count; i++) {
+    if (unique == 0 || list -> offsets[unique - 1] != list -> offsets[i]) {
+      list -> offsets[unique++] = list -> offsets[i];
+    }
+  }
+  list -> count = unique;
+  return matched;
+}
+
+/*
+   Name: restoreParallel
+   Purpose: Restore an archive with -j workers, or with -p only the entries
+            pathSelect picks from its path index. It is mapped and walked
+			through its index once: owner names are read, the directory
+			skeleton and symbolic links are created on the way and every
+			file becomes a job, large stored files one per RESTORE_RANGE
+			piece written with pwrite into the file created up front. The
+			workers then extract the files in parallel. Hard links and
+			tombstones follow once the files exist, and last the
+			directories get their mode and mtime, deepest first.
+   Parameters: int rootFd: restore directory
+   return: 0 on success, -1 on failure, 1 if the archive has no intact
+           index (or is a pipe) and has to be restored as a stream, or for
+		   -p has no path index
+*/
+static int restoreParallel(int rootFd) {
+  int fd = open(archiveFile, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || S_ISREG(st.st_mode) == 0
+      || st.st_size < ARCHIVE_HEADER_SIZE + TRAILER_SIZE) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return 1;
+  }
+  uint64_t size = st.st_size;
+  const unsigned char* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return 1;
+  }
+  struct archiveIndex ai;
+  if (memcmp(map, ARCHIVE_MAGIC, 8) != 0
+      || getLE32(map + 8) > ARCHIVE_VERSION
+      || archiveIndexOf(map, size, &ai) == -1
+      || (restorePathCount > 0 && ai.tableOffset == 0)) {
+    munmap((void*) map, size);
+    close(fd);
+    return 1;
+  }
+  // -p: only what the selectors pick, found through the path index
+  struct offsetList picked;
+  memset(&picked, 0, sizeof(picked));
+  uint64_t count = ai.count;
+  if (restorePathCount > 0) {
+    madvise((void*) map, size, MADV_RANDOM);
+    int64_t matched = pathSelect(map, size, &ai, &picked);
+    if (matched <= 0) {
+      if (matched == 0) {
+        printf("Error in restoreParallel: No entry matches the paths\n");
+      }
+      free(picked.offsets);
+      munmap((void*) map, size);
+      close(fd);
+      return -1;
+    }
+    count = picked.count;
+  }
+
+  struct restorePool pool;
+  memset(&pool, 0, sizeof(pool));
+  pool.map = map;
+  pool.size = size;
+  pool.fd = fd;
+  pool.rootFd = rootFd;
+  size_t jobCapacity = 0;
+  struct restoreRange** ranges = NULL;
+  size_t rangeCount = 0;
+  size_t rangeCapacity = 0;
+  // hard links and tombstones, by entry index, done after the files
+  uint64_t* later = malloc(count * sizeof(uint64_t) + 1);
+  size_t laterCount = 0;
+  // directories whose metadata is applied once everything is written
+  struct entryHeader* dirHdrs = NULL;
+  char** dirPaths = NULL;
+  size_t dirCount = 0;
+  size_t dirCapacity = 0;
+  int result = later == NULL ? -1 : 0;
+
+  for (uint64_t i = 0; result == 0 && i < count; i++) {
+    uint64_t offset = restorePathCount > 0 ? picked.offsets[i]
+                      : getLE64(map + ai.indexOffset + i * 8);
+    struct entryHeader hdr;
+    if (offset > size || size - offset < ENTRY_HEADER_SIZE
+        || decodeEntryHeader(map + offset, &hdr) == -1) {
+      printf("Error in restoreParallel: Corrupt entry at %llu\n",
+             (unsigned long long) offset);
+      result = -1;
+      break;
+    }
+    uint64_t body = offset + ENTRY_HEADER_SIZE;
+    uint64_t payload = body + hdr.pathLen + hdr.extraLen;
+    if (payload < body || payload > size || size - payload < hdr.payloadLen
+        || hdr.pathLen >= PATH_MAX) {
+      printf("Error in restoreParallel: Corrupt entry at %llu\n",
+             (unsigned long long) offset);
+      result = -1;
+      break;
+    }
+    if (hdr.type == ENTRY_USERNAME || hdr.type == ENTRY_GROUPNAME) {
+      struct restoreStream rs;
+      restoreMapped(&rs, fd, map + payload, hdr.payloadLen);
+      if (restoreOwnerName(&rs, &hdr) == -1) {
+        printf("Error in restoreParallel: Corrupt owner name\n");
+        result = -1;
+      }
+      continue;
+    }
+    char path[PATH_MAX];
+    memcpy(path, map + body, hdr.pathLen);
+    path[hdr.pathLen] = '\0';
+    if (isSafeRestorePath(path) == 0) {
+      printf("Error in restoreParallel: Skipping unsafe path %s\n", path);
+      continue;
+    }
+    restoreOwner(&hdr);
+
+    if (hdr.type == ENTRY_DIR) {
+      restoreDirectory(rootFd, path);
+      if (restoreDirAdd(&dirHdrs, &dirPaths, &dirCount, &dirCapacity, &hdr,
+                        path) == -1) {
+        printf("Error in restoreParallel: Out of memory\n");
+        result = -1;
+        break;
+      }
+    } else if (hdr.type == ENTRY_SYMLINK) {
+      char target[PATH_MAX];
+      if (hdr.payloadLen >= sizeof(target)) {
+        printf("Error in restoreParallel: Corrupt link %s\n", path);
+        result = -1;
+        break;
+      }
+      memcpy(target, map + payload, hdr.payloadLen);
+      target[hdr.payloadLen] = '\0';
+      restoreLink(rootFd, &hdr, path, target);
+    } else if (hdr.type == ENTRY_HARDLINK || hdr.type == ENTRY_TOMBSTONE) {
+      later[laterCount++] = offset;
+    } else if (hdr.type == ENTRY_FILE) {
+      size_t pieces = 1;
+      struct restoreRange* range = NULL;
+      // only stored payloads are the file itself and can be cut up
+      int ranged = (hdr.flags & (ENTRY_F_CHUNKED | ENTRY_F_COMPRESSED
+                                 | ENTRY_F_DELTA | ENTRY_F_SPARSE)) == 0
+                   && hdr.payloadLen == hdr.size
+                   && hdr.size >= 2 * (uint64_t) RESTORE_RANGE;
+      if (ranged) {
+        pieces = (hdr.size + RESTORE_RANGE - 1) / RESTORE_RANGE;
+      }
+      // make room first, so nothing has to be undone after the open
+      if (pool.count + pieces > jobCapacity) {
+        size_t capacity = (pool.count + pieces) * 2;
+        struct restoreJob* grown = realloc(pool.jobs,
+                                           capacity * sizeof(*grown));
+        if (grown == NULL) {
+          printf("Error in restoreParallel: Out of memory\n");
+          result = -1;
+          break;
+        }
+        pool.jobs = grown;
+        jobCapacity = capacity;
+      }
+      if (ranged && rangeCount == rangeCapacity) {
+        size_t capacity = rangeCapacity == 0 ? 16 : rangeCapacity * 2;
+        struct restoreRange** grown = realloc(ranges,
+                                              capacity * sizeof(*grown));
+        if (grown == NULL) {
+          printf("Error in restoreParallel: Out of memory\n");
+          result = -1;
+          break;
+        }
+        ranges = grown;
+        rangeCapacity = capacity;
+      }
+      if (ranged) {
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+        const char* name;
+        int dirFd = openRestoreParent(rootFd, path, 1, &name);
+        int out = dirFd == -1 ? -1
+                  : openat(dirFd, name, flags, S_IRUSR | S_IWUSR);
+        if (dirFd != -1 && dirFd != rootFd) {
+          close(dirFd);
+        }
+        range = out == -1 ? NULL : calloc(1, sizeof(*range));
+        if (out == -1 || range == NULL) {
+          printf("Error in restoreParallel: Could not create %s\n", path);
+          pool.damaged = 1;
+          if (out != -1) {
+            close(out);
+          }
+          continue;
+        }
+        range -> path = strdup(path);
+        if (range -> path == NULL) {
+          printf("Error in restoreParallel: Out of memory\n");
+          close(out);
+          free(range);
+          result = -1;
+          break;
+        }
+        posix_fallocate(out, 0, hdr.size);
+        range -> fd = out;
+        range -> hdr = hdr;
+        range -> digest = (hdr.flags & ENTRY_F_DIGEST)
+                          && hdr.extraLen >= HASH_SIZE
+                          ? map + body + hdr.pathLen : NULL;
+        range -> payload = map + payload;
+        atomic_store(&range -> pending, pieces);
+        ranges[rangeCount++] = range;
+      }
+      for (size_t k = 0; k < pieces; k++) {
+        struct restoreJob* job = &pool.jobs[pool.count++];
+        job -> offset = offset;
+        job -> range = range;
+        job -> uid = hdr.uid;
+        job -> gid = hdr.gid;
+        job -> start = (uint64_t) k * RESTORE_RANGE;
+        job -> len = 0;
+        if (range != NULL) {
+          job -> len = hdr.size - job -> start < RESTORE_RANGE
+                       ? hdr.size - job -> start : RESTORE_RANGE;
+        }
+      }
+    }
+  }
+
+  // the files, on all threads
+  int threads = scanThreads > 0 ? scanThreads : 1;
+  pthread_t* tids = calloc(threads, sizeof(pthread_t));
+  if (tids == NULL) {
+    threads = 0;
+    restoreWorker(&pool);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, restoreWorker, &pool);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  free(tids);
+  for (size_t i = 0; i < rangeCount; i++) {
+    free(ranges[i] -> path);
+    free(ranges[i]);
+  }
+  free(ranges);
+  free(pool.jobs);
+
+  // links to the files and deletions, in archive order
+  for (size_t i = 0; i < laterCount; i++) {
+    struct entryHeader hdr;
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    decodeEntryHeader(map + later[i], &hdr);
+    const unsigned char* body = map + later[i] + ENTRY_HEADER_SIZE;
+    memcpy(path, body, hdr.pathLen);
+    path[hdr.pathLen] = '\0';
+    if (hdr.type == ENTRY_TOMBSTONE) {
+      restoreRemove(rootFd, path);
+    } else if (hdr.payloadLen < sizeof(target)) {
+      memcpy(target, body + hdr.pathLen + hdr.extraLen, hdr.payloadLen);
+      target[hdr.payloadLen] = '\0';
+      restoreLink(rootFd, &hdr, path, target);
+    }
+  }
+  free(later);
+  free(picked.offsets);
+
+  // children always follow their parent, so reverse order is bottom up
+  for (size_t i = dirCount; i > 0; i--) {
+    restoreDirMetadata(rootFd, dirPaths[i - 1], &dirHdrs[i - 1]);
+    free(dirPaths[i - 1]);
+  }
+  free(dirPaths);
+  free(dirHdrs);
+  munmap((void*) map, size);
+  close(fd);
+  if (pool.failed) {
+    printf("Error in restoreParallel: Corrupt archive\n");
+    result = -1;
+  }
+  return result == 0 && pool.damaged ? -1 : result;
+}
+
+/*
+   Name: writeBackupToDirectory
+   Purpose: Restore every entry of the archive below dir. With -j above one
+            an indexed archive goes to restoreParallel, otherwise it is read
+			front to back through a restoreStream, so it also works when the
+			archive is a pipe. Directories are created as they are met but
+			their final mode and mtime are applied in one pass at the end,
+			deepest first, so writing their contents does not disturb them.
+   Parameters: char* dir: directory the archive is restored into
+   return: 0 on success, -1 on failure
+*/
+int writeBackupToDirectory(char* dir) {
+  mkdir(dir, S_IRWXU);
+  int rootFd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (rootFd == -1) {
+    printf("Error in writeBackupToDirectory: Could not open %s\n", dir);
+    return -1;
+  }
+  // with several threads an indexed archive is restored out of order
+  if ((scanThreads > 1 || restorePathCount > 0)
+      && strcmp(archiveFile, "-") != 0) {
+    int parallel = restoreParallel(rootFd);
+    if (parallel != 1) {
+      close(rootFd);
+      return parallel;
+    }
+  }
+  if (restorePathCount > 0) {
+    printf("Error in writeBackupToDirectory: -p needs an archive file with "
+           "a path index\n");
+    close(rootFd);
+    return -1;
+  }
+
+  struct restoreStream rs;
+  memset(&rs, 0, sizeof(rs));
+  rs.fd = strcmp(archiveFile, "-") == 0 ? STDIN_FILENO
+          : open(archiveFile, O_RDONLY);
+  if (rs.fd == -1) {
+    printf("Error in writeBackupToDirectory: Could not open archive\n");
+    close(rootFd);
+    return -1;
+  }
+  posix_fadvise(rs.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  for (int i = 0; i < RESTORE_SLOTS; i++) {
+    rs.data[i] = malloc(RESTORE_BUFFER_SIZE);
+    if (rs.data[i] == NULL) {
+      printf("Error in writeBackupToDirectory: Out of memory\n");
+      return -1;
+    }
+  }
+  pthread_mutex_init(&rs.lock, NULL);
+  pthread_cond_init(&rs.filled, NULL);
+  pthread_cond_init(&rs.drained, NULL);
+  pthread_t reader;
+  pthread_create(&reader, NULL, restoreReader, &rs);
+
+  // directories whose metadata is applied once everything is written
+  struct entryHeader* dirHdrs = NULL;
+  char** dirPaths = NULL;
+  size_t dirCount = 0;
+  size_t dirCapacity = 0;
+
+  int result = 0;
+  unsigned char buf[ENTRY_HEADER_SIZE];
+  if (restoreRead(&rs, buf, ARCHIVE_HEADER_SIZE) != 1
+      || memcmp(buf, ARCHIVE_MAGIC, 8) != 0
+      || getLE32(buf + 8) > ARCHIVE_VERSION) {
+    printf("Error in writeBackupToDirectory: Not a backup archive\n");
+    result = -1;
+  }
+
+  struct entryHeader hdr;
+  char path[PATH_MAX];
+  unsigned char digest[HASH_SIZE];
+  int damaged = 0; // some file failed its checksum
+  // the index follows the last entry and never starts with ENTRY_MAGIC
+  while (result == 0 && restoreRead(&rs, buf, ENTRY_HEADER_SIZE) == 1
+         && decodeEntryHeader(buf, &hdr) == 1) {
+    int hasDigest = (hdr.flags & ENTRY_F_DIGEST) && hdr.extraLen >= HASH_SIZE;
+    if (hdr.pathLen >= sizeof(path)
+        || restoreRead(&rs, path, hdr.pathLen) != 1
+        || (hasDigest && restoreRead(&rs, digest, HASH_SIZE) != 1)
+        || restoreCopyOut(&rs, -1, hdr.extraLen
+                          - (hasDigest ? HASH_SIZE : 0)) != 1) {
+      printf("Error in writeBackupToDirectory: Corrupt entry\n");
+      result = -1;
+      break;
+    }
+    path[hdr.pathLen] = '\0';
+    if (hdr.type == ENTRY_USERNAME || hdr.type == ENTRY_GROUPNAME) {
+      if (restoreOwnerName(&rs, &hdr) == -1) {
+        printf("Error in writeBackupToDirectory: Corrupt owner name\n");
+        result = -1;
+      }
+      continue;
+    }
+    // owners are restored by name where the archive has one
+    restoreOwner(&hdr);
+    if (isSafeRestorePath(path) == 0) {
+      printf("Error in writeBackupToDirectory: Skipping unsafe path %s\n",
+             path);
+      if (restoreCopyOut(&rs, -1, hdr.payloadLen) != 1) {
+        result = -1;
+      }
+      continue;
+    }
+
+    if (hdr.type == ENTRY_DIR) {
+      restoreDirectory(rootFd, path);
+      if (restoreDirAdd(&dirHdrs, &dirPaths, &dirCount, &dirCapacity, &hdr,
+                        path) == -1) {
+        printf("Error in writeBackupToDirectory: Out of memory\n");
+        result = -1;
+        break;
+      }
+      result = restoreCopyOut(&rs, -1, hdr.payloadLen) == 1 ? 0 : -1;
+    } else if (hdr.type == ENTRY_SYMLINK) {
+      char target[PATH_MAX];
+      if (hdr.payloadLen >= sizeof(target)
+          || restoreRead(&rs, target, hdr.payloadLen) != 1) {
+        printf("Error in writeBackupToDirectory: Corrupt link %s\n", path);
+        result = -1;
+        break;
+      }
+      target[hdr.payloadLen] = '\0';
+      restoreLink(rootFd, &hdr, path, target);
+    } else if (hdr.type == ENTRY_FILE) {
+      uint64_t started = metricNow();
+      int restored = restoreFile(&rs, rootFd, path, &hdr,
+                                 hasDigest ? digest : NULL);
+      metricTime(PHASE_RESTORE, started);
+      if (restored == 1) {
+        metricCount(COUNT_RESTORED, 1);
+        metricCount(COUNT_BYTES_RESTORED, hdr.size);
+      }
+      if (restored == 0) {
+        damaged = 1;
+      }
+      result = restored == -1 ? -1 : 0;
+    } else if (hdr.type == ENTRY_HARDLINK) {
+      char target[PATH_MAX];
+      if (hdr.payloadLen >= sizeof(target)
+          || restoreRead(&rs, target, hdr.payloadLen) != 1) {
+        printf("Error in writeBackupToDirectory: Corrupt link %s\n", path);
+        result = -1;
+        break;
+      }
+      target[hdr.payloadLen] = '\0';
+      restoreLink(rootFd, &hdr, path, target);
+    } else if (hdr.type == ENTRY_TOMBSTONE) {
+      // deleted since the previous archive of the chain
+      restoreRemove(rootFd, path);
+    } else {
+      result = restoreCopyOut(&rs, -1, hdr.payloadLen) == 1 ? 0 : -1;
+    }
+  }
+
+  // children always follow their parent, so reverse order is bottom up
+  for (size_t i = dirCount; i > 0; i--) {
+    restoreDirMetadata(rootFd, dirPaths[i - 1], &dirHdrs[i - 1]);
+    free(dirPaths[i - 1]);
+  }
+  free(dirPaths);
+  free(dirHdrs);
+
+  // the index and trailer are not needed, stop the reader and wait for it
+  pthread_mutex_lock(&rs.lock);
+  rs.stop = 1;
+  pthread_cond_signal(&rs.drained);
+  pthread_mutex_unlock(&rs.lock);
+  pthread_join(reader, NULL);
+  for (int i = 0; i < RESTORE_SLOTS; i++) {
+    free(rs.data[i]);
+  }
+  if (rs.fd != STDIN_FILENO) {
+    close(rs.fd);
+  }
+  close(rootFd);
+  return damaged ? -1 : result;
+}
+
+/*
+   Name: formatTime
+   Purpose: Turn a generic time_t object into that of the format: 
+            MONTH MONTH_DAY  HOUR:MINUTE
+			for displaying information for a given file. Similar to ls -l
+			localtime() is called for the two ends of each UTC hour of
+			timestamps seen: when the UTC offset is the same at both it is
+			remembered for the hour and the date is worked out from the
+			day number directly. An hour with a transition in it, which
+			for half hour zones does not start on the hour, asks
+			localtime() for every timestamp.
+   Parameters: time_t t
+               char* str: receives the text, at least TIME_SIZE bytes
+   return: length of the text in str
+*/
+int formatTime(time_t t, char* str) {
+  // define array of months that map to the corresponding number
+  static const char * months[12] = {
+    "Jan",
+    "Feb",
+    "Mar",
+    "Apr",
+    "May",
+    "Jun",
+    "Jul",
+    "Aug",
+    "Sep",
+    "Oct",
+    "Nov",
+    "Dec"
+  };
+  static time_t cachedHour = -1;
+  static long cachedOffset;
+  static int cachedSplit; // the offset changes within cachedHour
+
+  time_t hour = t >= 0 ? t / 3600 : (t - 3599) / 3600;
+  if (hour != cachedHour) {
+    struct tm first;
+    struct tm last;
+    time_t start = hour * 3600;
+    time_t end = start + 3599;
+    localtime_r(&start, &first);
+    localtime_r(&end, &last);
+    cachedOffset = first.tm_gmtoff;
+    cachedSplit = first.tm_gmtoff != last.tm_gmtoff;
+    cachedHour = hour;
+  }
+  long offset = cachedOffset;
+  if (cachedSplit) {
+    struct tm timeInfo;
+    localtime_r(&t, &timeInfo);
+    offset = timeInfo.tm_gmtoff;
+  }
+  int64_t local = (int64_t) t + offset;
+  int64_t days = local >= 0 ? local / 86400 : (local - 86399) / 86400;
+  int64_t secs = local - days * 86400;
+
+  // civil date from days since 1970-01-01, Howard Hinnant's algorithm
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t doe = days - era * 146097;
+  int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int64_t mp = (5 * doy + 2) / 153;
+  int mday = doy - (153 * mp + 2) / 5 + 1;
+  int mon = mp < 10 ? mp + 2 : mp - 10;
+
+  return snprintf(str, TIME_SIZE, "%s %2d  %02d:%02d", months[mon], mday,
+                  (int) (secs / 3600), (int) (secs / 60 % 60));
+}
+/*
+   Name: getPermissions()
+   Purpose: Given a file, determine what access permissions this given file has
+            and present them in the following format:
+			(1)d|-  : d = directory, - = file
+			(2)r|-  : r = user read permission, - = user no read permission
+			(3)w|-  : w = user write permission, - = user no write permission
+			(4)x|-  : x = user execute permission, - = user no execute permiss-
+							ion
+			(5)r|-  : r = group read permission, - = user no read permission
+			(6)w|-  : w = group write permission, - = user no write permission
+			(7)x|-  : x = group execute permission, - = user no execute permiss-
+							ion
+			(8)r|-  : r = other read permission, - = user no read permission
+			(9)w|-  : w = other write permission, - = user no write permission
+			(10)x|- : x = other execute permission, - = user no execute permiss-
+							ion				
+   Parameters: int fileMode
+               char* perStr: receives the string, at least 11 bytes
+   return: void, perStr holds 10 characters in the permission format of ls -l
+*/
+void getPermissions(int fileMode, char* perStr) {
+  // directory or not
+  if (S_ISDIR(fileMode) == 1) {
+    perStr[0] = 'd';
+  } else {
+    perStr[0] = '-';
+  }
+
+  // User permissions
+  // read
+  if ((fileMode & S_IRUSR) > 0) {
+    perStr[1] = 'r';
+  } else {
+    perStr[1] = '-';
+  }
+  // write
+  if ((fileMode & S_IWUSR) > 0) {
+    perStr[2] = 'w';
+  } else {
+    perStr[2] = '-';
+  }
+  // execute
+  if ((fileMode & S_IXUSR) > 0) {
+    perStr[3] = 'x';
+  } else {
+    perStr[3] = '-';
+  }
+
+  // Group permissions
+  // read
+  if ((fileMode & S_IRGRP) > 0) {
+    perStr[4] = 'r';
+  } else {
+    perStr[4] = '-';
+  }
+  // write
+  if ((fileMode & S_IWGRP) > 0) {
+    perStr[5] = 'w';
+  } else {
+    perStr[5] = '-';
+  }
+  // execute
+  if ((fileMode & S_IXGRP) > 0) {
+    perStr[6] = 'x';
+  } else {
+    perStr[6] = '-';
+  }
+
+  // other permissions
+  // read
+  if ((fileMode & S_IROTH) > 0) {
+    perStr[7] = 'r';
+  } else {
+    perStr[7] = '-';
+  }
+  // write
+  if ((fileMode & S_IWOTH) > 0) {
+    perStr[8] = 'w';
+  } else {
+    perStr[8] = '-';
+  }
+  // execute
+  if ((fileMode & S_IXOTH) > 0) {
+    perStr[9] = 'x';
+  } else {
+    perStr[9] = '-';
+  }
+  // terminate the permission string
+  perStr[10] = '\0';
+}
+
+/*
+   Name: fileInfo
+   Purpose: Given all information retrieved from the file, present it in a 
+		    format that of ls -l:
+			[permissionString links username groupname size date time filename]
+			Parameters: FILE* out: where the line is written
+						const char* name: Name of the file
+						const char* time: formatted time string (from
+									formatTime()) it is most recent
+									modification time of the file
+						unsigned long links: No of links to the file
+						const char* userName: User who created the file
+						const char* groupName: The group the file belongs to
+						const char* permissions: Permission string from 
+											getPermissions()
+						long long size: Size of the file in bytes
+   return: void
+*/
+void fileInfo(FILE* out, const char* name, const char* time,
+              unsigned long links, const char* userName,
+              const char* groupName, const char* permissions,
+              long long size) {
+  fprintf(out, "%s %2lu %s %10s %8lld %12s %s", permissions, links,
+          userName, groupName, size, time, name);
+}
+
+/*
+   Name: listName
+   Purpose: Owner name for a listing: the name the archive recorded for the
+            id, or the id itself. The local passwd and group databases are
+			not asked, the archive may come from another host.
+   Parameters: struct nameCache* cache: filled from the name entries
+               unsigned int id, char* number: room for the digits
+   return: the name
+*/
+static const char* listName(struct nameCache* cache, unsigned int id,
+                            char* number) {
+  struct idName* slot = nameSlot(cache, id);
+  if (slot != NULL && slot -> name != NULL) {
+    return slot -> name;
+  }
+  snprintf(number, 16, "%u", id);
+  return number;
+}
+
+/*
+   Name: listArchive
+   Purpose: Print what an archive holds, one ls -l style line per entry,
+            without reading any payload. The archive is mapped, and when
+			its trailer is intact the index leads straight to each entry
+			header, so only the pages holding headers are ever touched.
+			An archive without a valid trailer (an interrupted run) is
+			walked header by header instead, skipping over the payloads.
+			Symbolic and hard links show their target, the only payload
+			bytes looked at.
+   Parameters: const char* path: the archive
+   return: 1 on success, -1 if the archive cannot be read or is corrupt
+*/
+int listArchive(const char* path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    printf("Error in listArchive: Could not open %s\n", path);
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  uint64_t size = st.st_size;
+  const unsigned char* map = size > 0 ? mmap(NULL, size, PROT_READ,
+                                             MAP_SHARED, fd, 0)
+                             : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED || size < ARCHIVE_HEADER_SIZE
+      || memcmp(map, ARCHIVE_MAGIC, 8) != 0
+      || getLE32(map + 8) > ARCHIVE_VERSION) {
+    printf("Error in listArchive: %s is not a backup archive\n", path);
+    if (map != MAP_FAILED) {
+      munmap((void*) map, size);
+    }
+    return -1;
+  }
+
+  struct archiveIndex ai;
+  int indexed = archiveIndexOf(map, size, &ai) == 1;
+  uint64_t count = ai.count;
+  uint64_t indexOffset = ai.indexOffset;
+  madvise((void*) map, size, indexed ? MADV_RANDOM : MADV_NORMAL);
+
+  static char outBuf[1024 * 1024];
+  setvbuf(stdout, outBuf, _IOFBF, sizeof(outBuf));
+  int result = 1;
+  uint64_t offset = ARCHIVE_HEADER_SIZE;
+  for (uint64_t i = 0; indexed ? i < count : offset < size; i++) {
+    if (indexed) {
+      offset = getLE64(map + indexOffset + i * 8);
+    }
+    struct entryHeader hdr;
+    if (offset > size || size - offset < ENTRY_HEADER_SIZE
+        || decodeEntryHeader(map + offset, &hdr) == -1) {
+      // an unindexed archive ends where its index or damage begins
+      if (indexed) {
+        printf("Error in listArchive: Corrupt entry at %llu\n",
+               (unsigned long long) offset);
+        result = -1;
+      }
+      break;
+    }
+    uint64_t body = offset + ENTRY_HEADER_SIZE;
+    uint64_t payload = body + hdr.pathLen + hdr.extraLen;
+    if (payload < body || payload > size || size - payload < hdr.payloadLen
+        || hdr.pathLen >= PATH_MAX) {
+      printf("Error in listArchive: Corrupt entry at %llu\n",
+             (unsigned long long) offset);
+      result = -1;
+      break;
+    }
+    offset = payload + hdr.payloadLen;
+
+    char name[PATH_MAX * 2 + 16];
+    memcpy(name, map + body, hdr.pathLen);
+    name[hdr.pathLen] = '\0';
+    if (hdr.type == ENTRY_USERNAME || hdr.type == ENTRY_GROUPNAME) {
+      int isGroup = hdr.type == ENTRY_GROUPNAME;
+      struct nameCache* cache = isGroup ? &groupNames : &userNames;
+      struct idName* slot = nameSlot(cache, isGroup ? hdr.gid : hdr.uid);
+      if (slot != NULL && slot -> name == NULL && hdr.payloadLen < 256) {
+        slot -> name = strndup((const char*) map + payload,
+                               hdr.payloadLen);
+        slot -> id = isGroup ? hdr.gid : hdr.uid;
+        cache -> count += slot -> name != NULL;
+      }
+      continue;
+    }
+    size_t nameLen = hdr.pathLen;
+    if ((hdr.type == ENTRY_SYMLINK || hdr.type == ENTRY_HARDLINK)
+        && hdr.payloadLen < PATH_MAX) {
+      nameLen += snprintf(name + nameLen, 16, hdr.type == ENTRY_SYMLINK
+                          ? " -> " : " link to ");
+      memcpy(name + nameLen, map + payload, hdr.payloadLen);
+      name[nameLen + hdr.payloadLen] = '\0';
+    } else if (hdr.type == ENTRY_TOMBSTONE) {
+      strcat(name, " (deleted)");
+    }
+
+    char time[TIME_SIZE];
+    char permissions[11];
+    char userId[16];
+    char groupId[16];
+    formatTime(hdr.mtimeNs / 1000000000LL, time);
+    getPermissions(hdr.mode, permissions);
+    if (hdr.type == ENTRY_SYMLINK) {
+      permissions[0] = 'l';
+    }
+    fileInfo(stdout, name, time, 1, listName(&userNames, hdr.uid, userId),
+             listName(&groupNames, hdr.gid, groupId), permissions,
+             (long long) hdr.size);
+    putchar('\n');
+  }
+  fflush(stdout);
+  munmap((void*) map, size);
+  return result;
+}
+
+/*
+   Name: catalogBlock
+   Purpose: Fixed size slab of live records. Records never move once
+            created, so the archiving stage can hold a pointer to fill in
+			the content hash while scanners keep appending.
+*/
+struct catalogBlock {
+  struct catalogBlock* next;
+  size_t count;
+  struct catalogRecord records[CATALOG_BLOCK];
+};
+
+/*
+   Name: catalogList
+   Purpose: Records collected by one scanner thread plus the arena their
+            paths live in. One per thread so collection takes no locks.
+*/
+struct catalogList {
+  struct catalogBlock* blocks; // newest first
+  size_t count;
+  char* arena; // current path arena chunk
+  size_t arenaUsed;
+  char** chunks; // every arena chunk, freed at the end
+  size_t chunkCount;
+};
+
+/*
+   Name: catalogAdd
+   Purpose: Record a live entry in the calling thread's list. If the entry
+            is unchanged since the previous catalog its content hash is
+			carried over, otherwise it starts as zero.
+   Parameters: struct catalogList* list, const char* path, size_t len,
+               const struct stat* st, const struct catalog* prev,
+			   int64_t prevIndex: record in prev or -1
+   return: the new record, NULL if out of memory
+*/
+struct catalogRecord* catalogAdd(struct catalogList* list, const char* path,
+                                 size_t len, const struct stat* st,
+                                 const struct catalog* prev,
+                                 int64_t prevIndex) {
+  if (list -> blocks == NULL || list -> blocks -> count == CATALOG_BLOCK) {
+    struct catalogBlock* block = malloc(sizeof(struct catalogBlock));
+    if (block == NULL) {
+      return NULL;
+    }
+    block -> count = 0;
+    block -> next = list -> blocks;
+    list -> blocks = block;
+  }
+  if (list -> arena == NULL || list -> arenaUsed + len > CATALOG_ARENA) {
+    char** chunks = realloc(list -> chunks,
+                            (list -> chunkCount + 1) * sizeof(char*));
+    char* arena = malloc(len > CATALOG_ARENA ? len : CATALOG_ARENA);
+    if (chunks == NULL || arena == NULL) {
+      free(arena);
+      return NULL;
+    }
+    chunks[list -> chunkCount++] = arena;
+    list -> chunks = chunks;
+    list -> arena = arena;
+    list -> arenaUsed = 0;
+  }
+
+  struct catalogRecord* rec =
+    &list -> blocks -> records[list -> blocks -> count++];
+  memcpy(list -> arena + list -> arenaUsed, path, len);
+  rec -> path = list -> arena + list -> arenaUsed;
+  list -> arenaUsed += len;
+  rec -> pathLen = len;
+  rec -> mode = st -> st_mode;
+  rec -> dev = st -> st_dev;
+  rec -> ino = st -> st_ino;
+  rec -> size = st -> st_size;
+  rec -> mtimeNs = timespecToNs(&st -> st_mtim);
+  rec -> ctimeNs = timespecToNs(&st -> st_ctim);
+  if (prevIndex >= 0) {
+    memcpy(rec -> hash, prev -> records + prevIndex * prev -> recordSize
+           + 56, CATALOG_HASH_SIZE);
+  } else {
+    memset(rec -> hash, 0, CATALOG_HASH_SIZE);
+  }
+  // the caller drops sigPrev if the entry turns out to have changed
+  rec -> sigPrev = prevIndex;
+  rec -> sigSpill = -1;
+  rec -> sigLen = 0;
+  list -> count++;
+  return rec;
+}
+
+/*
+   Name: catalogCarry
+   Purpose: Copy record i of the previous catalog into a live list as it
+            is, for a path the -J journal says nothing happened to. Its
+			hash and delta signature carry over like those of an unchanged
+			file that was statted.
+   Parameters: struct catalogList* list, const struct catalog* prev,
+               uint64_t i
+   return: the new record, NULL if out of memory
+*/
+static struct catalogRecord* catalogCarry(struct catalogList* list,
+                                          const struct catalog* prev,
+                                          uint64_t i) {
+  const unsigned char* raw = prev -> records + i * prev -> recordSize;
+  struct stat st;
+  uint32_t len;
+  const char* path = catalogPath(prev, i, &len);
+
+  memset(&st, 0, sizeof(st));
+  st.st_mode = getLE32(raw + 12);
+  st.st_dev = getLE64(raw + 16);
+  st.st_ino = getLE64(raw + 24);
+  st.st_size = getLE64(raw + 32);
+  st.st_mtim.tv_sec = (int64_t) getLE64(raw + 40) / 1000000000LL;
+  st.st_mtim.tv_nsec = (int64_t) getLE64(raw + 40) % 1000000000LL;
+  st.st_ctim.tv_sec = (int64_t) getLE64(raw + 48) / 1000000000LL;
+  st.st_ctim.tv_nsec = (int64_t) getLE64(raw + 48) % 1000000000LL;
+  return catalogAdd(list, path, len, &st, prev, i);
+}
+
+/*
+   Name: compareRecords
+   Purpose: qsort() comparator ordering record pointers by path.
+   Parameters: const void* a, const void* b: struct catalogRecord**
+   return: <0, 0 or >0
+*/
+static int compareRecords(const void* a, const void* b) {
+  const struct catalogRecord* ra = *(const struct catalogRecord* const*) a;
+  const struct catalogRecord* rb = *(const struct catalogRecord* const*) b;
+  return comparePaths(ra -> path, ra -> pathLen, rb -> path, rb -> pathLen);
+}
+
+/*
+   Name: writeTombstone
+   Purpose: Record in the archive that a path present in the previous run
+            has been deleted, so a restore of the chain removes it.
+   Parameters: struct archiveWriter* w, const char* path, uint32_t len,
+               uint32_t mode: the mode the path had when it still existed
+   return: 1 on success, -1 on write failure
+*/
+int writeTombstone(struct archiveWriter* w, const char* path, uint32_t len,
+                   uint32_t mode) {
+  struct entryHeader hdr;
+  unsigned char hdrBuf[ENTRY_HEADER_SIZE];
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.type = ENTRY_TOMBSTONE;
+  hdr.mode = mode;
+  hdr.pathLen = len;
+  encodeEntryHeader(&hdr, hdrBuf);
+  if (recordEntryOffset(w, archiveTell(w), path, len) == -1
+      || archiveAppend(w, hdrBuf, ENTRY_HEADER_SIZE) == -1
+      || archiveAppend(w, path, len) == -1) {
+    w -> failed = 1;
+    return -1;
+  }
+  return 1;
+}
+
+/*
+   Name: copyRange
+   Purpose: Copy len bytes at offset of fd to the end of fp.
+   Parameters: int fd, uint64_t offset, uint64_t len, FILE* fp
+   return: 1 on success, -1 on a short read
+*/
+static int copyRange(int fd, uint64_t offset, uint64_t len, FILE* fp) {
+  unsigned char buf[64 * 1024];
+  while (len > 0) {
+    size_t take = len < sizeof(buf) ? len : sizeof(buf);
+    if (pread(fd, buf, take, offset) != (ssize_t) take) {
+      return -1;
+    }
+    fwrite(buf, 1, take, fp);
+    offset += take;
+    len -= take;
+  }
+  return 1;
+}
+
+/*
+   Name: catalogFinish
+   Purpose: End of run: sort the live records of every scanner thread by
+            path and merge-join them against the previous catalog. Paths
+			only in the previous catalog become tombstones in the archive
+			(children before parents, so directories are empty by the time
+			restore removes them). The live records are then written as the
+			new catalog to path.tmp, with the delta signatures of this run
+			from sigSpill and those of unchanged files carried over from
+			prev; catalogCommit() moves it into place once
+			the archive is complete, so a failed run never advances the
+			catalog past what was actually archived.
+   Parameters: struct catalogList* lists, int listCount,
+               const struct catalog* prev, const char* path: catalog file,
+			   struct archiveWriter* w
+   return: 1 on success, -1 on failure
+*/
+int catalogFinish(struct catalogList* lists, int listCount,
+                  const struct catalog* prev, const char* path,
+                  struct archiveWriter* w) {
+  size_t total = 0;
+  for (int i = 0; i < listCount; i++) {
+    total += lists[i].count;
+  }
+  struct catalogRecord** sorted = malloc((total + 1) * sizeof(*sorted));
+  if (sorted == NULL) {
+    printf("Error in catalogFinish: Out of memory\n");
+    return -1;
+  }
+  size_t n = 0;
+  for (int i = 0; i < listCount; i++) {
+    for (struct catalogBlock* b = lists[i].blocks; b != NULL; b = b -> next) {
+      for (size_t j = 0; j < b -> count; j++) {
+        sorted[n++] = &b -> records[j];
+      }
+    }
+  }
+  qsort(sorted, n, sizeof(*sorted), compareRecords);
+
+  // merge-join from the end so deleted children precede their parents
+  int result = 1;
+  size_t live = n;
+  for (uint64_t i = prev -> count; i > 0 && result == 1; i--) {
+    uint32_t len;
+    const char* old = catalogPath(prev, i - 1, &len);
+    int c = 1;
+    while (live > 0 && (c = comparePaths(sorted[live - 1] -> path,
+           sorted[live - 1] -> pathLen, old, len)) > 0) {
+      live--;
+    }
+    if (live == 0 || c != 0) {
+      result = writeTombstone(w, old, len, getLE32(prev -> records
+                              + (i - 1) * prev -> recordSize + 12));
+    }
+  }
+
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE* fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    printf("Error in catalogFinish: Could not create %s\n", tmp);
+    free(sorted);
+    return -1;
+  }
+  setvbuf(fp, NULL, _IOFBF, WRITER_BUFFER_SIZE);
+  // signatures follow the strings, in record order
+  uint64_t stringsOffset = CATALOG_HEADER_SIZE
+                           + (uint64_t) n * CATALOG_RECORD_SIZE;
+  uint64_t sigsOffset = stringsOffset;
+  for (size_t i = 0; i < n; i++) {
+    sigsOffset += sorted[i] -> pathLen;
+  }
+  uint64_t sigOff = sigsOffset;
+  unsigned char buf[CATALOG_HEADER_SIZE];
+  memset(buf, 0, CATALOG_HEADER_SIZE);
+  memcpy(buf, CATALOG_MAGIC, 8);
+  putLE32(buf + 8, CATALOG_VERSION);
+  putLE64(buf + 16, n);
+  putLE64(buf + 24, stringsOffset);
+  putLE64(buf + 32, sigsOffset);
+  putLE64(buf + 40, (uint64_t) scanStartNs);
+  fwrite(buf, 1, CATALOG_HEADER_SIZE, fp);
+  uint64_t pathOff = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char rec[CATALOG_RECORD_SIZE];
+    memset(rec, 0, CATALOG_RECORD_SIZE);
+    putLE64(rec, pathOff);
+    putLE32(rec + 8, sorted[i] -> pathLen);
+    putLE32(rec + 12, sorted[i] -> mode);
+    putLE64(rec + 16, sorted[i] -> dev);
+    putLE64(rec + 24, sorted[i] -> ino);
+    putLE64(rec + 32, sorted[i] -> size);
+    putLE64(rec + 40, (uint64_t) sorted[i] -> mtimeNs);
+    putLE64(rec + 48, (uint64_t) sorted[i] -> ctimeNs);
+    memcpy(rec + 56, sorted[i] -> hash, CATALOG_HASH_SIZE);
+    uint64_t sigLen = 0;
+    if (sorted[i] -> sigSpill >= 0) {
+      sigLen = sorted[i] -> sigLen;
+    } else if (catalogSig(prev, sorted[i] -> sigPrev, &sigLen) == NULL) {
+      sigLen = 0;
+    }
+    putLE64(rec + 72, sigLen > 0 ? sigOff : 0);
+    sigOff += sigLen;
+    fwrite(rec, 1, CATALOG_RECORD_SIZE, fp);
+    pathOff += sorted[i] -> pathLen;
+  }
+  for (size_t i = 0; i < n; i++) {
+    fwrite(sorted[i] -> path, 1, sorted[i] -> pathLen, fp);
+  }
+  // new signatures come from the spill file, unchanged ones from prev
+  if (sigSpill != NULL && fflush(sigSpill) != 0) {
+    result = -1;
+  }
+  for (size_t i = 0; i < n && result == 1; i++) {
+    uint64_t sigLen;
+    const unsigned char* sig = catalogSig(prev, sorted[i] -> sigPrev,
+                                          &sigLen);
+    if (sorted[i] -> sigSpill >= 0) {
+      result = copyRange(fileno(sigSpill), sorted[i] -> sigSpill,
+                         sorted[i] -> sigLen, fp);
+    } else if (sig != NULL) {
+      fwrite(sig, 1, sigLen, fp);
+    }
+  }
+  free(sorted);
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0
+      || result == -1) {
+    printf("Error in catalogFinish: Could not write %s\n", tmp);
+    return -1;
+  }
+  return result;
+}
+
+/*
+   Name: catalogCommit
+   Purpose: Atomically replace the catalog with the one catalogFinish()
+            wrote for this run.
+   Parameters: const char* path: catalog file
+   return: 1 on success, -1 on failure
+*/
+int catalogCommit(const char* path) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (rename(tmp, path) != 0) {
+    printf("Error in catalogCommit: Could not replace %s\n", path);
+    return -1;
+  }
+  return 1;
+}
 
-  
-  if(S_ISDIR(fileMode) == 0) {
-    fwrite(path, strlen(path), sizeof(path), backup);
-    fwrite("\n", 1, sizeof(char), backup);
-    fwrite(permissions, strlen(permissions), sizeof(char), backup);
-    fwrite("\n", 1, sizeof(char), backup);
-    fwrite(modtime, strlen(modtime), sizeof(char), backup);
-    fwrite("\n", 1, sizeof(char), backup);
-    fwrite(sizeStr, strlen(sizeStr), sizeof(char), backup);
-    fwrite("\n", 1, sizeof(char), backup);
-    int count;
-    char buffer[size];
-    while((count = read(readFile, buffer, size)) > 0) {
-      fwrite(buffer, strlen(buffer), sizeof(char), backup);
-    } 
+/*
+   Name: catalogFree
+   Purpose: Release the records and path arenas of a thread's list.
+   Parameters: struct catalogList* list
+   return: void
+*/
+void catalogFree(struct catalogList* list) {
+  while (list -> blocks != NULL) {
+    struct catalogBlock* next = list -> blocks -> next;
+    free(list -> blocks);
+    list -> blocks = next;
+  }
+  for (size_t i = 0; i < list -> chunkCount; i++) {
+    free(list -> chunks[i]);
+  }
+  free(list -> chunks);
+}
+
+/*
+   Name: scanEntry
+   Purpose: One entry of a scanBatch.
+*/
+struct scanEntry {
+  size_t pathOff; // offset of the NUL terminated path in arena
+  struct stat st; // metadata fetched by the scanner
+  struct catalogRecord* rec; // live catalog record, NULL without -C
+  uint64_t extent; // -O extent: disk offset of the data, 0 if none known
+};
+
+/*
+   Name: scanBatch
+   Purpose: A group of entries discovered in one directory, handed from a
+            scanner thread to the archiving stage in one queue operation.
+			Paths are relative to the backup root and packed into arena.
+			The entries are sorted into the -O read order before they are
+			queued.
+*/
+struct scanBatch {
+  struct scanBatch* next; // next batch in the entry queue
+  size_t count; // entries in use
+  size_t used; // arena bytes in use
+  struct scanEntry entries[SCAN_BATCH];
+  atomic_size_t pending; // -V: entries not yet archived, see volumeWorker
+  char arena[SCAN_ARENA];
+};
+
+/*
+   Name: scanDeque
+   Purpose: Per thread double ended queue of directories still to scan. The
+            owner pushes and pops at the bottom (depth first, good locality),
+			idle threads steal from the top (the oldest, usually largest
+			subtrees).
+*/
+struct scanDeque {
+  pthread_mutex_t lock;
+  char** dirs; // relative paths, "" is the backup root
+  size_t top; // next index to steal
+  size_t bottom; // next free index
+  size_t capacity;
+};
+
+/*
+   Name: scanner
+   Purpose: Shared state of one parallel scan: the backup root descriptor,
+            the deques of every thread and the bounded queue of batches
+			waiting for the archiving stage.
+*/
+struct scanner {
+  int rootFd; // every open is relative to this, nothing uses the cwd
+  dev_t archiveDev; // identity of the archive being written, so it is
+  ino_t archiveIno; // never backed up into itself
+  char* volumePrefix; // -V: relative "<archive>." if volumes land inside
+                      // the backup root, NULL otherwise
+  size_t volumePrefixLen;
+  int threads;
+  struct scanDeque* deques;
+  atomic_long pending; // directories queued or being scanned
+  pthread_mutex_t idleLock;
+  pthread_cond_t workCond; // signalled when a directory is pushed
+  pthread_mutex_t queueLock;
+  pthread_cond_t queueFilled;
+  pthread_cond_t queueDrained;
+  struct scanBatch* head; // oldest batch
+  struct scanBatch* tail; // newest batch
+  int queued; // batches in the queue
+  int running; // scanner threads not yet finished
+  struct catalogList* lists; // live catalog records of each thread, and
+                             // of the journal thread after them
+  struct changeJournal* journal; // -J: paths to visit instead of walking
+                                 // from the root, NULL for a full walk
+  int failed; // the live catalog is incomplete and must not be written
+};
+
+// passed to each scanner thread
+struct scanThreadArg {
+  struct scanner* sc;
+  int id;
+};
+
+/*
+   Name: scanPush
+   Purpose: Queue a directory on the calling thread's deque.
+   Parameters: struct scanner* sc, int id: owning thread,
+               char* dir: heap allocated relative path, ownership is taken
+   return: 1 on success, -1 if out of memory
+*/
+static int scanPush(struct scanner* sc, int id, char* dir) {
+  struct scanDeque* dq = &sc -> deques[id];
+  pthread_mutex_lock(&dq -> lock);
+  if (dq -> bottom == dq -> capacity) {
+    size_t capacity = dq -> capacity == 0 ? 64 : dq -> capacity * 2;
+    char** grown = realloc(dq -> dirs, capacity * sizeof(char*));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&dq -> lock);
+      printf("Error in scanPush: Out of memory\n");
+      free(dir);
+      return -1;
+    }
+    dq -> dirs = grown;
+    dq -> capacity = capacity;
   }
-  fclose(backup);
+  dq -> dirs[dq -> bottom++] = dir;
+  atomic_fetch_add(&sc -> pending, 1);
+  pthread_mutex_unlock(&dq -> lock);
+  pthread_cond_signal(&sc -> workCond);
   return 1;
 }
 
+/*
+   Name: scanTake
+   Purpose: Get the next directory for thread id: its own newest entry, or
+            failing that the oldest entry of another thread's deque.
+   Parameters: struct scanner* sc, int id
+   return: relative path to scan (caller frees), NULL if no work was found
+*/
+static char* scanTake(struct scanner* sc, int id) {
+  char* dir = NULL;
+  struct scanDeque* dq = &sc -> deques[id];
 
-// write backup archive to directory
-int writeBackupToDirectory(char* dir) {
-   FILE *fp = fopen(archiveFile, "r");
-   /* Use fseek to get specific information
-      go forward x number of bytes dependent upon data
-      path: seek 30
-     permissions: seek +10
-     modtime: seek +21
-     sizeStr: seek 5
-     then we have access to the data
-     write this data to a file (using the path)
-     seek: convertStrToNum(sizeStr) to go to next file
- */   
- fseek(fp, 0, SEEK_SET);
- char buffer[100];
- fread(buffer, 30, sizeof(char), fp);
- printf("%s\n", buffer);
+  pthread_mutex_lock(&dq -> lock);
+  if (dq -> bottom > dq -> top) {
+    dir = dq -> dirs[--dq -> bottom];
+  }
+  if (dq -> bottom == dq -> top) {
+    dq -> bottom = dq -> top = 0;
+  }
+  pthread_mutex_unlock(&dq -> lock);
+
+  for (int i = 1; dir == NULL && i < sc -> threads; i++) {
+    struct scanDeque* victim = &sc -> deques[(id + i) % sc -> threads];
+    pthread_mutex_lock(&victim -> lock);
+    if (victim -> bottom > victim -> top) {
+      dir = victim -> dirs[victim -> top++];
+    }
+    pthread_mutex_unlock(&victim -> lock);
+  }
+  return dir;
+}
 
+/*
+   Name: firstExtent
+   Purpose: Where the data of a file starts on the disk, asked for with
+            FIEMAP on one extent so -O extent can read a directory's files
+			in the order the disk holds them. Only the mapping is read, the
+			data is not synced for it, so files still in delayed allocation
+			or kept inline in the inode have no offset and sort by inode.
+   Parameters: int dirFd: directory holding the file
+               const char* name: file name
+   return: physical byte offset of the first extent, 0 if none is known
+*/
+static uint64_t firstExtent(int dirFd, const char* name) {
+#ifdef HAVE_FIEMAP
+  static atomic_int noFiemap;
+  uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent))
+               / sizeof(uint64_t) + 1];
+  struct fiemap* map = (struct fiemap*) buf;
 
+  if (atomic_load(&noFiemap)) {
+    return 0;
+  }
+  uint64_t started = metricNow();
+  int fd = openat(dirFd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+  if (fd == -1) {
+    return 0;
+  }
+  memset(buf, 0, sizeof(buf));
+  map -> fm_length = FIEMAP_MAX_OFFSET;
+  map -> fm_extent_count = 1;
+  int got = ioctl(fd, FS_IOC_FIEMAP, map);
+  close(fd);
+  metricTime(PHASE_FIEMAP, started);
+  if (got == -1) {
+    // the filesystem cannot tell, do not ask again this run
+    if (errno == EOPNOTSUPP || errno == ENOTTY) {
+      atomic_store(&noFiemap, 1);
+    }
+    return 0;
+  }
+  if (map -> fm_mapped_extents == 0
+      || (map -> fm_extents[0].fe_flags
+          & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)) != 0) {
+    return 0;
+  }
+  return map -> fm_extents[0].fe_physical;
+#else
+  (void) dirFd;
+  (void) name;
   return 0;
+#endif
 }
 
 /*
-   Name: formatTime
-   Purpose: Turn a generic time_t object into that of the format: 
-            MONTH MONTH_DAY  HOUR:MINUTE
-			for displaying information for a given file. Similar to ls -l
-   Parameters: time_t t
-   return: str (char*) 
+   Name: compareScanEntries
+   Purpose: qsort comparator of the -O read order: by first extent (all 0
+            unless -O extent), then by inode. Entries without data come
+			first, they cost no reads.
 */
-char* formatTime(time_t t) {
-  // define array of months that map to the corresponding number
-  const char* months[12] = {
-    "Jan",
-    "Feb",
-    "Mar",
-    "Apr",
-    "May",
-    "Jun",
-    "Jul",
-    "Aug",
-    "Sep",
-    "Oct",
-    "Nov",
-    "Dec"
-  };
+static int compareScanEntries(const void* a, const void* b) {
+  const struct scanEntry* x = a;
+  const struct scanEntry* y = b;
+  if (x -> extent != y -> extent) {
+    return x -> extent < y -> extent ? -1 : 1;
+  }
+  if (x -> st.st_ino != y -> st.st_ino) {
+    return x -> st.st_ino < y -> st.st_ino ? -1 : 1;
+  }
+  return 0;
+}
 
-  // define the string that will contain the time information
-  char* str = malloc(TIME_SIZE);
+/*
+   Name: scanEmit
+   Purpose: Hand a batch to the archiving stage, blocking while the queue
+            already holds SCAN_QUEUE_DEPTH batches so memory stays bounded
+			when archiving is slower than scanning. The entries are put in
+			the -O order first: readdir returns them in hash order on ext4
+			and XFS, which on a spinning disk turns reading the files of a
+			directory into random I/O.
+   Parameters: struct scanner* sc, struct scanBatch* batch
+   return: void
+*/
+static void scanEmit(struct scanner* sc, struct scanBatch* batch) {
+  if (batch -> count == 0) {
+    free(batch);
+    return;
+  }
+  if (readOrder != ORDER_NONE) {
+    qsort(batch -> entries, batch -> count, sizeof(struct scanEntry),
+          compareScanEntries);
+  }
+  batch -> next = NULL;
+  pthread_mutex_lock(&sc -> queueLock);
+  while (sc -> queued >= SCAN_QUEUE_DEPTH) {
+    pthread_cond_wait(&sc -> queueDrained, &sc -> queueLock);
+  }
+  if (sc -> tail == NULL) {
+    sc -> head = batch;
+  } else {
+    sc -> tail -> next = batch;
+  }
+  sc -> tail = batch;
+  sc -> queued++;
+  pthread_cond_signal(&sc -> queueFilled);
+  pthread_mutex_unlock(&sc -> queueLock);
+}
 
-  // utilize the struct tm to extract information from time_t
-  struct tm timeInfo = *localtime(&t);
-  snprintf(str, TIME_SIZE, "%s %2d  %02d:%02d", months[timeInfo.tm_mon], \
-    timeInfo.tm_mday, timeInfo.tm_hour, timeInfo.tm_min);
+/*
+   Name: statEntry
+   Purpose: The one metadata fetch for a directory entry. statx relative to
+            the directory descriptor asks only for the fields the backup
+			uses (no atime, no block counts) and does not follow symlinks, so
+			links are archived as links. The result is returned as a struct
+			stat so later stages reuse it instead of stat()ing again. Falls
+			back to fstatat where statx is unavailable.
+   Parameters: int dirFd: directory holding the entry
+               const char* name: entry name
+			   struct stat* st: filled in on success
+   return: 1 on success, -1 on failure
+*/
+static int statEntry(int dirFd, const char* name, struct stat* st) {
+  static atomic_int noStatx;
+  struct statx stx;
 
-  return str;
+  if (atomic_load(&noStatx) == 0) {
+    if (statx(dirFd, name, AT_SYMLINK_NOFOLLOW, STATX_ENTRY_MASK,
+              &stx) == 0) {
+      memset(st, 0, sizeof(*st));
+      st -> st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+      st -> st_ino = stx.stx_ino;
+      st -> st_mode = stx.stx_mode;
+      st -> st_nlink = stx.stx_nlink;
+      st -> st_uid = stx.stx_uid;
+      st -> st_gid = stx.stx_gid;
+      st -> st_size = stx.stx_size;
+      st -> st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+      st -> st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+      st -> st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+      st -> st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+      return 1;
+    }
+    if (errno != ENOSYS) {
+      return -1;
+    }
+    atomic_store(&noStatx, 1);
+  }
+  return fstatat(dirFd, name, st, AT_SYMLINK_NOFOLLOW) == 0 ? 1 : -1;
 }
+
 /*
-   Name: formatTimeStr
-   Purpose: Turn a generic time_t object into that of the format: 
-            YYYY-MM-DD hh:mm:ss
-			
-   Parameters: time_t t
-   return: str (char*) the formatted string 
+   Name: scanSelect
+   Purpose: Decide whether a statted entry travels in this run. The archive
+            and its volumes never do; with a catalog anything that differs
+			from the previous one does and the entry is recorded in the
+			thread's list, otherwise the cut off decides.
+   Parameters: struct scanner* sc, int id: calling thread,
+               struct scanEntry* se: entry with its stat filled in,
+			   const char* path, size_t pathLen: relative path,
+			   int dirFd, const char* name: the entry in its directory
+   return: 1 if selected, 0 if not
 */
-char* formatTimeStr(time_t t) {
-  char* str = malloc(TIME_SIZE);
-  struct tm timeInfo = *localtime(&t);
+static int scanSelect(struct scanner* sc, int id, struct scanEntry* se,
+                      const char* path, size_t pathLen, int dirFd,
+                      const char* name) {
+  struct stat* st = &se -> st;
 
-  snprintf(str, TIME_SIZE, "%d-%02d-%02d %02d:%02d:%d", timeInfo.tm_year \
-			+ 1900, timeInfo.tm_mon + 1, timeInfo.tm_mday, timeInfo.tm_hour, \
-			timeInfo.tm_min, timeInfo.tm_sec);
+  // the archive being written is never part of the backup
+  if (st -> st_dev == sc -> archiveDev && st -> st_ino == sc -> archiveIno) {
+    return 0;
+  }
+  if (sc -> volumePrefix != NULL
+      && strncmp(path, sc -> volumePrefix, sc -> volumePrefixLen) == 0
+      && path[sc -> volumePrefixLen] != '\0'
+      && strspn(path + sc -> volumePrefixLen, "0123456789")
+         == strlen(path + sc -> volumePrefixLen)) {
+    return 0;
+  }
 
-  return str;
+  // with a previous catalog anything that differs from it is selected,
+  // otherwise only entries changed since the cut off travel on
+  int selected;
+  se -> rec = NULL;
+  if (catalogFile != NULL) {
+    int64_t prevIndex = -1;
+    if (prevCatalog.map != NULL) {
+      prevIndex = catalogFind(&prevCatalog, path, pathLen);
+      selected = prevIndex < 0 || catalogChanged(&prevCatalog, prevIndex, st);
+    } else {
+      selected = isChanged(&predicate, st);
+    }
+    se -> rec = catalogAdd(&sc -> lists[id], path, pathLen, st, &prevCatalog,
+                           prevIndex);
+    if (se -> rec == NULL) {
+      printf("Error in scanSelect: Out of memory\n");
+      sc -> failed = 1;
+    } else if (selected) {
+      // the old signature no longer describes the file
+      se -> rec -> sigPrev = -1;
+    }
+  } else {
+    selected = isChanged(&predicate, st);
+  }
+  if (selected == 0) {
+    metricCount(prevCatalog.map != NULL ? COUNT_UNCHANGED : COUNT_CUTOFF, 1);
+    return 0;
+  }
+  metricCount(COUNT_SELECTED, 1);
+  se -> extent = 0;
+  if (readOrder == ORDER_EXTENT && S_ISREG(st -> st_mode)
+      && st -> st_size > 0) {
+    se -> extent = firstExtent(dirFd, name);
+  }
+  return 1;
 }
 
 /*
-   Name: getGroupName()
-   Purpose: Retrieve the group name that a file belongs too given the ID.
-   Parameters: int groupID, retrieved from the stat struct for a given file
-   return: char* the name of the group
+   Name: scanCarry
+   Purpose: Keep the previous catalog records below path, and with self the
+            record of path itself, when the scan could not look at them.
+			Otherwise catalogFinish takes them for deleted and writes
+			tombstones for files that still exist. The next run compares
+			them again.
+   Parameters: struct scanner* sc, int id: list of the thread,
+               const char* path, size_t len: "" for the root, int self
+   return: void
 */
-char* getGroupName(int groupID) {
-  struct group *gPoint;
-  gPoint = getgrgid(groupID);
-  return gPoint -> gr_name;
+static void scanCarry(struct scanner* sc, int id, const char* path,
+                      size_t len, int self) {
+  const struct catalog* prev = &prevCatalog;
+  char prefix[PATH_MAX + 1];
+  if (catalogFile == NULL || prev -> map == NULL) {
+    return;
+  }
+  if (len >= PATH_MAX) {
+    sc -> failed = 1;
+    return;
+  }
+  uint64_t i = 0;
+  if (len > 0) {
+    int64_t at = self ? catalogFind(prev, path, len) : -1;
+    if (at >= 0 && catalogCarry(&sc -> lists[id], prev, at) == NULL) {
+      printf("Error in scanCarry: Out of memory\n");
+      sc -> failed = 1;
+      return;
+    }
+    memcpy(prefix, path, len);
+    prefix[len] = '/';
+    i = catalogLowerBound(prev, prefix, len + 1);
+  }
+  for (; i < prev -> count; i++) {
+    uint32_t oldLen;
+    const char* old = catalogPath(prev, i, &oldLen);
+    if (len > 0 && (oldLen <= len || memcmp(old, prefix, len + 1) != 0)) {
+      break;
+    }
+    if (catalogCarry(&sc -> lists[id], prev, i) == NULL) {
+      printf("Error in scanCarry: Out of memory\n");
+      sc -> failed = 1;
+      return;
+    }
+  }
 }
+
 /*
-   Name: getUserName()
-   Purpose: Retrieve the username of the account that created the file.
-   Parameters: int userID, retrieved from the stat struct for a given file
-   return: char* the name of the user
+   Name: scanDirectory
+   Purpose: Read one directory relative to the backup root, stat each entry
+            once relative to the directory descriptor (see statEntry), queue
+			subdirectories on the thread's deque and emit the entries in
+			batches.
+   Parameters: struct scanner* sc, int id: calling thread,
+               const char* dir: relative path of the directory
+   return: void
 */
-char* getUserName(int userID) {
-  struct passwd *pPoint;
-  pPoint = getpwuid(userID);
-  return pPoint -> pw_name;
+static void scanDirectory(struct scanner* sc, int id, const char* dir) {
+  uint64_t started = metricNow();
+  int fd = openat(sc -> rootFd, dir[0] == '\0' ? "." : dir,
+                  O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  DIR* directPoint = fd == -1 ? NULL : fdopendir(fd);
+  if (directPoint == NULL) {
+    printf("Error in scanDirectory: Could not open directory %s/%s\n",
+           rootDir, dir);
+    if (fd != -1) {
+      close(fd);
+    }
+    scanCarry(sc, id, dir, strlen(dir), 0);
+    return;
+  }
+  printf("%s%s%s\n", rootDir, dir[0] == '\0' ? "" : "/", dir);
+
+  size_t dirLen = strlen(dir);
+  struct scanBatch* batch = malloc(sizeof(struct scanBatch));
+  if (batch != NULL) {
+    batch -> count = 0;
+    batch -> used = 0;
+  }
+  struct dirent* entry;
+  while (batch != NULL && (entry = readdir(directPoint)) != NULL) {
+    // the directory itself and its parent are archived by their own parents
+    if (strcmp(entry -> d_name, ".") == 0
+        || strcmp(entry -> d_name, "..") == 0) {
+      continue;
+    }
+    // d_type already says these are never archived, do not stat them
+    if (entry -> d_type == DT_FIFO || entry -> d_type == DT_SOCK
+        || entry -> d_type == DT_CHR || entry -> d_type == DT_BLK) {
+      continue;
+    }
+    size_t nameLen = strlen(entry -> d_name);
+    if (batch -> count == SCAN_BATCH
+        || batch -> used + dirLen + nameLen + 2 > SCAN_ARENA) {
+      scanEmit(sc, batch);
+      batch = malloc(sizeof(struct scanBatch));
+      if (batch == NULL) {
+        break;
+      }
+      batch -> count = 0;
+      batch -> used = 0;
+    }
+
+    size_t n = batch -> count;
+    char* path = batch -> arena + batch -> used;
+    if (dirLen > 0) {
+      memcpy(path, dir, dirLen);
+      path[dirLen] = '/';
+      memcpy(path + dirLen + 1, entry -> d_name, nameLen + 1);
+    } else {
+      memcpy(path, entry -> d_name, nameLen + 1);
+    }
+    uint64_t statStarted = metricNow();
+    int statted = statEntry(fd, entry -> d_name, &batch -> entries[n].st);
+    metricTime(PHASE_STAT, statStarted);
+    // gone since readdir is a deletion, anything else keeps the old record
+    if (statted == -1 && errno != ENOENT) {
+      printf("Error in scanDirectory: Could not stat %s/%s\n", rootDir, path);
+      scanCarry(sc, id, path, strlen(path), 1);
+    }
+    if (statted == -1) {
+      continue;
+    }
+    metricCount(COUNT_ENTRIES, 1);
+    struct stat* st = &batch -> entries[n].st;
+
+    // the entry was not followed, so a link to a directory is not a dir
+    if (S_ISDIR(st -> st_mode)) {
+      char* sub = strdup(path);
+      if (sub != NULL) {
+        scanPush(sc, id, sub);
+      }
+    }
+
+    size_t pathLen = strlen(path);
+    if (scanSelect(sc, id, &batch -> entries[n], path, pathLen, fd,
+                   entry -> d_name) == 0) {
+      continue;
+    }
+    batch -> entries[n].pathOff = batch -> used;
+    batch -> used += pathLen + 1;
+    batch -> count++;
+  }
+  if (batch == NULL) {
+    // the rest of the directory is missing from the catalog
+    printf("Error in scanDirectory: Out of memory\n");
+    sc -> failed = 1;
+  } else {
+    scanEmit(sc, batch);
+  }
+  closedir(directPoint);
+  metricCount(COUNT_DIRS, 1);
+  metricTime(PHASE_READDIR, started);
 }
+
 /*
-   Name: getPermissions()
-   Purpose: Given a file, determine what access permissions this given file has
-            and present them in the following format:
-			(1)d|-  : d = directory, - = file
-			(2)r|-  : r = user read permission, - = user no read permission
-			(3)w|-  : w = user write permission, - = user no write permission
-			(4)x|-  : x = user execute permission, - = user no execute permiss-
-							ion
-			(5)r|-  : r = group read permission, - = user no read permission
-			(6)w|-  : w = group write permission, - = user no write permission
-			(7)x|-  : x = group execute permission, - = user no execute permiss-
-							ion
-			(8)r|-  : r = other read permission, - = user no read permission
-			(9)w|-  : w = other write permission, - = user no write permission
-			(10)x|- : x = other execute permission, - = user no execute permiss-
-							ion				
-   Parameters: int fileMode
-   return: char* of size 10 representing the permission format of ls -l
+   Name: scanWorker
+   Purpose: Thread body: scan directories from the own deque, steal when it
+            runs dry, and exit once no directory is queued or in flight
+			anywhere. The last thread out wakes the archiving stage.
+   Parameters: void* arg: struct scanThreadArg
+   return: NULL
 */
-char* getPermissions(int fileMode) {
-  char* perStr = malloc(10);
-  // directory or not
-  if (S_ISDIR(fileMode) == 1) {
-    perStr[0] = 'd';
-  } else {
-    perStr[0] = '-';
+static void* scanWorker(void* arg) {
+  struct scanThreadArg* ta = arg;
+  struct scanner* sc = ta -> sc;
+
+  for (;;) {
+    char* dir = scanTake(sc, ta -> id);
+    if (dir != NULL) {
+      scanDirectory(sc, ta -> id, dir);
+      free(dir);
+      if (atomic_fetch_sub(&sc -> pending, 1) == 1) {
+        pthread_mutex_lock(&sc -> idleLock);
+        pthread_cond_broadcast(&sc -> workCond);
+        pthread_mutex_unlock(&sc -> idleLock);
+      }
+      continue;
+    }
+    if (atomic_load(&sc -> pending) == 0) {
+      break;
+    }
+    // others are still scanning and may push more, wait a little
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += 1000000;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&sc -> idleLock);
+    pthread_cond_timedwait(&sc -> workCond, &sc -> idleLock, &until);
+    pthread_mutex_unlock(&sc -> idleLock);
   }
 
-  // User permissions
-  // read
-  if ((fileMode & S_IRUSR) > 0) {
-    perStr[1] = 'r';
-  } else {
-    perStr[1] = '-';
+  pthread_mutex_lock(&sc -> queueLock);
+  sc -> running--;
+  pthread_cond_broadcast(&sc -> queueFilled);
+  pthread_mutex_unlock(&sc -> queueLock);
+  return NULL;
+}
+
+/*
+   Name: journalOpenDir
+   Purpose: Open the directory a journal path lives in one component at a
+            time without following links, so a directory replaced by a
+			link since the journal was written cannot lead out of the tree.
+   Parameters: int rootFd, const char* dir, size_t len: relative path of
+               the directory, empty for the root
+   return: descriptor (rootFd itself for the root), -1 if it is gone
+*/
+static int journalOpenDir(int rootFd, const char* dir, size_t len) {
+  int fd = rootFd;
+  size_t at = 0;
+  while (at < len) {
+    char name[NAME_MAX + 1];
+    size_t end = at;
+    while (end < len && dir[end] != '/') {
+      end++;
+    }
+    if (end - at > NAME_MAX) {
+      return -1;
+    }
+    memcpy(name, dir + at, end - at);
+    name[end - at] = '\0';
+    int next = openat(fd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+    if (fd != rootFd) {
+      close(fd);
+    }
+    if (next == -1) {
+      return -1;
+    }
+    fd = next;
+    at = end + 1;
   }
-  // write
-  if ((fileMode & S_IWUSR) > 0) {
-    perStr[2] = 'w';
-  } else {
-    perStr[2] = '-';
+  return fd;
+}
+
+/*
+   Name: journalBelow
+   Purpose: Check whether a journal path lies below one already dropped
+            by journalWorker, whose subtree a walk or a deletion covers.
+   Parameters: const struct changeJournal* jn, const size_t* dropped:
+               indices of the dropped paths, ascending so in path order,
+			   size_t count, const char* path, size_t len
+   return: 1 if an ancestor of path was dropped, 0 if not
+*/
+static int journalBelow(const struct changeJournal* jn,
+                        const size_t* dropped, size_t count,
+                        const char* path, size_t len) {
+  for (size_t end = 0; end < len; end++) {
+    if (path[end] != '/') {
+      continue;
+    }
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      const struct journalPath* d = &jn -> paths[dropped[mid]];
+      int c = comparePaths(d -> path, d -> len, path, end);
+      if (c == 0) {
+        return 1;
+      } else if (c < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
   }
-  // execute
-  if ((fileMode & S_IXUSR) > 0) {
-    perStr[3] = 'x';
+  return 0;
+}
+
+/*
+   Name: journalLinkAdd
+   Purpose: Note an inode whose other names journalWorker has to look at
+            too. path only marks the slot as used and is not owned.
+   Parameters: struct linkSet* links, uint64_t dev, uint64_t ino,
+               const char* path: a name of the inode
+   return: 1 on success, -1 if out of memory
+*/
+static int journalLinkAdd(struct linkSet* links, uint64_t dev, uint64_t ino,
+                          const char* path) {
+  struct linkSlot* slot = linkFind(links, dev, ino);
+  if (slot == NULL) {
+    return -1;
+  }
+  if (slot -> path == NULL) {
+    slot -> path = (char*) path;
+    slot -> dev = dev;
+    slot -> ino = ino;
+    links -> count++;
+  }
+  return 1;
+}
+
+/*
+   Name: journalAddLinks
+   Purpose: Append to the journal paths every record of the previous catalog
+            not visited yet that is a name of an inode in links. A write or
+			unlink through one name of a hard linked file changes the
+			inode under all of its names, but the journal only has the
+			name it went through.
+   Parameters: struct changeJournal* jn, const struct catalog* prev,
+               const unsigned char* visited, struct linkSet* links
+   return: number of paths added, -1 if out of memory
+*/
+static int64_t journalAddLinks(struct changeJournal* jn,
+                               const struct catalog* prev,
+                               const unsigned char* visited,
+                               struct linkSet* links) {
+  size_t added = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint64_t i = 0; i < prev -> count; i++) {
+      const unsigned char* rec = prev -> records + i * prev -> recordSize;
+      if ((visited[i / 8] & (1 << (i % 8))) != 0
+          || S_ISDIR(getLE32(rec + 12))
+          || linkFind(links, getLE64(rec + 16), getLE64(rec + 24)) -> path
+             == NULL) {
+        continue;
+      }
+      if (pass == 1) {
+        uint32_t len;
+        jn -> paths[jn -> count].path = catalogPath(prev, i, &len);
+        jn -> paths[jn -> count].len = len;
+        jn -> count++;
+      } else {
+        added++;
+      }
+    }
+    if (pass == 0 && added > 0) {
+      struct journalPath* grown = realloc(jn -> paths, (jn -> count + added)
+                                          * sizeof(*grown));
+      if (grown == NULL) {
+        return -1;
+      }
+      jn -> paths = grown;
+    } else if (pass == 0) {
+      break;
+    }
+  }
+  return added;
+}
+
+/*
+   Name: journalWorker
+   Purpose: Thread body standing in for the walk from the root when the -J
+            journal covers the time since the previous run. Each changed
+			path is statted and selected like a scanned entry. A directory
+			that is new or not the one there before (another inode) is
+			handed to the scanner threads to walk, a path that is gone is
+			left out, and in
+			both cases nothing below it is taken from the previous catalog.
+			The other names of a hard linked file that changed or went
+			away are statted as well, see journalAddLinks.
+			Every other record of the previous catalog is carried over as
+			it is, so catalogFinish() sees the live set a full walk would
+			have found and writes tombstones for what was deleted.
+   Parameters: void* arg: struct scanThreadArg, id is sc -> threads
+   return: NULL
+*/
+static void* journalWorker(void* arg) {
+  struct scanThreadArg* ta = arg;
+  struct scanner* sc = ta -> sc;
+  struct changeJournal* jn = sc -> journal;
+  const struct catalog* prev = &prevCatalog;
+  unsigned char* visited = calloc(prev -> count / 8 + 1, 1);
+  size_t* dropped = malloc((jn -> count + 1) * sizeof(size_t));
+  size_t droppedCount = 0;
+  struct scanBatch* batch = malloc(sizeof(struct scanBatch));
+  int dirFd = -1; // directory of the last path and its relative path
+  const char* dirPath = NULL;
+  size_t dirLen = 0;
+  struct linkSet links = { NULL, 0, 0 }; // inodes of the changed files
+  size_t journaled = jn -> count; // the paths after it are other names
+
+  if (visited == NULL || dropped == NULL || batch == NULL) {
+    printf("Error in journalWorker: Out of memory\n");
+    sc -> failed = 1;
+    free(batch);
+    batch = NULL;
   } else {
-    perStr[3] = '-';
+    batch -> count = 0;
+    batch -> used = 0;
+  }
+  for (size_t k = 0; batch != NULL; k++) {
+    if (k == jn -> count) {
+      int64_t added = k == journaled && links.count > 0
+                      ? journalAddLinks(jn, prev, visited, &links) : 0;
+      if (added == -1) {
+        printf("Error in journalWorker: Out of memory\n");
+        sc -> failed = 1;
+      }
+      if (added <= 0) {
+        break;
+      }
+    }
+    const char* path = jn -> paths[k].path;
+    size_t len = jn -> paths[k].len;
+    if (journalBelow(jn, dropped, droppedCount, path, len)) {
+      continue;
+    }
+    if (batch -> count == SCAN_BATCH || batch -> used + len + 1 > SCAN_ARENA) {
+      scanEmit(sc, batch);
+      batch = malloc(sizeof(struct scanBatch));
+      if (batch == NULL) {
+        printf("Error in journalWorker: Out of memory\n");
+        sc -> failed = 1;
+        break;
+      }
+      batch -> count = 0;
+      batch -> used = 0;
+    }
+    char* rel = batch -> arena + batch -> used;
+    memcpy(rel, path, len);
+    rel[len] = '\0';
+    const char* slash = strrchr(rel, '/');
+    size_t parentLen = slash != NULL ? (size_t) (slash - rel) : 0;
+    const char* name = slash != NULL ? slash + 1 : rel;
+    if (dirFd == -1 || parentLen != dirLen
+        || memcmp(path, dirPath, parentLen) != 0) {
+      if (dirFd != -1 && dirFd != sc -> rootFd) {
+        close(dirFd);
+      }
+      dirFd = journalOpenDir(sc -> rootFd, rel, parentLen);
+      dirPath = path;
+      dirLen = parentLen;
+    }
+
+    // the previous record is replaced by whatever is found now
+    struct scanEntry* se = &batch -> entries[batch -> count];
+    int64_t prevIndex = catalogFind(prev, path, len);
+    const unsigned char* old = NULL;
+    int wasDir = 0;
+    if (prevIndex >= 0) {
+      visited[prevIndex / 8] |= 1 << (prevIndex % 8);
+      old = prev -> records + prevIndex * prev -> recordSize;
+      wasDir = S_ISDIR(getLE32(old + 12));
+    }
+    uint64_t statStarted = metricNow();
+    int present = dirFd != -1 && statEntry(dirFd, name, &se -> st) == 1;
+    metricTime(PHASE_STAT, statStarted);
+    if (k < journaled
+        && ((present && S_ISDIR(se -> st.st_mode) == 0
+             && se -> st.st_nlink > 1
+             && journalLinkAdd(&links, se -> st.st_dev, se -> st.st_ino,
+                               path) == -1)
+            || (old != NULL && wasDir == 0
+                && (present == 0
+                    || getLE64(old + 16) != (uint64_t) se -> st.st_dev
+                    || getLE64(old + 24) != (uint64_t) se -> st.st_ino)
+                && journalLinkAdd(&links, getLE64(old + 16),
+                                  getLE64(old + 24), path) == -1))) {
+      printf("Error in journalWorker: Out of memory\n");
+      sc -> failed = 1;
+    }
+    // scanDirectory never archives these either
+    if (present == 0 || S_ISFIFO(se -> st.st_mode)
+        || S_ISSOCK(se -> st.st_mode) || S_ISCHR(se -> st.st_mode)
+        || S_ISBLK(se -> st.st_mode)) {
+      // other names are files, nothing is below them
+      if (k < journaled) {
+        dropped[droppedCount++] = k;
+      }
+      continue;
+    }
+    metricCount(COUNT_ENTRIES, 1);
+    // a directory moved over another keeps no events for what is in it
+    int isDir = S_ISDIR(se -> st.st_mode);
+    int replaced = old == NULL || isDir != wasDir
+                   || getLE64(old + 16) != (uint64_t) se -> st.st_dev
+                   || getLE64(old + 24) != (uint64_t) se -> st.st_ino;
+    if (replaced && (isDir || wasDir)) {
+      if (k < journaled) {
+        dropped[droppedCount++] = k;
+      }
+      if (isDir) {
+        char* sub = strdup(rel);
+        if (sub != NULL) {
+          scanPush(sc, 0, sub);
+        }
+      }
+    }
+    if (scanSelect(sc, ta -> id, se, rel, len, dirFd, name) == 1) {
+      se -> pathOff = batch -> used;
+      batch -> used += len + 1;
+      batch -> count++;
+    }
+  }
+  if (dirFd != -1 && dirFd != sc -> rootFd) {
+    close(dirFd);
+  }
+  if (batch != NULL) {
+    scanEmit(sc, batch);
+  }
+  // the walks queued above keep the scanner threads going
+  if (atomic_fetch_sub(&sc -> pending, 1) == 1) {
+    pthread_mutex_lock(&sc -> idleLock);
+    pthread_cond_broadcast(&sc -> workCond);
+    pthread_mutex_unlock(&sc -> idleLock);
+  }
+
+  // below a dropped path the walk, or nothing, replaces the old records
+  for (size_t d = 0; d < droppedCount; d++) {
+    const struct journalPath* jp = &jn -> paths[dropped[d]];
+    char prefix[PATH_MAX + 1];
+    memcpy(prefix, jp -> path, jp -> len);
+    prefix[jp -> len] = '/';
+    uint64_t i = catalogLowerBound(prev, prefix, jp -> len + 1);
+    for (; i < prev -> count; i++) {
+      uint32_t oldLen;
+      const char* old = catalogPath(prev, i, &oldLen);
+      if (oldLen <= jp -> len || memcmp(old, prefix, jp -> len + 1) != 0) {
+        break;
+      }
+      visited[i / 8] |= 1 << (i % 8);
+    }
+  }
+  for (uint64_t i = 0; visited != NULL && i < prev -> count
+       && sc -> failed == 0; i++) {
+    if ((visited[i / 8] & (1 << (i % 8))) == 0
+        && catalogCarry(&sc -> lists[ta -> id], prev, i) == NULL) {
+      printf("Error in journalWorker: Out of memory\n");
+      sc -> failed = 1;
+    }
+  }
+  free(visited);
+  free(dropped);
+  free(links.slots);
+
+  pthread_mutex_lock(&sc -> queueLock);
+  sc -> running--;
+  pthread_cond_broadcast(&sc -> queueFilled);
+  pthread_mutex_unlock(&sc -> queueLock);
+  return NULL;
+}
+
+/*
+   Name: scanNext
+   Purpose: Archiving side of the entry queue: wait for the next batch.
+   Parameters: struct scanner* sc
+   return: the batch (caller frees), NULL once every scanner has finished
+           and the queue is empty
+*/
+static struct scanBatch* scanNext(struct scanner* sc) {
+  pthread_mutex_lock(&sc -> queueLock);
+  while (sc -> head == NULL && sc -> running > 0) {
+    pthread_cond_wait(&sc -> queueFilled, &sc -> queueLock);
+  }
+  struct scanBatch* batch = sc -> head;
+  if (batch != NULL) {
+    sc -> head = batch -> next;
+    if (sc -> head == NULL) {
+      sc -> tail = NULL;
+    }
+    sc -> queued--;
+    pthread_cond_signal(&sc -> queueDrained);
+  }
+  pthread_mutex_unlock(&sc -> queueLock);
+  return batch;
+}
+
+/*
+   Name: prefetchWindow
+   Purpose: Read the small regular files among the next entries of a batch
+            through io_uring, URING_DEPTH at a time: all openat requests go
+			out in one submission, then every read with its close hard
+			linked behind it in a second one, so the kernel works on many
+			files at once instead of one open, read and close at a time.
+			Files that fail here are simply read again synchronously by
+			writeFileToBackup, which also reports the error.
+   Parameters: int rootFd, struct scanBatch* batch, size_t first: entry to
+               start at, unsigned char* arena: PREFETCH_BYTES of room
+			   struct prefetchFile* files: URING_DEPTH results, entry
+			   first + k goes to files[k]
+   return: the entry after the window, files beyond it are untouched
+*/
+static size_t prefetchWindow(int rootFd, struct scanBatch* batch,
+                             size_t first, unsigned char* arena,
+                             struct prefetchFile* files) {
+  size_t end = first;
+  size_t used = 0;
+  unsigned int opens = 0;
+
+  while (end < batch -> count && end - first < URING_DEPTH) {
+    const struct stat* st = &batch -> entries[end].st;
+    struct prefetchFile* f = &files[end - first];
+    f -> data = NULL;
+    f -> got = -1;
+    if (S_ISREG(st -> st_mode) && st -> st_size > 0
+        && st -> st_size <= SMALL_PAYLOAD) {
+      if (used + st -> st_size > PREFETCH_BYTES) {
+        break;
+      }
+      f -> data = arena + used;
+      used += st -> st_size;
+#ifdef HAVE_IO_URING
+      uringQueue(&readRing, IORING_OP_OPENAT, rootFd,
+                 batch -> arena + batch -> entries[end].pathOff, 0, 0,
+                 O_RDONLY | O_NOFOLLOW, end - first);
+#endif
+      opens++;
+    }
+    end++;
+  }
+#ifdef HAVE_IO_URING
+  if (opens == 0 || uringSubmit(&readRing, opens) == -1) {
+    return end;
+  }
+  unsigned int reads = 0;
+  for (unsigned int i = 0; i < opens; i++) {
+    uint64_t tag;
+    int res = uringReap(&readRing, &tag);
+    if (res >= 0) {
+      // the close runs even if the read fails
+      uringQueue(&readRing, IORING_OP_READ, res, files[tag].data,
+                 batch -> entries[first + tag].st.st_size, 0,
+                 IOSQE_IO_HARDLINK, tag);
+      uringQueue(&readRing, IORING_OP_CLOSE, res, NULL, 0, 0, 0,
+                 URING_CLOSE | tag);
+      reads += 2;
+    }
+  }
+  if (reads > 0 && uringSubmit(&readRing, reads) == -1) {
+    // in flight reads target the arena, wait for them before reuse
+    for (unsigned int i = 0; i < reads; i++) {
+      uint64_t tag;
+      uringReap(&readRing, &tag);
+    }
+    return end;
   }
-
-  // Group permissions
-  // read
-  if ((fileMode & S_IRGRP) > 0) {
-    perStr[4] = 'r';
-  } else {
-    perStr[4] = '-';
+  for (unsigned int i = 0; i < reads; i++) {
+    uint64_t tag;
+    int res = uringReap(&readRing, &tag);
+    if ((tag & URING_CLOSE) == 0) {
+      files[tag].got = res;
+    }
   }
-  // write
-  if ((fileMode & S_IWGRP) > 0) {
-    perStr[5] = 'w';
-  } else {
-    perStr[5] = '-';
+#endif
+  return end;
+}
+
+/*
+   Name: volumeOpen
+   Purpose: Start the next volume for a writer, named after the -f archive
+            with the volume number appended.
+   Parameters: struct volumeWriter* vw
+   return: 1 on success, -1 on failure
+*/
+static int volumeOpen(struct volumeWriter* vw) {
+  char name[PATH_MAX];
+  unsigned int number = atomic_fetch_add(&vw -> set -> next, 1);
+  snprintf(name, sizeof(name), "%s.%03u", archiveFile, number);
+  if (archiveOpen(&vw -> archive, name) == -1) {
+    return -1;
   }
-  // execute
-  if ((fileMode & S_IXGRP) > 0) {
-    perStr[6] = 'x';
-  } else {
-    perStr[6] = '-';
+  if (vw -> set -> codec != NULL) {
+    vw -> archive.compressor = &vw -> compressor;
   }
+  vw -> open = 1;
+  return 1;
+}
 
-  // other permissions
-  // read
-  if ((fileMode & S_IROTH) > 0) {
-    perStr[7] = 'r';
-  } else {
-    perStr[7] = '-';
+/*
+   Name: volumeClose
+   Purpose: Finish the volume a writer is filling: the blocks still in its
+            compressor, then the index and trailer.
+   Parameters: struct volumeWriter* vw
+   return: 1 on success, -1 on failure
+*/
+static int volumeClose(struct volumeWriter* vw) {
+  int result = 1;
+  if (vw -> open == 0) {
+    return 1;
   }
-  // write
-  if ((fileMode & S_IWOTH) > 0) {
-    perStr[8] = 'w';
-  } else {
-    perStr[8] = '-';
+  if (vw -> archive.compressor != NULL
+      && compressFlush(vw -> archive.compressor, &vw -> archive) == -1) {
+    result = -1;
   }
-  // execute
-  if ((fileMode & S_IXOTH) > 0) {
-    perStr[9] = 'x';
-  } else {
-    perStr[9] = '-';
+  if (archiveClose(&vw -> archive) == -1) {
+    result = -1;
   }
-  // terminate the permission string
-  perStr[10] = '\0';
-  return perStr;
+  vw -> open = 0;
+  return result;
 }
 
 /*
-   Name: toPower
-   Purpose: Raises a value to a given exponent and outputs the result. Multiply-
-		    ing the value exponent times. 
-				   
-			Parameters: int val: the value to multiply multiple times (the base)
-			            int ex: the exponent that represents the number of times
-						        it will multiply the val
-   return: return val 
+   Name: volumeWorker
+   Purpose: Thread body of a volume writer. It archives the entries queued
+            for it, moving on to a new volume before one would outgrow the
+			-V size, and frees each batch once its last entry is done.
+   Parameters: void* arg: the struct volumeWriter
+   return: NULL
 */
-int toPower(int val, int ex) {
-  int base = val;
-  for (int i = 0; i < ex - 1; i++) {
-    val *= base;
-  }
+static void* volumeWorker(void* arg) {
+  struct volumeWriter* vw = arg;
+  for (;;) {
+    pthread_mutex_lock(&vw -> lock);
+    while (vw -> count == 0 && vw -> done == 0) {
+      pthread_cond_wait(&vw -> filled, &vw -> lock);
+    }
+    if (vw -> count == 0) {
+      pthread_mutex_unlock(&vw -> lock);
+      break;
+    }
+    struct volumeJob job = vw -> jobs[vw -> head];
+    vw -> head = (vw -> head + 1) % VOLUME_QUEUE;
+    vw -> count--;
+    pthread_cond_signal(&vw -> drained);
+    pthread_mutex_unlock(&vw -> lock);
 
-  return val;
+    struct stat* st = &job.batch -> entries[job.index].st;
+    char* path = job.batch -> arena + job.batch -> entries[job.index].pathOff;
+    uint64_t size = S_ISREG(st -> st_mode) ? st -> st_size : 0;
+    // room for the entry, its index slot and the trailer
+    uint64_t need = ENTRY_HEADER_SIZE + strlen(path) + HASH_SIZE + size
+                    + (vw -> archive.count + 2) * 8 + TRAILER_SIZE;
+    if (vw -> failed == 0 && vw -> open && vw -> archive.count > 0
+        && archiveTell(&vw -> archive) + need > vw -> set -> limit
+        && volumeClose(vw) == -1) {
+      vw -> failed = 1;
+    }
+    if (vw -> failed == 0 && vw -> open == 0 && volumeOpen(vw) == -1) {
+      vw -> failed = 1;
+    }
+    if (vw -> failed == 0) {
+      uint64_t started = metricNow();
+      int written = writeFileToBackup(vw -> set -> rootFd, path,
+                                      &vw -> archive, st,
+                                      job.batch -> entries[job.index].rec,
+                                      NULL);
+      metricTime(PHASE_ENTRY, started);
+      metricCount(written == 1 ? COUNT_ARCHIVED : COUNT_FAILED, 1);
+      if (written == -1 && vw -> archive.failed) {
+        vw -> failed = 1;
+      } else if (written == -1) {
+        catalogForget(job.batch -> entries[job.index].rec);
+      }
+    }
+
+    pthread_mutex_lock(&vw -> lock);
+    vw -> queuedBytes -= size;
+    pthread_mutex_unlock(&vw -> lock);
+    if (atomic_fetch_sub(&job.batch -> pending, 1) == 1) {
+      free(job.batch);
+    }
+  }
+  free(chunkWindow);
+  free(copyBuffer);
+  free(sparseBuffer);
+  return NULL;
 }
 
 /*
-   Name: convertStrToNum
-   Purpose: Takes in a string and converts it to an integer.
-            eg: "2500" == > 2500
-				   
-			Parameters: char* str: the string to convert
-   return: return num (integer value of str)
+   Name: volumeDispatch
+   Purpose: Hand every entry of a batch to a volume writer. Regular files
+            with several links always go to the same writer, chosen by
+			inode, so their links can share a volume; everything else goes
+			to the writer with the fewest bytes queued.
+   Parameters: struct volumeSet* set, struct scanBatch* batch: freed by
+               whichever writer finishes its last entry
+   return: void
 */
-int convertStrToNum(char* str) {
-  
-  int num = 0; // will store the converted string
-  int numLength = strlen(str); // get number of characters in string
-                               // this will represent number of powers of 10
-  int exponent = numLength - 1; // represents the exponent of 10^e
-  
-  for (int i = 0; i < numLength; i++) {
-    int digit = str[i] - '0'; // gets difference between ascii value of 0 and 
-	                          // ascii value of current character, this will
-							  // give the digit
-    if (exponent > 0) 
-      digit *= toPower(10, exponent); // multiply the digit by 10^exponent 
-    else
-      digit *= 1; // else 10^0 = 1 therefore just multiply by 1
-    exponent--; // decrement the exponent as it reads left to right and 
-	            // therefore goes from highest power to lowest power
-    num += digit; // store the result as a sum in num
+static void volumeDispatch(struct volumeSet* set, struct scanBatch* batch) {
+  atomic_store(&batch -> pending, batch -> count + 1);
+  for (size_t i = 0; i < batch -> count; i++) {
+    struct stat* st = &batch -> entries[i].st;
+    struct volumeWriter* vw = &set -> writers[0];
+    if (S_ISREG(st -> st_mode) && st -> st_nlink > 1) {
+      vw = &set -> writers[linkHash(st -> st_dev, st -> st_ino)
+                           % set -> count];
+    } else {
+      // a racy look is good enough to balance
+      for (int j = 1; j < set -> count; j++) {
+        if (set -> writers[j].queuedBytes + set -> writers[j].count
+            < vw -> queuedBytes + vw -> count) {
+          vw = &set -> writers[j];
+        }
+      }
+    }
+    pthread_mutex_lock(&vw -> lock);
+    while (vw -> count == VOLUME_QUEUE) {
+      pthread_cond_wait(&vw -> drained, &vw -> lock);
+    }
+    vw -> jobs[(vw -> head + vw -> count) % VOLUME_QUEUE].batch = batch;
+    vw -> jobs[(vw -> head + vw -> count) % VOLUME_QUEUE].index = i;
+    vw -> count++;
+    vw -> queuedBytes += S_ISREG(st -> st_mode) ? st -> st_size : 0;
+    pthread_cond_signal(&vw -> filled);
+    pthread_mutex_unlock(&vw -> lock);
   }
+  if (atomic_fetch_sub(&batch -> pending, 1) == 1) {
+    free(batch);
+  }
+}
 
-  return num;
+/*
+   Name: volumeStart
+   Purpose: Start the writers of a multi-volume run. The first volume is
+            opened at once so the scanner knows its identity, the others
+			when their writer gets its first entry.
+   Parameters: struct volumeSet* set: count and limit already set
+               const struct codec* codec: -z or NULL, int threads: -j
+   return: 1 on success, -1 on failure
+*/
+int volumeStart(struct volumeSet* set, const struct codec* codec,
+                int threads) {
+  set -> codec = codec;
+  set -> writers = calloc(set -> count, sizeof(struct volumeWriter));
+  if (set -> writers == NULL) {
+    printf("Error in volumeStart: Out of memory\n");
+    return -1;
+  }
+  int perWriter = threads / set -> count > 0 ? threads / set -> count : 1;
+  for (int i = 0; i < set -> count; i++) {
+    struct volumeWriter* vw = &set -> writers[i];
+    vw -> set = set;
+    pthread_mutex_init(&vw -> lock, NULL);
+    pthread_cond_init(&vw -> filled, NULL);
+    pthread_cond_init(&vw -> drained, NULL);
+    if (codec != NULL
+        && compressStart(&vw -> compressor, codec, perWriter) == -1) {
+      return -1;
+    }
+  }
+  return volumeOpen(&set -> writers[0]);
 }
 
 /*
-   Name: convertTimeToArr
-   Purpose: Takes in the time string hh:mm:ss and outputs an array of ints
-			[hh, mm, ss]
-				   
-			Parameters: char* time
-   return: return array of integers (timeArr)
+   Name: volumeDrain
+   Purpose: Let the writers finish the entries queued for them and stop.
+            Their last volumes stay open for the tombstones of the catalog.
+   Parameters: struct volumeSet* set
+   return: 1 on success, -1 if any volume could not be written
 */
-int* convertTimeToArr(char* time) {
-  int* timeArr = malloc(3);
-  
-  // define hours string
-  char hours[3] = {
-    time[0],
-    time[1],
-    '\0'
-  };
-  // define minutes string
-  char minutes[3] = {
-    time[3],
-    time[4],
-    '\0'
-  };
-  // define seconds string
-  char seconds[3] = {
-    time[6],
-    time[7],
-    '\0'
-  };
+int volumeDrain(struct volumeSet* set) {
+  int result = 1;
+  for (int i = 0; i < set -> count; i++) {
+    pthread_mutex_lock(&set -> writers[i].lock);
+    set -> writers[i].done = 1;
+    pthread_cond_signal(&set -> writers[i].filled);
+    pthread_mutex_unlock(&set -> writers[i].lock);
+  }
+  for (int i = 0; i < set -> count; i++) {
+    pthread_join(set -> writers[i].tid, NULL);
+    if (set -> writers[i].failed) {
+      result = -1;
+    }
+  }
+  // anything written from here on goes to the first writer's volume,
+  // after the blocks its compressor still holds
+  struct volumeWriter* first = &set -> writers[0];
+  if (first -> open == 0 && volumeOpen(first) == -1) {
+    result = -1;
+  }
+  if (result == 1 && first -> archive.compressor != NULL
+      && compressFlush(first -> archive.compressor, &first -> archive) == -1) {
+    result = -1;
+  }
+  return result;
+}
 
-  // convert strings to integers
-  int hoursNum = convertStrToNum(hours);
-  int minutesNum = convertStrToNum(minutes);
-  int secondsNum = convertStrToNum(seconds);
+/*
+   Name: volumeFinish
+   Purpose: Close the volumes still open and stop the compressors.
+   Parameters: struct volumeSet* set
+   return: 1 on success, -1 on failure
+*/
+int volumeFinish(struct volumeSet* set) {
+  int result = 1;
+  for (int i = 0; set -> writers != NULL && i < set -> count; i++) {
+    if (volumeClose(&set -> writers[i]) == -1) {
+      result = -1;
+    }
+    compressStop(&set -> writers[i].compressor);
+  }
+  free(set -> writers);
+  set -> writers = NULL;
+  return result;
+}
 
-  // set indexes of array to corresponding integer values
-  timeArr[0] = hoursNum;
-  timeArr[1] = minutesNum;
-  timeArr[2] = secondsNum;
+/*
+   Name: backupClose
+   Purpose: Finish what the run writes, the -f archive or its volumes.
+   Parameters: none
+   return: 1 on success, -1 on failure
+*/
+int backupClose(void) {
+  if (volumes.count > 0) {
+    return volumeFinish(&volumes);
+  }
+  compressStop(&compressor);
+  return archiveClose(&archive);
+}
 
-  return timeArr;
+/*
+   Name: parseSize
+   Purpose: Read a byte count with an optional K, M or G suffix.
+   Parameters: const char* str, uint64_t* size: set on success
+   return: 1 on success, -1 if str is not a positive size
+*/
+int parseSize(const char* str, uint64_t* size) {
+  char* end;
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+  int shift = 0;
+  switch (*end) {
+    case 'K': case 'k': shift = 10; end++; break;
+    case 'M': case 'm': shift = 20; end++; break;
+    case 'G': case 'g': shift = 30; end++; break;
+  }
+  if (errno != 0 || end == str || *end != '\0' || value == 0
+      || value > (UINT64_MAX >> shift)) {
+    return -1;
+  }
+  *size = (uint64_t) value << shift;
+  return 1;
 }
 
 /*
-   Name: convertCalToArr
-   Purpose: Takes in the calendar string YYYY-MM-DD and outputs an array of ints
-			[YYYY, MM, DD]
-				   
-			Parameters: char* cal
-   return: return array of integers (calArr)
+   Name: volumePrefix
+   Purpose: Find where the volumes of a -V run land relative to the backup
+            root, so the scanner can leave them out.
+   Parameters: size_t* len: set to the length of the prefix
+   return: malloc'd "dir/archive." relative to rootDir, NULL if the volumes
+           are written outside of it
 */
-int* convertCalToArr(char* cal) {
-  int* calArr = malloc(3);
-  
-  // define year string
-  char year[5] = {
-    cal[0],
-    cal[1],
-    cal[2],
-    cal[3],
-    '\0'
-  };
-  // define month string
-  char month[3] = {
-    cal[5],
-    cal[6],
-    '\0'
-  };
-  // define day string
-  char day[3] = {
-    cal[8],
-    cal[9],
-    '\0'
-  };
-  // convert each string into an integer
-  int yearNum = convertStrToNum(year);
-  int monthNum = convertStrToNum(month);
-  int dayNum = convertStrToNum(day);
-  
-  // set relevant indexes to corresponding integer values
-  calArr[0] = yearNum;
-  calArr[1] = monthNum;
-  calArr[2] = dayNum;
+char* volumePrefix(size_t* len) {
+  char root[PATH_MAX];
+  char dir[PATH_MAX];
+  char* copy = strdup(archiveFile);
+  char* prefix = NULL;
+  if (copy != NULL && realpath(rootDir, root) != NULL
+      && realpath(dirname(copy), dir) != NULL) {
+    size_t rootLen = strcmp(root, "/") == 0 ? 0 : strlen(root);
+    if (strncmp(dir, root, rootLen) == 0
+        && (dir[rootLen] == '\0' || dir[rootLen] == '/')) {
+      const char* base = strrchr(archiveFile, '/');
+      base = base != NULL ? base + 1 : archiveFile;
+      const char* sub = dir[rootLen] == '/' ? dir + rootLen + 1 : "";
+      *len = strlen(sub) + (*sub != '\0') + strlen(base) + 1;
+      prefix = malloc(*len + 1);
+      if (prefix != NULL) {
+        snprintf(prefix, *len + 1, "%s%s%s.", sub, *sub != '\0' ? "/" : "",
+                 base);
+      }
+    }
+  }
+  free(copy);
+  return prefix;
+}
 
-  return calArr;
+/*
+   Name: journalPathOk
+   Purpose: Check that a journal path names something below the root: not
+            empty, not absolute, no empty, "." or ".." component.
+   Parameters: const char* path, uint32_t len
+   return: 1 if usable, 0 if not
+*/
+static int journalPathOk(const char* path, uint32_t len) {
+  if (len == 0 || len >= PATH_MAX) {
+    return 0;
+  }
+  size_t at = 0;
+  while (at <= len) {
+    size_t end = at;
+    while (end < len && path[end] != '/') {
+      end++;
+    }
+    if (end == at || memchr(path + at, '\0', end - at) != NULL
+        || (end - at == 1 && path[at] == '.')
+        || (end - at == 2 && path[at] == '.' && path[at + 1] == '.')) {
+      return 0;
+    }
+    at = end + 1;
+  }
+  return 1;
 }
 
+/*
+   Name: compareJournalPaths
+   Purpose: qsort() comparator ordering journal paths like the catalog.
+   Parameters: const void* a, const void* b: struct journalPath*
+   return: <0, 0 or >0
+*/
+static int compareJournalPaths(const void* a, const void* b) {
+  const struct journalPath* pa = a;
+  const struct journalPath* pb = b;
+  return comparePaths(pa -> path, pa -> len, pb -> path, pb -> len);
+}
 
 /*
-   Name: t1GTt2
-   Purpose: Compares two strings that are of the format:
-			YYYY-MM-DD hh:mm:ss
-			and returns 1 if t1 is greater than t2 else prints 0
-			
-			Parameters: string t1 of size 21, string t2 of size 21
-   return: return 1 if t1 is greater and 0 if not
+   Name: journalOpen
+   Purpose: Map the -J journal and collect the distinct paths recorded since
+            the previous run started scanning, less JOURNAL_SLACK. The
+			journal is only trusted if the previous catalog says when that
+			was, backupwatch is still recording into it, it watches this
+			root, was recording by then and has lost no events since.
+   Parameters: struct changeJournal* jn: filled in,
+               const char* path: journal file, int rootFd: backup root
+   return: 1 if the journal can stand in for the walk, -1 if not (the
+           reason is printed and the whole tree is walked)
 */
-int t1GTt2(char t1[21], char t2[21]) {
-  char* t2Copy = malloc(48);
-  strcpy(t2Copy, t2);
+int journalOpen(struct changeJournal* jn, const char* path, int rootFd) {
+  const char* why = NULL;
+  struct stat info;
+  struct stat rootInfo;
+  void* map = MAP_FAILED;
+  int64_t since = prevCatalog.scanStartNs;
 
-  const char split[2] = " ";
-  
-  // split the two strings into respective YYYY-MM-DD and hh:mm:ss
-  // as seperate strings
-  
-  char* t1Cal = strtok(t1, split); // t1 YYYY-MM-DD
-  char* t1Time = strtok(NULL, split); // t1 hh:mm:ss
-  
-  char* t2Cal = strtok(t2Copy, split); // t2 YYYY-MM-DD
-  char* t2Time = strtok(NULL, split); // t2 hh:mm:ss
-  
-  // convert the strings to arrays of numbers
-  // index mapping: calendar: [YYYY, MM, DD]
-  // index mapping: time: [hh, mm, ss]
-  
-  // t1
-  int* t1CalArr = convertCalToArr(t1Cal); 
-  int* t1TimeArr = convertTimeToArr(t1Time);
+  memset(jn, 0, sizeof(*jn));
+  int fd = open(path, O_RDONLY);
+  if (prevCatalog.map == NULL || since == 0) {
+    why = "the catalog does not say when the last run started";
+  } else if (fd != -1 && flock(fd, LOCK_SH | LOCK_NB) == 0) {
+    // backupwatch holds an exclusive lock for as long as it records
+    why = "backupwatch is not running";
+  } else if (fd == -1 || fstat(fd, &info) == -1
+             || info.st_size < JOURNAL_HEADER_SIZE
+             || (map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd,
+                            0)) == MAP_FAILED) {
+    why = "it could not be read";
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  const unsigned char* base = map;
+  if (why == NULL && (memcmp(base, JOURNAL_MAGIC, 8) != 0
+                      || getLE32(base + 8) > JOURNAL_VERSION)) {
+    why = "it is not a journal";
+  }
+  if (why == NULL && (fstat(rootFd, &rootInfo) == -1
+                      || getLE64(base + 16) != (uint64_t) rootInfo.st_dev
+                      || getLE64(base + 24) != (uint64_t) rootInfo.st_ino)) {
+    why = "it watches another directory";
+  }
+  if (why == NULL && (int64_t) getLE64(base + 32) > since) {
+    why = "it started recording after the last run";
+  }
+  if (why == NULL && (int64_t) getLE64(base + 40) >= since - JOURNAL_SLACK) {
+    why = "events were lost since the last run";
+  }
 
-  // t2
-  int* t2CalArr = convertCalToArr(t2Cal);
-  int* t2TimeArr = convertTimeToArr(t2Time);
+  // a record still being appended at the end is left for the next run
+  uint64_t off = JOURNAL_HEADER_SIZE;
+  size_t capacity = 0;
+  while (why == NULL && off + JOURNAL_RECORD_SIZE <= (uint64_t) info.st_size) {
+    int64_t timeNs = (int64_t) getLE64(base + off);
+    uint32_t len = getLE32(base + off + 8);
+    const char* name = (const char*) base + off + JOURNAL_RECORD_SIZE;
+    if (len > info.st_size - off - JOURNAL_RECORD_SIZE) {
+      break;
+    }
+    off += JOURNAL_RECORD_SIZE + len;
+    if (timeNs < since - JOURNAL_SLACK || journalPathOk(name, len) == 0) {
+      continue;
+    }
+    if (jn -> count == capacity) {
+      capacity = capacity == 0 ? 1024 : capacity * 2;
+      struct journalPath* grown = realloc(jn -> paths,
+                                          capacity * sizeof(*grown));
+      if (grown == NULL) {
+        why = "out of memory";
+        break;
+      }
+      jn -> paths = grown;
+    }
+    jn -> paths[jn -> count].path = name;
+    jn -> paths[jn -> count].len = len;
+    jn -> count++;
+  }
+  if (why != NULL) {
+    printf("Journal %s not used, %s: walking the whole tree\n", path, why);
+    free(jn -> paths);
+    if (map != MAP_FAILED) {
+      munmap(map, info.st_size);
+    }
+    memset(jn, 0, sizeof(*jn));
+    return -1;
+  }
 
-  // t1 year > t2 year
-  if (t1CalArr[0] > t2CalArr[0]) { 
-    return 1;
-	          // assume year equal, t1 month > t2 month
-  } else if (t1CalArr[0] == t2CalArr[0] && t1CalArr[1] > t2CalArr[1]) { 
-    return 1;
-	         // assume year and month equal, t1 monthday > t2 monthday
-  } else if (t1CalArr[0] == t2CalArr[0] && t1CalArr[2] > t2CalArr[2]) { 
-    return 1;
-	         //assume the calendar strings are equal, now compare time str
-  } else if (t1CalArr[0] == t2CalArr[0] && t1CalArr[1] == t2CalArr[1] 
-             && t1CalArr[2] == t2CalArr[2]) {
-	     // t1 hour > t2 hour
-	if (t1TimeArr[0] > t2TimeArr[0]) {
-	  return 1;
-	            // assume hours equal, t1 minute > t2 minute
-	} else if (t1TimeArr[0] == t2TimeArr[0] && t1TimeArr[1] > t2TimeArr[1]) {
-	  return 1;
-	            // assume hours and minutes equal, t1 seconds > t2 seconds
-	} else if (t1TimeArr[0] == t2TimeArr[0] && t1TimeArr[1] == t2TimeArr[1] 
-	           && t1TimeArr[2] > t2TimeArr[2]) {
-	  return 1;
-	}
+  qsort(jn -> paths, jn -> count, sizeof(struct journalPath),
+        compareJournalPaths);
+  size_t distinct = 0;
+  for (size_t i = 0; i < jn -> count; i++) {
+    if (distinct == 0 || compareJournalPaths(&jn -> paths[distinct - 1],
+                                             &jn -> paths[i]) != 0) {
+      jn -> paths[distinct++] = jn -> paths[i];
+    }
   }
+  jn -> count = distinct;
+  jn -> map = base;
+  jn -> mapLen = info.st_size;
+  printf("Journal %s: %zu paths changed since the last run\n", path,
+         jn -> count);
+  return 1;
+}
 
-  return 0;
+/*
+   Name: journalClose
+   Purpose: Release what journalOpen() mapped and allocated.
+   Parameters: struct changeJournal* jn
+   return: void
+*/
+void journalClose(struct changeJournal* jn) {
+  if (jn -> map != NULL) {
+    munmap((void*) jn -> map, jn -> mapLen);
+  }
+  free(jn -> paths);
+  memset(jn, 0, sizeof(*jn));
 }
+
 /*
-   Name: fileInfo
-   Purpose: Given all information retrieved from the file, present it in a 
-		    format that of ls -l:
-			[permissionString links username groupname size date time filename]
-			Parameters: char* name: Name of the file
-						char* time: formatted time string (from formatTime())
-									it is most recent modification time of the
-									file
-						int links: No of links to the file
-						char* userName: User who created the file
-						char* groupName: The group the file belongs to
-						char* permissions: Permission string from 
-											getPermissions()
-						int size: Size of the file in bytes
-   return: char* of size 10 representing the permission format of ls -l
-*/
-char* fileInfo(char* name, char* time, int links, char* userName,
-  char* groupName, char* permissions, int size) {
-  char* fileInfo = malloc(INFOSTR_SIZE);
-
-  snprintf(fileInfo, INFOSTR_SIZE, "%s %2d %s %10s %8d %12s %s",
-    permissions, links, userName, groupName,
-    size, time, name);
-
-  return fileInfo;
-}
-/*
-   Name: readDir
-   Purpose: Given a directory, the subroutine determines all files that exist
-			in the directory and retrieves the following information:
-			- Name of file
-			- Latest modification time of file
-			- Size of file
-			- No of links to file
-			- username who created the file
-			- groupname the file belongs to
-			- permissions of the file
-			It them displays the information using fileInfo(). 
-			
-			Parameters: Directory to traverse
-   return: return 0 on success
+   Name: backupTree
+   Purpose: Back up the tree below rootDir. scanThreads threads walk the
+            tree in parallel, keeping only entries that pass the change
+			predicate or differ from the previous catalog, while the calling
+			thread archives what they find. With -C the live catalog is then
+			diffed against the previous one for deletions and written out.
+   Parameters: struct archiveWriter* w: archive to write to
+   return: 1 on success, -1 on failure
 */
-int readDir(const char* dir) {
+int backupTree(struct archiveWriter* w) {
+  struct scanner sc;
+  struct stat archiveInfo;
+  struct changeJournal journal;
+  struct timespec now;
+
+  // anything changed from here on is the next run's business
+  clock_gettime(CLOCK_REALTIME, &now);
+  scanStartNs = timespecToNs(&now);
+  memset(&sc, 0, sizeof(sc));
+  sc.rootFd = open(rootDir, O_RDONLY | O_DIRECTORY);
+  if (sc.rootFd == -1 || fstat(w -> fd, &archiveInfo) == -1) {
+    printf("Error in backupTree: Could not open %s\n", rootDir);
+    return -1;
+  }
+  int useJournal = journalFile != NULL
+                   && journalOpen(&journal, journalFile, sc.rootFd) == 1;
+  sc.journal = useJournal ? &journal : NULL;
+  sc.archiveDev = archiveInfo.st_dev;
+  sc.archiveIno = archiveInfo.st_ino;
+  if (volumes.count > 0) {
+    sc.volumePrefix = volumePrefix(&sc.volumePrefixLen);
+    volumes.rootFd = sc.rootFd;
+    for (int i = 0; i < volumes.count; i++) {
+      pthread_create(&volumes.writers[i].tid, NULL, volumeWorker,
+                     &volumes.writers[i]);
+    }
+  }
+  sc.threads = scanThreads > 0 ? scanThreads : 1;
+  sc.running = sc.threads + useJournal;
+  sc.deques = calloc(sc.threads, sizeof(struct scanDeque));
+  sc.lists = calloc(sc.threads + 1, sizeof(struct catalogList));
+  struct scanThreadArg* args = calloc(sc.threads + 1,
+                                      sizeof(struct scanThreadArg));
+  pthread_t* tids = calloc(sc.threads + 1, sizeof(pthread_t));
+  if (sc.deques == NULL || sc.lists == NULL || args == NULL
+      || tids == NULL) {
+    printf("Error in backupTree: Out of memory\n");
+    return -1;
+  }
+  pthread_mutex_init(&sc.idleLock, NULL);
+  pthread_cond_init(&sc.workCond, NULL);
+  pthread_mutex_init(&sc.queueLock, NULL);
+  pthread_cond_init(&sc.queueFilled, NULL);
+  pthread_cond_init(&sc.queueDrained, NULL);
+  for (int i = 0; i < sc.threads; i++) {
+    pthread_mutex_init(&sc.deques[i].lock, NULL);
+  }
+  // with a journal the scanners wait for the directories it hands them
+  if (useJournal) {
+    atomic_fetch_add(&sc.pending, 1);
+    args[sc.threads].sc = &sc;
+    args[sc.threads].id = sc.threads;
+    pthread_create(&tids[sc.threads], NULL, journalWorker,
+                   &args[sc.threads]);
+  } else {
+    scanPush(&sc, 0, strdup(""));
+  }
+  for (int i = 0; i < sc.threads; i++) {
+    args[i].sc = &sc;
+    args[i].id = i;
+    pthread_create(&tids[i], NULL, scanWorker, &args[i]);
+  }
 
-  // declare a pointer to the directory argument
-  DIR * directPoint = opendir(dir);
+  // small files are read ahead through io_uring when it is available
+  // and nothing else needs their descriptor
+  unsigned char* arena = NULL;
+  struct prefetchFile files[URING_DEPTH];
+  if (readRing.fd != -1 && w -> compressor == NULL) {
+    arena = malloc(PREFETCH_BYTES);
+  }
 
-  // if unable to read the directory exit
-  if (directPoint == NULL) {
-    printf("Error in readDir: Could not open directory");
-    return -1;
-  }
-
-  // dirent struct provides file name information and determines whether
-  // the file pointer is actually pointing to a file
-  struct dirent * entry;
-    
-  // open backup
-  //int backup = open(archiveFile, O_WRONLY|O_CREAT, S_IRWXU);
-  FILE *fp;   
-  // iterate through the directory until the directory pointer sees no file left
-  // in the directory
-  while ((entry = readdir(directPoint)) != NULL) {
-    fp = fopen(archiveFile, "a");
-    struct stat fileData; // to retrieve user ids, group ids and mod times
-    // for a given file
-    char buffer[BUFFER_SIZE]; // declare a string that stores the current
-    // file being looked at
-    char path[1024]; // declare a string that stores the absolute
-    // path of the current file being looked at
-
-    strcpy(path, dir);
-    strcat(path, "/%s");
-    snprintf(buffer, BUFFER_SIZE, path, entry -> d_name);
-
-    stat(buffer, & fileData); // accesses a struct that contains information
-    // for the current file stored in the buffer
-
-    // determines whether the current file is newer than the cut off time
-    if (t1GTt2(formatTimeStr(fileData.st_mtime), timeLimit) == 1
-        && strcmp(buffer, archiveFile) != 0) {
-      // Retrieve/store information for given file			 
-      char* name = entry -> d_name; // Name of file/directory
-      char* time = formatTime(fileData.st_mtime); // last modification time 
-      //of file
-      int size = fileData.st_size; // Size of file in bytes
-      int noOfLinks = fileData.st_nlink; // Number of links to file
-      char* userName = getUserName(fileData.st_uid); // User who created file
-      char* groupName = getGroupName(fileData.st_gid); // Group file belongs 
-      //to
-      char* permissions = getPermissions(fileData.st_mode); // Permission 
-      //string
-	// write file to backup
-      writeFileToBackup(buffer, fp, name, fileData.st_mode, permissions, \
-                        formatTimeStr(fileData.st_mtime), size);
-    }
-  }
-
-  // clear memory
-  closedir(directPoint);
-  return 0;
+  int result = 1;
+  struct scanBatch* batch;
+  while ((batch = scanNext(&sc)) != NULL) {
+    // -V: the volume writers archive the batch and free it
+    if (volumes.count > 0) {
+      volumeDispatch(&volumes, batch);
+      continue;
+    }
+    size_t first = 0;
+    size_t end = 0;
+    for (size_t i = 0; i < batch -> count; i++) {
+      if (arena != NULL && i == end) {
+        first = i;
+        uint64_t started = metricNow();
+        end = prefetchWindow(sc.rootFd, batch, first, arena, files);
+        metricTime(PHASE_PREFETCH, started);
+      }
+      struct stat* fileData = &batch -> entries[i].st;
+      char* path = batch -> arena + batch -> entries[i].pathOff;
+      struct prefetchFile* pre = arena != NULL && files[i - first].data
+                                 != NULL ? &files[i - first] : NULL;
+
+      // a file that vanished or is unreadable does not end the backup,
+      // only a failing archive does
+      // the catalog record collects the digest and delta signature
+      struct catalogRecord* rec = batch -> entries[i].rec;
+      uint64_t started = metricNow();
+      int written = writeFileToBackup(sc.rootFd, path, w, fileData, rec,
+                                      pre);
+      metricTime(PHASE_ENTRY, started);
+      metricCount(written == 1 ? COUNT_ARCHIVED : COUNT_FAILED, 1);
+      if (written == -1 && w -> failed) {
+        result = -1;
+      } else if (written == -1) {
+        catalogForget(rec);
+      }
+    }
+    free(batch);
+  }
+  free(arena);
+  if (volumes.count > 0) {
+    result = volumeDrain(&volumes);
+  }
+  // blocks of the last files are still in the compressor
+  else if (result == 1 && w -> compressor != NULL
+      && compressFlush(w -> compressor, w) == -1) {
+    result = -1;
+  }
+
+  for (int i = 0; i < sc.threads + useJournal; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  for (int i = 0; i < sc.threads; i++) {
+    free(sc.deques[i].dirs);
+  }
+  if (catalogFile != NULL && result == 1) {
+    uint64_t started = metricNow();
+    result = sc.failed ? -1 : catalogFinish(sc.lists,
+                                            sc.threads + useJournal,
+                                            &prevCatalog, catalogFile, w);
+    metricTime(PHASE_CATALOG, started);
+  }
+  for (int i = 0; i < sc.threads + 1; i++) {
+    catalogFree(&sc.lists[i]);
+  }
+  if (useJournal) {
+    journalClose(&journal);
+  }
+  free(sc.lists);
+  free(sc.deques);
+  free(sc.volumePrefix);
+  free(args);
+  free(tids);
+  close(sc.rootFd);
+  return result;
 }
+
+// names of the -m phases and counters, indexed by PHASE_* and COUNT_*
+static const char* phaseNames[PHASE_COUNT] = {
+  "readdir", "stat", "open", "read", "prefetch", "hash", "copy", "write",
+  "compress", "owner_lookup", "entry", "catalog", "restore_file",
+  "restore_range", "fiemap"
+};
+static const char* countNames[COUNT_COUNT] = {
+  "dirs_scanned", "entries_scanned", "entries_selected", "skipped_cutoff",
+  "skipped_unchanged", "entries_archived", "entries_failed", "bytes_read",
+  "bytes_written", "files_restored", "bytes_restored"
+};
+
 /*
-   Name: traverse
-   Purpose: Navigates through the directory tree, distinguishing between file
-			and directory and then performs the readDir() routine for each
-			directory in the hierarchy. 
-		
-			Parameters: const char *fpath: File path to start from
-			            const struct stat *sb: Access information to determine
-						 whether directory or not
-						int tflag: 
-						FTW *ftwbuf: To determine the current file being looked
-						             at in the hierarchy
-   return: returns 0 to tell the nftw subroutine to keep searching the tree
+   Name: metricsWrite
+   Purpose: Sum the metricSet of every thread and write the totals to the
+            -m file: in the Prometheus text format when its name ends in
+			.prom (for node_exporter's textfile collector, histograms
+			cumulative), as JSON otherwise (only buckets that were hit,
+			keyed by their upper bound in nanoseconds). The file is written
+			under a temporary name and renamed, so a collector never reads
+			half of it. Runs once every thread has been joined.
+   Parameters: const char* path: the -m file
+               int ok: 1 if the run succeeded
+   return: 1 on success, -1 if the file could not be written
 */
-static int traverse(const char* fpath,
-  const struct stat *fileInfo,
-    int tflag, struct FTW *ftwbuf) {
-  // Determine if file is a direcetory
-  if (S_ISDIR(fileInfo -> st_mode) == 1) {
-    // char* workDir = malloc(BUFFER_DIR);
-    // Change current directory 
-    chdir(fpath + ftwbuf -> base);
-    printf("%s\n", fpath);
+int metricsWrite(const char* path, int ok) {
+  struct metricSet total;
+  int threads = 0;
+  const char* mode = restoreMode ? "restore" : listMode ? "list" : "backup";
+  double runSeconds = (double) (metricNow() - metricsStart) / 1e9;
 
-    // Output information of all files in given directory
-    if ((readDir(fpath)) == -1) {
-      perror("Couldn't read directory");
-      return -1;
+  memset(&total, 0, sizeof(total));
+  while (metricSets != NULL) {
+    struct metricSet* set = metricSets;
+    for (int c = 0; c < COUNT_COUNT; c++) {
+      total.counts[c] += set -> counts[c];
+    }
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      total.phaseNs[p] += set -> phaseNs[p];
+      total.phaseCalls[p] += set -> phaseCalls[p];
+      for (int b = 0; b < METRIC_BUCKETS; b++) {
+        total.buckets[p][b] += set -> buckets[p][b];
+      }
     }
+    metricSets = set -> next;
+    free(set);
+    threads++;
   }
+  threadMetrics = NULL;
 
-  return 0;
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE* out = fopen(tmp, "w");
+  if (out == NULL) {
+    printf("Error in metricsWrite: Could not create %s\n", tmp);
+    return -1;
+  }
+  size_t len = strlen(path);
+  if (len > 5 && strcmp(path + len - 5, ".prom") == 0) {
+    fprintf(out, "# HELP backup_run_seconds Wall time of the run.\n");
+    fprintf(out, "# TYPE backup_run_seconds gauge\n");
+    fprintf(out, "backup_run_seconds{mode=\"%s\"} %.6f\n", mode,
+            runSeconds);
+    fprintf(out, "# HELP backup_run_success 1 if the run succeeded.\n");
+    fprintf(out, "# TYPE backup_run_success gauge\n");
+    fprintf(out, "backup_run_success{mode=\"%s\"} %d\n", mode, ok == 1);
+    fprintf(out, "# HELP backup_run_timestamp_seconds When the run ended.\n");
+    fprintf(out, "# TYPE backup_run_timestamp_seconds gauge\n");
+    fprintf(out, "backup_run_timestamp_seconds{mode=\"%s\"} %lld\n", mode,
+            (long long) time(NULL));
+    fprintf(out, "# HELP backup_threads Threads that recorded metrics.\n");
+    fprintf(out, "# TYPE backup_threads gauge\n");
+    fprintf(out, "backup_threads{mode=\"%s\"} %d\n", mode, threads);
+    for (int c = 0; c < COUNT_COUNT; c++) {
+      fprintf(out, "# TYPE backup_%s_total counter\n", countNames[c]);
+      fprintf(out, "backup_%s_total{mode=\"%s\"} %llu\n", countNames[c],
+              mode, (unsigned long long) total.counts[c]);
+    }
+    fprintf(out, "# HELP backup_phase_seconds Time spent in each phase.\n");
+    fprintf(out, "# TYPE backup_phase_seconds histogram\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      uint64_t below = 0;
+      for (int b = 0; b < METRIC_BUCKETS - 1; b++) {
+        below += total.buckets[p][b];
+        fprintf(out, "backup_phase_seconds_bucket{mode=\"%s\",phase=\"%s\","
+                "le=\"%.9g\"} %llu\n", mode, phaseNames[p],
+                (double) (1ULL << b) / 1e9, (unsigned long long) below);
+      }
+      fprintf(out, "backup_phase_seconds_bucket{mode=\"%s\",phase=\"%s\","
+              "le=\"+Inf\"} %llu\n", mode, phaseNames[p],
+              (unsigned long long) total.phaseCalls[p]);
+      fprintf(out, "backup_phase_seconds_sum{mode=\"%s\",phase=\"%s\"} "
+              "%.9f\n", mode, phaseNames[p],
+              (double) total.phaseNs[p] / 1e9);
+      fprintf(out, "backup_phase_seconds_count{mode=\"%s\",phase=\"%s\"} "
+              "%llu\n", mode, phaseNames[p],
+              (unsigned long long) total.phaseCalls[p]);
+    }
+  } else {
+    fprintf(out, "{\"mode\": \"%s\", \"success\": %s, ", mode,
+            ok == 1 ? "true" : "false");
+    fprintf(out, "\"run_seconds\": %.6f, \"finished\": %lld, "
+            "\"threads\": %d,\n", runSeconds, (long long) time(NULL),
+            threads);
+    fprintf(out, "  \"counters\": {");
+    for (int c = 0; c < COUNT_COUNT; c++) {
+      fprintf(out, "%s\n    \"%s\": %llu", c > 0 ? "," : "",
+              countNames[c], (unsigned long long) total.counts[c]);
+    }
+    fprintf(out, "\n  },\n  \"phases\": {");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      fprintf(out, "%s\n    \"%s\": {\"calls\": %llu, \"seconds\": %.9f, "
+              "\"histogram_ns\": {", p > 0 ? "," : "", phaseNames[p],
+              (unsigned long long) total.phaseCalls[p],
+              (double) total.phaseNs[p] / 1e9);
+      int first = 1;
+      for (int b = 0; b < METRIC_BUCKETS; b++) {
+        if (total.buckets[p][b] == 0) {
+          continue;
+        }
+        if (b < METRIC_BUCKETS - 1) {
+          fprintf(out, "%s\"%llu\": %llu", first ? "" : ", ",
+                  1ULL << b, (unsigned long long) total.buckets[p][b]);
+        } else {
+          fprintf(out, "%s\"+Inf\": %llu", first ? "" : ", ",
+                  (unsigned long long) total.buckets[p][b]);
+        }
+        first = 0;
+      }
+      fprintf(out, "}}");
+    }
+    fprintf(out, "\n  }\n}\n");
+  }
+  if (fclose(out) != 0 || rename(tmp, path) == -1) {
+    printf("Error in metricsWrite: Could not write %s\n", path);
+    unlink(tmp);
+    return -1;
+  }
+  return 1;
 }
 /*
    Name: isValidTime
@@ -705,8 +8342,14 @@ int isValidTime(char* time) {
 				   to get the modification time of this. 
 				   If the file doesn't exist it will exit and print an error 
 				   message.
-			If no filename or timestring is provided it will use the default
-			1970-01-01 00:00:00 cutoff time
+			If no filename or timestring is provided there is no cut off and
+			everything is backed up. With -C <catalog> an existing catalog
+			from the previous run decides what is selected instead of the
+			cut off, which then only applies to the first run. -J <journal>
+			narrows that comparison to the paths backupwatch recorded
+			since the previous run. -c additionally selects files whose
+			ctime is after the cut off. The result is compiled into the
+			change predicate once, here.
 			
 			The last argument HAS to be a directory to read
 			
@@ -718,23 +8361,59 @@ int isValidTime(char* time) {
 */
 int commandLineSwitch(char* argv [], int sizeOfArgs) {
 	
-	char* time = "1970-01-01 00:00:00"; 
+	int64_t cutoffNs = INT64_MIN; // no cut off, everything is selected
+	int useCtime = 0;
 	char* directory = "."; 
 	char* file;
+	const struct codec* codec = NULL;
 
 
 	for(int i = 1; i < sizeOfArgs; i++) { 
 	  if(strcmp(argv[i], "-h") == 0) {
 	    printf("\n");
-	    printf("Switches: -t | -h (can appear in any order\n");
+	    printf("Switches: -t | -c | -C | -d | -D | -z | -f | -r | -l | -p | -j | -V | -O | -m | -J | -h (can appear in any order\n");
   	    printf("-t <filename|time> used to set last modification time\n"); 
 	    printf("filename gets last modification time of file\n");
 	    printf("time format YYYY-MM-DD hh:mm:ss to set cut off time\n");
-	    printf("If no filename or time is present, it will use default \
-		   1970-01-01 00:00:00\n");
+	    printf("If no filename or time is present, everything is backed up\n");
+	    printf("-c also select files whose ctime is newer than the cut off\n");
+	    printf("-f <archive> file the binary backup archive is written to\n");
+	    printf("-r restore the -f archive (- for stdin) into the directory\n");
+	    printf("-l list the entries of the -f archive like ls -l\n");
+	    printf("-p <path> with -r, restore only path (and what is below\n");
+	    printf("   it) or entries matching the pattern; may be repeated\n");
+	    printf("-j <threads> number of directory scanner and hashing threads,\n");
+	    printf("   and of restore workers\n");
+	    printf("-C <catalog> select files that differ from the catalog of\n");
+	    printf("   the last run, record deletions and update the catalog\n");
+	    printf("-J <journal> with -C, visit only the paths backupwatch\n");
+	    printf("   recorded since the last run instead of the whole tree\n");
+	    printf("-d with -C, store changed large files as block deltas against\n");
+	    printf("   the previous run; restore the archives in order\n");
+	    printf("-D store large files as deduplicated content defined chunks\n");
+	    printf("-z <codec> compress file contents with");
+	    for (const struct codec* c = codecs; c -> name != NULL; c++) {
+	      printf(" %s", c -> name);
+	    }
+	    if (codecs[0].name == NULL) {
+	      printf(" (none built in, see -DHAVE_ZSTD\n");
+	      printf("   -DHAVE_LZ4 -DHAVE_ZLIB in the README)");
+	    }
+	    printf("\n");
+	    printf("   files stored sparse, as deltas (-d) or as chunks (-D)\n");
+	    printf("   are not compressed\n");
+	    printf("-V <size> split the archive into volumes <archive>.000,\n");
+	    printf("   .001, ... of at most size bytes (K, M or G), written in\n");
+	    printf("   parallel; each volume restores on its own\n");
+	    printf("-O <order> read the files of a directory in inode order\n");
+	    printf("   (inode, the default), by disk position (extent) or as\n");
+	    printf("   listed (none)\n");
+	    printf("-m <file> write counters and phase timings of the run to\n");
+	    printf("   file, as JSON or, for a name ending in .prom, in the\n");
+	    printf("   Prometheus text format\n");
 	    printf("-h displays this current message\n");
 	    printf("Last command must be the directory to look at\n");
-	    printf("Example format: ./backupfiles -t -h .\n");
+	    printf("Example format: ./backup -f backup.arc -t -h .\n");
 	     return 1;
 	  }
 	  if(strcmp(argv[i], "-t") == 0 &&\
@@ -742,19 +8421,39 @@ int commandLineSwitch(char* argv [], int sizeOfArgs) {
 	     strcmp(argv[i+1], "-f") != 0 && i != sizeOfArgs-2) { 
 			
 	     if(isValidTime(argv[i+1]) == 1) { 
-               time = argv[i+1];
+	       if(parseTime(argv[i+1], &cutoffNs) == -1) {
+	         printf("Error in commandLineSwitch: Invalid time\n");
+	         return -1;
+	       }
 	     } else { // else it is filename
 	        file = realpath(argv[i+1], NULL); 
 	     	if(file == NULL) { 
 	          printf("Error in commandLineSwitch: No such file\n"); 
 	          return -1;
 	        }
-		// get modification time of file
+		// get modification time of file, to the nanosecond
 		struct stat fileInfo; 
 		stat(file, &fileInfo); 
-		time = formatTimeStr(fileInfo.st_mtime);
+		cutoffNs = timespecToNs(&fileInfo.st_mtim);
 		}
 	     }
+	  if(strcmp(argv[i], "-c") == 0) {
+	     useCtime = 1;
+	  }
+	  if(strcmp(argv[i], "-C") == 0) {
+	     if(i >= sizeOfArgs - 2) {
+	        printf("Error in commandLineSwitch: Please put a file after -C\n");
+		return -1;
+	     }
+	     catalogFile = argv[i+1];
+	  }
+	  if(strcmp(argv[i], "-J") == 0) {
+	     if(i >= sizeOfArgs - 2) {
+	        printf("Error in commandLineSwitch: Please put a file after -J\n");
+		return -1;
+	     }
+	     journalFile = argv[i+1];
+	  }
           if(strcmp(argv[i], "-f") == 0) {
 	     if(i == sizeOfArgs -2) {
 	        printf("Error in commandLineSwitch: Please put a file after -f");
@@ -763,6 +8462,110 @@ int commandLineSwitch(char* argv [], int sizeOfArgs) {
 	     archiveFile = argv[i+1];
 	     
 	  }	
+	  if(strcmp(argv[i], "-r") == 0) {
+	     restoreMode = 1;
+	  }
+	  if(strcmp(argv[i], "-l") == 0) {
+	     listMode = 1;
+	  }
+	  if(strcmp(argv[i], "-D") == 0) {
+	     dedupMode = 1;
+	  }
+	  if(strcmp(argv[i], "-d") == 0) {
+	     deltaMode = 1;
+	  }
+	  if(strcmp(argv[i], "-z") == 0) {
+	     if(i >= sizeOfArgs - 2) {
+	        printf("Error in commandLineSwitch: Please put a codec after -z\n");
+		return -1;
+	     }
+	     codec = findCodec(argv[i+1], 0);
+	     if(codec == NULL && codecs[0].name == NULL) {
+	        printf("Error in commandLineSwitch: No codec is built in, build"
+		       " with -DHAVE_ZSTD -lzstd, -DHAVE_LZ4 -llz4 or"
+		       " -DHAVE_ZLIB -lz\n");
+		return -1;
+	     }
+	     if(codec == NULL) {
+	        printf("Error in commandLineSwitch: Codec %s is not built in,"
+		       " this build has", argv[i+1]);
+	        for (const struct codec* c = codecs; c -> name != NULL; c++) {
+	          printf(" %s", c -> name);
+	        }
+	        printf("\n");
+		return -1;
+	     }
+	  }
+	  if(strcmp(argv[i], "-j") == 0) {
+	     if(i >= sizeOfArgs - 2 || atoi(argv[i+1]) <= 0) {
+	        printf("Error in commandLineSwitch: -j needs a thread count\n");
+		return -1;
+	     }
+	     scanThreads = atoi(argv[i+1]);
+	  }
+	  if(strcmp(argv[i], "-p") == 0) {
+	     if(i >= sizeOfArgs - 2) {
+	        printf("Error in commandLineSwitch: Please put a path after -p\n");
+		return -1;
+	     }
+	     if(restorePaths == NULL) {
+	        restorePaths = calloc(sizeOfArgs, sizeof(char*));
+	     }
+	     // archived paths never end in a slash
+	     size_t len = strlen(argv[i+1]);
+	     while(len > 1 && argv[i+1][len-1] == '/') {
+	        argv[i+1][--len] = '\0';
+	     }
+	     restorePaths[restorePathCount++] = argv[i+1];
+	  }
+	  if(strcmp(argv[i], "-V") == 0) {
+	     if(i >= sizeOfArgs - 2 || parseSize(argv[i+1], &volumeLimit) == -1) {
+	        printf("Error in commandLineSwitch: -V needs a volume size\n");
+		return -1;
+	     }
+	  }
+	  if(strcmp(argv[i], "-O") == 0) {
+	     if(i >= sizeOfArgs - 2) {
+	        printf("Error in commandLineSwitch: Please put an order after -O\n");
+		return -1;
+	     }
+	     if(strcmp(argv[i+1], "none") == 0) {
+	        readOrder = ORDER_NONE;
+	     } else if(strcmp(argv[i+1], "inode") == 0) {
+	        readOrder = ORDER_INODE;
+	     } else if(strcmp(argv[i+1], "extent") == 0) {
+	        readOrder = ORDER_EXTENT;
+	     } else {
+	        printf("Error in commandLineSwitch: Unknown order %s\n", argv[i+1]);
+		return -1;
+	     }
+	  }
+	  if(strcmp(argv[i], "-m") == 0) {
+	     if(i >= sizeOfArgs - 2) {
+	        printf("Error in commandLineSwitch: Please put a file after -m\n");
+		return -1;
+	     }
+	     metricsFile = argv[i+1];
+	     metricsStart = metricNow();
+	  }
+	}
+	if(scanThreads == 0) {
+	  scanThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	hashThreads = scanThreads;
+	if(listMode == 1) {
+	  if(archiveFile == NULL) {
+	    printf("Error in commandLineSwitch: Please give an archive with -f\n");
+	    return -1;
+	  }
+	  return listArchive(archiveFile);
+	}
+	if(restoreMode == 1) {
+	  if(archiveFile == NULL) {
+	    printf("Error in commandLineSwitch: Please give an archive with -f\n");
+	    return -1;
+	  }
+	  return writeBackupToDirectory(argv[sizeOfArgs-1]) == -1 ? -1 : 1;
 	}
 	directory = realpath(argv[sizeOfArgs-1], NULL);
 	// test if directory exists
@@ -770,18 +8573,97 @@ int commandLineSwitch(char* argv [], int sizeOfArgs) {
 		 printf("Error in commandLineSwitch: Directory doesn't exist\n");
 		 return -1;
 	}
-        FILE *fp = fopen(archiveFile, "w");
-        fclose(fp); // Delete current backup archive
-	timeLimit = time; 
-	nftw(directory, traverse, 20, FTW_D);
+        if (archiveFile == NULL) {
+	  printf("Error in commandLineSwitch: Please give an archive with -f\n");
+	  return -1;
+	}
+	if (volumeLimit > 0 && deltaMode == 1) {
+	  printf("Error in commandLineSwitch: -d can not be used with -V\n");
+	  return -1;
+	}
+	// Delete current backup archive
+	struct archiveWriter* out = &archive;
+	if (volumeLimit > 0) {
+	  // the rings are not shared between threads, so they stay unset
+	  volumes.limit = volumeLimit;
+	  volumes.count = scanThreads < VOLUME_WRITERS_MAX ? scanThreads
+	                                                   : VOLUME_WRITERS_MAX;
+	  if (volumeStart(&volumes, codec, scanThreads) == -1) {
+	    backupClose();
+	    return -1;
+	  }
+	  out = &volumes.writers[0].archive;
+	} else {
+	  // io_uring when the kernel allows it, synchronous I/O otherwise
+	  uringInit(&readRing, 2 * URING_DEPTH);
+	  uringInit(&writeRing, 4);
+	  if (archiveOpen(&archive, archiveFile) == -1) {
+	    return -1;
+	  }
+	}
+	rootDir = directory;
+	compilePredicate(&predicate, cutoffNs, useCtime);
+	if (catalogFile != NULL && catalogOpen(&prevCatalog, catalogFile) == -1) {
+	  backupClose();
+	  return -1;
+	}
+	if (journalFile != NULL && catalogFile == NULL) {
+	  printf("Error in commandLineSwitch: -J needs a catalog, use -C\n");
+	  backupClose();
+	  return -1;
+	}
+	if (deltaMode == 1) {
+	  if (catalogFile == NULL) {
+	    printf("Error in commandLineSwitch: -d needs a catalog, use -C\n");
+	    backupClose();
+	    return -1;
+	  }
+	  // signatures of this run, unlinked at once so nothing is left over
+	  char spill[PATH_MAX];
+	  snprintf(spill, sizeof(spill), "%s.sigs", catalogFile);
+	  sigSpill = fopen(spill, "w+");
+	  if (sigSpill == NULL) {
+	    printf("Error in commandLineSwitch: Could not create %s\n", spill);
+	    backupClose();
+	    return -1;
+	  }
+	  unlink(spill);
+	  setvbuf(sigSpill, NULL, _IOFBF, WRITER_BUFFER_SIZE);
+	}
+	if (volumes.count == 0 && codec != NULL
+	    && compressStart(&compressor, codec, scanThreads) == -1) {
+	  backupClose();
+	  return -1;
+	}
+	if (volumes.count == 0 && codec != NULL) {
+	  archive.compressor = &compressor;
+	}
+	if (backupTree(out) == -1) {
+	  backupClose();
+	  return -1;
+	}
+	int closed = backupClose();
+	uringFree(&readRing);
+	uringFree(&writeRing);
+	if (closed == -1) {
+	  printf("Error in commandLineSwitch: Could not finish archive\n");
+	  return -1;
+	}
+	if (catalogFile != NULL && catalogCommit(catalogFile) == -1) {
+	  return -1;
+	}
 	
 	return 1;
 }
 int main(int argc, char * argv[]) {
   
-  if ((commandLineSwitch(argv, argc) == -1)) { 
+  int result = commandLineSwitch(argv, argc);
+  // every thread has been joined, so all counters are in
+  if (metricsFile != NULL && metricsWrite(metricsFile, result) == -1) {
+    result = -1;
+  }
+  if (result == -1) { 
 	return EXIT_FAILURE;
   }
-  writeBackupToDirectory(".");
   return EXIT_SUCCESS;
 }
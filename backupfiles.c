@@ -7,7 +7,7 @@
 			specified specified by the user in the command line.
    Version: 1.0
 */
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <stdio.h> 
 #include <time.h> 
 #include <fcntl.h> 
@@ -20,6 +20,7 @@
 #include <grp.h> 
 #include <pwd.h> 
 #include <string.h>
+#include <stdint.h>
 
   // SYMBOLIC CONSTANTS
   #define BUFFER_DIR (1024)
@@ -27,8 +28,20 @@
   #define TIME_SIZE (128)
   #define INFOSTR_SIZE (2048)
 
-// Stores time limit basis to skip nftw
-static char* timeLimit;
+/*
+   Name: changePredicate
+   Purpose: The -t/-c selection rule, compiled once in commandLineSwitch.
+            Times are integer nanoseconds since the epoch so testing an entry
+			is two integer compares with no formatting or parsing per file,
+			correct across month boundaries and to sub-second precision.
+*/
+struct changePredicate {
+  int64_t mtimeCutoffNs; // select entries modified after this
+  int64_t ctimeCutoffNs; // select entries changed after this (-c only)
+};
+
+// selection rule built from -t and -c, used to skip entries during nftw
+static struct changePredicate predicate;
 
 /*
    Name: formatTime
@@ -65,25 +78,6 @@ char* formatTime(time_t t) {
 
   return str;
 }
-/*
-   Name: formatTimeStr
-   Purpose: Turn a generic time_t object into that of the format: 
-            YYYY-MM-DD hh:mm:ss
-			
-   Parameters: time_t t
-   return: str (char*) the formatted string 
-*/
-char* formatTimeStr(time_t t) {
-  char* str = malloc(TIME_SIZE);
-  struct tm timeInfo = *localtime(&t);
-
-  snprintf(str, TIME_SIZE, "%d-%02d-%02d %02d:%02d:%d", timeInfo.tm_year \
-			+ 1900, timeInfo.tm_mon + 1, timeInfo.tm_mday, timeInfo.tm_hour, \
-			timeInfo.tm_min, timeInfo.tm_sec);
-
-  return str;
-}
-
 /*
    Name: getGroupName()
    Purpose: Retrieve the group name that a file belongs too given the ID.
@@ -200,206 +194,75 @@ char* getPermissions(int fileMode) {
 }
 
 /*
-   Name: toPower
-   Purpose: Raises a value to a given exponent and outputs the result. Multiply-
-		    ing the value exponent times. 
-				   
-			Parameters: int val: the value to multiply multiple times (the base)
-			            int ex: the exponent that represents the number of times
-						        it will multiply the val
-   return: return val 
+   Name: timespecToNs
+   Purpose: Collapse a struct timespec into integer nanoseconds since the
+            epoch, the unit every time comparison in the backup uses.
+   Parameters: const struct timespec* ts
+   return: nanoseconds since the epoch
 */
-int toPower(int val, int ex) {
-  int base = val;
-  for (int i = 0; i < ex - 1; i++) {
-    val *= base;
-  }
-
-  return val;
+static inline int64_t timespecToNs(const struct timespec* ts) {
+  return (int64_t) ts -> tv_sec * 1000000000LL + ts -> tv_nsec;
 }
 
 /*
-   Name: convertStrToNum
-   Purpose: Takes in a string and converts it to an integer.
-            eg: "2500" == > 2500
-				   
-			Parameters: char* str: the string to convert
-   return: return num (integer value of str)
+   Name: parseTime
+   Purpose: Convert a time string already accepted by isValidTime() of the
+            format YYYY-MM-DD hh:mm:ss (local time) into nanoseconds since
+			the epoch. Done once per run for the -t cut off.
+   Parameters: const char* time: the time string
+               int64_t* ns: set to the parsed time
+   return: 1 on success, -1 if the string does not name a valid time
 */
-int convertStrToNum(char* str) {
-  
-  int num = 0; // will store the converted string
-  int numLength = strlen(str); // get number of characters in string
-                               // this will represent number of powers of 10
-  int exponent = numLength - 1; // represents the exponent of 10^e
-  
-  for (int i = 0; i < numLength; i++) {
-    int digit = str[i] - '0'; // gets difference between ascii value of 0 and 
-	                          // ascii value of current character, this will
-							  // give the digit
-    if (exponent > 0) 
-      digit *= toPower(10, exponent); // multiply the digit by 10^exponent 
-    else
-      digit *= 1; // else 10^0 = 1 therefore just multiply by 1
-    exponent--; // decrement the exponent as it reads left to right and 
-	            // therefore goes from highest power to lowest power
-    num += digit; // store the result as a sum in num
+int parseTime(const char* time, int64_t* ns) {
+  struct tm timeInfo;
+  memset(&timeInfo, 0, sizeof(timeInfo));
+  if (sscanf(time, "%4d-%2d-%2d %2d:%2d:%2d", &timeInfo.tm_year,
+             &timeInfo.tm_mon, &timeInfo.tm_mday, &timeInfo.tm_hour,
+             &timeInfo.tm_min, &timeInfo.tm_sec) != 6) {
+    return -1;
   }
-
-  return num;
+  timeInfo.tm_year -= 1900;
+  timeInfo.tm_mon -= 1;
+  timeInfo.tm_isdst = -1; // let mktime decide whether DST applied
+  time_t t = mktime(&timeInfo);
+  if (t == (time_t) -1) {
+    return -1;
+  }
+  *ns = (int64_t) t * 1000000000LL;
+  return 1;
 }
 
 /*
-   Name: convertTimeToArr
-   Purpose: Takes in the time string hh:mm:ss and outputs an array of ints
-			[hh, mm, ss]
-				   
-			Parameters: char* time
-   return: return array of integers (timeArr)
+   Name: compilePredicate
+   Purpose: Build the change predicate from the parsed command line. The
+            ctime test is folded into a second cut off that is unreachable
+			when -c is not given, so isChanged() never has to branch on the
+			mode.
+   Parameters: struct changePredicate* pred: filled in
+               int64_t cutoffNs: the -t cut off
+			   int useCtime: non zero for -c
+   return: void
 */
-int* convertTimeToArr(char* time) {
-  int* timeArr = malloc(3);
-  
-  // define hours string
-  char hours[3] = {
-    time[0],
-    time[1],
-    '\0'
-  };
-  // define minutes string
-  char minutes[3] = {
-    time[3],
-    time[4],
-    '\0'
-  };
-  // define seconds string
-  char seconds[3] = {
-    time[6],
-    time[7],
-    '\0'
-  };
-
-  // convert strings to integers
-  int hoursNum = convertStrToNum(hours);
-  int minutesNum = convertStrToNum(minutes);
-  int secondsNum = convertStrToNum(seconds);
-
-  // set indexes of array to corresponding integer values
-  timeArr[0] = hoursNum;
-  timeArr[1] = minutesNum;
-  timeArr[2] = secondsNum;
-
-  return timeArr;
+void compilePredicate(struct changePredicate* pred, int64_t cutoffNs,
+                      int useCtime) {
+  pred -> mtimeCutoffNs = cutoffNs;
+  pred -> ctimeCutoffNs = useCtime ? cutoffNs : INT64_MAX;
 }
 
 /*
-   Name: convertCalToArr
-   Purpose: Takes in the calendar string YYYY-MM-DD and outputs an array of ints
-			[YYYY, MM, DD]
-				   
-			Parameters: char* cal
-   return: return array of integers (calArr)
+   Name: isChanged
+   Purpose: The innermost test of an incremental run: has this entry
+            changed since the cut off? Pure integer compares on the
+			metadata the scanner already fetched.
+   Parameters: const struct changePredicate* pred, const struct stat* st
+   return: 1 if the entry is selected, 0 if not
 */
-int* convertCalToArr(char* cal) {
-  int* calArr = malloc(3);
-  
-  // define year string
-  char year[5] = {
-    cal[0],
-    cal[1],
-    cal[2],
-    cal[3],
-    '\0'
-  };
-  // define month string
-  char month[3] = {
-    cal[5],
-    cal[6],
-    '\0'
-  };
-  // define day string
-  char day[3] = {
-    cal[8],
-    cal[9],
-    '\0'
-  };
-  // convert each string into an integer
-  int yearNum = convertStrToNum(year);
-  int monthNum = convertStrToNum(month);
-  int dayNum = convertStrToNum(day);
-  
-  // set relevant indexes to corresponding integer values
-  calArr[0] = yearNum;
-  calArr[1] = monthNum;
-  calArr[2] = dayNum;
-
-  return calArr;
+static inline int isChanged(const struct changePredicate* pred,
+                            const struct stat* st) {
+  return (timespecToNs(&st -> st_mtim) > pred -> mtimeCutoffNs)
+         | (timespecToNs(&st -> st_ctim) > pred -> ctimeCutoffNs);
 }
 
-
-/*
-   Name: t1GTt2
-   Purpose: Compares two strings that are of the format:
-			YYYY-MM-DD hh:mm:ss
-			and returns 1 if t1 is greater than t2 else prints 0
-			
-			Parameters: string t1 of size 21, string t2 of size 21
-   return: return 1 if t1 is greater and 0 if not
-*/
-int t1GTt2(char t1[21], char t2[21]) {
-  char* t2Copy = malloc(48);
-  strcpy(t2Copy, t2);
-
-  const char split[2] = " ";
-  
-  // split the two strings into respective YYYY-MM-DD and hh:mm:ss
-  // as seperate strings
-  
-  char* t1Cal = strtok(t1, split); // t1 YYYY-MM-DD
-  char* t1Time = strtok(NULL, split); // t1 hh:mm:ss
-  
-  char* t2Cal = strtok(t2Copy, split); // t2 YYYY-MM-DD
-  char* t2Time = strtok(NULL, split); // t2 hh:mm:ss
-  
-  // convert the strings to arrays of numbers
-  // index mapping: calendar: [YYYY, MM, DD]
-  // index mapping: time: [hh, mm, ss]
-  
-  // t1
-  int* t1CalArr = convertCalToArr(t1Cal); 
-  int* t1TimeArr = convertTimeToArr(t1Time);
-
-  // t2
-  int* t2CalArr = convertCalToArr(t2Cal);
-  int* t2TimeArr = convertTimeToArr(t2Time);
-
-  // t1 year > t2 year
-  if (t1CalArr[0] > t2CalArr[0]) { 
-    return 1;
-	          // assume year equal, t1 month > t2 month
-  } else if (t1CalArr[0] == t2CalArr[0] && t1CalArr[1] > t2CalArr[1]) { 
-    return 1;
-	         // assume year and month equal, t1 monthday > t2 monthday
-  } else if (t1CalArr[0] == t2CalArr[0] && t1CalArr[2] > t2CalArr[2]) { 
-    return 1;
-	         //assume the calendar strings are equal, now compare time str
-  } else if (t1CalArr[0] == t2CalArr[0] && t1CalArr[1] == t2CalArr[1] 
-             && t1CalArr[2] == t2CalArr[2]) {
-	     // t1 hour > t2 hour
-	if (t1TimeArr[0] > t2TimeArr[0]) {
-	  return 1;
-	            // assume hours equal, t1 minute > t2 minute
-	} else if (t1TimeArr[0] == t2TimeArr[0] && t1TimeArr[1] > t2TimeArr[1]) {
-	  return 1;
-	            // assume hours and minutes equal, t1 seconds > t2 seconds
-	} else if (t1TimeArr[0] == t2TimeArr[0] && t1TimeArr[1] == t2TimeArr[1] 
-	           && t1TimeArr[2] > t2TimeArr[2]) {
-	  return 1;
-	}
-  }
-
-  return 0;
-}
 /*
    Name: fileInfo
    Purpose: Given all information retrieved from the file, present it in a 
@@ -477,7 +340,7 @@ int readDir(const char* dir) {
     // for the current file stored in the buffer
 
     // determines whether the current file is newer than the cut off time
-    if (t1GTt2(formatTimeStr(fileData.st_mtime), timeLimit) == 1) {
+    if (isChanged(&predicate, &fileData) == 1) {
       // Retrieve/store information for given file			 
       char* name = entry -> d_name; // Name of file/directory
       char* time = formatTime(fileData.st_mtime); // last modification time 
@@ -648,8 +511,10 @@ int isValidTime(char* time) {
 				   to get the modification time of this. 
 				   If the file doesn't exist it will exit and print an error 
 				   message.
-			If no filename or timestring is provided it will use the default
-			1970-01-01 00:00:00 cutoff time
+			If no filename or timestring is provided there is no cut off and
+			everything is listed. -c additionally selects files whose ctime
+			is after the cut off. The result is compiled into the change
+			predicate once, here.
 			
 			The last argument HAS to be a directory to read
 			
@@ -661,7 +526,8 @@ int isValidTime(char* time) {
 */
 int commandLineSwitch(char* argv [], int sizeOfArgs) {
 	
-	char* time = "1970-01-01 00:00:00"; 
+	int64_t cutoffNs = INT64_MIN; // no cut off, everything is selected
+	int useCtime = 0;
 	char* directory = "."; 
 	char* file;
 
@@ -669,12 +535,12 @@ int commandLineSwitch(char* argv [], int sizeOfArgs) {
 	for(int i = 1; i < sizeOfArgs; i++) { 
 	  if(strcmp(argv[i], "-h") == 0) {
 	    printf("\n");
-	    printf("Switches: -t | -h (can appear in any order\n");
+	    printf("Switches: -t | -c | -h (can appear in any order\n");
   	    printf("-t <filename|time> used to set last modification time\n"); 
 	    printf("filename gets last modification time of file\n");
 	    printf("time format YYYY-MM-DD hh:mm:ss to set cut off time\n");
-	    printf("If no filename or time is present, it will use default \
-		   1970-01-01 00:00:00\n");
+	    printf("If no filename or time is present, everything is listed\n");
+	    printf("-c also select files whose ctime is newer than the cut off\n");
 	    printf("-h displays this current message\n");
 	    printf("Last command must be the directory to look at\n");
 	    printf("Example format: ./backupfiles -t -h .\n");
@@ -684,19 +550,25 @@ int commandLineSwitch(char* argv [], int sizeOfArgs) {
 	     strcmp(argv[i+1], "-h") != 0 && i != sizeOfArgs-2) { 
 			
 	     if(isValidTime(argv[i+1]) == 1) { 
-               time = argv[i+1];
+	       if(parseTime(argv[i+1], &cutoffNs) == -1) {
+	         printf("Error in commandLineSwitch: Invalid time\n");
+	         return -1;
+	       }
 	     } else { // else it is filename
 	        file = realpath(argv[i+1], NULL); 
 	     	if(file == NULL) { 
 	          printf("Error in commandLineSwitch: No such file\n"); 
 	          return -1;
 	        }
-		// get modification time of file
+		// get modification time of file, to the nanosecond
 		struct stat fileInfo; 
 		stat(file, &fileInfo); 
-		time = formatTimeStr(fileInfo.st_mtime);
+		cutoffNs = timespecToNs(&fileInfo.st_mtim);
 		}
 	     }	
+	  if(strcmp(argv[i], "-c") == 0) {
+	     useCtime = 1;
+	  }
 	}
 	directory = realpath(argv[sizeOfArgs-1], NULL);
 	// test if directory exists
@@ -705,7 +577,7 @@ int commandLineSwitch(char* argv [], int sizeOfArgs) {
 		 return -1;
 	}
 			
-	timeLimit = time; 
+	compilePredicate(&predicate, cutoffNs, useCtime);
 	nftw(directory, traverse, 20, FTW_D);
 	
 	return 1;
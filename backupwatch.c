@@ -0,0 +1,945 @@
+/*
+   Title: backupwatch.c
+   Author: Calvin Mohammed
+   Purpose: Watch the directory tree inputted by the user and record every
+            path that is created, deleted, renamed, written or has its
+			attributes changed in a journal file. backup -J reads the
+			journal and visits only those paths on an incremental run
+			instead of walking the whole tree. Events come from fanotify
+			(one mark for the whole filesystem, needs root) or, where that
+			is not available, from an inotify watch on every directory.
+			When events are lost the journal says so and the next backup
+			walks the tree again.
+   Version: 1.0
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <ftw.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <libgen.h>
+// fanotify reports names only since Linux 5.9
+#if defined(__linux__) && __has_include(<sys/fanotify.h>)
+#include <sys/fanotify.h>
+#ifdef FAN_REPORT_DFID_NAME
+#define HAVE_FANOTIFY_NAMES
+#endif
+#endif
+
+  // SYMBOLIC CONSTANTS
+  #define EVENT_BUFFER (64 * 1024) // bytes of events read at once
+  #define EVENT_MAX (1024) // longest fanotify event, a handle and a name
+  #define COMPACT_MIN (4096) // records the file may hold beyond twice the
+                             // distinct paths before it is rewritten
+  #define TABLE_START (1024) // initial slots of the path table
+
+  // CHANGE JOURNAL, the same layout backup.c reads with -J, all
+  // little-endian:
+  //   header (JOURNAL_HEADER_SIZE): magic "IFBJOURN", u32 version,
+  //     u32 reserved, u64 dev and u64 ino of the watched root, i64 startNs
+  //     (changes are recorded from then on), i64 overflowNs (last time
+  //     events were lost, 0 for never)
+  //   records (JOURNAL_RECORD_SIZE then the path): i64 timeNs, u32 pathLen,
+  //     path relative to the root; a path may appear more than once
+  // While recording the journal is locked with flock(LOCK_EX).
+  #define JOURNAL_MAGIC "IFBJOURN"
+  #define JOURNAL_VERSION (1)
+  #define JOURNAL_HEADER_SIZE (64)
+  #define JOURNAL_RECORD_SIZE (12)
+  #define JOURNAL_SLACK (10LL * 1000000000LL) // ns between a change and its
+                                              // record reaching the journal
+
+  // a path changed again this soon after its last record is not written
+  // again; backup reads from JOURNAL_SLACK before its cut off, so the
+  // earlier record still covers the change
+  #define REPEAT_WINDOW (JOURNAL_SLACK / 2)
+
+  // what an inotify watch on each directory reports
+  #define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO\
+                      | IN_MODIFY | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW\
+                      | IN_EXCL_UNLINK)
+
+/*
+   Name: pathEntry
+   Purpose: One distinct path in the journal and the time of its newest
+            record, a slot of the open addressing path table.
+*/
+struct pathEntry {
+  char* path; // NUL terminated, relative to the root; NULL for a free slot
+  int64_t timeNs;
+};
+
+/*
+   Name: journalWriter
+   Purpose: The journal file being appended to and the distinct paths it
+            holds, from which it is rewritten when it grows too long.
+*/
+struct journalWriter {
+  int fd; // open and locked, records are written at end
+  uint64_t end;
+  uint64_t records; // records in the file, repeats included
+  unsigned char header[JOURNAL_HEADER_SIZE];
+  struct pathEntry* table;
+  size_t capacity; // slots in table, a power of two
+  size_t live; // paths in table
+};
+
+// -J, the journal and its state
+static char* journalFile;
+static struct journalWriter journal = { .fd = -1 };
+
+// -C, catalog of the backup runs; records it no longer needs are dropped
+static char* catalogFile;
+
+// directory being watched, realpath, and the length of its prefix in the
+// absolute paths events resolve to
+static char* rootDir;
+static size_t rootLen;
+
+// the journal and its temporary name relative to the root, never recorded
+static char* ownPath;
+static char* ownTmpPath;
+
+// set by SIGINT and SIGTERM, the event loop returns
+static volatile sig_atomic_t stopping;
+
+// inotify state: the descriptor and the relative path of each watch
+static int inotifyFd = -1;
+static char** watchPaths;
+static int watchCapacity;
+static int watchCount;
+
+// while watchTree runs: record what it finds, and the time to record it with
+static int recordFound;
+static int64_t recordNow;
+
+// set once a directory could not be watched for lack of inotify watches
+static int watchesLost;
+
+/*
+   Name: putLE32, putLE64
+   Purpose: Store an integer at buf in little-endian byte order regardless of
+            the byte order of the host.
+   Parameters: unsigned char* buf: destination, uintN_t val: value to store
+   return: void
+*/
+static void putLE32(unsigned char* buf, uint32_t val) {
+  for (int i = 0; i < 4; i++) {
+    buf[i] = (val >> (8 * i)) & 0xff;
+  }
+}
+
+static void putLE64(unsigned char* buf, uint64_t val) {
+  for (int i = 0; i < 8; i++) {
+    buf[i] = (val >> (8 * i)) & 0xff;
+  }
+}
+
+/*
+   Name: getLE64
+   Purpose: Read back an integer stored by putLE64.
+   Parameters: const unsigned char* buf: source bytes
+   return: the decoded value
+*/
+static uint64_t getLE64(const unsigned char* buf) {
+  uint64_t val = 0;
+  for (int i = 7; i >= 0; i--) {
+    val = (val << 8) | buf[i];
+  }
+  return val;
+}
+
+/*
+   Name: realtimeNs
+   Purpose: Wall clock time; the journal is compared against catalogs
+            written by other processes, so a monotonic clock will not do.
+   Parameters: none
+   return: nanoseconds since the epoch
+*/
+static int64_t realtimeNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+   Name: stopHandler
+   Purpose: SIGINT and SIGTERM handler, ends the event loop.
+   Parameters: int sig
+   return: void
+*/
+static void stopHandler(int sig) {
+  (void) sig;
+  stopping = 1;
+}
+
+/*
+   Name: pathSlot
+   Purpose: Find the slot of a path in the path table (FNV-1a, linear
+            probing).
+   Parameters: struct pathEntry* table, size_t capacity,
+               const char* path, size_t len
+   return: the slot holding the path, or the free slot it would go in
+*/
+static size_t pathSlot(struct pathEntry* table, size_t capacity,
+                       const char* path, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) path[i]) * 0x100000001b3ULL;
+  }
+  size_t slot = hash & (capacity - 1);
+  while (table[slot].path != NULL
+         && (strncmp(table[slot].path, path, len) != 0
+             || table[slot].path[len] != '\0')) {
+    slot = (slot + 1) & (capacity - 1);
+  }
+  return slot;
+}
+
+/*
+   Name: tableGrow
+   Purpose: Double the path table once it is half full.
+   Parameters: struct journalWriter* jw
+   return: 1 on success, -1 if out of memory
+*/
+static int tableGrow(struct journalWriter* jw) {
+  size_t capacity = jw -> capacity == 0 ? TABLE_START : jw -> capacity * 2;
+  struct pathEntry* table = calloc(capacity, sizeof(struct pathEntry));
+  if (table == NULL) {
+    printf("Error in tableGrow: Out of memory\n");
+    return -1;
+  }
+  for (size_t i = 0; i < jw -> capacity; i++) {
+    if (jw -> table[i].path != NULL) {
+      const char* path = jw -> table[i].path;
+      table[pathSlot(table, capacity, path, strlen(path))] = jw -> table[i];
+    }
+  }
+  free(jw -> table);
+  jw -> table = table;
+  jw -> capacity = capacity;
+  return 1;
+}
+
+/*
+   Name: catalogStartNs
+   Purpose: When the last backup run started scanning, from the header of
+            the -C catalog. backup -J never asks for records from before
+			that, less JOURNAL_SLACK.
+   Parameters: none
+   return: the time, INT64_MIN if there is no usable catalog
+*/
+static int64_t catalogStartNs(void) {
+  unsigned char header[JOURNAL_HEADER_SIZE];
+  int64_t startNs = INT64_MIN;
+  int fd = catalogFile != NULL ? open(catalogFile, O_RDONLY) : -1;
+  if (fd == -1) {
+    return INT64_MIN;
+  }
+  if (read(fd, header, sizeof(header)) == (ssize_t) sizeof(header)
+      && memcmp(header, "IFBCATLG", 8) == 0 && getLE64(header + 40) != 0) {
+    startNs = (int64_t) getLE64(header + 40);
+  }
+  close(fd);
+  return startNs;
+}
+
+/*
+   Name: journalRewrite
+   Purpose: Write the journal afresh: the header and one record for each
+            distinct path, leaving out those older than the -C catalog
+			needs. It is written and locked under a temporary name and then
+			renamed over the old one, so a reader always sees a whole file
+			and the lock never lapses.
+   Parameters: struct journalWriter* jw
+   return: 1 on success, -1 on failure
+*/
+static int journalRewrite(struct journalWriter* jw) {
+  int64_t oldest = catalogStartNs();
+  if (oldest != INT64_MIN) {
+    oldest -= JOURNAL_SLACK;
+  }
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", journalFile);
+
+  // drop what no run will ask for, then lay the rest out in one buffer
+  size_t size = JOURNAL_HEADER_SIZE;
+  size_t kept = 0;
+  for (size_t i = 0; i < jw -> capacity; i++) {
+    if (jw -> table[i].path != NULL && jw -> table[i].timeNs < oldest) {
+      free(jw -> table[i].path);
+      jw -> table[i].path = NULL;
+    } else if (jw -> table[i].path != NULL) {
+      size += JOURNAL_RECORD_SIZE + strlen(jw -> table[i].path);
+      kept++;
+    }
+  }
+  unsigned char* buf = malloc(size);
+  struct pathEntry* table = calloc(jw -> capacity, sizeof(struct pathEntry));
+  if (buf == NULL || table == NULL) {
+    printf("Error in journalRewrite: Out of memory\n");
+    free(buf);
+    free(table);
+    return -1;
+  }
+  memcpy(buf, jw -> header, JOURNAL_HEADER_SIZE);
+  size_t used = JOURNAL_HEADER_SIZE;
+  for (size_t i = 0; i < jw -> capacity; i++) {
+    const char* path = jw -> table[i].path;
+    if (path == NULL) {
+      continue;
+    }
+    size_t len = strlen(path);
+    putLE64(buf + used, (uint64_t) jw -> table[i].timeNs);
+    putLE32(buf + used + 8, len);
+    memcpy(buf + used + JOURNAL_RECORD_SIZE, path, len);
+    used += JOURNAL_RECORD_SIZE + len;
+    // freed slots broke the probe chains, so every path moves over
+    table[pathSlot(table, jw -> capacity, path, len)] = jw -> table[i];
+  }
+  free(jw -> table);
+  jw -> table = table;
+  jw -> live = kept;
+
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int result = fd == -1 ? -1 : 1;
+  for (size_t done = 0; result == 1 && done < size; ) {
+    ssize_t n = write(fd, buf + done, size - done);
+    if (n <= 0) {
+      result = -1;
+    }
+    done += n > 0 ? n : 0;
+  }
+  free(buf);
+  if (result == -1 || flock(fd, LOCK_EX | LOCK_NB) == -1
+      || rename(tmp, journalFile) == -1) {
+    printf("Error in journalRewrite: Could not write %s\n", journalFile);
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    return -1;
+  }
+  if (jw -> fd != -1) {
+    close(jw -> fd);
+  }
+  jw -> fd = fd;
+  jw -> end = size;
+  jw -> records = kept;
+  return 1;
+}
+
+/*
+   Name: journalStart
+   Purpose: Create the journal for a root that is now being watched. What
+            an earlier instance recorded is of no use: events may have been
+			missed while nothing was watching, so startNs is now and backup
+			walks the tree once before it trusts the journal again.
+   Parameters: struct journalWriter* jw, const struct stat* root
+   return: 1 on success, -1 on failure
+*/
+static int journalStart(struct journalWriter* jw, const struct stat* root) {
+  memset(jw, 0, sizeof(*jw));
+  jw -> fd = -1;
+  memcpy(jw -> header, JOURNAL_MAGIC, 8);
+  putLE32(jw -> header + 8, JOURNAL_VERSION);
+  putLE64(jw -> header + 16, (uint64_t) root -> st_dev);
+  putLE64(jw -> header + 24, (uint64_t) root -> st_ino);
+  putLE64(jw -> header + 32, (uint64_t) realtimeNs());
+  if (tableGrow(jw) == -1) {
+    return -1;
+  }
+  return journalRewrite(jw);
+}
+
+/*
+   Name: journalOverflow
+   Purpose: Note in the header that events were lost just now. backup
+            walks the whole tree on its next run, after which the journal
+			is good again.
+   Parameters: struct journalWriter* jw
+   return: 1 on success, -1 on failure
+*/
+static int journalOverflow(struct journalWriter* jw) {
+  printf("Events were lost, the next backup walks the whole tree\n");
+  putLE64(jw -> header + 40, (uint64_t) realtimeNs());
+  if (pwrite(jw -> fd, jw -> header + 40, 8, 40) != 8) {
+    printf("Error in journalOverflow: Could not write %s\n", journalFile);
+    return -1;
+  }
+  return 1;
+}
+
+/*
+   Name: journalRecord
+   Purpose: Append a record for a changed path, unless it already has one
+            from the last REPEAT_WINDOW. Rewrites the journal once repeats
+			make up most of it.
+   Parameters: struct journalWriter* jw, const char* path: relative to the
+               root, int64_t now: when the event was read
+   return: 1 on success, -1 on failure
+*/
+static int journalRecord(struct journalWriter* jw, const char* path,
+                         int64_t now) {
+  size_t len = strlen(path);
+  // the root itself is never archived, and the journal is not content
+  if (len == 0 || len >= PATH_MAX
+      || (ownPath != NULL && (strcmp(path, ownPath) == 0
+                              || strcmp(path, ownTmpPath) == 0))) {
+    return 1;
+  }
+  size_t slot = pathSlot(jw -> table, jw -> capacity, path, len);
+  struct pathEntry* e = &jw -> table[slot];
+  if (e -> path != NULL && now - e -> timeNs < REPEAT_WINDOW) {
+    return 1;
+  }
+
+  unsigned char buf[JOURNAL_RECORD_SIZE + PATH_MAX];
+  putLE64(buf, (uint64_t) now);
+  putLE32(buf + 8, len);
+  memcpy(buf + JOURNAL_RECORD_SIZE, path, len);
+  ssize_t size = JOURNAL_RECORD_SIZE + len;
+  // one write per record, a reader never sees a torn one in the middle
+  if (pwrite(jw -> fd, buf, size, jw -> end) != size) {
+    printf("Error in journalRecord: Could not write %s\n", journalFile);
+    return -1;
+  }
+  jw -> end += size;
+  jw -> records++;
+  if (e -> path == NULL) {
+    e -> path = strdup(path);
+    if (e -> path == NULL) {
+      printf("Error in journalRecord: Out of memory\n");
+      return -1;
+    }
+    jw -> live++;
+  }
+  e -> timeNs = now;
+  if (2 * jw -> live > jw -> capacity && tableGrow(jw) == -1) {
+    return -1;
+  }
+  if (jw -> records > 2 * jw -> live + COMPACT_MIN) {
+    return journalRewrite(jw);
+  }
+  return 1;
+}
+
+/*
+   Name: recordEvent
+   Purpose: Record what one event changed: the named entry, or the
+            directory itself for an event without a name. Creating,
+			deleting or renaming an entry also changes its directory.
+   Parameters: const char* dir: directory relative to the root,
+               const char* name: entry, "" or "." for the directory,
+			   int namespaceChange: the event added or removed a name,
+			   int64_t now
+   return: 1 on success, -1 on failure
+*/
+static int recordEvent(const char* dir, const char* name, int namespaceChange,
+                       int64_t now) {
+  char path[PATH_MAX];
+  if (name[0] == '\0' || strcmp(name, ".") == 0) {
+    return journalRecord(&journal, dir, now);
+  }
+  if (snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] == '\0' ? "" : "/",
+               name) >= (int) sizeof(path)) {
+    return 1;
+  }
+  if (journalRecord(&journal, path, now) == -1) {
+    return -1;
+  }
+  return namespaceChange ? journalRecord(&journal, dir, now) : 1;
+}
+
+/*
+   Name: relativePath
+   Purpose: Path of an absolute name relative to the watched root.
+   Parameters: const char* abs
+   return: the relative path ("" for the root), NULL if outside the root
+*/
+static const char* relativePath(const char* abs) {
+  if (strncmp(abs, rootDir, rootLen) != 0) {
+    return NULL;
+  }
+  if (abs[rootLen] == '\0') {
+    return "";
+  }
+  return abs[rootLen] == '/' ? abs + rootLen + 1 : NULL;
+}
+
+/*
+   Name: watchAdd
+   Purpose: nftw() callback of watchTree: put an inotify watch on each
+            directory and, for a tree that just appeared, record every
+			entry, since whatever was created in it before its watch was
+			in place raised no event.
+   Parameters: const char* fpath, const struct stat* sb, int type,
+               struct FTW* ftwbuf
+   return: 0 to continue the walk
+*/
+static int watchAdd(const char* fpath, const struct stat* sb, int type,
+                    struct FTW* ftwbuf) {
+  (void) sb;
+  const char* rel = relativePath(fpath);
+  if (rel == NULL) {
+    return 0;
+  }
+  if (recordFound && ftwbuf -> level > 0) {
+    journalRecord(&journal, rel, recordNow);
+  }
+  if (type != FTW_D) {
+    return 0;
+  }
+  int wd = inotify_add_watch(inotifyFd, fpath, WATCH_MASK);
+  if (wd == -1) {
+    if (errno == ENOSPC) {
+      printf("Error in watchAdd: Out of inotify watches, raise "
+             "fs.inotify.max_user_watches\n");
+      watchesLost = 1;
+      if (journal.fd != -1) {
+        journalOverflow(&journal);
+      }
+    }
+    return 0;
+  }
+  if (wd >= watchCapacity) {
+    int capacity = watchCapacity == 0 ? 1024 : watchCapacity;
+    while (capacity <= wd) {
+      capacity *= 2;
+    }
+    char** grown = realloc(watchPaths, capacity * sizeof(char*));
+    if (grown == NULL) {
+      printf("Error in watchAdd: Out of memory\n");
+      inotify_rm_watch(inotifyFd, wd);
+      return 0;
+    }
+    memset(grown + watchCapacity, 0,
+           (capacity - watchCapacity) * sizeof(char*));
+    watchPaths = grown;
+    watchCapacity = capacity;
+  }
+  // a directory watched before keeps its watch, only the path changes
+  if (watchPaths[wd] == NULL) {
+    watchCount++;
+  }
+  free(watchPaths[wd]);
+  watchPaths[wd] = strdup(rel);
+  return 0;
+}
+
+/*
+   Name: watchTree
+   Purpose: Watch a directory and everything below it with inotify.
+   Parameters: const char* rel: directory relative to the root,
+               int record: also record every entry found (a new tree),
+			   int64_t now
+   return: void
+*/
+static void watchTree(const char* rel, int record, int64_t now) {
+  char abs[PATH_MAX];
+  snprintf(abs, sizeof(abs), "%s%s%s", rootDir, rel[0] == '\0' ? "" : "/",
+           rel);
+  recordFound = record;
+  recordNow = now;
+  nftw(abs, watchAdd, 64, FTW_PHYS);
+}
+
+/*
+   Name: watchMove
+   Purpose: A watched directory was renamed inside the tree: its watches
+            and those below it stay, their paths change.
+   Parameters: const char* from, const char* to: old and new relative path
+   return: void
+*/
+static void watchMove(const char* from, const char* to) {
+  size_t fromLen = strlen(from);
+  for (int wd = 0; wd < watchCapacity; wd++) {
+    char* old = watchPaths[wd];
+    if (old == NULL || strncmp(old, from, fromLen) != 0
+        || (old[fromLen] != '\0' && old[fromLen] != '/')) {
+      continue;
+    }
+    char* moved = malloc(strlen(to) + strlen(old + fromLen) + 1);
+    if (moved != NULL) {
+      sprintf(moved, "%s%s", to, old + fromLen);
+      free(old);
+      watchPaths[wd] = moved;
+    }
+  }
+}
+
+/*
+   Name: watchForget
+   Purpose: A watched directory was moved out of the tree: drop its watches
+            and those below it. The entries are freed on IN_IGNORED.
+   Parameters: const char* from: old relative path
+   return: void
+*/
+static void watchForget(const char* from) {
+  size_t fromLen = strlen(from);
+  for (int wd = 0; wd < watchCapacity; wd++) {
+    const char* old = watchPaths[wd];
+    if (old != NULL && strncmp(old, from, fromLen) == 0
+        && (old[fromLen] == '\0' || old[fromLen] == '/')) {
+      inotify_rm_watch(inotifyFd, wd);
+    }
+  }
+}
+
+/*
+   Name: inotifyRun
+   Purpose: Watch every directory of the tree with inotify and record
+            events until stopped. A rename is two events joined by a
+			cookie; a directory whose second half does not follow in the
+			same read left the tree.
+   Parameters: const struct stat* root
+   return: 1 when stopped, -1 on failure
+*/
+static int inotifyRun(const struct stat* root) {
+  static uint64_t buf[EVENT_BUFFER / 8]; // aligned for inotify_event
+  char* moveFrom = NULL;
+  uint32_t moveCookie = 0;
+
+  inotifyFd = inotify_init1(IN_CLOEXEC);
+  if (inotifyFd == -1) {
+    printf("Error in inotifyRun: Could not start inotify\n");
+    return -1;
+  }
+  // the journal starts once the watches are in place
+  watchTree("", 0, 0);
+  if (watchesLost) {
+    printf("Error in inotifyRun: Could not watch all of %s\n", rootDir);
+    return -1;
+  }
+  if (journalStart(&journal, root) == -1) {
+    return -1;
+  }
+  printf("Watching %s with inotify, %d directories\n", rootDir, watchCount);
+  fflush(stdout);
+
+  while (!stopping) {
+    ssize_t n = read(inotifyFd, buf, sizeof(buf));
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      printf("Error in inotifyRun: Could not read events\n");
+      return -1;
+    }
+    int64_t now = realtimeNs();
+    for (char* p = (char*) buf; p < (char*) buf + n; ) {
+      struct inotify_event* ev = (struct inotify_event*) p;
+      p += sizeof(struct inotify_event) + ev -> len;
+      if (ev -> mask & IN_Q_OVERFLOW) {
+        journalOverflow(&journal);
+        continue;
+      }
+      if (ev -> wd < 0 || ev -> wd >= watchCapacity
+          || watchPaths[ev -> wd] == NULL) {
+        continue;
+      }
+      if (ev -> mask & IN_IGNORED) {
+        free(watchPaths[ev -> wd]);
+        watchPaths[ev -> wd] = NULL;
+        watchCount--;
+        continue;
+      }
+      const char* dir = watchPaths[ev -> wd];
+      const char* name = ev -> len > 0 ? ev -> name : "";
+      int namespaceChange = (ev -> mask & (IN_CREATE | IN_DELETE
+                             | IN_MOVED_FROM | IN_MOVED_TO)) != 0;
+      if (recordEvent(dir, name, namespaceChange, now) == -1) {
+        return -1;
+      }
+      if ((ev -> mask & IN_ISDIR) == 0 || name[0] == '\0') {
+        continue;
+      }
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] == '\0' ? "" : "/",
+               name);
+      if (ev -> mask & IN_CREATE) {
+        watchTree(path, 1, now);
+      } else if (ev -> mask & IN_MOVED_FROM) {
+        if (moveFrom != NULL) {
+          watchForget(moveFrom);
+          free(moveFrom);
+        }
+        moveFrom = strdup(path);
+        moveCookie = ev -> cookie;
+      } else if (ev -> mask & IN_MOVED_TO) {
+        if (moveFrom != NULL && moveCookie == ev -> cookie) {
+          watchMove(moveFrom, path);
+          free(moveFrom);
+          moveFrom = NULL;
+        } else {
+          watchTree(path, 1, now);
+        }
+      }
+    }
+    if (moveFrom != NULL) {
+      watchForget(moveFrom);
+      free(moveFrom);
+      moveFrom = NULL;
+    }
+  }
+  return 1;
+}
+
+#ifdef HAVE_FANOTIFY_NAMES
+/*
+   Name: mountsBelow
+   Purpose: Check /proc/self/mountinfo for a filesystem mounted below the
+            root. A fanotify filesystem mark does not reach into it, but
+			backup walks into it, so inotify has to be used instead.
+   Parameters: none
+   return: 1 if there is one, 0 if not
+*/
+static int mountsBelow(void) {
+  FILE* fp = fopen("/proc/self/mountinfo", "r");
+  char line[PATH_MAX + 512];
+  int found = 0;
+  if (fp == NULL) {
+    return 1;
+  }
+  while (!found && fgets(line, sizeof(line), fp) != NULL) {
+    char mountPoint[PATH_MAX];
+    if (sscanf(line, "%*s %*s %*s %*s %4095s", mountPoint) == 1) {
+      const char* rel = relativePath(mountPoint);
+      found = rel != NULL && rel[0] != '\0';
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+/*
+   Name: fanotifyRun
+   Purpose: Mark the filesystem holding the root with fanotify and record
+            events until stopped. Each event names an entry in a directory
+			given by file handle; the directory is opened by handle and its
+			path read back from /proc, so renames above it need no
+			bookkeeping. Events outside the root are dropped.
+   Parameters: const struct stat* root
+   return: 1 when stopped, 0 if fanotify can not be used here, -1 on
+           failure
+*/
+static int fanotifyRun(const struct stat* root) {
+  static char buf[EVENT_BUFFER];
+  static uint64_t event[EVENT_MAX / 8]; // one event, aligned
+  uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO
+                  | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR;
+
+  if (mountsBelow()) {
+    return 0;
+  }
+  int fan = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME
+                          | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+  if (fan == -1) {
+    return 0;
+  }
+  int mountFd = open(rootDir, O_RDONLY | O_DIRECTORY);
+  if (mountFd == -1 || fanotify_mark(fan, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                                     mask, AT_FDCWD, rootDir) == -1) {
+    close(fan);
+    if (mountFd != -1) {
+      close(mountFd);
+    }
+    return 0;
+  }
+  if (journalStart(&journal, root) == -1) {
+    return -1;
+  }
+  printf("Watching %s with fanotify\n", rootDir);
+  fflush(stdout);
+
+  while (!stopping) {
+    ssize_t n = read(fan, buf, sizeof(buf));
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      printf("Error in fanotifyRun: Could not read events\n");
+      return -1;
+    }
+    int64_t now = realtimeNs();
+    for (ssize_t at = 0; at + (ssize_t) FAN_EVENT_METADATA_LEN <= n; ) {
+      // names make events any length, the next one need not be aligned
+      uint32_t len;
+      memcpy(&len, buf + at, sizeof(len));
+      if (len < FAN_EVENT_METADATA_LEN || len > n - at) {
+        break;
+      }
+      size_t copied = len < sizeof(event) ? len : sizeof(event);
+      memcpy(event, buf + at, copied);
+      at += len;
+      struct fanotify_event_metadata* meta = (void*) event;
+      if (meta -> fd >= 0) {
+        close(meta -> fd);
+      }
+      if (meta -> mask & FAN_Q_OVERFLOW) {
+        journalOverflow(&journal);
+        continue;
+      }
+      struct fanotify_event_info_fid* fid = (void*) (meta + 1);
+      if (len > copied || (char*) (fid + 1) > (char*) event + copied
+          || (fid -> hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME
+              && fid -> hdr.info_type != FAN_EVENT_INFO_TYPE_DFID)) {
+        continue;
+      }
+      struct file_handle* handle = (struct file_handle*) fid -> handle;
+      const char* name = fid -> hdr.info_type
+                         == FAN_EVENT_INFO_TYPE_DFID_NAME
+                         ? (const char*) handle -> f_handle
+                           + handle -> handle_bytes : "";
+
+      // a directory that is gone by now had its own event
+      int dirFd = open_by_handle_at(mountFd, handle, O_PATH);
+      if (dirFd == -1) {
+        continue;
+      }
+      char link[64];
+      char abs[PATH_MAX];
+      snprintf(link, sizeof(link), "/proc/self/fd/%d", dirFd);
+      ssize_t absLen = readlink(link, abs, sizeof(abs) - 1);
+      close(dirFd);
+      if (absLen <= 0) {
+        continue;
+      }
+      abs[absLen] = '\0';
+      const char* dir = relativePath(abs);
+      if (dir == NULL) {
+        continue;
+      }
+      int namespaceChange = (meta -> mask & (FAN_CREATE | FAN_DELETE
+                             | FAN_MOVED_FROM | FAN_MOVED_TO)) != 0;
+      if (recordEvent(dir, name, namespaceChange, now) == -1) {
+        return -1;
+      }
+    }
+  }
+  return 1;
+}
+#endif
+
+/*
+   Name: commandLineSwitch
+   Purpose: Read the switches, start the journal and record events until
+            SIGINT or SIGTERM.
+			Parameters: char* argv[]: arrays of arguments
+					   int sizeOfArgs: number of arguments
+   return: return 1 if success, -1 on failure
+*/
+int commandLineSwitch(char* argv [], int sizeOfArgs) {
+  int useInotify = 0;
+  struct stat root;
+
+  for (int i = 1; i < sizeOfArgs; i++) {
+    if (strcmp(argv[i], "-h") == 0) {
+      printf("\n");
+      printf("Switches: -J | -C | -i | -h (can appear in any order\n");
+      printf("-J <journal> file the changed paths are recorded in, for\n");
+      printf("   backup -J\n");
+      printf("-C <catalog> catalog of the backup runs; records older than\n");
+      printf("   the last run are dropped when the journal is rewritten\n");
+      printf("-i use inotify even where fanotify is available\n");
+      printf("-h displays this current message\n");
+      printf("Last command must be the directory to watch\n");
+      printf("Example format: ./backupwatch -J /var/lib/b.jrn -C b.cat .\n");
+      return 1;
+    }
+    if (strcmp(argv[i], "-i") == 0) {
+      useInotify = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-J") == 0 || strcmp(argv[i], "-C") == 0) {
+      if (i >= sizeOfArgs - 2) {
+        printf("Error in commandLineSwitch: Please put a file after %s\n",
+               argv[i]);
+        return -1;
+      }
+      if (argv[i][1] == 'J') {
+        journalFile = argv[i+1];
+      } else {
+        catalogFile = argv[i+1];
+      }
+      i++;
+    }
+  }
+  if (journalFile == NULL) {
+    printf("Error in commandLineSwitch: Please give a journal with -J\n");
+    return -1;
+  }
+  rootDir = sizeOfArgs > 1 ? realpath(argv[sizeOfArgs-1], NULL) : NULL;
+  if (rootDir == NULL || stat(rootDir, &root) == -1
+      || !S_ISDIR(root.st_mode)) {
+    printf("Error in commandLineSwitch: Directory doesn't exist\n");
+    return -1;
+  }
+  rootLen = strcmp(rootDir, "/") == 0 ? 0 : strlen(rootDir);
+
+  // the journal may well live inside the tree it watches
+  char* copy = strdup(journalFile);
+  char dir[PATH_MAX];
+  if (copy != NULL && realpath(dirname(copy), dir) != NULL) {
+    char* base = strdup(journalFile);
+    char abs[2 * PATH_MAX];
+    snprintf(abs, sizeof(abs), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir,
+             basename(base));
+    const char* rel = relativePath(abs);
+    if (rel != NULL && rel[0] != '\0') {
+      ownPath = strdup(rel);
+      ownTmpPath = malloc(strlen(rel) + 5);
+      if (ownTmpPath != NULL) {
+        sprintf(ownTmpPath, "%s.tmp", rel);
+      }
+    }
+    free(base);
+  }
+  free(copy);
+  if (ownPath != NULL && ownTmpPath == NULL) {
+    printf("Error in commandLineSwitch: Out of memory\n");
+    return -1;
+  }
+
+  // no SA_RESTART: a signal interrupts the blocking read of events
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stopHandler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int result = 0;
+#ifdef HAVE_FANOTIFY_NAMES
+  if (!useInotify) {
+    result = fanotifyRun(&root);
+  }
+#endif
+  if (result == 0) {
+    result = inotifyRun(&root);
+  }
+  // the lock goes with the descriptor, after which backup no longer
+  // trusts the journal
+  if (journal.fd != -1) {
+    close(journal.fd);
+  }
+  return result;
+}
+
+int main(int argc, char * argv[]) {
+
+  if ((commandLineSwitch(argv, argc) == -1)) {
+	return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
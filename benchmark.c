@@ -0,0 +1,1113 @@
+/*
+   Title: benchmark.c
+   Author: Calvin Mohammed
+   Purpose: Generate representative directory trees and time listfiles,
+            backupfiles and backup (full, incremental and restore) against
+			them, reporting files/s, MB/s, peak RSS, CPU time and block
+			I/O of every run as one JSON document on stdout. With -s each
+			run is repeated under ptrace to count its system calls. The
+			trees are built from a fixed seed, so two releases measured
+			with the same switches see the same files.
+   Version: 1.0
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include <sys/utsname.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+
+  // SYMBOLIC CONSTANTS
+  #define DEFAULT_FILES (100000) // files in the tiny, deep and wide trees
+  #define DEFAULT_HUGE_SIZE (256ULL << 20) // bytes in each dense huge file
+  #define TINY_MAX_SIZE (4096) // tiny files are 0 to this many bytes
+  #define DIR_FANOUT (1000) // entries per directory in the tiny tree
+  #define DEEP_LEVELS (1000) // nesting depth of the deep tree
+  #define HUGE_FILES (2) // dense huge files in the huge tree
+  #define SPARSE_FILES (2) // sparse files, four times the huge size
+  #define SPARSE_EXTENTS (16) // data extents spread over each sparse file
+  #define SPARSE_EXTENT_SIZE (1 << 20) // bytes in each of those extents
+  #define FILL_SIZE (1 << 20) // pattern buffer all file contents come from
+  #define MUTATE_EVERY (100) // one in this many files changes before -C runs
+  #define MUTATE_SIZE (4096) // bytes rewritten in each changed file
+  #define MAX_ARGS (32) // arguments of one measured command
+  #define SEED (0x9e3779b97f4a7c15ULL) // generator seed, fixed on purpose
+
+// tree profiles, -g
+#define PROFILE_TINY (0) // many small files, DIR_FANOUT to a directory
+#define PROFILE_DEEP (1) // a narrow chain DEEP_LEVELS directories deep
+#define PROFILE_WIDE (2) // every file in a single directory
+#define PROFILE_HUGE (3) // a few huge dense files and sparse files
+#define PROFILE_COUNT (4)
+
+// names of the profiles, indexed by PROFILE_*
+static const char* profileNames[PROFILE_COUNT] = {
+  "tiny", "deep", "wide", "huge"
+};
+
+/*
+   Name: treeStats
+   Purpose: What the generator put in a tree. The rates of every run are
+            taken over these numbers, so files/s of an incremental run is
+			the scan rate over the whole tree, not over the changed files.
+*/
+struct treeStats {
+  uint64_t files; // regular files
+  uint64_t dirs; // directories, the root included
+  uint64_t bytes; // data bytes written, holes of sparse files excluded
+  uint64_t apparentBytes; // st_size summed, holes included
+  uint64_t changedFiles; // files rewritten by mutateTree
+};
+
+/*
+   Name: runResult
+   Purpose: The measurements of one run of one tool. Time comes from
+            CLOCK_MONOTONIC around fork and wait; everything else from
+			the rusage wait4 returns for the child and its threads.
+*/
+struct runResult {
+  double wallSeconds;
+  double userSeconds;
+  double systemSeconds;
+  long maxRssKb; // peak resident set size of the child
+  long inBlocks; // 512 byte blocks read from storage
+  long outBlocks; // 512 byte blocks written to storage
+  int exitStatus; // exit code, or 128 plus the signal that killed it
+  long long syscalls; // system calls made, -1 when not counted
+};
+
+// pseudo random state of the generator, reset for every tree
+static uint64_t randomState;
+
+// contents files are cut from: random bytes, then repeated text
+static char* fillBuffer;
+
+// data bytes in each dense huge file, -H
+static uint64_t hugeSize = DEFAULT_HUGE_SIZE;
+
+// drop the page cache before each timed run (-c, needs root)
+static int dropCaches = 0;
+
+// repeat each run under ptrace to count system calls (-s)
+static int countSyscalls = 0;
+
+// extra switches given to every backup run (-a), NULL terminated
+static char* backupArgs[MAX_ARGS];
+static int backupArgCount = 0;
+
+// first record of a JSON array has no comma in front of it
+static int firstProfile = 1;
+
+/*
+   Name: nextRandom
+   Purpose: xorshift64*, good enough for file sizes and contents and the
+            same on every machine, unlike rand().
+   return: next pseudo random 64 bit value
+*/
+static uint64_t nextRandom(void) {
+  randomState ^= randomState >> 12;
+  randomState ^= randomState << 25;
+  randomState ^= randomState >> 27;
+  return randomState * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+   Name: fillInit
+   Purpose: Build the pattern buffer. The first half does not compress,
+            the second half compresses well, so codecs see a mixed load
+			like real data rather than all zeros or all noise.
+   return: 1 on success, -1 on failure
+*/
+static int fillInit(void) {
+  static const char text[] = "the quick brown fox jumps over the lazy dog ";
+
+  fillBuffer = malloc(FILL_SIZE);
+  if (fillBuffer == NULL) {
+    fprintf(stderr, "Error in fillInit: Out of memory\n");
+    return -1;
+  }
+  randomState = SEED;
+  for (size_t i = 0; i < FILL_SIZE / 2; i += sizeof(uint64_t)) {
+    uint64_t r = nextRandom();
+    memcpy(fillBuffer + i, &r, sizeof(r));
+  }
+  for (size_t i = FILL_SIZE / 2; i < FILL_SIZE; i++) {
+    fillBuffer[i] = text[i % (sizeof(text) - 1)];
+  }
+  return 1;
+}
+
+/*
+   Name: writeFill
+   Purpose: Write len bytes of pattern at offset, starting at a pseudo
+            random place in the pattern so files do not all share the
+			same blocks (which would flatter -D deduplication).
+   Parameters: int fd: file to write to
+			   uint64_t offset: where in the file to start
+			   uint64_t len: number of bytes to write
+   return: 1 on success, -1 on failure
+*/
+static int writeFill(int fd, uint64_t offset, uint64_t len) {
+  uint64_t start = nextRandom() % (FILL_SIZE / 2);
+
+  while (len > 0) {
+    size_t n = FILL_SIZE - start;
+    if (n > len) {
+      n = len;
+    }
+    ssize_t done = pwrite(fd, fillBuffer + start, n, (off_t) offset);
+    if (done <= 0) {
+      perror("Error in writeFill: Could not write file");
+      return -1;
+    }
+    offset += (uint64_t) done;
+    len -= (uint64_t) done;
+    start = 0;
+  }
+  return 1;
+}
+
+/*
+   Name: makeFile
+   Purpose: Create one file of len pattern bytes in the directory dirFd.
+   Parameters: int dirFd: directory to create it in
+			   const char* name: file name
+			   uint64_t len: size of the file
+			   struct treeStats* stats: counts the file and its bytes
+   return: 1 on success, -1 on failure
+*/
+static int makeFile(int dirFd, const char* name, uint64_t len,
+                    struct treeStats* stats) {
+  int fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "Error in makeFile: Could not create %s: %s\n", name,
+            strerror(errno));
+    return -1;
+  }
+  int ok = len == 0 ? 1 : writeFill(fd, 0, len);
+  close(fd);
+  stats -> files++;
+  stats -> bytes += len;
+  stats -> apparentBytes += len;
+  return ok;
+}
+
+/*
+   Name: makeDir
+   Purpose: Create and open a directory below dirFd.
+   Parameters: int dirFd: parent directory
+			   const char* name: directory name
+			   struct treeStats* stats: counts the directory
+   return: descriptor of the new directory, -1 on failure
+*/
+static int makeDir(int dirFd, const char* name, struct treeStats* stats) {
+  if (mkdirat(dirFd, name, 0755) == -1 && errno != EEXIST) {
+    fprintf(stderr, "Error in makeDir: Could not create %s: %s\n", name,
+            strerror(errno));
+    return -1;
+  }
+  int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    fprintf(stderr, "Error in makeDir: Could not open %s: %s\n", name,
+            strerror(errno));
+    return -1;
+  }
+  stats -> dirs++;
+  return fd;
+}
+
+/*
+   Name: tinySize
+   Purpose: Size of a small file: most are a few hundred bytes, some up to
+            TINY_MAX_SIZE and a few are empty, roughly like source trees
+			and mail spools.
+   return: size in bytes
+*/
+static uint64_t tinySize(void) {
+  uint64_t r = nextRandom();
+
+  if (r % 16 == 0) {
+    return 0;
+  }
+  if (r % 4 == 0) {
+    return (r >> 8) % TINY_MAX_SIZE;
+  }
+  return (r >> 8) % (TINY_MAX_SIZE / 8);
+}
+
+/*
+   Name: generateTiny
+   Purpose: count small files as t000/s000/f000, DIR_FANOUT files to a
+            directory and DIR_FANOUT directories below each top directory,
+			so 10 million files need ten top directories.
+   Parameters: int rootFd: root of the tree
+			   uint64_t count: number of files
+			   struct treeStats* stats: what was created
+   return: 1 on success, -1 on failure
+*/
+static int generateTiny(int rootFd, uint64_t count, struct treeStats* stats) {
+  int topFd = -1;
+  int subFd = -1;
+  char name[32];
+
+  for (uint64_t i = 0; i < count; i++) {
+    if (i % ((uint64_t) DIR_FANOUT * DIR_FANOUT) == 0) {
+      if (topFd != -1) {
+        close(topFd);
+      }
+      snprintf(name, sizeof(name), "t%03llu",
+               (unsigned long long) (i / DIR_FANOUT / DIR_FANOUT));
+      topFd = makeDir(rootFd, name, stats);
+      if (topFd == -1) {
+        return -1;
+      }
+    }
+    if (i % DIR_FANOUT == 0) {
+      if (subFd != -1) {
+        close(subFd);
+      }
+      snprintf(name, sizeof(name), "s%03llu",
+               (unsigned long long) (i / DIR_FANOUT % DIR_FANOUT));
+      subFd = makeDir(topFd, name, stats);
+      if (subFd == -1) {
+        close(topFd);
+        return -1;
+      }
+    }
+    snprintf(name, sizeof(name), "f%03llu",
+             (unsigned long long) (i % DIR_FANOUT));
+    if (makeFile(subFd, name, tinySize(), stats) == -1) {
+      close(subFd);
+      close(topFd);
+      return -1;
+    }
+  }
+  if (subFd != -1) {
+    close(subFd);
+  }
+  if (topFd != -1) {
+    close(topFd);
+  }
+  return 1;
+}
+
+/*
+   Name: generateDeep
+   Purpose: A chain of DEEP_LEVELS directories named d with count files
+            spread evenly over the levels. Paths reach about two thousand
+			bytes, which is where per-path costs and descriptor limits of
+			a recursive walk show.
+   Parameters: int rootFd: root of the tree
+			   uint64_t count: number of files
+			   struct treeStats* stats: what was created
+   return: 1 on success, -1 on failure
+*/
+static int generateDeep(int rootFd, uint64_t count, struct treeStats* stats) {
+  uint64_t perLevel = count / DEEP_LEVELS;
+  uint64_t extra = count % DEEP_LEVELS;
+  int dirFd = dup(rootFd);
+  char name[32];
+
+  for (int level = 0; level < DEEP_LEVELS && dirFd != -1; level++) {
+    uint64_t here = perLevel + ((uint64_t) level < extra ? 1 : 0);
+    for (uint64_t i = 0; i < here; i++) {
+      snprintf(name, sizeof(name), "f%llu", (unsigned long long) i);
+      if (makeFile(dirFd, name, tinySize(), stats) == -1) {
+        close(dirFd);
+        return -1;
+      }
+    }
+    int next = makeDir(dirFd, "d", stats);
+    close(dirFd);
+    dirFd = next;
+  }
+  if (dirFd == -1) {
+    return -1;
+  }
+  close(dirFd);
+  return 1;
+}
+
+/*
+   Name: generateWide
+   Purpose: count small files in the root directory itself, the case
+            where directory reads and name lookups dominate.
+   Parameters: int rootFd: root of the tree
+			   uint64_t count: number of files
+			   struct treeStats* stats: what was created
+   return: 1 on success, -1 on failure
+*/
+static int generateWide(int rootFd, uint64_t count, struct treeStats* stats) {
+  char name[32];
+
+  for (uint64_t i = 0; i < count; i++) {
+    snprintf(name, sizeof(name), "w%08llu", (unsigned long long) i);
+    if (makeFile(rootFd, name, tinySize(), stats) == -1) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/*
+   Name: generateHuge
+   Purpose: HUGE_FILES dense files of hugeSize bytes and SPARSE_FILES
+            files four times that size holding SPARSE_EXTENTS data extents
+			with holes between them.
+   Parameters: int rootFd: root of the tree
+			   struct treeStats* stats: what was created
+   return: 1 on success, -1 on failure
+*/
+static int generateHuge(int rootFd, struct treeStats* stats) {
+  char name[32];
+
+  for (int i = 0; i < HUGE_FILES; i++) {
+    snprintf(name, sizeof(name), "huge%d", i);
+    if (makeFile(rootFd, name, hugeSize, stats) == -1) {
+      return -1;
+    }
+  }
+  uint64_t sparseSize = 4 * hugeSize;
+  uint64_t stride = sparseSize / SPARSE_EXTENTS;
+  uint64_t extent = stride < SPARSE_EXTENT_SIZE ? stride : SPARSE_EXTENT_SIZE;
+  for (int i = 0; i < SPARSE_FILES; i++) {
+    snprintf(name, sizeof(name), "sparse%d", i);
+    int fd = openat(rootFd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, (off_t) sparseSize) == -1) {
+      fprintf(stderr, "Error in generateHuge: Could not create %s: %s\n",
+              name, strerror(errno));
+      if (fd != -1) {
+        close(fd);
+      }
+      return -1;
+    }
+    for (int e = 0; e < SPARSE_EXTENTS; e++) {
+      if (writeFill(fd, e * stride, extent) == -1) {
+        close(fd);
+        return -1;
+      }
+    }
+    close(fd);
+    stats -> files++;
+    stats -> bytes += SPARSE_EXTENTS * extent;
+    stats -> apparentBytes += sparseSize;
+  }
+  return 1;
+}
+
+/*
+   Name: removeEntry
+   Purpose: nftw callback of removeTree, called children first.
+   return: 0 to keep walking
+*/
+static int removeEntry(const char* path, const struct stat* st, int flag,
+                       struct FTW* ftw) {
+  (void) st;
+  (void) flag;
+  (void) ftw;
+  if (remove(path) == -1 && errno != ENOENT) {
+    fprintf(stderr, "Error in removeTree: Could not remove %s: %s\n", path,
+            strerror(errno));
+  }
+  return 0;
+}
+
+/*
+   Name: removeTree
+   Purpose: rm -rf path, used to clear trees and restore targets between
+            runs. A path that does not exist is not an error.
+   Parameters: const char* path: file or directory to remove
+*/
+static void removeTree(const char* path) {
+  struct stat st;
+
+  if (lstat(path, &st) == -1) {
+    return;
+  }
+  nftw(path, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+   Name: generateTree
+   Purpose: Build the tree of one profile at path from the fixed seed,
+            replacing whatever was there.
+   Parameters: const char* path: root of the tree
+			   int profile: PROFILE_*
+			   uint64_t count: files for the tiny, deep and wide profiles
+			   struct treeStats* stats: what was created
+   return: 1 on success, -1 on failure
+*/
+static int generateTree(const char* path, int profile, uint64_t count,
+                        struct treeStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  removeTree(path);
+  if (mkdir(path, 0755) == -1) {
+    fprintf(stderr, "Error in generateTree: Could not create %s: %s\n",
+            path, strerror(errno));
+    return -1;
+  }
+  int rootFd = open(path, O_RDONLY | O_DIRECTORY);
+  if (rootFd == -1) {
+    fprintf(stderr, "Error in generateTree: Could not open %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+  stats -> dirs = 1;
+  randomState = SEED + (uint64_t) profile;
+  int ok = -1;
+  switch (profile) {
+    case PROFILE_TINY: ok = generateTiny(rootFd, count, stats); break;
+    case PROFILE_DEEP: ok = generateDeep(rootFd, count, stats); break;
+    case PROFILE_WIDE: ok = generateWide(rootFd, count, stats); break;
+    case PROFILE_HUGE: ok = generateHuge(rootFd, stats); break;
+  }
+  close(rootFd);
+  return ok;
+}
+
+// tree being changed by mutateTree, nftw gives its callback no argument
+static struct treeStats* mutateStats;
+
+// regular files seen so far by mutateEntry
+static uint64_t mutateSeen;
+
+/*
+   Name: mutateEntry
+   Purpose: nftw callback of mutateTree: rewrites MUTATE_SIZE bytes in the
+            middle of every MUTATE_EVERY-th regular file, so large files
+			change one block and small files change as a whole.
+   return: 0 to keep walking, -1 to stop on a write error
+*/
+static int mutateEntry(const char* path, const struct stat* st, int flag,
+                       struct FTW* ftw) {
+  (void) ftw;
+  if (flag != FTW_F || !S_ISREG(st -> st_mode)
+      || mutateSeen++ % MUTATE_EVERY != 0) {
+    return 0;
+  }
+  int fd = open(path, O_WRONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Error in mutateTree: Could not open %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+  uint64_t size = (uint64_t) st -> st_size;
+  uint64_t offset = size > MUTATE_SIZE ? (size / 2) & ~(uint64_t) 4095 : 0;
+  int ok = writeFill(fd, offset, MUTATE_SIZE);
+  close(fd);
+  if (ok == -1) {
+    return -1;
+  }
+  if (offset + MUTATE_SIZE > size) {
+    mutateStats -> bytes += offset + MUTATE_SIZE - size;
+    mutateStats -> apparentBytes += offset + MUTATE_SIZE - size;
+  }
+  mutateStats -> changedFiles++;
+  return 0;
+}
+
+/*
+   Name: mutateTree
+   Purpose: Change one file in MUTATE_EVERY between the full and the
+            incremental backup, what a day of work does to a tree. Each
+			repetition writes other bytes, so its incremental run finds
+			the same files changed since the full run before it.
+   Parameters: const char* path: root of the tree
+			   struct treeStats* stats: changedFiles and bytes are updated
+			   int rep: repetition, part of the seed
+   return: 1 on success, -1 on failure
+*/
+static int mutateTree(const char* path, struct treeStats* stats, int rep) {
+  mutateStats = stats;
+  mutateSeen = 0;
+  stats -> changedFiles = 0;
+  randomState = SEED ^ stats -> files ^ ((uint64_t) rep << 32);
+  if (nftw(path, mutateEntry, 64, FTW_PHYS) != 0) {
+    return -1;
+  }
+  return 1;
+}
+
+/*
+   Name: dropPageCache
+   Purpose: Flush dirty pages and drop the page, dentry and inode caches so
+            the next run reads from storage like a nightly job would. Turns
+			-c off with a warning when not allowed (not root, containers).
+*/
+static void dropPageCache(void) {
+  sync();
+  int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+  if (fd == -1 || write(fd, "3\n", 2) != 2) {
+    fprintf(stderr, "Error in dropPageCache: Cannot drop caches (%s), "
+            "measuring with a warm cache\n", strerror(errno));
+    dropCaches = 0;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+/*
+   Name: startChild
+   Purpose: Fork and exec argv in cwd with stdout on /dev/null; output of
+            the tools is not what is measured beyond the cost of writing it.
+			A traced child stops itself before exec so the tracer can
+			attach its options first.
+   Parameters: char* argv[]: command, argv[0] an absolute path
+			   const char* cwd: directory to run in, NULL to stay
+			   int traced: 1 to run under ptrace
+   return: process id of the child, -1 on failure
+*/
+static pid_t startChild(char* argv[], const char* cwd, int traced) {
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("Error in startChild: Could not fork");
+    return -1;
+  }
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) {
+      dup2(null, STDOUT_FILENO);
+      close(null);
+    }
+    if (cwd != NULL && chdir(cwd) == -1) {
+      _exit(126);
+    }
+    if (traced) {
+      if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+        _exit(126);
+      }
+      raise(SIGSTOP);
+    }
+    execv(argv[0], argv);
+    fprintf(stderr, "Error in startChild: Could not run %s: %s\n", argv[0],
+            strerror(errno));
+    _exit(127);
+  }
+  return pid;
+}
+
+/*
+   Name: exitCode
+   Purpose: Shell style exit code of a wait status.
+   return: the exit status, or 128 plus the terminating signal
+*/
+static int exitCode(int status) {
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+/*
+   Name: traceSyscalls
+   Purpose: Run argv under ptrace and count the system calls of the process
+            and every thread and child it starts. Entries are told from
+			exits with PTRACE_GET_SYSCALL_INFO, so a call interrupted by
+			exit_group still counts once. The timing of this run is not
+			reported, the stops make it many times slower.
+   Parameters: char* argv[]: command
+			   const char* cwd: directory to run in
+   return: number of system calls, -1 when ptrace is not available
+*/
+static long long traceSyscalls(char* argv[], const char* cwd) {
+  pid_t pid = startChild(argv, cwd, 1);
+  int status;
+
+  if (pid == -1) {
+    return -1;
+  }
+  if (waitpid(pid, &status, __WALL) == -1 || !WIFSTOPPED(status)) {
+    fprintf(stderr, "Error in traceSyscalls: ptrace is not permitted\n");
+    return -1;
+  }
+  ptrace(PTRACE_SETOPTIONS, pid, NULL,
+         (void*) (long) (PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE
+                         | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+                         | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL));
+  ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+  long long count = 0;
+  for (;;) {
+    pid_t tid = waitpid(-1, &status, __WALL);
+    if (tid == -1) {
+      break; // ECHILD, every traced task is gone
+    }
+    if (!WIFSTOPPED(status)) {
+      continue;
+    }
+    int sig = WSTOPSIG(status);
+    int deliver = 0;
+    if (sig == (SIGTRAP | 0x80)) {
+      struct __ptrace_syscall_info info;
+      long got = ptrace(PTRACE_GET_SYSCALL_INFO, tid,
+                        (void*) sizeof(info), &info);
+      if (got > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+        count++;
+      }
+    } else if (sig != SIGSTOP && !(sig == SIGTRAP && status >> 16 != 0)) {
+      deliver = sig; // a real signal for the tool, pass it on
+    }
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void*) (long) deliver);
+  }
+  return count;
+}
+
+/*
+   Name: runTool
+   Purpose: Run one command, measuring it with the clock and wait4, and
+            with -s once more under ptrace for its system call count.
+   Parameters: char* argv[]: command
+			   const char* cwd: directory to run in, NULL to stay
+			   struct runResult* result: the measurements
+   return: 1 when the command ran (whatever its exit code), -1 otherwise
+*/
+static int runTool(char* argv[], const char* cwd, struct runResult* result) {
+  struct timespec start;
+  struct timespec end;
+  struct rusage usage;
+  int status;
+
+  memset(result, 0, sizeof(*result));
+  result -> syscalls = -1;
+  if (dropCaches) {
+    dropPageCache();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = startChild(argv, cwd, 0);
+  if (pid == -1) {
+    return -1;
+  }
+  if (wait4(pid, &status, 0, &usage) == -1) {
+    perror("Error in runTool: Could not wait for child");
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result -> wallSeconds = (double) (end.tv_sec - start.tv_sec)
+                          + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+  result -> userSeconds = (double) usage.ru_utime.tv_sec
+                          + (double) usage.ru_utime.tv_usec / 1e6;
+  result -> systemSeconds = (double) usage.ru_stime.tv_sec
+                            + (double) usage.ru_stime.tv_usec / 1e6;
+  result -> maxRssKb = usage.ru_maxrss;
+  result -> inBlocks = usage.ru_inblock;
+  result -> outBlocks = usage.ru_oublock;
+  result -> exitStatus = exitCode(status);
+  return 1;
+}
+
+/*
+   Name: printRun
+   Purpose: One JSON object for one run. files/s and MB/s are over the
+            whole tree (MB being 10^6 data bytes), so runs of different
+			phases and releases compare directly.
+   Parameters: const char* tool: listfiles, backupfiles or backup
+			   const char* phase: what the run did
+			   int rep: repetition number
+			   const struct treeStats* stats: the tree measured
+			   const struct runResult* r: the measurements
+			   const char* archive: archive the run wrote, NULL if none
+			   int first: 1 for the first run of a profile
+*/
+static void printRun(const char* tool, const char* phase, int rep,
+                     const struct treeStats* stats,
+                     const struct runResult* r, const char* archive,
+                     int first) {
+  double wall = r -> wallSeconds > 0 ? r -> wallSeconds : 1e-9;
+
+  printf("%s\n        {\"tool\": \"%s\", \"phase\": \"%s\", \"rep\": %d, ",
+         first ? "" : ",", tool, phase, rep);
+  printf("\"exit\": %d, \"wall_s\": %.6f, \"user_s\": %.6f, "
+         "\"sys_s\": %.6f, ", r -> exitStatus, r -> wallSeconds,
+         r -> userSeconds, r -> systemSeconds);
+  printf("\"files_per_s\": %.1f, \"mb_per_s\": %.3f, ",
+         (double) stats -> files / wall, (double) stats -> bytes / 1e6 / wall);
+  printf("\"max_rss_kb\": %ld, \"in_blocks\": %ld, \"out_blocks\": %ld, ",
+         r -> maxRssKb, r -> inBlocks, r -> outBlocks);
+  if (archive != NULL) {
+    struct stat st;
+    long long size = stat(archive, &st) == 0 ? (long long) st.st_size : -1;
+    printf("\"archive_bytes\": %lld, ", size);
+  }
+  if (r -> syscalls >= 0) {
+    printf("\"syscalls\": %lld}", r -> syscalls);
+  } else {
+    printf("\"syscalls\": null}");
+  }
+}
+
+/*
+   Name: buildArgs
+   Purpose: Fill argv with the tool path, the given switches and the -a
+            switches when the tool is backup, NULL terminated.
+   Parameters: char* argv[]: MAX_ARGS slots to fill
+			   char* tool: absolute path of the tool
+			   int isBackup: 1 to append the -a switches
+			   char* args[]: switches and operands, NULL terminated
+*/
+static void buildArgs(char* argv[], char* tool, int isBackup, char* args[]) {
+  int n = 0;
+
+  argv[n++] = tool;
+  if (isBackup) {
+    for (int i = 0; i < backupArgCount && n < MAX_ARGS - 8; i++) {
+      argv[n++] = backupArgs[i];
+    }
+  }
+  for (int i = 0; args[i] != NULL && n < MAX_ARGS - 1; i++) {
+    argv[n++] = args[i];
+  }
+  argv[n] = NULL;
+}
+
+/*
+   Name: benchProfile
+   Purpose: Generate one tree and run every tool against it reps times:
+            listfiles (in the tree), backupfiles, a full backup that
+			starts a catalog, an incremental backup after mutateTree, and a
+			restore of the full archive into an empty directory.
+   Parameters: const char* work: working directory, absolute
+			   const char* bin: directory holding the three tools, absolute
+			   int profile: PROFILE_*
+			   uint64_t count: files for the file count profiles
+			   int reps: repetitions of each run
+			   int keep: 1 to leave the tree and archives behind
+   return: 1 on success, -1 when the tree could not be built
+*/
+static int benchProfile(const char* work, const char* bin, int profile,
+                        uint64_t count, int reps, int keep) {
+  char dir[PATH_MAX];
+  char tree[PATH_MAX];
+  char restored[PATH_MAX];
+  char catalog[PATH_MAX];
+  char full[PATH_MAX];
+  char incr[PATH_MAX];
+  char listfiles[PATH_MAX];
+  char backupfiles[PATH_MAX];
+  char backup[PATH_MAX];
+  struct treeStats stats;
+  struct timespec start;
+  struct timespec end;
+
+  // every path below is at most a short suffix longer than work or bin
+  if (snprintf(dir, sizeof(dir), "%s/%s", work, profileNames[profile])
+      >= (int) sizeof(dir)
+      || snprintf(tree, sizeof(tree), "%s/tree", dir) >= (int) sizeof(tree)
+      || snprintf(restored, sizeof(restored), "%s/restored", dir)
+         >= (int) sizeof(restored)
+      || snprintf(catalog, sizeof(catalog), "%s/tree.cat", dir)
+         >= (int) sizeof(catalog)
+      || snprintf(full, sizeof(full), "%s/full.arc", dir) >= (int) sizeof(full)
+      || snprintf(incr, sizeof(incr), "%s/incremental.arc", dir)
+         >= (int) sizeof(incr)
+      || snprintf(listfiles, sizeof(listfiles), "%s/listfiles", bin)
+         >= (int) sizeof(listfiles)
+      || snprintf(backupfiles, sizeof(backupfiles), "%s/backupfiles", bin)
+         >= (int) sizeof(backupfiles)
+      || snprintf(backup, sizeof(backup), "%s/backup", bin)
+         >= (int) sizeof(backup)) {
+    fprintf(stderr, "Error in benchProfile: Path too long below %s\n", work);
+    return -1;
+  }
+
+  removeTree(dir);
+  if (mkdir(dir, 0755) == -1) {
+    fprintf(stderr, "Error in benchProfile: Could not create %s: %s\n", dir,
+            strerror(errno));
+    return -1;
+  }
+  fprintf(stderr, "benchmark: generating %s tree\n", profileNames[profile]);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (generateTree(tree, profile, count, &stats) == -1) {
+    return -1;
+  }
+  sync();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("%s\n    {\"profile\": \"%s\", \"files\": %llu, \"dirs\": %llu, ",
+         firstProfile ? "" : ",", profileNames[profile],
+         (unsigned long long) stats.files, (unsigned long long) stats.dirs);
+  printf("\"bytes\": %llu, \"apparent_bytes\": %llu, \"generate_s\": %.3f,\n",
+         (unsigned long long) stats.bytes,
+         (unsigned long long) stats.apparentBytes,
+         (double) (end.tv_sec - start.tv_sec)
+         + (double) (end.tv_nsec - start.tv_nsec) / 1e9);
+  printf("      \"runs\": [");
+  firstProfile = 0;
+
+  char* listArgs[] = { NULL };
+  char* selectArgs[] = { tree, NULL };
+  char* fullArgs[] = { "-C", catalog, "-f", full, tree, NULL };
+  char* incrArgs[] = { "-C", catalog, "-f", incr, tree, NULL };
+  char* restoreArgs[] = { "-r", "-f", full, restored, NULL };
+  char* argv[MAX_ARGS];
+  struct runResult r;
+  int first = 1;
+
+  for (int rep = 0; rep < reps; rep++) {
+    fprintf(stderr, "benchmark: %s run %d\n", profileNames[profile], rep);
+    buildArgs(argv, listfiles, 0, listArgs);
+    if (runTool(argv, tree, &r) == 1) {
+      if (countSyscalls) {
+        r.syscalls = traceSyscalls(argv, tree);
+      }
+      printRun("listfiles", "list", rep, &stats, &r, NULL, first);
+      first = 0;
+    }
+    buildArgs(argv, backupfiles, 0, selectArgs);
+    if (runTool(argv, NULL, &r) == 1) {
+      if (countSyscalls) {
+        r.syscalls = traceSyscalls(argv, NULL);
+      }
+      printRun("backupfiles", "select", rep, &stats, &r, NULL, first);
+      first = 0;
+    }
+
+    // the full run starts the catalog the incremental run compares with;
+    // the traced repeat runs first so the timed run leaves the catalog
+    buildArgs(argv, backup, 1, fullArgs);
+    if (countSyscalls) {
+      unlink(catalog);
+      r.syscalls = traceSyscalls(argv, NULL);
+    }
+    long long traced = r.syscalls;
+    unlink(catalog);
+    if (runTool(argv, NULL, &r) == 1) {
+      r.syscalls = countSyscalls ? traced : -1;
+      printRun("backup", "full", rep, &stats, &r, full, first);
+      first = 0;
+    }
+
+    // every full run starts a new catalog, so change the tree again
+    if (mutateTree(tree, &stats, rep) == -1) {
+      fprintf(stderr, "Error in benchProfile: Could not change the tree\n");
+      return -1;
+    }
+    buildArgs(argv, backup, 1, incrArgs);
+    char saved[PATH_MAX + 8];
+    snprintf(saved, sizeof(saved), "%s.full", catalog);
+    if (countSyscalls) {
+      // the traced run moves the catalog on, so it runs on a copy
+      rename(catalog, saved);
+      char* copyArgs[] = { "/bin/cp", saved, catalog, NULL };
+      pid_t copier = startChild(copyArgs, NULL, 0);
+      int status;
+      if (copier != -1) {
+        waitpid(copier, &status, 0);
+      }
+      r.syscalls = traceSyscalls(argv, NULL);
+      rename(saved, catalog);
+    }
+    traced = r.syscalls;
+    if (runTool(argv, NULL, &r) == 1) {
+      r.syscalls = countSyscalls ? traced : -1;
+      printRun("backup", "incremental", rep, &stats, &r, incr, first);
+      first = 0;
+    }
+
+    buildArgs(argv, backup, 1, restoreArgs);
+    if (countSyscalls) {
+      removeTree(restored);
+      mkdir(restored, 0755);
+      traced = traceSyscalls(argv, NULL);
+    }
+    removeTree(restored);
+    mkdir(restored, 0755);
+    if (dropCaches) {
+      sync(); // the removal above is not part of the restore
+    }
+    if (runTool(argv, NULL, &r) == 1) {
+      r.syscalls = countSyscalls ? traced : -1;
+      printRun("backup", "restore", rep, &stats, &r, NULL, first);
+      first = 0;
+    }
+    removeTree(restored);
+  }
+  printf("\n      ], \"changed_files\": %llu}",
+         (unsigned long long) stats.changedFiles);
+  fflush(stdout);
+  if (!keep) {
+    removeTree(dir);
+  }
+  return 1;
+}
+
+/*
+   Name: commandLineSwitch
+   Purpose: Read the switches and run the chosen profiles, printing the
+            JSON document.
+			Parameters: char* argv[]: arrays of arguments
+					   int sizeOfArgs: number of arguments
+   return: return 1 if success, -1 on failure
+*/
+int commandLineSwitch(char* argv [], int sizeOfArgs) {
+  int selected[PROFILE_COUNT] = { 0 };
+  int anySelected = 0;
+  uint64_t count = DEFAULT_FILES;
+  int reps = 1;
+  int keep = 0;
+  const char* work = "benchwork";
+  const char* bin = ".";
+
+  for (int i = 1; i < sizeOfArgs; i++) {
+    if (strcmp(argv[i], "-h") == 0) {
+      printf("\n");
+      printf("Switches: -g | -n | -H | -r | -w | -b | -a | -c | -s | -k | -h\n");
+      printf("-g <profile> tree to measure: tiny, deep, wide, huge or all;\n");
+      printf("   may be repeated, all by default\n");
+      printf("-n <files> files in the tiny, deep and wide trees (%d)\n",
+             DEFAULT_FILES);
+      printf("-H <size> size of the huge files, K, M or G (256M); the\n");
+      printf("   sparse files are four times that with holes\n");
+      printf("-r <count> repetitions of each run (1)\n");
+      printf("-w <dir> working directory for trees and archives (benchwork)\n");
+      printf("-b <dir> directory holding listfiles, backupfiles, backup (.)\n");
+      printf("-a <switches> extra switches for every backup run, e.g. -z zstd\n");
+      printf("-c drop the page cache before each run (needs root)\n");
+      printf("-s count system calls, repeating each run under ptrace\n");
+      printf("-k keep the trees and archives\n");
+      printf("-h displays this current message\n");
+      printf("Example format: ./benchmark -g tiny -n 10000000 -s > out.json\n");
+      return 1;
+    }
+    if (strcmp(argv[i], "-c") == 0) {
+      dropCaches = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-s") == 0) {
+      countSyscalls = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-k") == 0) {
+      keep = 1;
+      continue;
+    }
+    if (i == sizeOfArgs - 1) {
+      printf("Error in commandLineSwitch: %s needs a value\n", argv[i]);
+      return -1;
+    }
+    char* value = argv[++i];
+    char* end;
+    if (strcmp(argv[i-1], "-g") == 0) {
+      int found = 0;
+      for (int p = 0; p < PROFILE_COUNT; p++) {
+        if (strcmp(value, profileNames[p]) == 0
+            || strcmp(value, "all") == 0) {
+          selected[p] = 1;
+          found = 1;
+        }
+      }
+      if (!found) {
+        printf("Error in commandLineSwitch: Unknown profile %s\n", value);
+        return -1;
+      }
+      anySelected = 1;
+    } else if (strcmp(argv[i-1], "-n") == 0) {
+      count = strtoull(value, &end, 10);
+      if (*end != '\0' || count == 0) {
+        printf("Error in commandLineSwitch: Invalid file count %s\n", value);
+        return -1;
+      }
+    } else if (strcmp(argv[i-1], "-H") == 0) {
+      hugeSize = strtoull(value, &end, 10);
+      int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+      if (shift != 0) {
+        end++;
+      }
+      hugeSize <<= shift;
+      if (*end != '\0' || hugeSize < SPARSE_EXTENTS) {
+        printf("Error in commandLineSwitch: Invalid size %s\n", value);
+        return -1;
+      }
+    } else if (strcmp(argv[i-1], "-r") == 0) {
+      reps = atoi(value);
+      if (reps < 1) {
+        printf("Error in commandLineSwitch: Invalid repetitions %s\n", value);
+        return -1;
+      }
+    } else if (strcmp(argv[i-1], "-w") == 0) {
+      work = value;
+    } else if (strcmp(argv[i-1], "-b") == 0) {
+      bin = value;
+    } else if (strcmp(argv[i-1], "-a") == 0) {
+      // split on spaces, the strings stay in argv
+      for (char* s = strtok(value, " "); s != NULL; s = strtok(NULL, " ")) {
+        if (backupArgCount == MAX_ARGS / 2) {
+          printf("Error in commandLineSwitch: Too many -a switches\n");
+          return -1;
+        }
+        backupArgs[backupArgCount++] = s;
+      }
+    } else {
+      printf("Error in commandLineSwitch: Unknown switch %s\n", argv[i-1]);
+      return -1;
+    }
+  }
+  if (!anySelected) {
+    for (int p = 0; p < PROFILE_COUNT; p++) {
+      selected[p] = 1;
+    }
+  }
+
+  // the tools run in other directories, so both paths are made absolute
+  if (mkdir(work, 0755) == -1 && errno != EEXIST) {
+    printf("Error in commandLineSwitch: Could not create %s\n", work);
+    return -1;
+  }
+  char* workPath = realpath(work, NULL);
+  char* binPath = realpath(bin, NULL);
+  if (workPath == NULL || binPath == NULL) {
+    printf("Error in commandLineSwitch: No such directory\n");
+    return -1;
+  }
+  if (fillInit() == -1) {
+    return -1;
+  }
+
+  struct utsname host;
+  uname(&host);
+  printf("{\"benchmark\": 1, \"host\": \"%s\", \"kernel\": \"%s\", ",
+         host.nodename, host.release);
+  printf("\"cpus\": %ld, \"cold_cache\": %s, \"backup_args\": \"",
+         sysconf(_SC_NPROCESSORS_ONLN), dropCaches ? "true" : "false");
+  for (int i = 0; i < backupArgCount; i++) {
+    printf("%s%s", i > 0 ? " " : "", backupArgs[i]);
+  }
+  printf("\",\n  \"profiles\": [");
+
+  int ok = 1;
+  for (int p = 0; p < PROFILE_COUNT; p++) {
+    if (selected[p] && benchProfile(workPath, binPath, p, count, reps,
+                                    keep) == -1) {
+      ok = -1;
+      break;
+    }
+  }
+  printf("\n  ]}\n");
+  free(workPath);
+  free(binPath);
+  free(fillBuffer);
+  return ok;
+}
+
+int main(int argc, char * argv[]) {
+
+  if ((commandLineSwitch(argv, argc) == -1)) {
+	return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
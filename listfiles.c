@@ -2,10 +2,12 @@
    Title: listfiles.c
    Author: Calvin Mohammed
    Purpose: Recursively traverse through the relative directory "." displaying
-	        information about each file/directory encountered.
+	        information about each file/directory encountered. Besides the
+			ls -l style text, the listing can be written NUL delimited,
+			as JSON Lines or as binary records for other tools, see -o.
    Version: 1.0
 */
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <stdio.h> 
 #include <time.h> 
 #include <fcntl.h> 
@@ -13,18 +15,69 @@
 #include <unistd.h> 
 #include <sys/types.h> 
 #include <dirent.h> 
-#include <ftw.h> 
 #include <sys/stat.h> 
 #include <grp.h> 
 #include <pwd.h> 
 #include <string.h> 
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 
 
 // SYMBOLIC CONSTANTS
 #define BUFFER_DIR (1024)
 #define BUFFER_SIZE (1024)
 #define TIME_SIZE (128)
-#define INFOSTR_SIZE (2048)
+#define OUTPUT_SIZE (1024 * 1024) // bytes collected before each write()
+#define LINE_MAX_SIZE (PATH_MAX + 512) // longest single entry in any format
+
+// output formats, -o
+#define FORMAT_TEXT (0) // ls -l lines under a header line per directory
+#define FORMAT_NUL (1) // full paths, each terminated by a NUL byte
+#define FORMAT_JSON (2) // one JSON object per line
+#define FORMAT_BINARY (3) // fixed size record followed by the path
+
+// BINARY RECORD, all fields little endian
+//  0 magic "IFBL"  4 mode u32  8 nlink u32  12 uid u32  16 gid u32
+// 20 pathLen u32  24 size u64  32 mtimeNs i64  40 ino u64  48 dev u64
+// 56 blocks u64, then pathLen bytes of path without a terminator
+#define RECORD_MAGIC "IFBL"
+#define RECORD_SIZE (64)
+
+
+/*
+   Name: nameCache
+   Purpose: Cache of user or group names by numeric id for the whole run,
+            so the passwd and group databases (possibly LDAP or sssd behind
+			NSS) are asked once per id instead of once per file. Open
+			addressing with linear probing.
+*/
+struct idName {
+  unsigned int id;
+  char* name; // NULL for a free slot
+};
+
+struct nameCache {
+  struct idName* slots;
+  size_t mask; // slot count - 1, the count is a power of two
+  size_t count; // slots in use
+};
+
+static struct nameCache userNames;
+static struct nameCache groupNames;
+
+/*
+   Name: output
+   Purpose: One large buffer all entries are formatted into, handed to
+            write() whenever it fills up, so a listing of millions of
+			files costs a few thousand system calls and no allocations.
+*/
+static struct {
+  char* data;
+  size_t used;
+  int format;
+  int failed; // stdout went away or out of memory, stop listing
+} output;
 
 
 
@@ -33,12 +86,19 @@
    Purpose: Turn a generic time_t object into that of the format: 
             MONTH MONTH_DAY  HOUR:MINUTE
 			for displaying information for a given file. Similar to ls -l
+			localtime() is called for the two ends of each UTC hour of
+			timestamps seen: when the UTC offset is the same at both it is
+			remembered for the hour and the date is worked out from the
+			day number directly. An hour with a transition in it, which
+			for half hour zones does not start on the hour, asks
+			localtime() for every timestamp.
    Parameters: time_t t
-   return: str (char*) 
+               char* str: receives the text, at least TIME_SIZE bytes
+   return: length of the text in str
 */
-char* formatTime(time_t t) {
+int formatTime(time_t t, char* str) {
   // define array of months that map to the corresponding number
-  const char * months[12] = {
+  static const char * months[12] = {
     "Jan",
     "Feb",
     "Mar",
@@ -52,40 +112,126 @@ char* formatTime(time_t t) {
     "Nov",
     "Dec"
   };
+  static time_t cachedHour = -1;
+  static long cachedOffset;
+  static int cachedSplit; // the offset changes within cachedHour
 
-  // define the string that will contain the time information
-  char* str = malloc(TIME_SIZE);
-  
-  // utilize the struct tm to extract information from time_t
-  struct tm timeInfo = *localtime(&t);
-  snprintf(str, TIME_SIZE, "%s %2d  %02d:%02d", months[timeInfo.tm_mon],\
-		   timeInfo.tm_mday, timeInfo.tm_hour, timeInfo.tm_min);
+  time_t hour = t >= 0 ? t / 3600 : (t - 3599) / 3600;
+  if (hour != cachedHour) {
+    struct tm first;
+    struct tm last;
+    time_t start = hour * 3600;
+    time_t end = start + 3599;
+    localtime_r(&start, &first);
+    localtime_r(&end, &last);
+    cachedOffset = first.tm_gmtoff;
+    cachedSplit = first.tm_gmtoff != last.tm_gmtoff;
+    cachedHour = hour;
+  }
+  long offset = cachedOffset;
+  if (cachedSplit) {
+    struct tm timeInfo;
+    localtime_r(&t, &timeInfo);
+    offset = timeInfo.tm_gmtoff;
+  }
+  int64_t local = (int64_t) t + offset;
+  int64_t days = local >= 0 ? local / 86400 : (local - 86399) / 86400;
+  int64_t secs = local - days * 86400;
+
+  // civil date from days since 1970-01-01, Howard Hinnant's algorithm
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t doe = days - era * 146097;
+  int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int64_t mp = (5 * doy + 2) / 153;
+  int mday = doy - (153 * mp + 2) / 5 + 1;
+  int mon = mp < 10 ? mp + 2 : mp - 10;
 
-  return str;
+  return snprintf(str, TIME_SIZE, "%s %2d  %02d:%02d", months[mon], mday,
+                  (int) (secs / 3600), (int) (secs / 60 % 60));
 }
 
 
+/*
+   Name: cachedName
+   Purpose: Look up the name of a user or group id, asking NSS only the
+            first time an id is seen. Ids without an entry are named by
+			their number, like ls does, instead of crashing. The table
+			doubles before it is 70% full.
+   Parameters: struct nameCache* cache: userNames or groupNames
+               unsigned int id, int isGroup
+   return: char* the name, "?" if out of memory
+*/
+char* cachedName(struct nameCache* cache, unsigned int id, int isGroup) {
+  if (cache -> slots == NULL
+      || (cache -> count + 1) * 10 > (cache -> mask + 1) * 7) {
+    size_t size = cache -> slots == NULL ? 64 : (cache -> mask + 1) * 2;
+    struct idName* grown = calloc(size, sizeof(struct idName));
+    if (grown == NULL) {
+      return "?";
+    }
+    for (size_t i = 0; cache -> slots != NULL && i <= cache -> mask; i++) {
+      if (cache -> slots[i].name != NULL) {
+        size_t j = (cache -> slots[i].id * 0x9E3779B1U) & (size - 1);
+        while (grown[j].name != NULL) {
+          j = (j + 1) & (size - 1);
+        }
+        grown[j] = cache -> slots[i];
+      }
+    }
+    free(cache -> slots);
+    cache -> slots = grown;
+    cache -> mask = size - 1;
+  }
+
+  size_t i = (id * 0x9E3779B1U) & cache -> mask;
+  while (cache -> slots[i].name != NULL && cache -> slots[i].id != id) {
+    i = (i + 1) & cache -> mask;
+  }
+  if (cache -> slots[i].name != NULL) {
+    return cache -> slots[i].name;
+  }
+
+  const char* name = NULL;
+  if (isGroup) {
+    struct group* gPoint = getgrgid(id);
+    name = gPoint != NULL ? gPoint -> gr_name : NULL;
+  } else {
+    struct passwd* pPoint = getpwuid(id);
+    name = pPoint != NULL ? pPoint -> pw_name : NULL;
+  }
+  char number[16];
+  if (name == NULL) {
+    snprintf(number, sizeof(number), "%u", id);
+  }
+  char* copy = strdup(name != NULL ? name : number);
+  if (copy == NULL) {
+    return "?";
+  }
+  cache -> slots[i].id = id;
+  cache -> slots[i].name = copy;
+  cache -> count++;
+  return copy;
+}
+
 /*
    Name: getGroupName()
    Purpose: Retrieve the group name that a file belongs too given the ID.
    Parameters: int groupID, retrieved from the stat struct for a given file
-   return: char* the name of the group
+   return: char* the name of the group, or the ID itself if it has none
 */
 char* getGroupName(int groupID) {
-  struct group* gPoint;
-  gPoint = getgrgid(groupID);
-  return gPoint -> gr_name;
+  return cachedName(&groupNames, groupID, 1);
 }
 /*
    Name: getUserName()
    Purpose: Retrieve the username of the account that created the file.
    Parameters: int userID, retrieved from the stat struct for a given file
-   return: char* the name of the user
+   return: char* the name of the user, or the ID itself if it has none
 */
 char* getUserName(int userID) {
-  struct passwd* pPoint;
-  pPoint = getpwuid(userID);
-  return pPoint -> pw_name;
+  return cachedName(&userNames, userID, 0);
 }
 /*
    Name: getPermissions()
@@ -105,10 +251,10 @@ char* getUserName(int userID) {
 			(10)x|- : x = other execute permission, - = user no execute permiss-
 							ion				
    Parameters: int fileMode
-   return: char* of size 10 representing the permission format of ls -l
+               char* perStr: receives the string, at least 11 bytes
+   return: void, perStr holds 10 characters in the permission format of ls -l
 */
-char* getPermissions(int fileMode) {
-  char* perStr = malloc(10);
+void getPermissions(int fileMode, char* perStr) {
   // directory or not
   if (S_ISDIR(fileMode) == 1) {
     perStr[0] = 'd';
@@ -177,35 +323,186 @@ char* getPermissions(int fileMode) {
   }
   // terminate the permission string
   perStr[10] = '\0';
-  return perStr;
 }
+/*
+   Name: outputFlush
+   Purpose: Hand everything formatted so far to stdout.
+   Parameters: none
+   return: 1 on success, -1 if stdout could not be written
+*/
+int outputFlush(void) {
+  size_t done = 0;
+  while (done < output.used) {
+    ssize_t n = write(STDOUT_FILENO, output.data + done, output.used - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror("Error in outputFlush: Could not write listing");
+      output.failed = 1;
+      output.used = 0;
+      return -1;
+    }
+    done += n;
+  }
+  output.used = 0;
+  return 1;
+}
+
+/*
+   Name: outputReserve
+   Purpose: Make sure the next entry fits behind what is already buffered.
+   Parameters: size_t len: most bytes the entry will take
+   return: where to format it
+*/
+char* outputReserve(size_t len) {
+  if (OUTPUT_SIZE - output.used < len) {
+    outputFlush();
+  }
+  return output.data + output.used;
+}
+
+// little endian stores for the binary records
+static void putLE32(unsigned char* p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+static void putLE64(unsigned char* p, uint64_t v) {
+  for (int i = 0; i < 8; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+/*
+   Name: jsonString
+   Purpose: Copy s into out as a quoted JSON string. Quotes, backslashes and
+            control characters are escaped; other bytes are copied as they
+			are, so names that are not valid UTF-8 stay byte exact.
+   Parameters: char* out: room for 6 bytes per input byte plus 2
+               const char* s
+   return: bytes written
+*/
+size_t jsonString(char* out, const char* s) {
+  static const char hex[] = "0123456789abcdef";
+  size_t n = 0;
+  out[n++] = '"';
+  for (; *s != '\0'; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out[n++] = '\\';
+      out[n++] = c;
+    } else if (c < 0x20) {
+      memcpy(out + n, "\\u00", 4);
+      out[n + 4] = hex[c >> 4];
+      out[n + 5] = hex[c & 15];
+      n += 6;
+    } else {
+      out[n++] = c;
+    }
+  }
+  out[n++] = '"';
+  return n;
+}
+
 /*
    Name: fileInfo
-   Purpose: Given all information retrieved from the file, present it in a 
-		    format that of ls -l:
+   Purpose: Given all information retrieved from the file, append it to the
+		    output buffer in the selected format. For text that is the
+			format of ls -l:
 			[permissionString links username groupname size date time filename]
-			Parameters: char* name: Name of the file
-						char* time: formatted time string (from formatTime())
-									it is most recent modification time of the
-									file
-						int links: No of links to the file
-						char* userName: User who created the file
-						char* groupName: The group the file belongs to
-						char* permissions: Permission string from 
-											getPermissions()
-						int size: Size of the file in bytes
-			it will print it out in a format that of ls -l.
-   return: char* string
+			The other formats name the file by its full path and skip the
+			"." and ".." entries, so every file appears exactly once.
+			Parameters: const char* dir: directory the file is in
+						const char* name: Name of the file
+						const struct stat* fileData: information for the file
+   return: void
 */
-char* fileInfo(char* name, char* time, int links, char* userName, 
-			   char* groupName, char* permissions, int size) {
-  char* fileInfo = malloc(INFOSTR_SIZE);
+void fileInfo(const char* dir, const char* name,
+              const struct stat* fileData) {
+  int dots = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+  if (output.format != FORMAT_TEXT && dots) {
+    return;
+  }
+  char path[PATH_MAX];
+  size_t dirLen = strlen(dir);
+  size_t nameLen = strlen(name);
+  size_t pathLen = dirLen + 1 + nameLen;
+  if (output.format != FORMAT_TEXT) {
+    if (pathLen >= PATH_MAX) {
+      return;
+    }
+    memcpy(path, dir, dirLen);
+    path[dirLen] = '/';
+    memcpy(path + dirLen + 1, name, nameLen + 1);
+  }
+
+  if (output.format == FORMAT_NUL) {
+    char* out = outputReserve(pathLen + 1);
+    memcpy(out, path, pathLen + 1);
+    output.used += pathLen + 1;
+    return;
+  }
+  if (output.format == FORMAT_BINARY) {
+    unsigned char* out = (unsigned char*) outputReserve(RECORD_SIZE
+                                                        + pathLen);
+    memcpy(out, RECORD_MAGIC, 4);
+    putLE32(out + 4, fileData -> st_mode);
+    putLE32(out + 8, fileData -> st_nlink);
+    putLE32(out + 12, fileData -> st_uid);
+    putLE32(out + 16, fileData -> st_gid);
+    putLE32(out + 20, pathLen);
+    putLE64(out + 24, fileData -> st_size);
+    putLE64(out + 32, (int64_t) fileData -> st_mtim.tv_sec * 1000000000LL
+                      + fileData -> st_mtim.tv_nsec);
+    putLE64(out + 40, fileData -> st_ino);
+    putLE64(out + 48, fileData -> st_dev);
+    putLE64(out + 56, fileData -> st_blocks);
+    memcpy(out + RECORD_SIZE, path, pathLen);
+    output.used += RECORD_SIZE + pathLen;
+    return;
+  }
 
-  snprintf(fileInfo, INFOSTR_SIZE, "%s %2d %s %10s %8d %12s %s",
-	   permissions, links, userName, groupName, 
-	   size, time, name);
+  const char* userName = getUserName(fileData -> st_uid);
+  const char* groupName = getGroupName(fileData -> st_gid);
+  if (output.format == FORMAT_JSON) {
+    // every string may grow sixfold when escaped
+    char* out = outputReserve(6 * (pathLen + strlen(userName)
+                                   + strlen(groupName)) + 256);
+    const char* type = S_ISDIR(fileData -> st_mode) ? "dir"
+                       : S_ISREG(fileData -> st_mode) ? "file"
+                       : S_ISLNK(fileData -> st_mode) ? "symlink" : "other";
+    size_t n = 0;
+    memcpy(out, "{\"path\":", 8);
+    n = 8 + jsonString(out + 8, path);
+    n += sprintf(out + n, ",\"type\":\"%s\",\"mode\":%u,\"nlink\":%lu,"
+                 "\"uid\":%u,\"user\":", type,
+                 (unsigned int) (fileData -> st_mode & 07777),
+                 (unsigned long) fileData -> st_nlink,
+                 (unsigned int) fileData -> st_uid);
+    n += jsonString(out + n, userName);
+    n += sprintf(out + n, ",\"gid\":%u,\"group\":",
+                 (unsigned int) fileData -> st_gid);
+    n += jsonString(out + n, groupName);
+    n += sprintf(out + n, ",\"size\":%lld,\"mtime\":%lld.%09ld}\n",
+                 (long long) fileData -> st_size,
+                 (long long) fileData -> st_mtim.tv_sec,
+                 (long) fileData -> st_mtim.tv_nsec);
+    output.used += n;
+    return;
+  }
 
-  return fileInfo;
+  char time[TIME_SIZE];
+  char permissions[11];
+  formatTime(fileData -> st_mtime, time);
+  getPermissions(fileData -> st_mode, permissions);
+  char* out = outputReserve(LINE_MAX_SIZE + strlen(userName)
+                            + strlen(groupName));
+  output.used += sprintf(out, "%s %2lu %s %10s %8lld %12s %s\n",
+                         permissions, (unsigned long) fileData -> st_nlink,
+                         userName, groupName,
+                         (long long) fileData -> st_size, time, name);
 }
 /*
    Name: readDir
@@ -218,17 +515,45 @@ char* fileInfo(char* name, char* time, int links, char* userName,
 			- username who created the file
 			- groupname the file belongs to
 			- permissions of the file
-			It them displays the information using fileInfo(). 
+			It them displays the information using fileInfo(), then does the
+			same for every subdirectory in readdir() order.
+			Each entry is stat()ed exactly once, relative to the directory
+			descriptor. "." and ".." reuse the information already fetched
+			by the caller, and dirent's d_type decides which entries are
+			subdirectories, so nothing is looked up twice.
 			
-			Parameters: Directory to traverse
+			Parameters: const char* dir: absolute path of the directory
+			            const struct stat* self: information for dir
+						const struct stat* parent: information for dir/..
    return: return 0 on success
 */
-int readDir(const char* dir) {
+int readDir(const char* dir, const struct stat* self,
+            const struct stat* parent) {
 	
-  
+  int dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
   // declare a pointer to the directory argument
-  DIR* directPoint = opendir(dir);
-  
+  DIR* directPoint = dirFd == -1 ? NULL : fdopendir(dirFd);
+  if (directPoint == NULL) {
+    if (dirFd != -1) {
+      close(dirFd);
+    }
+    return -1;
+  }
+
+  // State what directory you are currently in
+  if (output.format == FORMAT_TEXT) {
+    size_t dirLen = strlen(dir);
+    char* out = outputReserve(dirLen + 1);
+    memcpy(out, dir, dirLen);
+    out[dirLen] = '\n';
+    output.used += dirLen + 1;
+  }
+
+  // subdirectories are listed after this directory, like nftw did
+  char** subNames = NULL;
+  struct stat* subData = NULL;
+  size_t subCount = 0;
+  size_t subCapacity = 0;
 
   // dirent struct provides file name information and determines whether
   // the file pointer is actually pointing to a file
@@ -236,87 +561,122 @@ int readDir(const char* dir) {
 
   // iterate through the directory until the directory pointer sees no file left
   // in the directory
-  while ((entry = readdir(directPoint)) != NULL) {
+  while (output.failed == 0 && (entry = readdir(directPoint)) != NULL) {
 	  
 	
     struct stat fileData; // to retrieve user ids, group ids and mod times
 						  // for a given file
-    char buffer[BUFFER_SIZE]; // declare a string that stores the current
-							  // file being looked at
-    char path[1024];		 // declare a string that stores the absolute
-							  // path of the current file being looked at
-	
 	
-    strcpy(path, dir);
-    strcat(path, "/%s");
-    snprintf(buffer, BUFFER_SIZE, path, entry -> d_name);
-
-    stat(buffer, &fileData); // accesses a struct that contains information
-							 // for the current file stored in the buffer
+    if (strcmp(entry -> d_name, ".") == 0) {
+      fileData = *self;
+    } else if (strcmp(entry -> d_name, "..") == 0) {
+      fileData = *parent;
+    } else if (fstatat(dirFd, entry -> d_name, &fileData, 0) == -1) {
+      continue; // vanished since readdir
+    }
 							 
-	// Retrieve/store information for given file			 
     char* name = entry -> d_name; // Name of file/directory
-    char* time = formatTime(fileData.st_mtime); //last modification time of file
-    int size = fileData.st_size; // Size of file in bytes
-    int noOfLinks = fileData.st_nlink; // Number of links to file
-    char* userName = getUserName(fileData.st_uid); // User who created file
-    char* groupName = getGroupName(fileData.st_gid); // Group file belongs to
-    char* permissions = getPermissions(fileData.st_mode); // Permission string
-	
+
 	// Output the fileInfo() of the current file
-    printf("%s\n", fileInfo(name, time, noOfLinks, userName, groupName, \
-							permissions, size));
-    
+    fileInfo(dir, name, &fileData);
+
+    // remember real subdirectories, symlinks to directories are not followed
+    int isDir = entry -> d_type == DT_DIR
+                || (entry -> d_type == DT_UNKNOWN && S_ISDIR(fileData.st_mode));
+    if (isDir && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+      if (subCount == subCapacity) {
+        size_t grown = subCapacity == 0 ? 16 : subCapacity * 2;
+        char** moreNames = realloc(subNames, grown * sizeof(char*));
+        if (moreNames != NULL) {
+          subNames = moreNames;
+        }
+        struct stat* moreData = realloc(subData, grown * sizeof(struct stat));
+        if (moreData != NULL) {
+          subData = moreData;
+        }
+        if (moreNames == NULL || moreData == NULL) {
+          perror("Couldn't remember subdirectory");
+          output.failed = 1;
+          break;
+        }
+        subCapacity = grown;
+      }
+      subNames[subCount] = strdup(name);
+      if (subNames[subCount] == NULL) {
+        perror("Couldn't remember subdirectory");
+        output.failed = 1;
+        break;
+      }
+      subData[subCount++] = fileData;
+    }
   }
   
   // clear memory
   closedir(directPoint);
+
+  for (size_t i = 0; i < subCount; i++) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", dir, subNames[i]);
+    if (readDir(path, &subData[i], self) == -1 && errno != ELOOP
+        && errno != ENOTDIR) {
+      perror("Couldn't read directory");
+    }
+    free(subNames[i]);
+  }
+  free(subNames);
+  free(subData);
   
   return 0;
 }
+
 /*
-   Name: traverse
-   Purpose: Navigates through the directory tree, distinguishing between file
-			and directory and then performs the readDir() routine for each
-			directory in the hierarchy. 
-		
-			Parameters: const char *fpath: File path to start from
-			            const struct stat *sb: Access information to determine
-						 whether directory or not
-						int tflag: 
-						FTW *ftwbuf: To determine the current file being looked
-						             at in the hierarchy
-   return: returns 0 to tell the nftw subroutine to keep searching the tree
+   Name: parseFormat
+   Purpose: Read the command line, which is either empty or -o followed by
+            one of text, nul, json or binary.
+   Parameters: int argc, char* argv[]
+   return: the FORMAT_ constant, -1 on a bad command line
 */
-static int traverse(const char * fpath, const struct stat *fileInfo, 
-				     int tflag, struct FTW * ftwbuf) {
-  // Determine if file is a direcetory
-  if (S_ISDIR(fileInfo -> st_mode) == 1) {
-	  	
-	// Change current directory relative to root of fpath
-    chdir(fpath + ftwbuf -> base);
-
-	// State what directory you are currently in
-	printf("%s\n", fpath);	
-	
-	// Output information of all files in given directory
-    if((readDir(fpath)) == -1) {
-		perror("Couldn't read directory");
-		return -1;
-	}
+int parseFormat(int argc, char* argv[]) {
+  static const char* names[] = { "text", "nul", "json", "binary" };
+  if (argc == 1) {
+    return FORMAT_TEXT;
   }
-
-  return 0; 
+  if (argc == 3 && strcmp(argv[1], "-o") == 0) {
+    for (int i = 0; i < 4; i++) {
+      if (strcmp(argv[2], names[i]) == 0) {
+        return i;
+      }
+    }
+  }
+  printf("Usage: %s [-o text|nul|json|binary]\n", argv[0]);
+  return -1;
 }
 
 int main(int argc, char * argv[]) {
+  output.format = parseFormat(argc, argv);
+  if (output.format == -1) {
+    return EXIT_FAILURE;
+  }
+  output.data = malloc(OUTPUT_SIZE);
+  if (output.data == NULL) {
+    perror("Couldn't allocate output buffer");
+    return EXIT_FAILURE;
+  }
   char* path = realpath(".", NULL); // get absolute path of current directory
+  struct stat self;
+  struct stat parent;
   
   /*
     Traverses the tree structure of the directory given the absolute
 	path of the current directory.
   */
-  if ((nftw(path, traverse, 20, FTW_D) == -1)) {
+  if (path == NULL || stat(path, &self) == -1 || stat("..", &parent) == -1
+      || readDir(path, &self, &parent) == -1) {
+    outputFlush();
+    perror("Couldn't read directory");
+    return EXIT_FAILURE;
+  }
+  if (outputFlush() == -1 || output.failed) {
     return EXIT_FAILURE;
   }
   return EXIT_SUCCESS;